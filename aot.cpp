@@ -0,0 +1,150 @@
+#include "aot.h"
+#include "console.h"
+#include "engine.h"
+#include "ops.h"
+#include <chrono>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <new>
+#include <string>
+#include <unistd.h>
+
+void aot_trap(Vm& vm, uint8_t vect) {
+  trap(vm, decode(static_cast<uint16_t>(0xF000 | vect)));
+}
+
+uint64_t run_aot(Vm& vm, const AotProgram& prog) {
+  AotState* st = new (std::nothrow) AotState{};
+  if (!st) {
+    bad_opcode(vm, "Out of memory");
+    return 0;
+  }
+  for (size_t i = 0; i < prog.block_count; ++i) {
+    const AotBlock& b = prog.blocks[i];
+    st->entries[b.start >> 6] |= 1ull << (b.start & 63);
+    for (uint32_t k = 0; k < b.length; ++k) {
+      uint16_t addr = static_cast<uint16_t>(b.start + k);
+      st->code[addr >> 6] |= 1ull << (addr & 63);
+      st->code_pages[addr >> MEM_PAGE_SHIFT] = 1;
+    }
+  }
+
+  uint64_t retired = 0;
+  load_cond(vm);
+  while (vm.running) {
+    if (!aot_bit(st->entries, vm.reg[R_PC])) {
+      // somewhere lc3aot didn't see coming, one instruction at a time
+      // until it's back in translated code
+      materialize_cond(vm);
+      retired += run_step(vm);
+      load_cond(vm);
+      continue;
+    }
+    AotExit exit = vm.interrupts ? AOT_MODIFIED : prog.run(vm, *st, retired);
+    if (exit == AOT_MODIFIED) {
+      // the translation doesn't match memory any more, or interrupts have
+      // to be checked for, interpret the rest
+      materialize_cond(vm);
+      retired += run_threaded(vm);
+      load_cond(vm);
+      break;
+    }
+  }
+  materialize_cond(vm);
+  delete st;
+  return retired;
+}
+
+static void handle_interrupt(int) {
+  restore_input_buffering();
+  printf("\n");
+  exit(-2);
+}
+
+int aot_main(int argc, const char* argv[], const AotProgram& prog) {
+  bool headless = false;
+  bool print_stats = false;
+  const char* input_path = nullptr;
+  const char* output_path = nullptr;
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--headless") == 0) {
+      headless = true;
+    } else if (strcmp(argv[i], "--input") == 0 && i + 1 < argc) {
+      input_path = argv[++i];
+    } else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+      output_path = argv[++i];
+    } else if (strcmp(argv[i], "--stats") == 0) {
+      print_stats = true;
+    } else {
+      fprintf(stderr, "Usage: %s [--headless [--input file] [--output file]] [--stats]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  Vm* vm = nullptr;
+  if (headless) {
+    std::string input;
+    if (input_path) {
+      std::ifstream file(input_path, std::ios::binary);
+      if (!file) {
+        fprintf(stderr, "Failed to read input: %s\n", input_path);
+        return 1;
+      }
+      input.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    }
+    vm = vm_create_headless(input.data(), input.size());
+  } else {
+    signal(SIGINT, handle_interrupt);
+    disable_input_buffering();
+    vm = vm_create(stdin, stdout);
+  }
+  if (!vm) {
+    fprintf(stderr, "Out of memory\n");
+    return 1;
+  }
+  if (!headless && isatty(STDOUT_FILENO)) {
+    console_start_timer(vm->console, 50);
+  }
+
+  for (size_t i = 0; i < prog.image_count; ++i) {
+    const AotImage& image = prog.images[i];
+    memcpy(vm->memory + image.origin, image.words, image.size * sizeof(uint16_t));
+    invalidate_decoded_range(*vm, image.origin, image.size);
+    mem_mark_dirty(*vm, image.origin, image.size);
+  }
+  vm->reg[R_PC] = prog.start;
+  vm->reg[R_COND] = FL_ZR0;
+
+  auto start = std::chrono::steady_clock::now();
+  uint64_t retired = run_aot(*vm, prog);
+  console_flush(vm->console);
+  auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  if (print_stats) {
+    fprintf(stderr, "instructions: %llu, seconds: %g, MIPS: %g\n",
+      static_cast<unsigned long long>(retired), elapsed,
+      elapsed > 0 ? static_cast<double>(retired) / elapsed / 1e6 : 0.0);
+  }
+
+  if (headless) {
+    size_t size = 0;
+    const char* output = console_captured(vm->console, size);
+    FILE* out = output_path ? fopen(output_path, "wb") : stdout;
+    if (!out || fwrite(output, 1, size, out) != size) {
+      fprintf(stderr, "Failed to write output: %s\n", output_path ? output_path : "stdout");
+    }
+    if (out && out != stdout) { fclose(out); }
+    fflush(stdout);
+  }
+
+  int status = 0;
+  if (vm->error) {
+    fprintf(stderr, "%s\n", vm->error);
+    status = 1;
+  }
+  vm_destroy(vm);
+  if (!headless) { restore_input_buffering(); }
+  return status;
+}
@@ -0,0 +1,112 @@
+#ifndef AOT_H
+#define AOT_H
+#include <cstddef>
+#include <cstdint>
+#include "decode.h"
+#include "memory.h"
+#include "vm.h"
+
+// ============================
+// === Ahead-of-Time Runtime ==
+// ============================
+// `lc3aot` (tools/lc3aot.cpp) turns a fixed program into C++ ahead of time:
+//
+//   bin/lc3aot -o prog.cpp image.obj
+//   g++ -O2 -I. prog.cpp <every .cpp but vm.cpp> -o prog
+//   ./prog [--headless [--input file] [--output file]] [--stats]
+//
+// - The control flow graph is followed from the start address (direct
+//   BR/JSR targets, fall-throughs & return addresses), each basic block
+//   becomes a label in one function with the registers as locals, so the
+//   host compiler allocates them to host registers across blocks
+// - The memory image is compiled in, the program needs no .obj at run time
+// - TRAPs & the keyboard registers go through the same runtime as the vm
+//   (trap(), mem_read), so console, input & EOF behave exactly the same
+//
+// What it can't know ahead of time falls back to the interpreter
+// - JMP/RET/JSRR go to a block through a switch on the target, a target
+//   that wasn't found statically runs interpreted (run_step) until it
+//   reaches a translated block again
+// - A store over translated code (self-modifying code) leaves the native
+//   code for good, the rest of the run is the threaded core
+// - So does turning interrupts on (see interrupt.h), & RTI runs interpreted
+
+// One contiguous run of non-zero words of the program's memory
+struct AotImage {
+  uint16_t origin;
+  uint32_t size;
+  const uint16_t* words;
+};
+
+// Translated basic block: `length` instructions from `start`
+struct AotBlock {
+  uint16_t start;
+  uint16_t length;
+};
+
+// Built by run_aot from the program's blocks
+struct AotState {
+  // translated words, a store to one of them is self-modifying code
+  uint64_t code[MEMORY_MAX / 64];
+  uint8_t code_pages[MEM_PAGES];
+  // block starts, where the interpreter hands back to native code
+  uint64_t entries[MEMORY_MAX / 64];
+};
+
+// Why the native code returned
+enum AotExit {
+  AOT_STOPPED = 0, // vm.running was cleared (HALT, end of input, a paused GETC/IN)
+  AOT_NO_CODE,     // vm.reg[R_PC] has no translation
+  AOT_MODIFIED,    // a store overwrote translated code (or turned interrupts on)
+};
+
+// What lc3aot generates
+struct AotProgram {
+  const AotImage* images;
+  size_t image_count;
+  uint16_t start;
+  const AotBlock* blocks;
+  size_t block_count;
+  // native code from vm.reg[R_PC], adds the instructions it retired
+  AotExit (*run)(Vm& vm, const AotState& st, uint64_t& retired);
+};
+
+inline bool aot_bit(const uint64_t* bits, uint16_t addr) {
+  return (bits[addr >> 6] >> (addr & 63)) & 1;
+}
+
+// LDR/LDI/loads from the I/O page: mem_read only where a page has attributes
+// (the caller checks vm.running afterwards, KBSR can stop the VM)
+inline uint16_t aot_load(Vm& vm, uint16_t addr) {
+  if (vm.page_attr[addr >> MEM_PAGE_SHIFT] & PAGE_ATTR_READ) { return mem_read(vm, addr); }
+  return vm.memory[addr];
+}
+
+// Every store, returns true if it overwrote translated code, turned
+// interrupts on (KBSR's IE bit or the timer, the native code never checks)
+// or stopped the VM (MCR, see device.h)
+// (mem_write where a page has attributes, a clean page gets marked dirty)
+inline bool aot_store(Vm& vm, const AotState& st, uint16_t addr, uint16_t val) {
+  if (vm.page_attr[addr >> MEM_PAGE_SHIFT]) {
+    mem_write(vm, addr, val);
+    if (vm.interrupts || !vm.running) { return true; }
+  } else {
+    vm.memory[addr] = val;
+    invalidate_decoded(vm, addr);
+  }
+  return st.code_pages[addr >> MEM_PAGE_SHIFT] && aot_bit(st.code, addr);
+}
+
+// TRAP `vect`, with the registers & cond_result already in vm
+// (vm.reg[R_PC] past the TRAP, like the interpreters)
+void aot_trap(Vm& vm, uint8_t vect);
+
+// Run `prog` on vm (memory already loaded) until it stops
+// returns the number of instructions retired, native & interpreted
+uint64_t run_aot(Vm& vm, const AotProgram& prog);
+
+// main() of a generated program: makes the VM (console or --headless),
+// loads prog.images, runs it & reports like the vm program
+int aot_main(int argc, const char* argv[], const AotProgram& prog);
+
+#endif // !AOT_H
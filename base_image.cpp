@@ -0,0 +1,128 @@
+#include "base_image.h"
+#include "decode.h"
+#include "device.h"
+#include "jit.h"
+#include "memory.h"
+#include <cstddef>
+#include <new>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Same requirements as snapshots: memory first in its own page aligned mapping
+static_assert(offsetof(Vm, memory) == 0, "bases map over vm.memory");
+
+#define DECODED_BYTES (MEMORY_MAX * sizeof(DecodedInstr))
+
+struct BaseImage {
+  // the memory words, & the whole of it already decoded (see decode.h)
+  int fd;
+  int decoded_fd;
+  uint16_t pc;
+};
+
+// memfd of `size` bytes, mapped shared at `*data` for filling in
+// returns -1 if it can't be made
+static int make_memfd(const char* name, size_t size, void** data) {
+  int fd = memfd_create(name, MFD_CLOEXEC);
+  if (fd < 0) { return -1; }
+  if (ftruncate(fd, static_cast<off_t>(size)) == 0) {
+    *data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (*data != MAP_FAILED) { return fd; }
+  }
+  close(fd);
+  return -1;
+}
+
+BaseImage* base_image_load(const char* const* image_paths, size_t count, size_t* failed) {
+  void* words = nullptr;
+  void* decoded = nullptr;
+  int fd = make_memfd("lc3-base", sizeof(Vm::memory), &words);
+  if (fd < 0) { return nullptr; }
+  int decoded_fd = make_memfd("lc3-base-decoded", DECODED_BYTES, &decoded);
+  if (decoded_fd < 0) {
+    munmap(words, sizeof(Vm::memory));
+    close(fd);
+    return nullptr;
+  }
+
+  uint16_t pc = 0x3000;
+  uint16_t* memory = static_cast<uint16_t*>(words);
+  int loaded = load_images(memory, nullptr, image_paths, count, pc, failed);
+  // decoding up front means a VM never writes its decoded table just to
+  // execute the base, so that stays shared too
+  DecodedInstr* table = static_cast<DecodedInstr*>(decoded);
+  for (uint32_t addr = 0; loaded && addr < MEMORY_MAX; ++addr) {
+    table[addr] = decode(memory[addr]);
+  }
+  munmap(words, sizeof(Vm::memory));
+  munmap(decoded, DECODED_BYTES);
+
+  BaseImage* base = loaded ? new (std::nothrow) BaseImage{fd, decoded_fd, pc} : nullptr;
+  if (!base) {
+    close(fd);
+    close(decoded_fd);
+  }
+  return base;
+}
+
+uint16_t base_image_pc(const BaseImage* base) {
+  return base->pc;
+}
+
+int vm_map_base(Vm& vm, const BaseImage* base) {
+  void* p = mmap(vm.memory, sizeof(vm.memory), PROT_READ | PROT_WRITE,
+    MAP_PRIVATE | MAP_FIXED, base->fd, 0);
+  if (p == MAP_FAILED) { return 0; }
+  vm.reg[R_PC] = base->pc;
+  // all of memory was replaced (mem_clear_dirty makes the base the baseline)
+  mem_mark_dirty(vm, 0, MEMORY_MAX);
+  bus_sync(vm);
+
+  // everything derived from the old memory is stale, the base's own
+  // decoded table replaces it (or if that can't be mapped, decode again)
+  p = mmap(vm.decoded, DECODED_BYTES, PROT_READ | PROT_WRITE,
+    MAP_PRIVATE | MAP_FIXED, base->decoded_fd, 0);
+  if (p == MAP_FAILED) {
+    invalidate_decoded_range(vm, 0, MEMORY_MAX);
+  }
+  jit_destroy(vm);
+  return 1;
+}
+
+// /proc/self/pagemap: one 64bit entry per virtual page
+#define PAGEMAP_PRESENT (1ull << 63)
+#define PAGEMAP_SWAPPED (1ull << 62)
+// file page (the base) or shared anonymous memory, i.e. not a private copy
+#define PAGEMAP_FILE (1ull << 61)
+
+int vm_private_pages(const Vm& vm, size_t& pages) {
+  int fd = open("/proc/self/pagemap", O_RDONLY);
+  if (fd < 0) { return 0; }
+  size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+  size_t first = reinterpret_cast<uintptr_t>(vm.memory) / page_size;
+  size_t count = sizeof(vm.memory) / page_size;
+
+  uint64_t entries[MEMORY_MAX * sizeof(uint16_t) / 4096];
+  if (count > sizeof(entries) / sizeof(entries[0])) { count = sizeof(entries) / sizeof(entries[0]); }
+  ssize_t got = pread(fd, entries, count * sizeof(uint64_t), static_cast<off_t>(first * sizeof(uint64_t)));
+  close(fd);
+  if (got != static_cast<ssize_t>(count * sizeof(uint64_t))) { return 0; }
+
+  pages = 0;
+  for (size_t i = 0; i < count; ++i) {
+    // never touched pages aren't present at all, read-only ones are the base's
+    if ((entries[i] & (PAGEMAP_PRESENT | PAGEMAP_SWAPPED)) && !(entries[i] & PAGEMAP_FILE)) {
+      ++pages;
+    }
+  }
+  return 1;
+}
+
+void base_image_destroy(BaseImage* base) {
+  if (!base) { return; }
+  // the VMs' mappings keep their own reference to the memfd
+  close(base->fd);
+  close(base->decoded_fd);
+  delete base;
+}
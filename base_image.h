@@ -0,0 +1,48 @@
+#ifndef BASE_IMAGE_H
+#define BASE_IMAGE_H
+#include <cstddef>
+#include <cstdint>
+#include "vm.h"
+
+// ============================
+// ==== Shared Base Images ====
+// ============================
+// Many VMs started from the same images (a grading farm, thousands of
+// sessions) mostly hold identical, never written memory
+//
+// - base_image_load loads the images once into an in-memory file (memfd)
+// - vm_map_base maps that file over vm.memory copy-on-write (MAP_PRIVATE),
+//   like snapshot_restore does with a snapshot file
+//   -- every VM reads the same physical pages
+//   -- the first write to a page gives that VM its own copy of just that
+//      page (the host's page size, 4KB = 2048 words on x86-64)
+// - vm_private_pages says how many pages a VM has copied so far,
+//   what it actually costs on top of the base
+//
+// Usually a program writes its stack, a few variables & KBSR/KBDR,
+// so each VM owns a handful of pages out of the 32 (128KB) it can see
+
+struct BaseImage;
+
+// Loads `count` images like read_images (later ones win where they overlap)
+// returns nullptr if an image is bad (`*failed`, when given, is its index)
+// or the memfd can't be made
+BaseImage* base_image_load(const char* const* image_paths, size_t count, size_t* failed = nullptr);
+
+// Where the program starts, the last image's origin
+uint16_t base_image_pc(const BaseImage* base);
+
+// Replace vm.memory with a copy-on-write view of `base` & set PC to its start
+// - The predecoded cache & any JIT translations are thrown away
+// returns 0 if the mapping failed (vm.memory is left as it was)
+int vm_map_base(Vm& vm, const BaseImage* base);
+
+// Pages of vm.memory the VM has its own copy of (written since mapping
+// a base, or touched at all without one)
+// returns 0 if the kernel doesn't say (no /proc/self/pagemap)
+int vm_private_pages(const Vm& vm, size_t& pages);
+
+// Frees the base, VMs already mapped on it keep their view of it
+void base_image_destroy(BaseImage* base);
+
+#endif // !BASE_IMAGE_H
@@ -0,0 +1,317 @@
+#include "batch.h"
+#include "base_image.h"
+#include "engine.h"
+#include "lockstep.h"
+#include "memory.h"
+#include "ops.h"
+#include "vm.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct BatchJob {
+  std::string image{};
+  std::string input{};  // empty: no stdin
+  std::string output{};
+};
+
+struct BatchResult {
+  const char* status;
+  uint64_t retired;
+  double seconds;
+  // pages of memory the job copied from its image's shared base
+  size_t pages;
+};
+
+// One worker's queue
+// the owner takes jobs from the front, thieves from the back
+struct WorkQueue {
+  std::mutex lock{};
+  std::deque<size_t> jobs{};
+};
+
+// <image without its extension>.<ext>
+static std::string sibling_path(const std::string& image, const char* ext) {
+  std::filesystem::path p(image);
+  p.replace_extension(ext);
+  return p.string();
+}
+
+// Every *.obj in `dir`, sorted so the summary comes out in a stable order
+static bool jobs_from_dir(const std::string& dir, std::vector<BatchJob>& jobs) {
+  std::error_code ec;
+  std::vector<std::string> images;
+  for (const auto& entry : std::filesystem::directory_iterator(dir, ec)) {
+    if (entry.is_regular_file() && entry.path().extension() == ".obj") {
+      images.push_back(entry.path().string());
+    }
+  }
+  if (ec) { return false; }
+  std::sort(images.begin(), images.end());
+
+  for (const std::string& image : images) {
+    std::string input = sibling_path(image, ".in");
+    if (!std::filesystem::exists(input)) { input.clear(); }
+    jobs.push_back(BatchJob{image, input, sibling_path(image, ".out")});
+  }
+  return true;
+}
+
+// `image [input [output]]` per line, # comments
+static bool jobs_from_manifest(const std::string& path, std::vector<BatchJob>& jobs) {
+  std::ifstream file(path);
+  if (!file) { return false; }
+
+  std::string line;
+  while (std::getline(file, line)) {
+    std::istringstream fields(line);
+    BatchJob job;
+    if (!(fields >> job.image) || job.image[0] == '#') { continue; }
+    fields >> job.input >> job.output;
+    if (job.input == "-") { job.input.clear(); }
+    if (job.output.empty()) { job.output = sibling_path(job.image, ".out"); }
+    jobs.push_back(job);
+  }
+  return true;
+}
+
+// A job's VM & the files it reads & writes, while it runs
+struct JobRun {
+  Vm* vm;
+  FILE* in;
+  FILE* out;
+};
+
+// Closes everything the job had open
+static void close_job(JobRun& run) {
+  vm_destroy(run.vm);
+  if (run.out) { fclose(run.out); }
+  if (run.in) { fclose(run.in); }
+}
+
+// Opens the job's files & maps its image
+// returns false (with nothing left open) if any of it failed
+static bool start_job(const BatchJob& job, const BaseImage* base, EofPolicy eof_policy, JobRun& run) {
+  run = JobRun{nullptr, nullptr, nullptr};
+  if (!base) { return false; }
+
+  // no input file: the VM gets no input at all (always at end of input)
+  if (!job.input.empty()) {
+    run.in = fopen(job.input.c_str(), "r");
+    if (!run.in) { return false; }
+  }
+  run.out = fopen(job.output.c_str(), "w");
+  if (run.out) { run.vm = vm_create(run.in, run.out); }
+  if (!run.vm || !vm_map_base(*run.vm, base)) {
+    close_job(run);
+    return false;
+  }
+  run.vm->reg[R_COND] = FL_ZR0;
+  run.vm->eof_policy = eof_policy;
+  return true;
+}
+
+// How the job ended, then closes it
+static void finish_job(JobRun& run, BatchResult& result) {
+  result.status = run.vm->error ? "error" : run.vm->running ? "budget" : "halted";
+  vm_private_pages(*run.vm, result.pages);
+  close_job(run);
+}
+
+static BatchResult run_job(const BatchJob& job, const BaseImage* base, Engine engine,
+  EofPolicy eof_policy, uint64_t max_instructions) {
+  BatchResult result{"load-failed", 0, 0.0, 0};
+  JobRun run;
+  if (!start_job(job, base, eof_policy, run)) { return result; }
+
+  auto start = std::chrono::steady_clock::now();
+  result.retired = run_engine(engine, *run.vm, max_instructions);
+  result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  finish_job(run, result);
+  return result;
+}
+
+// Jobs on the same image, up to LOCKSTEP_LANES of them, run as one (see lockstep.h)
+// every job gets the group's time
+static void run_lockstep_group(const std::vector<BatchJob>& jobs, const std::vector<size_t>& group,
+  const std::vector<const BaseImage*>& job_bases, EofPolicy eof_policy, uint64_t max_instructions,
+  std::vector<BatchResult>& results) {
+  JobRun runs[LOCKSTEP_LANES];
+  Vm* vms[LOCKSTEP_LANES];
+  size_t lanes[LOCKSTEP_LANES];
+  size_t count = 0;
+  for (size_t job : group) {
+    results[job] = BatchResult{"load-failed", 0, 0.0, 0};
+    if (start_job(jobs[job], job_bases[job], eof_policy, runs[count])) {
+      vms[count] = runs[count].vm;
+      lanes[count++] = job;
+    }
+  }
+  if (count == 0) { return; }
+
+  uint64_t retired[LOCKSTEP_LANES];
+  auto start = std::chrono::steady_clock::now();
+  run_lockstep(vms, count, retired, max_instructions);
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  for (size_t i = 0; i < count; ++i) {
+    BatchResult& result = results[lanes[i]];
+    result.retired = retired[i];
+    result.seconds = seconds;
+    finish_job(runs[i], result);
+  }
+}
+
+// Next job for worker `self`: its own queue first, then steal
+// returns false once every queue is empty
+static bool next_job(std::vector<WorkQueue>& queues, size_t self, size_t& job) {
+  {
+    std::lock_guard<std::mutex> guard(queues[self].lock);
+    if (!queues[self].jobs.empty()) {
+      job = queues[self].jobs.front();
+      queues[self].jobs.pop_front();
+      return true;
+    }
+  }
+  for (size_t i = 1; i < queues.size(); ++i) {
+    WorkQueue& victim = queues[(self + i) % queues.size()];
+    std::lock_guard<std::mutex> guard(victim.lock);
+    if (!victim.jobs.empty()) {
+      job = victim.jobs.back();
+      victim.jobs.pop_back();
+      return true;
+    }
+  }
+  return false;
+}
+
+int batch_main(int argc, const char* argv[]) {
+  const char* source = nullptr;
+  const char* summary_path = nullptr;
+  Engine engine = ENGINE_THREADED;
+  EofPolicy eof_policy = EOF_CONTINUE;
+  uint64_t max_instructions = UINT64_MAX;
+  size_t workers = std::thread::hardware_concurrency();
+  bool lockstep = false;
+
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+      source = argv[++i];
+    } else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+      workers = strtoull(argv[++i], nullptr, 10);
+    } else if (strcmp(argv[i], "--summary") == 0 && i + 1 < argc) {
+      summary_path = argv[++i];
+    } else if (strcmp(argv[i], "--engine") == 0 && i + 1 < argc) {
+      if (!engine_from_name(argv[++i], engine)) {
+        std::cerr << "Unknown engine: " << argv[i] << std::endl;
+        return 2;
+      }
+    } else if (strcmp(argv[i], "--on-eof") == 0 && i + 1 < argc) {
+      if (!eof_policy_from_name(argv[++i], eof_policy)) {
+        std::cerr << "Unknown --on-eof policy: " << argv[i] << std::endl;
+        return 2;
+      }
+    } else if (strcmp(argv[i], "--max-instructions") == 0 && i + 1 < argc) {
+      max_instructions = strtoull(argv[++i], nullptr, 10);
+    } else if (strcmp(argv[i], "--lockstep") == 0) {
+      lockstep = true;
+    } else if (strcmp(argv[i], "--trace") == 0 || strcmp(argv[i], "--trace-last") == 0
+               || strcmp(argv[i], "--profile") == 0) {
+      std::cerr << argv[i] << " can't be used with --batch" << std::endl;
+      return 2;
+    } else {
+      std::cerr << "Unknown batch option: " << argv[i] << std::endl;
+      return 2;
+    }
+  }
+  if (!source) {
+    std::cerr << "--batch needs a directory or manifest" << std::endl;
+    return 2;
+  }
+  if (workers == 0) { workers = 1; }
+
+  std::vector<BatchJob> jobs;
+  bool listed = std::filesystem::is_directory(source)
+    ? jobs_from_dir(source, jobs)
+    : jobs_from_manifest(source, jobs);
+  if (!listed) {
+    std::cerr << "Failed to read jobs from: " << source << std::endl;
+    return 2;
+  }
+
+  // every image is loaded once, jobs running the same one share its pages
+  std::map<std::string, BaseImage*> bases;
+  std::vector<const BaseImage*> job_bases(jobs.size());
+  for (size_t i = 0; i < jobs.size(); ++i) {
+    auto it = bases.find(jobs[i].image);
+    if (it == bases.end()) {
+      const char* path = jobs[i].image.c_str();
+      it = bases.emplace(jobs[i].image, base_image_load(&path, 1)).first;
+    }
+    job_bases[i] = it->second;
+  }
+
+  // --lockstep: jobs on the same image in groups of up to LOCKSTEP_LANES,
+  // a group is what a worker takes
+  std::vector<std::vector<size_t>> groups;
+  if (lockstep) {
+    std::map<const BaseImage*, size_t> filling;
+    for (size_t i = 0; i < jobs.size(); ++i) {
+      auto it = filling.find(job_bases[i]);
+      if (it == filling.end() || groups[it->second].size() == LOCKSTEP_LANES) {
+        it = filling.insert_or_assign(job_bases[i], groups.size()).first;
+        groups.emplace_back();
+      }
+      groups[it->second].push_back(i);
+    }
+  }
+
+  // deal the jobs (or groups) out round robin, stealing evens out the rest
+  size_t work = lockstep ? groups.size() : jobs.size();
+  std::vector<WorkQueue> queues(workers);
+  for (size_t i = 0; i < work; ++i) {
+    queues[i % workers].jobs.push_back(i);
+  }
+
+  std::vector<BatchResult> results(jobs.size());
+  std::vector<std::thread> threads;
+  for (size_t w = 0; w < workers; ++w) {
+    threads.emplace_back([&, w]() {
+      size_t job;
+      while (next_job(queues, w, job)) {
+        if (lockstep) {
+          run_lockstep_group(jobs, groups[job], job_bases, eof_policy, max_instructions, results);
+        } else {
+          results[job] = run_job(jobs[job], job_bases[job], engine, eof_policy, max_instructions);
+        }
+      }
+    });
+  }
+  for (std::thread& t : threads) { t.join(); }
+  for (auto& entry : bases) { base_image_destroy(entry.second); }
+
+  FILE* summary = summary_path ? fopen(summary_path, "w") : stdout;
+  if (!summary) {
+    std::cerr << "Failed to open summary file: " << summary_path << std::endl;
+    return 2;
+  }
+  int exit_code = 0;
+  for (size_t i = 0; i < jobs.size(); ++i) {
+    const BatchResult& r = results[i];
+    fprintf(summary, "%s\t%s\t%llu\t%.6f\t%zu\n", jobs[i].image.c_str(), r.status,
+      static_cast<unsigned long long>(r.retired), r.seconds, r.pages);
+    if (strcmp(r.status, "halted") != 0) { exit_code = 1; }
+  }
+  if (summary != stdout) { fclose(summary); }
+  return exit_code;
+}
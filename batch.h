@@ -0,0 +1,53 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+// ============================
+// ======= Batch Runner =======
+// ============================
+// Runs many images in one process, each in its own Vm
+//
+//   vm --batch <dir|manifest> [--jobs n] [--summary file] [--engine name]
+//              [--on-eof continue|halt|error] [--max-instructions n] [--lockstep]
+//
+// Jobs come from either
+// - a directory: every *.obj in it
+//   -- stdin is <name>.in next to the image if there is one, empty otherwise
+//   -- stdout goes to <name>.out next to the image
+// - a manifest: one job per line, `image [input [output]]`
+//   -- a missing input (or `-`) is empty stdin, a missing output is <image>.out
+//   -- blank lines & lines starting with # are skipped
+//
+// Jobs run on `--jobs` worker threads (default: one per core)
+// - Every worker has its own queue of jobs, & takes work from the
+//   back of another worker's queue once its own is empty (work stealing),
+//   so a few long running images don't leave the other cores idle
+//
+// Each distinct image is loaded once into a shared base (see base_image.h),
+// its jobs map it copy-on-write instead of loading their own copy
+//
+// When everything is done a summary is written, one tab separated line per job
+// (in the order the jobs were listed): image, status, instructions, seconds,
+// pages (of the image's 32 the job had to copy, see vm_private_pages)
+// - status is `halted`, `error` (ex. unused opcode), `budget` (still running
+//   after --max-instructions) or `load-failed` (the image, its input or its
+//   output couldn't be opened)
+// - goes to stdout, or to `--summary file`
+//
+// `--lockstep` runs jobs on the same image together, up to LOCKSTEP_LANES
+// at a time, one instruction stream across all of them (see lockstep.h)
+// - `--engine` doesn't apply, a job's seconds are its whole group's
+// - faster the more the jobs follow the same path through the program
+//
+// `--on-eof` (default continue, see EofPolicy in vm.h) decides what an image
+// reading past the end of its input does, `halt` ends it instead of letting
+// it wait forever, `error` also marks the job as failed
+//
+// Tracing is per process, so --trace/--trace-last can't be combined with --batch
+// An image that never halts keeps its worker busy forever, unless
+// `--max-instructions` limits every job to about that many instructions
+
+// Handles `vm --batch ...`, returns the process exit code
+// (0 if every job halted, 1 if any didn't, 2 on bad arguments)
+int batch_main(int argc, const char* argv[]);
+
+#endif // !BATCH_H
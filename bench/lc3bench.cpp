@@ -0,0 +1,655 @@
+// Benchmark suite & MIPS harness
+// Builds a set of LC-3 workloads in memory, runs each one on each engine
+// & reports instructions retired, MIPS, ns/instruction & the opcode mix
+//
+// Workloads:
+//   alu     ADD/AND/NOT in a tight nested loop
+//   mem     LDR/STR sweeps over a 4K word array
+//   branch  data dependent branches on an LCG's high bits
+//   trap    PUTS/OUT heavy output
+//   locals  subroutine calls keeping R7, saved registers & counters in .FILL
+//           words right next to the code (stores into pages holding code)
+//   2048    the 2048 game (4x4 board, slide/merge/spawn, board printed
+//           after every move) playing a scripted list of moves from stdin
+//
+// Usage: lc3bench [--engine switch|threaded|jit|specialized|all] [--workload name]
+//                 [--repeat n] [--json file] [--lockstep]
+// - JSON results go to stdout (or --json file), a readable table to stderr
+// - Each workload runs `repeat` times per engine (default 3), the fastest counts
+// - --lockstep also runs LOCKSTEP_LANES copies of each workload, one after
+//   another on the threaded core ("threaded16") & together on every lockstep
+//   ISA the CPU has ("lockstep-avx2", ...), MIPS over all copies
+//   -- 2048's copies each play their own moves, so they diverge
+// - The workloads run headless, console output is kept in memory & dropped
+#include "../engine.h"
+#include "../lockstep.h"
+#include "../memory.h"
+#include "../ops.h"
+#include "../trace.h"
+#include "../vm.h"
+#include "../tools/lc3asm.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+// ============================
+// ======== Workloads =========
+// ============================
+
+static void build_alu(Asm& a) {
+  a.ld(R6, "outer");
+  a.label("o");
+  a.ld(R5, "inner");
+  a.label("i");
+  a.add(R0, R0, R1);
+  a.andi(R2, R0, 7);
+  a.not_(R3, R2);
+  a.add(R1, R1, R3);
+  a.and_(R4, R1, R0);
+  a.addi(R5, R5, -1);
+  a.br(BR_P, "i");
+  a.addi(R6, R6, -1);
+  a.br(BR_P, "o");
+  a.trap(TRAP_HALT);
+  a.label("outer"); a.fill(800);
+  a.label("inner"); a.fill(10000);
+}
+
+static void build_mem(Asm& a) {
+  a.ld(R6, "passes");
+  a.label("pass");
+  a.ld(R1, "array");
+  a.ld(R5, "count");
+  a.label("loop");
+  a.ldr(R0, R1, 0);
+  a.add(R0, R0, R5);
+  a.str(R0, R1, 0);
+  a.ldr(R2, R1, 1);
+  a.add(R3, R3, R2);
+  a.str(R3, R1, 2);
+  a.addi(R1, R1, 1);
+  a.addi(R5, R5, -1);
+  a.br(BR_P, "loop");
+  a.addi(R6, R6, -1);
+  a.br(BR_P, "pass");
+  a.trap(TRAP_HALT);
+  a.label("passes"); a.fill(800);
+  a.label("count"); a.fill(4096);
+  a.label("array"); a.fill(0x4000);
+}
+
+static void build_branch(Asm& a) {
+  a.ld(R6, "outer");
+  a.ld(R2, "mask_a");
+  a.ld(R3, "mask_b");
+  a.label("o");
+  a.ld(R5, "inner");
+  a.label("i");
+  // r = r * 5 + 1
+  a.add(R1, R0, R0);
+  a.add(R1, R1, R1);
+  a.add(R0, R1, R0);
+  a.addi(R0, R0, 1);
+  a.and_(R1, R0, R2);
+  a.br(BR_Z, "a0");
+  a.addi(R4, R4, 1);
+  a.and_(R1, R0, R3);
+  a.br(BR_Z, "next");
+  a.addi(R4, R4, 3);
+  a.br(BR_N | BR_Z | BR_P, "next");
+  a.label("a0");
+  a.and_(R1, R0, R3);
+  a.br(BR_Z, "next");
+  a.addi(R4, R4, -2);
+  a.label("next");
+  a.addi(R5, R5, -1);
+  a.br(BR_P, "i");
+  a.addi(R6, R6, -1);
+  a.br(BR_P, "o");
+  a.trap(TRAP_HALT);
+  a.label("outer"); a.fill(300);
+  a.label("inner"); a.fill(10000);
+  a.label("mask_a"); a.fill(0x0400);
+  a.label("mask_b"); a.fill(0x2000);
+}
+
+static void build_trap(Asm& a) {
+  a.ld(R6, "lines");
+  a.label("loop");
+  a.lea(R0, "msg");
+  a.trap(TRAP_PUTS);
+  a.ld(R0, "star");
+  a.trap(TRAP_OUT);
+  a.trap(TRAP_OUT);
+  a.ld(R0, "nl");
+  a.trap(TRAP_OUT);
+  a.addi(R6, R6, -1);
+  a.br(BR_P, "loop");
+  a.trap(TRAP_HALT);
+  a.label("lines"); a.fill(30000);
+  a.label("star"); a.fill('*');
+  a.label("nl"); a.fill('\n');
+  a.label("msg"); a.stringz("The quick brown fox jumps over the lazy dog ");
+}
+
+static void build_locals(Asm& a) {
+  a.ld(R6, "outer");
+  a.label("o");
+  a.ld(R5, "inner");
+  a.label("i");
+  a.jsr("step");
+  a.addi(R5, R5, -1);
+  a.br(BR_P, "i");
+  a.addi(R6, R6, -1);
+  a.br(BR_P, "o");
+  a.trap(TRAP_HALT);
+  a.label("outer"); a.fill(100);
+  a.label("inner"); a.fill(10000);
+  // the usual LC-3 subroutine: R7 & what it uses saved to memory around it
+  a.label("step");
+  a.st(R7, "save_r7");
+  a.st(R1, "save_r1");
+  a.ld(R1, "count");
+  a.addi(R1, R1, 1);
+  a.st(R1, "count");
+  a.ld(R0, "sum");
+  a.add(R0, R0, R1);
+  a.st(R0, "sum");
+  a.ld(R1, "save_r1");
+  a.ld(R7, "save_r7");
+  a.ret();
+  a.label("save_r7"); a.fill(0);
+  a.label("save_r1"); a.fill(0);
+  a.label("count"); a.fill(0);
+  a.label("sum"); a.fill(0);
+}
+
+// 2048
+// - board: 16 cells, 0 = empty, otherwise the tile's exponent (1 = 2, 2 = 4, ...)
+// - GETC a move: w/a/s/d slide up/left/down/right, q quits
+// - each of the 4 lines of the move is gathered along a (start, stride) path,
+//   compressed with merges, & written back
+// - a move that changed something spawns a tile, 4 useless moves in a row
+//   (no move possible) start a new game
+// - the board is printed after every move, one char per cell
+static void build_2048(Asm& a) {
+  a.jsr("clear");
+  a.jsr("spawn");
+  a.jsr("spawn");
+
+  a.label("loop");
+  a.jsr("print");
+  a.trap(TRAP_GETC);
+  a.ld(R1, "neg_q");
+  a.add(R1, R0, R1);
+  a.br(BR_Z, "quit");
+  a.lea(R2, "tab_a");
+  a.ld(R1, "neg_a");
+  a.add(R1, R0, R1);
+  a.br(BR_Z, "go");
+  a.lea(R2, "tab_d");
+  a.ld(R1, "neg_d");
+  a.add(R1, R0, R1);
+  a.br(BR_Z, "go");
+  a.lea(R2, "tab_w");
+  a.ld(R1, "neg_w");
+  a.add(R1, R0, R1);
+  a.br(BR_Z, "go");
+  a.lea(R2, "tab_s");
+  a.ld(R1, "neg_s");
+  a.add(R1, R0, R1);
+  a.br(BR_Z, "go");
+  a.br(BR_N | BR_Z | BR_P, "loop");
+
+  a.label("go");
+  a.st(R2, "dirtab");
+  a.jsr("move");
+  a.ld(R0, "moved");
+  a.br(BR_Z, "nomove");
+  a.andi(R0, R0, 0);
+  a.st(R0, "stuck");
+  a.jsr("spawn");
+  a.br(BR_N | BR_Z | BR_P, "loop");
+  a.label("nomove");
+  a.ld(R0, "stuck");
+  a.addi(R0, R0, 1);
+  a.st(R0, "stuck");
+  a.addi(R0, R0, -4);
+  a.br(BR_N, "loop");
+  a.jsr("clear");
+  a.jsr("spawn");
+  a.jsr("spawn");
+  a.br(BR_N | BR_Z | BR_P, "loop");
+  a.label("quit");
+  a.trap(TRAP_HALT);
+
+  // move: every line of the direction in `dirtab`
+  a.label("move");
+  a.st(R7, "mv_r7");
+  a.andi(R0, R0, 0);
+  a.st(R0, "moved");
+  a.ld(R6, "dirtab");
+  a.ldr(R5, R6, 4);
+  a.st(R5, "stride");
+  a.andi(R4, R4, 0);
+  a.addi(R4, R4, 4);
+  a.label("mv_line");
+  a.ldr(R3, R6, 0);
+  a.ld(R2, "boardp");
+  a.add(R3, R3, R2);
+  a.st(R3, "linep");
+  a.jsr("line");
+  a.addi(R6, R6, 1);
+  a.addi(R4, R4, -1);
+  a.br(BR_P, "mv_line");
+  a.ld(R7, "mv_r7");
+  a.ret();
+
+  // line: compress the 4 cells from `linep` along `stride` into `out`
+  // R1 = tile waiting for a possible merge, R2 = next free slot of `out`
+  a.label("line");
+  a.ld(R3, "linep");
+  a.ld(R5, "stride");
+  a.lea(R2, "out");
+  a.andi(R1, R1, 0);
+  a.andi(R0, R0, 0);
+  a.addi(R0, R0, 4);
+  a.st(R0, "cnt");
+  a.label("ln_gather");
+  a.ldr(R0, R3, 0);
+  a.br(BR_Z, "ln_next");
+  a.addi(R1, R1, 0);
+  a.br(BR_Z, "ln_pend");
+  a.st(R0, "vtmp");
+  a.not_(R0, R0);
+  a.addi(R0, R0, 1);
+  a.add(R0, R0, R1);
+  a.br(BR_N | BR_P, "ln_flush");
+  a.addi(R1, R1, 1);        // merge
+  a.str(R1, R2, 0);
+  a.addi(R2, R2, 1);
+  a.andi(R1, R1, 0);
+  a.br(BR_N | BR_Z | BR_P, "ln_next");
+  a.label("ln_flush");
+  a.str(R1, R2, 0);
+  a.addi(R2, R2, 1);
+  a.ld(R1, "vtmp");
+  a.br(BR_N | BR_Z | BR_P, "ln_next");
+  a.label("ln_pend");
+  a.addi(R1, R0, 0);
+  a.label("ln_next");
+  a.add(R3, R3, R5);
+  a.ld(R0, "cnt");
+  a.addi(R0, R0, -1);
+  a.st(R0, "cnt");
+  a.br(BR_P, "ln_gather");
+  a.addi(R1, R1, 0);
+  a.br(BR_Z, "ln_fill");
+  a.str(R1, R2, 0);
+  a.addi(R2, R2, 1);
+  a.label("ln_fill");
+  a.lea(R0, "out_end");
+  a.not_(R0, R0);
+  a.addi(R0, R0, 1);
+  a.add(R0, R0, R2);
+  a.br(BR_Z | BR_P, "ln_back");
+  a.andi(R1, R1, 0);
+  a.str(R1, R2, 0);
+  a.addi(R2, R2, 1);
+  a.br(BR_N | BR_Z | BR_P, "ln_fill");
+  a.label("ln_back");
+  a.ld(R3, "linep");
+  a.lea(R2, "out");
+  a.andi(R0, R0, 0);
+  a.addi(R0, R0, 4);
+  a.st(R0, "cnt");
+  a.label("ln_write");
+  a.ldr(R0, R2, 0);
+  a.ldr(R1, R3, 0);
+  a.str(R0, R3, 0);
+  a.not_(R1, R1);
+  a.addi(R1, R1, 1);
+  a.add(R1, R1, R0);
+  a.br(BR_Z, "ln_same");
+  a.andi(R1, R1, 0);
+  a.addi(R1, R1, 1);
+  a.st(R1, "moved");
+  a.label("ln_same");
+  a.addi(R2, R2, 1);
+  a.add(R3, R3, R5);
+  a.ld(R0, "cnt");
+  a.addi(R0, R0, -1);
+  a.st(R0, "cnt");
+  a.br(BR_P, "ln_write");
+  a.ret();
+
+  // spawn: a 2 tile in the first empty cell from a random one
+  // seed = seed * 5 + 1
+  a.label("spawn");
+  a.ld(R0, "seed");
+  a.add(R1, R0, R0);
+  a.add(R1, R1, R1);
+  a.add(R0, R1, R0);
+  a.addi(R0, R0, 1);
+  a.st(R0, "seed");
+  a.andi(R2, R0, 15);
+  a.andi(R3, R3, 0);
+  a.addi(R3, R3, 15);
+  a.addi(R3, R3, 1);
+  a.ld(R5, "boardp");
+  a.label("sp_try");
+  a.add(R1, R5, R2);
+  a.ldr(R0, R1, 0);
+  a.br(BR_Z, "sp_put");
+  a.addi(R2, R2, 1);
+  a.andi(R2, R2, 15);
+  a.addi(R3, R3, -1);
+  a.br(BR_P, "sp_try");
+  a.ret();
+  a.label("sp_put");
+  a.addi(R0, R0, 1);
+  a.str(R0, R1, 0);
+  a.ret();
+
+  // clear: new game
+  a.label("clear");
+  a.ld(R1, "boardp");
+  a.andi(R0, R0, 0);
+  a.andi(R2, R2, 0);
+  a.addi(R2, R2, 15);
+  a.addi(R2, R2, 1);
+  a.label("cl_loop");
+  a.str(R0, R1, 0);
+  a.addi(R1, R1, 1);
+  a.addi(R2, R2, -1);
+  a.br(BR_P, "cl_loop");
+  a.st(R0, "stuck");
+  a.ret();
+
+  // print: '.' for empty, '0' + exponent otherwise
+  a.label("print");
+  a.st(R7, "pr_r7");
+  a.ld(R1, "boardp");
+  a.andi(R3, R3, 0);
+  a.addi(R3, R3, 4);
+  a.label("pr_row");
+  a.andi(R2, R2, 0);
+  a.addi(R2, R2, 4);
+  a.label("pr_cell");
+  a.ldr(R0, R1, 0);
+  a.br(BR_Z, "pr_dot");
+  a.ld(R4, "ascii0");
+  a.add(R0, R0, R4);
+  a.br(BR_N | BR_Z | BR_P, "pr_out");
+  a.label("pr_dot");
+  a.ld(R0, "dot");
+  a.label("pr_out");
+  a.trap(TRAP_OUT);
+  a.addi(R1, R1, 1);
+  a.addi(R2, R2, -1);
+  a.br(BR_P, "pr_cell");
+  a.ld(R0, "nl");
+  a.trap(TRAP_OUT);
+  a.addi(R3, R3, -1);
+  a.br(BR_P, "pr_row");
+  a.ld(R0, "nl");
+  a.trap(TRAP_OUT);
+  a.ld(R7, "pr_r7");
+  a.ret();
+
+  // data
+  a.label("neg_q"); a.fill(-'q');
+  a.label("neg_a"); a.fill(-'a');
+  a.label("neg_d"); a.fill(-'d');
+  a.label("neg_w"); a.fill(-'w');
+  a.label("neg_s"); a.fill(-'s');
+  // (start index of each line, stride)
+  a.label("tab_a"); a.fill(0); a.fill(4); a.fill(8); a.fill(12); a.fill(1);
+  a.label("tab_d"); a.fill(3); a.fill(7); a.fill(11); a.fill(15); a.fill(-1);
+  a.label("tab_w"); a.fill(0); a.fill(1); a.fill(2); a.fill(3); a.fill(4);
+  a.label("tab_s"); a.fill(12); a.fill(13); a.fill(14); a.fill(15); a.fill(-4);
+  a.label("ascii0"); a.fill('0');
+  a.label("dot"); a.fill('.');
+  a.label("nl"); a.fill('\n');
+  a.label("seed"); a.fill(12345);
+  a.label("dirtab"); a.fill(0);
+  a.label("moved"); a.fill(0);
+  a.label("stuck"); a.fill(0);
+  a.label("stride"); a.fill(0);
+  a.label("linep"); a.fill(0);
+  a.label("cnt"); a.fill(0);
+  a.label("vtmp"); a.fill(0);
+  a.label("mv_r7"); a.fill(0);
+  a.label("pr_r7"); a.fill(0);
+  a.label("boardp"); a.fill_addr("board");
+  a.label("out"); a.blkw(4);
+  a.label("out_end");
+  a.label("board"); a.blkw(16);
+}
+
+// The moves the 2048 workload plays: mostly left/down with some up/right,
+// like a typical corner strategy, then q
+// (`seed` picks the game, the lockstep copies play different ones)
+static std::string moves_2048(size_t count, uint32_t seed = 1) {
+  std::string moves;
+  uint32_t r = seed;
+  for (size_t i = 0; i < count; ++i) {
+    r = r * 1103515245u + 12345u;
+    switch ((r >> 16) % 8) {
+      case 0: case 1: case 2: moves += 'a'; break;
+      case 3: case 4: case 5: moves += 's'; break;
+      case 6: moves += 'd'; break;
+      default: moves += 'w'; break;
+    }
+  }
+  moves += 'q';
+  return moves;
+}
+
+struct Workload {
+  const char* name;
+  void (*build)(Asm& a);
+  size_t moves; // scripted stdin, 2048 only
+};
+
+static const Workload WORKLOADS[] = {
+  {"alu", build_alu, 0},
+  {"mem", build_mem, 0},
+  {"branch", build_branch, 0},
+  {"trap", build_trap, 0},
+  {"locals", build_locals, 0},
+  {"2048", build_2048, 40000},
+};
+
+static const char* const ENGINE_NAMES[] = {"switch", "threaded", "jit", "specialized"};
+
+static const char* const OPCODE_NAMES[16] = {
+  "BR", "ADD", "LD", "ST", "JSR", "AND", "LDR", "STR",
+  "RTI", "NOT", "LDI", "STI", "JMP", "RES", "LEA", "TRAP",
+};
+
+// ============================
+// ========= Harness ==========
+// ============================
+
+// A fresh headless VM with the workload loaded & its scripted input
+static Vm* load(const Asm& a, const Workload& w, uint32_t seed = 1) {
+  std::string input = w.moves ? moves_2048(w.moves, seed) : std::string();
+  return asm_load(a, input.data(), input.size());
+}
+
+// How many instructions the opcode mix is taken from
+#define MIX_SAMPLE (1u << 20)
+
+// Opcode mix, from a trace of one run (tracing runs on the threaded core)
+
+static void opcode_mix(const Asm& a, const Workload& w, uint64_t mix[16]) {
+  char path[] = "/tmp/lc3bench-trace-XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0) { return; }
+  close(fd);
+
+  Vm* vm = load(a, w);
+  // Flight recorder keeps the mix to the last MIX_SAMPLE instructions,
+  // a full streaming trace of these workloads would be several GB
+  if (trace_open_flight(path, MIX_SAMPLE)) {
+    run_engine(ENGINE_THREADED, *vm);
+    trace_close();
+  }
+  vm_destroy(vm);
+
+  FILE* f = fopen(path, "rb");
+  TraceHeader header;
+  if (f && fread(&header, sizeof(header), 1, f) == 1) {
+    TraceRecord records[4096];
+    size_t n;
+    while ((n = fread(records, sizeof(TraceRecord), 4096, f)) > 0) {
+      for (size_t i = 0; i < n; ++i) { ++mix[records[i].instr >> 12]; }
+    }
+  }
+  if (f) { fclose(f); }
+  unlink(path);
+}
+
+// One row of the table & one JSON result
+static void report(FILE* json, bool& first, const char* workload, const char* engine,
+  uint64_t retired, double best, const uint64_t mix[16]) {
+  double mips = best > 0 ? static_cast<double>(retired) / best / 1e6 : 0.0;
+  double ns = retired ? best * 1e9 / static_cast<double>(retired) : 0.0;
+  fprintf(stderr, "%-8s %-15s %12llu %9.4f %9.1f %8.2f\n", workload, engine,
+    static_cast<unsigned long long>(retired), best, mips, ns);
+
+  fprintf(json, "%s\n    {\"workload\": \"%s\", \"engine\": \"%s\", \"instructions\": %llu, "
+    "\"seconds\": %.6f, \"mips\": %.2f, \"ns_per_instruction\": %.3f, \"opcode_mix\": {",
+    first ? "" : ",", workload, engine, static_cast<unsigned long long>(retired), best, mips, ns);
+  first = false;
+  bool first_op = true;
+  for (int op = 0; op < 16; ++op) {
+    if (!mix[op]) { continue; }
+    fprintf(json, "%s\"%s\": %llu", first_op ? "" : ", ", OPCODE_NAMES[op],
+      static_cast<unsigned long long>(mix[op]));
+    first_op = false;
+  }
+  fprintf(json, "}}");
+}
+
+// LOCKSTEP_LANES copies of the workload, `isa` < 0: one after another on
+// the threaded core, otherwise together with run_lockstep
+// returns the seconds, `retired` over every copy
+static double run_copies(const Asm& a, const Workload& w, int isa, uint64_t& retired) {
+  Vm* vms[LOCKSTEP_LANES];
+  for (uint32_t i = 0; i < LOCKSTEP_LANES; ++i) { vms[i] = load(a, w, i + 1); }
+  uint64_t counts[LOCKSTEP_LANES] = {};
+  auto start = std::chrono::steady_clock::now();
+  if (isa < 0) {
+    for (size_t i = 0; i < LOCKSTEP_LANES; ++i) { counts[i] = run_threaded(*vms[i]); }
+  } else {
+    run_lockstep(vms, LOCKSTEP_LANES, counts, UINT64_MAX, static_cast<LockstepIsa>(isa));
+  }
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  retired = 0;
+  for (size_t i = 0; i < LOCKSTEP_LANES; ++i) {
+    retired += counts[i];
+    vm_destroy(vms[i]);
+  }
+  return seconds;
+}
+
+int main(int argc, const char* argv[]) {
+  const char* engine_arg = "all";
+  const char* only = nullptr;
+  const char* json_path = nullptr;
+  int repeat = 3;
+  bool lockstep = false;
+
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--engine") == 0 && i + 1 < argc) {
+      engine_arg = argv[++i];
+    } else if (strcmp(argv[i], "--workload") == 0 && i + 1 < argc) {
+      only = argv[++i];
+    } else if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc) {
+      repeat = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+      json_path = argv[++i];
+    } else if (strcmp(argv[i], "--lockstep") == 0) {
+      lockstep = true;
+    } else {
+      fprintf(stderr, "Usage: lc3bench [--engine switch|threaded|jit|specialized|all] [--workload name]"
+                      " [--repeat n] [--json file] [--lockstep]\n");
+      return 2;
+    }
+  }
+  if (repeat < 1) { repeat = 1; }
+
+  std::vector<Engine> engines;
+  if (strcmp(engine_arg, "all") == 0) {
+    engines = {ENGINE_SWITCH, ENGINE_THREADED, ENGINE_JIT, ENGINE_SPECIALIZED};
+  } else {
+    Engine e;
+    if (!engine_from_name(engine_arg, e)) {
+      fprintf(stderr, "Unknown engine: %s\n", engine_arg);
+      return 2;
+    }
+    engines.push_back(e);
+  }
+
+  FILE* json = json_path ? fopen(json_path, "w") : stdout;
+  if (!json) {
+    fprintf(stderr, "lc3bench: can't open output\n");
+    return 1;
+  }
+
+  fprintf(json, "{\n  \"results\": [");
+  fprintf(stderr, "%-8s %-15s %12s %9s %9s %8s\n", "workload", "engine", "instructions", "seconds", "MIPS", "ns/inst");
+  bool first = true;
+
+  for (const Workload& w : WORKLOADS) {
+    if (only && strcmp(only, w.name) != 0) { continue; }
+    Asm a;
+    w.build(a);
+    a.link();
+
+    uint64_t mix[16] = {};
+    opcode_mix(a, w, mix);
+
+    for (Engine e : engines) {
+      uint64_t retired = 0;
+      double best = 0;
+      for (int r = 0; r < repeat; ++r) {
+        Vm* vm = load(a, w);
+        auto start = std::chrono::steady_clock::now();
+        retired = run_engine(e, *vm);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (vm->error) {
+          fprintf(stderr, "lc3bench: %s stopped: %s\n", w.name, vm->error);
+        }
+        vm_destroy(vm);
+        if (r == 0 || seconds < best) { best = seconds; }
+      }
+
+      report(json, first, w.name, ENGINE_NAMES[e], retired, best, mix);
+    }
+
+    if (!lockstep) { continue; }
+    // -1: the threaded baseline, then every ISA up to the CPU's best
+    for (int isa = -1; isa <= static_cast<int>(lockstep_best_isa()); ++isa) {
+      uint64_t retired = 0;
+      double best = 0;
+      for (int r = 0; r < repeat; ++r) {
+        double seconds = run_copies(a, w, isa, retired);
+        if (r == 0 || seconds < best) { best = seconds; }
+      }
+      std::string name = isa < 0 ? std::string("threaded") + std::to_string(LOCKSTEP_LANES)
+        : std::string("lockstep-") + lockstep_isa_name(static_cast<LockstepIsa>(isa));
+      report(json, first, w.name, name.c_str(), retired, best, mix);
+    }
+  }
+  fprintf(json, "\n  ]\n}\n");
+
+  if (json != stdout) { fclose(json); }
+  return 0;
+}
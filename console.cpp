@@ -0,0 +1,176 @@
+#include "console.h"
+#include "memory.h"
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <string>
+#include <sys/uio.h>
+#include <thread>
+#include <unistd.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+struct Console {
+  // -1 : capture console, flushing appends to `captured`
+  int fd{};
+  std::string captured{};
+  bool line_flush{};
+  size_t len{};
+  char buf[CONSOLE_BUF_SIZE];
+
+  // The timer thread flushes too, so every access to the buffer is locked
+  // (uncontended, a lot cheaper than the syscall per trap it replaces)
+  std::mutex lock{};
+
+  std::thread timer{};
+  std::condition_variable timer_wake{};
+  bool timer_stop{};
+};
+
+// Write all of iov[0..count), retrying short writes & EINTR
+// output that can't be written (ex. closed pipe) is dropped
+static void write_all(Console* c, struct iovec* iov, int count) {
+  if (c->fd < 0) {
+    for (int i = 0; i < count; ++i) {
+      c->captured.append(static_cast<const char*>(iov[i].iov_base), iov[i].iov_len);
+    }
+    return;
+  }
+  while (count > 0) {
+    ssize_t n = writev(c->fd, iov, count);
+    if (n < 0) {
+      if (errno == EINTR) { continue; }
+      return;
+    }
+    size_t done = static_cast<size_t>(n);
+    while (count > 0 && done >= iov->iov_len) {
+      done -= iov->iov_len;
+      ++iov;
+      --count;
+    }
+    if (count > 0) {
+      iov->iov_base = static_cast<char*>(iov->iov_base) + done;
+      iov->iov_len -= done;
+    }
+  }
+}
+
+// c->lock must be held
+static void flush_locked(Console* c) {
+  if (c->len == 0) { return; }
+  struct iovec iov = {c->buf, c->len};
+  write_all(c, &iov, 1);
+  c->len = 0;
+}
+
+Console* console_create(int fd) {
+  Console* c = new (std::nothrow) Console();
+  if (!c) { return nullptr; }
+  c->fd = fd;
+  c->line_flush = isatty(fd) != 0;
+  return c;
+}
+
+Console* console_create_capture() {
+  Console* c = new (std::nothrow) Console();
+  if (!c) { return nullptr; }
+  c->fd = -1;
+  return c;
+}
+
+const char* console_captured(Console* c, size_t& size) {
+  std::lock_guard<std::mutex> guard(c->lock);
+  if (c->fd >= 0) {
+    size = 0;
+    return nullptr;
+  }
+  flush_locked(c);
+  size = c->captured.size();
+  return c->captured.data();
+}
+
+void console_discard(Console* c) {
+  std::lock_guard<std::mutex> guard(c->lock);
+  if (c->fd >= 0) { return; }
+  c->len = 0;
+  c->captured.clear();
+}
+
+void console_destroy(Console* c) {
+  if (!c) { return; }
+  if (c->timer.joinable()) {
+    {
+      std::lock_guard<std::mutex> guard(c->lock);
+      c->timer_stop = true;
+    }
+    c->timer_wake.notify_one();
+    c->timer.join();
+  }
+  flush_locked(c);
+  delete c;
+}
+
+void console_set_line_flush(Console* c, bool on) {
+  std::lock_guard<std::mutex> guard(c->lock);
+  c->line_flush = on;
+}
+
+void console_start_timer(Console* c, int ms) {
+  if (c->timer.joinable()) { return; }
+  c->timer = std::thread([c, ms]() {
+    std::unique_lock<std::mutex> guard(c->lock);
+    while (!c->timer_stop) {
+      c->timer_wake.wait_for(guard, std::chrono::milliseconds(ms));
+      flush_locked(c);
+    }
+  });
+}
+
+void console_flush(Console* c) {
+  std::lock_guard<std::mutex> guard(c->lock);
+  flush_locked(c);
+}
+
+void console_write(Console* c, const char* data, size_t n) {
+  std::lock_guard<std::mutex> guard(c->lock);
+  if (c->len + n <= CONSOLE_BUF_SIZE) {
+    memcpy(c->buf + c->len, data, n);
+    c->len += n;
+  } else if (n >= CONSOLE_BUF_SIZE) {
+    // too big to be worth copying: buffer & data in one writev
+    struct iovec iov[2] = {{c->buf, c->len}, {const_cast<char*>(data), n}};
+    write_all(c, iov, 2);
+    c->len = 0;
+    return;
+  } else {
+    flush_locked(c);
+    memcpy(c->buf, data, n);
+    c->len = n;
+  }
+  if (c->line_flush && memchr(data, '\n', n)) { flush_locked(c); }
+}
+
+void console_putc(Console* c, char ch) {
+  console_write(c, &ch, 1);
+}
+
+size_t guest_strlen(const uint16_t* memory, uint16_t start) {
+  size_t i = start;
+#if defined(__x86_64__)
+  // 8 words at a time: compare with zero, the movemask has 2 bits per word
+  const __m128i zero = _mm_setzero_si128();
+  for (; i + 8 <= MEMORY_MAX; i += 8) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(memory + i));
+    int mask = _mm_movemask_epi8(_mm_cmpeq_epi16(v, zero));
+    if (mask) {
+      return i + static_cast<size_t>(__builtin_ctz(static_cast<unsigned>(mask)) / 2) - start;
+    }
+  }
+#endif
+  while (i < MEMORY_MAX && memory[i]) { ++i; }
+  return i - start;
+}
@@ -0,0 +1,64 @@
+#ifndef CONSOLE_H
+#define CONSOLE_H
+#include <cstddef>
+#include <cstdint>
+
+// ============================
+// ====== Console Output ======
+// ============================
+// OUT/PUTS/PUTSP/IN/HALT used to putc every character & fflush on every
+// trap, so output heavy programs made a write syscall per character
+//
+// Now output collects in the console's own buffer & is written out
+// - when the buffer is full (big strings go out with writev, buffer + string)
+// - at a newline, only when line flushing is on (writing to a terminal)
+//   headless runs (files, pipes) never flush per line
+// - before the VM waits for input (GETC/IN, & KBSR polls)
+// - on HALT, & when the console is destroyed
+// - from a timer thread, when one is started (interactive sessions),
+//   so a prompt without a newline still shows up
+//
+// The console writes to the fd directly, nothing goes through stdio
+// A capture console (headless runs) keeps everything in memory instead
+
+#define CONSOLE_BUF_SIZE 4096
+
+struct Console;
+
+// Console writing to `fd`, line flushing if `fd` is a terminal
+// returns nullptr if out of memory
+Console* console_create(int fd);
+
+// Console appending all output to memory instead of writing it anywhere
+// returns nullptr if out of memory
+Console* console_create_capture();
+
+// Everything a capture console was given so far (nullptr for an fd console)
+// `size` gets the length, valid until the next write to the console
+const char* console_captured(Console* c, size_t& size);
+
+// Throws away everything a capture console was given so far
+// (ex. between fuzzing runs, see fuzz.h), nothing for an fd console
+void console_discard(Console* c);
+
+// Flushes whatever is left, stops the timer & frees the console (not the fd)
+void console_destroy(Console* c);
+
+// Flush at every newline or not (the default is whether fd is a terminal)
+void console_set_line_flush(Console* c, bool on);
+
+// Start a thread flushing the buffer every `ms` milliseconds
+void console_start_timer(Console* c, int ms);
+
+// Write everything buffered
+void console_flush(Console* c);
+
+// Queue `n` bytes of output
+void console_write(Console* c, const char* data, size_t n);
+void console_putc(Console* c, char ch);
+
+// Number of words before the first x0000 at or after memory[start]
+// (stops at the end of memory, strings don't wrap around)
+size_t guest_strlen(const uint16_t* memory, uint16_t start);
+
+#endif // !CONSOLE_H
@@ -0,0 +1,311 @@
+#include "debug.h"
+#include "decode.h"
+#include "disasm.h"
+#include "ops.h"
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+int debug_attach(Vm& vm) {
+  if (vm.debug) { return 1; }
+  vm.debug = new (std::nothrow) Debugger;
+  return vm.debug != nullptr;
+}
+
+void debug_detach(Vm& vm) {
+  Debugger* dbg = vm.debug;
+  if (!dbg) { return; }
+  // back to the real instructions, & no page watched any more
+  for (uint32_t addr = 0; addr < MEMORY_MAX; ++addr) {
+    if (debug_has_breakpoint(*dbg, static_cast<uint16_t>(addr))) {
+      invalidate_decoded(vm, static_cast<uint16_t>(addr));
+    }
+  }
+  for (uint8_t& attr : vm.page_attr) {
+    attr = static_cast<uint8_t>(attr & ~PAGE_ATTR_WATCH);
+  }
+  delete dbg;
+  vm.debug = nullptr;
+}
+
+static void set_bit(uint64_t* bits, uint16_t addr, bool on) {
+  uint64_t bit = 1ull << (addr & 63);
+  if (on) {
+    bits[addr >> 6] |= bit;
+  } else {
+    bits[addr >> 6] &= ~bit;
+  }
+}
+
+static bool get_bit(const uint64_t* bits, uint16_t addr) {
+  return (bits[addr >> 6] >> (addr & 63)) & 1;
+}
+
+void debug_set_breakpoint(Vm& vm, uint16_t addr, bool on) {
+  set_bit(vm.debug->breakpoints, addr, on);
+  if (on) {
+    vm.decoded[addr].op = OP_BREAK;
+  } else {
+    invalidate_decoded(vm, addr);
+  }
+}
+
+void debug_set_watchpoint(Vm& vm, uint16_t addr, int access) {
+  Debugger& dbg = *vm.debug;
+  set_bit(dbg.watch_read, addr, access & DEBUG_WATCH_READ);
+  set_bit(dbg.watch_write, addr, access & DEBUG_WATCH_WRITE);
+
+  // the page stays marked while any of its 256 words is watched
+  // (4 bitmap words per page)
+  size_t page = addr >> MEM_PAGE_SHIFT;
+  bool watched = false;
+  for (size_t i = page * 4; i < page * 4 + 4; ++i) {
+    watched = watched || dbg.watch_read[i] || dbg.watch_write[i];
+  }
+  if (watched) {
+    vm.page_attr[page] |= PAGE_ATTR_WATCH;
+  } else {
+    vm.page_attr[page] = static_cast<uint8_t>(vm.page_attr[page] & ~PAGE_ATTR_WATCH);
+  }
+}
+
+void debug_break(Vm& vm) {
+  Debugger& dbg = *vm.debug;
+  // back in front of it, continuing runs the real instruction
+  --vm.reg[R_PC];
+  dbg.stop = DEBUG_BREAKPOINT;
+  dbg.stop_addr = vm.reg[R_PC];
+  vm.running = 0;
+}
+
+void debug_watch_hit(Vm& vm, uint16_t addr, DebugWatch access) {
+  Debugger* dbg = vm.debug;
+  // only the page is marked, this word may not be watched at all
+  if (!dbg || !get_bit(access == DEBUG_WATCH_READ ? dbg->watch_read : dbg->watch_write, addr)) {
+    return;
+  }
+  // already stopping (HALT, end of input, an error), that wins
+  if (!vm.running) { return; }
+  dbg->stop = DEBUG_WATCHPOINT;
+  dbg->stop_addr = addr;
+  dbg->stop_access = access;
+  // PC is already past the instruction doing the access
+  dbg->stop_pc = static_cast<uint16_t>(vm.reg[R_PC] - 1);
+  vm.running = 0;
+}
+
+// Stopped by the debugger (not HALT or an error), so it can carry on
+// returns false if the VM has finished
+static bool resume(Vm& vm) {
+  Debugger& dbg = *vm.debug;
+  if (!vm.running && dbg.stop != DEBUG_NONE && !vm.error) {
+    vm.running = 1;
+  }
+  dbg.stop = DEBUG_NONE;
+  return vm.running;
+}
+
+DebugStop debug_step(Vm& vm, uint64_t& retired) {
+  if (!resume(vm)) { return DEBUG_NONE; }
+  retired += run_step(vm);
+  return vm.debug->stop;
+}
+
+DebugStop debug_continue(Vm& vm, Engine engine, uint64_t& retired) {
+  // sitting on a breakpoint: over it first, or it stops right there again
+  if (debug_has_breakpoint(*vm.debug, vm.reg[R_PC])) {
+    DebugStop stop = debug_step(vm, retired);
+    if (stop != DEBUG_NONE || !vm.running) { return stop; }
+  } else if (!resume(vm)) {
+    return DEBUG_NONE;
+  }
+  retired += run_engine(engine, vm);
+  return vm.debug->stop;
+}
+
+// x3000 / 0x3000 / 12288
+static bool parse_word(const char* text, uint16_t& value) {
+  int base = 10;
+  if (text[0] == 'x' || text[0] == 'X') {
+    text += 1;
+    base = 16;
+  } else if (text[0] == '0' && (text[1] == 'x' || text[1] == 'X')) {
+    text += 2;
+    base = 16;
+  }
+  char* end = nullptr;
+  unsigned long v = strtoul(text, &end, base);
+  if (end == text || *end || v > 0xFFFF) { return false; }
+  value = static_cast<uint16_t>(v);
+  return true;
+}
+
+static void report(const Vm& vm, DebugStop stop, FILE* out) {
+  const Debugger& dbg = *vm.debug;
+  if (stop == DEBUG_BREAKPOINT) {
+    fprintf(out, "breakpoint x%04X\n", dbg.stop_addr);
+  } else if (stop == DEBUG_WATCHPOINT) {
+    fprintf(out, "watch %s x%04X at x%04X\n", dbg.stop_access == DEBUG_WATCH_READ ? "read" : "write",
+      dbg.stop_addr, dbg.stop_pc);
+  } else if (vm.error) {
+    fprintf(out, "error: %s\n", vm.error);
+  } else if (!vm.running) {
+    fprintf(out, "halted\n");
+  } else {
+    fprintf(out, "pc x%04X\n", vm.reg[R_PC]);
+  }
+}
+
+static void print_regs(const Vm& vm, FILE* out) {
+  for (int r = R_R0; r <= R_R7; ++r) {
+    fprintf(out, "R%d x%04X%s", r, vm.reg[r], r == R_R7 ? "\n" : "  ");
+  }
+  // engines leave R_COND up to date when they return
+  uint16_t cond = vm.reg[R_COND];
+  fprintf(out, "PC x%04X  COND %c%c%c  PSR x%04X\n", vm.reg[R_PC],
+    cond & FL_NEG ? 'n' : '-', cond & FL_ZR0 ? 'z' : '-', cond & FL_POS ? 'p' : '-', vm.reg[R_PSR]);
+}
+
+// `count` words from `addr`, PC marked with '>' & breakpoints with '*'
+static void print_mem(const Vm& vm, uint16_t addr, uint32_t count, FILE* out) {
+  for (uint32_t i = 0; i < count; ++i) {
+    uint16_t at = static_cast<uint16_t>(addr + i);
+    // straight from memory, mem_read would poll the keyboard at KBSR
+    uint16_t word = vm.memory[at];
+    char text[64];
+    disassemble(at, word, text, sizeof(text));
+    fprintf(out, "%c%c x%04X  %04X  %s\n", at == vm.reg[R_PC] ? '>' : ' ',
+      debug_has_breakpoint(*vm.debug, at) ? '*' : ' ', at, word, text);
+  }
+}
+
+static void print_list(const Vm& vm, FILE* out) {
+  const Debugger& dbg = *vm.debug;
+  for (uint32_t addr = 0; addr < MEMORY_MAX; ++addr) {
+    uint16_t at = static_cast<uint16_t>(addr);
+    if (debug_has_breakpoint(dbg, at)) {
+      fprintf(out, "break x%04X\n", at);
+    }
+    bool r = get_bit(dbg.watch_read, at);
+    bool w = get_bit(dbg.watch_write, at);
+    if (r || w) {
+      fprintf(out, "watch x%04X %s%s\n", at, r ? "r" : "", w ? "w" : "");
+    }
+  }
+  fprintf(out, "end\n");
+}
+
+uint64_t debug_serve(Vm& vm, Engine engine, FILE* in, FILE* out) {
+  uint64_t retired = 0;
+  if (!debug_attach(vm)) {
+    fprintf(out, "error: out of memory\n");
+    return 0;
+  }
+
+  char line[256];
+  while (fgets(line, sizeof(line), in)) {
+    char cmd[16] = "";
+    char arg1[32] = "";
+    char arg2[32] = "";
+    int args = sscanf(line, "%15s %31s %31s", cmd, arg1, arg2) - 1;
+    if (args < 0) { continue; }
+    uint16_t addr = 0;
+    bool has_addr = args >= 1 && parse_word(arg1, addr);
+
+    if (strcmp(cmd, "quit") == 0 || strcmp(cmd, "q") == 0) {
+      break;
+    } else if (strcmp(cmd, "break") == 0 || strcmp(cmd, "b") == 0
+        || strcmp(cmd, "delete") == 0 || strcmp(cmd, "d") == 0) {
+      if (!has_addr) {
+        fprintf(out, "error: bad address\n");
+      } else {
+        debug_set_breakpoint(vm, addr, cmd[0] == 'b');
+        fprintf(out, "ok\n");
+      }
+    } else if (strcmp(cmd, "watch") == 0 || strcmp(cmd, "unwatch") == 0) {
+      int access = 0;
+      if (cmd[0] == 'w') {
+        const char* kind = args >= 2 ? arg2 : "w";
+        access = (strchr(kind, 'r') ? DEBUG_WATCH_READ : 0) | (strchr(kind, 'w') ? DEBUG_WATCH_WRITE : 0);
+      }
+      if (!has_addr || (cmd[0] == 'w' && !access)) {
+        fprintf(out, "error: bad address or access\n");
+      } else {
+        debug_set_watchpoint(vm, addr, access);
+        fprintf(out, "ok\n");
+      }
+    } else if (strcmp(cmd, "list") == 0) {
+      print_list(vm, out);
+    } else if (strcmp(cmd, "step") == 0 || strcmp(cmd, "s") == 0) {
+      uint16_t n = 1;
+      if (args >= 1 && (!parse_word(arg1, n) || n == 0)) {
+        fprintf(out, "error: bad count\n");
+      } else {
+        DebugStop stop = DEBUG_NONE;
+        for (uint16_t i = 0; i < n; ++i) {
+          stop = debug_step(vm, retired);
+          if (stop != DEBUG_NONE || !vm.running) { break; }
+        }
+        report(vm, stop, out);
+      }
+    } else if (strcmp(cmd, "continue") == 0 || strcmp(cmd, "c") == 0) {
+      report(vm, debug_continue(vm, engine, retired), out);
+    } else if (strcmp(cmd, "regs") == 0 || strcmp(cmd, "r") == 0) {
+      print_regs(vm, out);
+    } else if (strcmp(cmd, "mem") == 0 || strcmp(cmd, "x") == 0) {
+      uint16_t count = 8;
+      if (!has_addr || (args >= 2 && !parse_word(arg2, count))) {
+        fprintf(out, "error: bad address or count\n");
+      } else {
+        print_mem(vm, addr, count, out);
+      }
+    } else {
+      fprintf(out, "error: unknown command %s\n", cmd);
+    }
+    fflush(out);
+  }
+  fflush(out);
+  return retired;
+}
+
+int debug_serve_socket(Vm& vm, Engine engine, const char* path, uint64_t& retired) {
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) { return 0; }
+  strcpy(addr.sun_path, path);
+
+  // a socket left over from an earlier run is in the way, anything else isn't ours
+  struct stat st;
+  if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) { unlink(path); }
+
+  int server = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (server < 0) { return 0; }
+  if (bind(server, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || listen(server, 1) != 0) {
+    close(server);
+    return 0;
+  }
+  int client = accept(server, nullptr, nullptr);
+  close(server);
+  unlink(path);
+  if (client < 0) { return 0; }
+
+  // the client going away mid reply shouldn't kill the VM
+  signal(SIGPIPE, SIG_IGN);
+  FILE* in = fdopen(client, "r");
+  int out_fd = dup(client);
+  FILE* out = out_fd < 0 ? nullptr : fdopen(out_fd, "w");
+  if (!in || !out) {
+    if (in) { fclose(in); } else { close(client); }
+    if (out) { fclose(out); } else if (out_fd >= 0) { close(out_fd); }
+    return 0;
+  }
+  retired = debug_serve(vm, engine, in, out);
+  fclose(in);
+  fclose(out);
+  return 1;
+}
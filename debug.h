@@ -0,0 +1,111 @@
+#ifndef DEBUG_H
+#define DEBUG_H
+#include <cstdint>
+#include <cstdio>
+#include "engine.h"
+#include "memory.h"
+#include "vm.h"
+
+// ============================
+// ========= Debugger =========
+// ============================
+// Breakpoints, single stepping & memory watchpoints, driven by text
+// commands from stdin or a local (unix) socket
+//
+//   vm --debug --input keys.txt image.obj       (commands on stdin, replies on stdout)
+//   vm --debug-socket /tmp/lc3.sock image.obj   (one client, ex. `nc -U /tmp/lc3.sock`)
+//
+// Nothing here costs anything while no debugger is attached
+// - A breakpoint is an OP_BREAK entry in the predecoded cache (see decode.h),
+//   so the engines find it by dispatching, never by checking each PC
+//   -- the instruction stays in memory, a step over it decodes it directly
+//   -- the entry stays OP_BREAK when the word is written or reloaded
+// - A watchpoint marks its page PAGE_ATTR_WATCH (see memory.h), only then
+//   does mem_read/mem_write look any further
+//   -- the VM stops after the instruction that touched the address
+//   -- TRAP routines run natively & don't go through mem_read/mem_write,
+//      so they don't trigger watchpoints
+// - The JIT's blocks don't look at either, while debugging run_jit falls
+//   back to the threaded core like it does for tracing & profiling
+//
+// Breakpoints live in the decoded cache: restoring a snapshot or mapping a
+// base image (which replace it) drops them, set them afterwards
+//
+// Commands (addresses: x3000, 0x3000 or decimal)
+//   break ADDR | b         delete ADDR | d        list (ends with "end")
+//   watch ADDR [r|w|rw]    unwatch ADDR
+//   step [N] | s           continue | c
+//   regs | r               mem ADDR [N] | x       (with disassembly)
+//   quit | q
+// Every stop is reported as one line:
+//   "breakpoint x3005", "watch write x4000 at x3010", "halted", "error: ..."
+
+// Why the debugger last stopped the VM
+enum DebugStop {
+  DEBUG_NONE = 0,
+  DEBUG_BREAKPOINT,
+  DEBUG_WATCHPOINT,
+};
+
+// Kinds of access a watchpoint stops on
+enum DebugWatch {
+  DEBUG_WATCH_READ = 1 << 0,
+  DEBUG_WATCH_WRITE = 1 << 1,
+};
+
+struct Debugger {
+  // one bit per address
+  uint64_t breakpoints[MEMORY_MAX / 64]{};
+  uint64_t watch_read[MEMORY_MAX / 64]{};
+  uint64_t watch_write[MEMORY_MAX / 64]{};
+
+  // what stopped the VM, the address (breakpoint or watched word), & for a
+  // watchpoint the access & the instruction which made it
+  DebugStop stop{DEBUG_NONE};
+  uint16_t stop_addr{0};
+  DebugWatch stop_access{DEBUG_WATCH_READ};
+  uint16_t stop_pc{0};
+};
+
+inline bool debug_has_breakpoint(const Debugger& dbg, uint16_t addr) {
+  return (dbg.breakpoints[addr >> 6] >> (addr & 63)) & 1;
+}
+
+// Attach a debugger to vm with nothing set
+// returns 0 if out of memory
+int debug_attach(Vm& vm);
+
+// Detach & clear every breakpoint & watchpoint (vm_destroy does this)
+void debug_detach(Vm& vm);
+
+// Set / clear a breakpoint at `addr`
+void debug_set_breakpoint(Vm& vm, uint16_t addr, bool on);
+
+// Watch `addr` for `access` (DebugWatch bits), 0 stops watching it
+void debug_set_watchpoint(Vm& vm, uint16_t addr, int access);
+
+// Run one instruction, over a breakpoint if it's sitting on one
+// returns what stopped it (DEBUG_NONE if it just retired, or the VM had
+// already stopped), `retired` is increased by the instructions run
+DebugStop debug_step(Vm& vm, uint64_t& retired);
+
+// Run until a breakpoint, watchpoint, HALT or error
+DebugStop debug_continue(Vm& vm, Engine engine, uint64_t& retired);
+
+// Engines: an OP_BREAK entry was dispatched at vm.reg[R_PC] - 1
+// stops the VM in front of it, it didn't retire
+void debug_break(Vm& vm);
+
+// mem_read/mem_write: `addr` on a watched page was accessed
+void debug_watch_hit(Vm& vm, uint16_t addr, DebugWatch access);
+
+// Read commands from `in` & reply on `out` until quit or end of input
+// (attaching a debugger if there isn't one)
+// returns the instructions retired meanwhile
+uint64_t debug_serve(Vm& vm, Engine engine, FILE* in, FILE* out);
+
+// debug_serve over a unix socket at `path`, for one client
+// returns 0 if the socket can't be set up
+int debug_serve_socket(Vm& vm, Engine engine, const char* path, uint64_t& retired);
+
+#endif // !DEBUG_H
@@ -0,0 +1,52 @@
+#include "decode.h"
+#include "jit.h"
+#include "ops.h"
+
+DecodedInstr decode(uint16_t instr) {
+  DecodedInstr d;
+  d.op = static_cast<uint8_t>(instr >> 12);
+  // Register fields are always in the same place,
+  // handlers just ignore the ones their opcode doesn't use
+  d.dr = static_cast<uint8_t>((instr >> 9) & 0x7);
+  d.sr1 = static_cast<uint8_t>((instr >> 6) & 0x7);
+  d.sr2 = static_cast<uint8_t>(instr & 0x7);
+  d.imm_mode = static_cast<uint8_t>((instr >> 5) & 1);
+  d.imm = 0;
+
+  // Only the size of the immediate depends on the opcode
+  switch (d.op) {
+    case OP_ADD:
+    case OP_AND:
+      d.imm = sign_extend(instr & 0x1F, 5);
+      break;
+    case OP_LDR:
+    case OP_STR:
+      d.imm = sign_extend(instr & 0x3F, 6);
+      break;
+    case OP_BR:
+    case OP_LD:
+    case OP_LDI:
+    case OP_LEA:
+    case OP_ST:
+    case OP_STI:
+      d.imm = sign_extend(instr & 0x1FF, 9);
+      break;
+    case OP_JSR:
+      // JSR (PCoffset11) vs JSRR (BaseR) is bit 11, not bit 5
+      d.imm_mode = static_cast<uint8_t>((instr >> 11) & 1);
+      d.imm = sign_extend(instr & 0x7FF, 11);
+      break;
+    case OP_TRAP:
+      d.imm = static_cast<uint16_t>(instr & 0xFF);
+      break;
+  }
+  return d;
+}
+
+void invalidate_decoded_range(Vm& vm, uint16_t addr, size_t count) {
+  for (size_t i = 0; i < count && addr + i < MEMORY_MAX; ++i) {
+    vm.decoded[addr + i].op = OP_UNDECODED;
+  }
+  // & so are the JIT's translations of it
+  jit_invalidate(vm, addr, count);
+}
@@ -0,0 +1,116 @@
+#ifndef DECODE_H
+#define DECODE_H
+#include <cstddef>
+#include <cstdint>
+#include "memory.h"
+#include "vm.h"
+#include "debug.h"
+
+// ============================
+// ==== Predecoded Cache ======
+// ============================
+// Every instruction used to be decoded (shift/mask + sign_extend) each time
+// it was executed, once in the main loop & again inside its handler
+//
+// Instead, a side table parallel to `memory` holds each word already decoded
+// - Filled lazily the first time an address is executed
+// - Invalidated by mem_write & image loads, so self-modifying code still works
+// - Tight loops decode once per address instead of once per execution
+
+// Marks an entry which has to be decoded before it can be executed
+// (one past the last real opcode, OP_TRAP = 15)
+#define OP_UNDECODED 16
+
+// A breakpoint, the instruction itself is left in memory (see debug.h)
+// Engines dispatch on it like any opcode, so breakpoints cost nothing
+// when none are set
+#define OP_BREAK 17
+
+// 8 bytes per entry, 512KB for the whole table
+struct DecodedInstr {
+  uint8_t op;       // opcode (enum Instruction), OP_UNDECODED or OP_BREAK
+  uint8_t dr;       // [11..=9] DR, SR for ST/STI/STR, nzp mask for BR
+  uint8_t sr1;      // [8..=6]  SR1, BaseR
+  uint8_t sr2;      // [2..=0]  SR2 (register mode ADD/AND)
+  uint8_t imm_mode; // ADD/AND bit 5 (immediate mode), JSR bit 11 (JSR vs JSRR)
+  uint16_t imm;     // already sign extended imm5 / offset6 / PCoffset9 / PCoffset11
+                    // or the zero extended trapvect8 for TRAP
+};
+
+// The same fields for every word whose top 10 bits are `Hi`
+// (opcode, [11..=9], [8..=6]): those are compile time constants, so
+// `vm.reg[d.dr]` is a fixed offset & a BR's nzp mask is known, only the
+// low bits are pulled out when one is made, by the opcode's own rule
+// 1024 of these cover every word (see ENGINE_SPECIALIZED in engine.h)
+template <unsigned Hi>
+struct FixedInstr {
+  static constexpr uint8_t op = static_cast<uint8_t>(Hi >> 6);
+  static constexpr uint8_t dr = static_cast<uint8_t>((Hi >> 3) & 0x7);
+  static constexpr uint8_t sr1 = static_cast<uint8_t>(Hi & 0x7);
+  uint8_t sr2;
+  uint8_t imm_mode;
+  uint16_t imm;
+
+  explicit FixedInstr(uint16_t instr)
+    : sr2(static_cast<uint8_t>(instr & 0x7)), imm_mode(mode_of(instr)), imm(imm_of(instr)) {}
+
+  // low `bits` of instr, sign extended (a shift pair)
+  template <int bits>
+  static uint16_t sext(uint16_t instr) {
+    return static_cast<uint16_t>(static_cast<int16_t>(static_cast<uint16_t>(instr << (16 - bits))) >> (16 - bits));
+  }
+  static uint8_t mode_of(uint16_t instr) {
+    // JSR vs JSRR is bit 11, which is part of Hi
+    if constexpr (op == 4) { return static_cast<uint8_t>((Hi >> 5) & 1); }
+    return static_cast<uint8_t>((instr >> 5) & 1);
+  }
+  // same sizes as decode()
+  static uint16_t imm_of(uint16_t instr) {
+    if constexpr (op == 1 || op == 5) { return sext<5>(instr); }           // ADD/AND
+    if constexpr (op == 6 || op == 7) { return sext<6>(instr); }           // LDR/STR
+    if constexpr (op == 4) { return sext<11>(instr); }                     // JSR
+    if constexpr (op == 15) { return static_cast<uint16_t>(instr & 0xFF); } // TRAP
+    if constexpr (op == 8 || op == 9 || op == 12 || op == 13) { return 0; } // RTI/NOT/JMP/RES
+    return sext<9>(instr);                                                 // BR/LD/LDI/LEA/ST/STI
+  }
+};
+
+// Vm::decoded[addr] is the decoded form of memory[addr], same indexing
+//
+// A zeroed entry is exactly what a zeroed memory word (x0000, BR with no
+// nzp bits, a NOP) decodes to, so the zero-initialised table already agrees
+// with the zero-initialised memory before anything is loaded
+
+// Pulls the operand fields out of a raw instruction
+DecodedInstr decode(uint16_t instr);
+
+// The word at `addr` changed, decode it again before its next execution
+inline void invalidate_decoded(Vm& vm, uint16_t addr) {
+  vm.decoded[addr].op = OP_UNDECODED;
+}
+
+// Same as invalidate_decoded, for `count` words starting at `addr` (image loads),
+// the JIT's translations of them too (see jit.h)
+void invalidate_decoded_range(Vm& vm, uint16_t addr, size_t count);
+
+// Decode the word at `addr` into its entry
+// (a breakpoint there stays one however often the word changes)
+inline DecodedInstr& decode_at(Vm& vm, uint16_t addr) {
+  DecodedInstr& d = vm.decoded[addr];
+  d = decode(vm.memory[addr]);
+  if (vm.debug && debug_has_breakpoint(*vm.debug, addr)) {
+    d.op = OP_BREAK;
+  }
+  return d;
+}
+
+// The decoded instruction at `addr`, decoding it first if needed
+inline const DecodedInstr& fetch_decoded(Vm& vm, uint16_t addr) {
+  DecodedInstr& d = vm.decoded[addr];
+  if (d.op == OP_UNDECODED) {
+    return decode_at(vm, addr);
+  }
+  return d;
+}
+
+#endif // !DECODE_H
@@ -0,0 +1,260 @@
+#include "device.h"
+#include "console.h"
+#include "idle.h"
+#include "input.h"
+#include "memory.h"
+#include "replay.h"
+#include "vm.h"
+#include <cstdint>
+
+// Some device may interrupt or has an event coming (see Vm::interrupts)
+static void attention(Vm& vm) {
+  vm.interrupts = (vm.memory[MMR_KBSR] & KBSR_IE) || vm.bus.events.count;
+}
+
+// ============================
+// ========= Keyboard =========
+// ============================
+
+// KBSR read from vm.input: the key, KEY_EOF if the VM should see end of
+// input (only looked for when eof_policy does something with it), or KEY_NONE
+static int poll_key(Vm& vm) {
+  // served from the input queue, no syscall (see input.h)
+  bool ready = input_ready(vm.input);
+  if (ready) {
+    vm.idle_polls = 0;
+  } else if (vm.eof_policy != EOF_CONTINUE && input_eof(vm.input)) {
+    return KEY_EOF;
+  } else if ((vm.idle_wait_ms > 0 || vm.yield_on_input) && ++vm.idle_polls >= IDLE_POLL_THRESHOLD
+      && is_polling_loop(vm, vm.reg[R_PC])) {
+    // nothing but spinning until a key arrives, sleep instead (see idle.h)
+    // or under execute(), stop after this read & let the caller wait
+    // (the loop is at a fixed point, so picking up after the read is the same)
+    if (vm.yield_on_input) {
+      vm.blocked = 1;
+      vm.running = 0;
+    } else {
+      ready = input_wait(vm.input, vm.idle_wait_ms);
+    }
+  }
+  return ready ? input_getc(vm.input) : KEY_NONE;
+}
+
+static uint16_t keyboard_read(Vm& vm, uint16_t address) {
+  if (address != MMR_KBSR) { return vm.memory[address]; }
+  // polling for a key = waiting for input, show the output so far
+  console_flush(vm.console);
+  int key;
+  if (vm.replay && vm.replay->playing) {
+    key = replay_next(vm, false);
+  } else {
+    key = poll_key(vm);
+    if (vm.replay) { replay_note(vm, key); }
+  }
+  // KBSR/KBDR change, that's a write too
+  mem_mark_dirty(vm, MMR_KBSR, MMR_KBDR - MMR_KBSR + 1);
+  uint16_t ie = static_cast<uint16_t>(vm.memory[MMR_KBSR] & KBSR_IE);
+  if (key >= 0) {
+    vm.memory[MMR_KBSR] = static_cast<uint16_t>(KBSR_READY | ie);
+    vm.memory[MMR_KBDR] = static_cast<uint16_t>(key);
+  } else {
+    vm.memory[MMR_KBSR] = ie;
+    // the guest reads KBSR = 0 & stops right after this instruction
+    if (key == KEY_EOF && vm.running) { end_of_input(vm); }
+  }
+  return vm.memory[MMR_KBSR];
+}
+
+static void keyboard_write(Vm& vm, uint16_t address) {
+  // KBSR's IE bit may have changed
+  if (address == MMR_KBSR) { attention(vm); }
+}
+
+// ============================
+// ========= Display ==========
+// ============================
+
+static uint16_t display_read(Vm& vm, uint16_t address) {
+  // the console buffers, it's never busy
+  return address == MMR_DSR ? static_cast<uint16_t>(DSR_READY) : vm.memory[address];
+}
+
+static void display_write(Vm& vm, uint16_t address) {
+  if (address == MMR_DDR) {
+    console_putc(vm.console, static_cast<char>(vm.memory[MMR_DDR] & 0xFF));
+  }
+}
+
+// ============================
+// ========== Timer ===========
+// ============================
+
+static void timer_expired(Vm& vm);
+
+// (Re)starts the timer from TMI, stopped if it's 0
+static void timer_start(Vm& vm) {
+  if (vm.bus.timer) {
+    event_cancel(vm, vm.bus.timer - 1);
+    vm.bus.timer = 0;
+  }
+  if (vm.memory[MMR_TMI]) {
+    // (the timer is the only device with events, there's always room)
+    vm.bus.timer = static_cast<uint8_t>(event_schedule(vm, vm.memory[MMR_TMI], timer_expired) + 1);
+  }
+  attention(vm);
+}
+
+static void timer_expired(Vm& vm) {
+  vm.bus.timer = 0;
+  vm.memory[MMR_TMR] = static_cast<uint16_t>(vm.memory[MMR_TMR] | TMR_READY);
+  mem_mark_dirty(vm, MMR_TMR, 1);
+  // again in another TMI ticks
+  timer_start(vm);
+}
+
+static uint16_t timer_read(Vm& vm, uint16_t address) {
+  uint16_t val = vm.memory[address];
+  if (address == MMR_TMR && (val & TMR_READY)) {
+    vm.memory[address] = static_cast<uint16_t>(val & ~TMR_READY);
+    mem_mark_dirty(vm, address, 1);
+  }
+  return val;
+}
+
+static void timer_write(Vm& vm, uint16_t address) {
+  if (address == MMR_TMI) { timer_start(vm); }
+}
+
+// ============================
+// ===== Machine Control ======
+// ============================
+
+static uint16_t mcr_read(Vm& vm, uint16_t address) {
+  // a machine that runs has its clock on
+  return static_cast<uint16_t>(vm.memory[address] | MCR_CLOCK);
+}
+
+static void mcr_write(Vm& vm, uint16_t address) {
+  if (!(vm.memory[address] & MCR_CLOCK)) {
+    // clock off: stops like HALT, after this instruction
+    console_flush(vm.console);
+    vm.running = 0;
+  }
+}
+
+// ============================
+// ========= Registry =========
+// ============================
+
+static const Device DEVICES[] = {
+  {"keyboard", MMR_KBSR, MMR_KBDR - MMR_KBSR + 1, keyboard_read, keyboard_write, nullptr},
+  {"display", MMR_DSR, MMR_DDR - MMR_DSR + 1, display_read, display_write, nullptr},
+  {"timer", MMR_TMR, MMR_TMI - MMR_TMR + 1, timer_read, timer_write, timer_start},
+  {"mcr", MMR_MCR, 1, mcr_read, mcr_write, nullptr},
+};
+
+const Device* device_at(uint16_t address) {
+  for (const Device& d : DEVICES) {
+    if (static_cast<uint16_t>(address - d.base) < d.count) { return &d; }
+  }
+  return nullptr;
+}
+
+bool device_page(size_t page) {
+  for (const Device& d : DEVICES) {
+    if (page >= (d.base >> MEM_PAGE_SHIFT)
+        && page <= static_cast<size_t>((d.base + d.count - 1) >> MEM_PAGE_SHIFT)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void bus_attach(Vm& vm) {
+  for (size_t page = 0; page < MEM_PAGES; ++page) {
+    if (device_page(page)) {
+      vm.page_attr[page] = static_cast<uint8_t>(vm.page_attr[page] | PAGE_ATTR_IO);
+    }
+  }
+}
+
+uint16_t bus_read(Vm& vm, uint16_t address) {
+  const Device* d = device_at(address);
+  return d && d->read ? d->read(vm, address) : vm.memory[address];
+}
+
+void bus_write(Vm& vm, uint16_t address) {
+  const Device* d = device_at(address);
+  if (d && d->write) { d->write(vm, address); }
+}
+
+void bus_sync(Vm& vm) {
+  for (const Device& d : DEVICES) {
+    if (d.sync) { d.sync(vm); }
+  }
+  attention(vm);
+}
+
+// ============================
+// ====== Device Events =======
+// ============================
+
+int event_schedule(Vm& vm, uint64_t delay, void (*fire)(Vm& vm)) {
+  DeviceEvents& ev = vm.bus.events;
+  for (int i = 0; i < DEVICE_EVENTS_MAX; ++i) {
+    DeviceEvent& e = ev.event[i];
+    if (e.fire) { continue; }
+    e.when = ev.now + (delay ? delay : 1);
+    e.fire = fire;
+    uint8_t& head = ev.slot[e.when % DEVICE_WHEEL_SLOTS];
+    e.next = head;
+    head = static_cast<uint8_t>(i + 1);
+    ++ev.count;
+    return i;
+  }
+  return -1;
+}
+
+void event_cancel(Vm& vm, int index) {
+  DeviceEvents& ev = vm.bus.events;
+  DeviceEvent& e = ev.event[index];
+  if (!e.fire) { return; }
+  uint8_t* link = &ev.slot[e.when % DEVICE_WHEEL_SLOTS];
+  while (*link != index + 1) {
+    link = &ev.event[*link - 1].next;
+  }
+  *link = e.next;
+  e.fire = nullptr;
+  --ev.count;
+}
+
+void event_tick(Vm& vm) {
+  DeviceEvents& ev = vm.bus.events;
+  ++ev.now;
+  uint8_t* link = &ev.slot[ev.now % DEVICE_WHEEL_SLOTS];
+  while (*link) {
+    DeviceEvent& e = ev.event[*link - 1];
+    if (e.when != ev.now) {
+      // a later turn of the wheel
+      link = &e.next;
+      continue;
+    }
+    // off the wheel before it runs, it may schedule itself again
+    void (*fire)(Vm& vm) = e.fire;
+    *link = e.next;
+    e.fire = nullptr;
+    --ev.count;
+    fire(vm);
+  }
+}
+
+bool event_skip(Vm& vm) {
+  DeviceEvents& ev = vm.bus.events;
+  if (!ev.count) { return false; }
+  uint64_t next = UINT64_MAX;
+  for (const DeviceEvent& e : ev.event) {
+    if (e.fire && e.when < next) { next = e.when; }
+  }
+  ev.now = next - 1;
+  return true;
+}
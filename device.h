@@ -0,0 +1,134 @@
+#ifndef DEVICE_H
+#define DEVICE_H
+#include <cstddef>
+#include <cstdint>
+
+struct Vm;
+
+// ============================
+// ======== Device Bus ========
+// ============================
+// The memory mapped devices, each a range of registers on an I/O page
+// - keyboard : KBSR xFE00, KBDR xFE02 (see memory.h)
+// - display  : DSR xFE04, always ready (output is buffered, see console.h)
+//              DDR xFE06, a write prints its low byte like OUT
+// - timer    : TMR xFE08, bit 15 set each time the timer expires, bit 14 (IE)
+//              raises an interrupt then (see interrupt.h), a TMR read or
+//              taking the interrupt clears bit 15
+//              TMI xFE0A, the interval in ticks, writing it (re)starts the
+//              timer, 0 stops it
+// - MCR      : xFFFE, bit 15 is the clock, writing it with bit 15 clear
+//              stops the machine (reads always show it set while running)
+//
+// Cost: nothing for plain memory
+// - bus_attach gives each device's page PAGE_ATTR_IO, mem_read/mem_write
+//   only come here for those pages (one table lookup, same as before)
+// - the instruction fetch never does, code isn't run out of device registers
+// - an I/O page access finds its device in the registry below, an address
+//   on the page that no device owns is plain memory
+//
+// Device state lives in memory where it can (the registers themselves), so
+// snapshots, base images & fuzzing resets carry it, bus_sync rebuilds the
+// rest afterwards (the timer starts over with a full TMI interval)
+
+// Memory mapped registers past the keyboard's (MemMapRegister is in memory.h)
+#define MMR_DSR 0xFE04
+#define MMR_DDR 0xFE06
+#define MMR_TMR 0xFE08
+#define MMR_TMI 0xFE0A
+#define MMR_MCR 0xFFFE
+
+#define DSR_READY (1 << 15)
+#define TMR_READY (1 << 15)
+#define TMR_IE (1 << 14)
+#define MCR_CLOCK (1 << 15)
+
+// One entry in the registry
+struct Device {
+  const char* name;
+  // registers are memory[base .. base + count)
+  uint16_t base;
+  uint16_t count;
+  // the guest reads `address`: returns what it sees (nullptr: memory[address])
+  uint16_t (*read)(Vm& vm, uint16_t address);
+  // the guest wrote memory[address] (nullptr: nothing else happens)
+  void (*write)(Vm& vm, uint16_t address);
+  // memory was replaced without mem_write, rebuild what isn't in it
+  // (nullptr: nothing to rebuild)
+  void (*sync)(Vm& vm);
+};
+
+// The device owning `address`, nullptr for everything else
+const Device* device_at(uint16_t address);
+
+// Does some device have registers on page `page` (address >> MEM_PAGE_SHIFT)?
+bool device_page(size_t page);
+
+// Gives the device pages PAGE_ATTR_IO (vm_alloc does this)
+void bus_attach(Vm& vm);
+
+// mem_read/mem_write on an I/O page
+uint16_t bus_read(Vm& vm, uint16_t address);
+void bus_write(Vm& vm, uint16_t address);
+
+// After memory was replaced without mem_write (snapshots, base images, a
+// fuzzing reset): every device's sync, then Vm::interrupts
+void bus_sync(Vm& vm);
+
+// ============================
+// ====== Device Events =======
+// ============================
+// A timing wheel for things a device does later (the timer expiring)
+// - time is counted in ticks: one per interrupt check, the end of a basic
+//   block (BR/JMP/JSR/TRAP/RTI) while Vm::interrupts is set, the same in
+//   every interpreter, so a run (or a replay) sees events at the same points
+// - DEVICE_WHEEL_SLOTS slots, an event due at tick t waits in slot
+//   t % DEVICE_WHEEL_SLOTS, a tick only looks at its own slot
+//   (an event further off than a turn of the wheel stays put until its tick)
+// - Vm::interrupts stays set while an event is scheduled, that's what
+//   keeps the ticks coming, a program with none pays nothing
+// - a program idling until an event (see interrupt.h) skips straight to it
+#define DEVICE_WHEEL_SLOTS 64
+#define DEVICE_EVENTS_MAX 8
+
+struct DeviceEvent {
+  // tick it's due at
+  uint64_t when;
+  // nullptr: the entry is free
+  void (*fire)(Vm& vm);
+  // next event in the same slot, index + 1 (0: last one)
+  uint8_t next;
+};
+
+struct DeviceEvents {
+  // ticks so far
+  uint64_t now;
+  // events scheduled
+  uint32_t count;
+  // first event in each slot, index + 1 (0: empty)
+  uint8_t slot[DEVICE_WHEEL_SLOTS];
+  DeviceEvent event[DEVICE_EVENTS_MAX];
+};
+
+// What the bus keeps outside memory (Vm::bus, zeroed with the Vm)
+struct Bus {
+  DeviceEvents events;
+  // the timer's event, index + 1 (0: stopped)
+  uint8_t timer;
+};
+
+// `fire` runs `delay` ticks from now (at least 1)
+// returns the event's index, -1 if DEVICE_EVENTS_MAX are already scheduled
+int event_schedule(Vm& vm, uint64_t delay, void (*fire)(Vm& vm));
+
+// Unschedules event `index`
+void event_cancel(Vm& vm, int index);
+
+// One tick: fires what's due (interrupt_check does this)
+void event_tick(Vm& vm);
+
+// Moves time on to just before the next event, so the next tick fires it
+// returns false if nothing is scheduled
+bool event_skip(Vm& vm);
+
+#endif // !DEVICE_H
@@ -0,0 +1,100 @@
+#include "disasm.h"
+#include "ops.h"
+#include <cstdio>
+
+// sign extended field as a signed int, for printing `#-3` instead of `#65533`
+static int signed_field(uint16_t instr, int bits) {
+  return static_cast<int16_t>(sign_extend(static_cast<uint16_t>(instr & ((1 << bits) - 1)), bits));
+}
+
+// PC-relative target, PC is already incremented when the offset is applied
+static unsigned target(uint16_t pc, uint16_t instr, int bits) {
+  return static_cast<uint16_t>(pc + 1 + signed_field(instr, bits));
+}
+
+void disassemble(uint16_t pc, uint16_t instr, char* out, size_t size) {
+  unsigned dr = (instr >> 9) & 0x7;
+  unsigned sr1 = (instr >> 6) & 0x7;
+  unsigned sr2 = instr & 0x7;
+  bool imm = (instr >> 5) & 1;
+
+  switch (instr >> 12) {
+    case OP_ADD:
+    case OP_AND: {
+      const char* name = (instr >> 12) == OP_ADD ? "ADD" : "AND";
+      if (imm) {
+        snprintf(out, size, "%s R%u, R%u, #%d", name, dr, sr1, signed_field(instr, 5));
+      } else {
+        snprintf(out, size, "%s R%u, R%u, R%u", name, dr, sr1, sr2);
+      }
+      break;
+    }
+    case OP_NOT:
+      snprintf(out, size, "NOT R%u, R%u", dr, sr1);
+      break;
+    case OP_BR: {
+      // nzp bits live where DR normally is
+      if (dr == 0) {
+        snprintf(out, size, "NOP");
+      } else {
+        snprintf(out, size, "BR%s%s%s x%04x",
+          dr & 0b100 ? "n" : "", dr & 0b010 ? "z" : "", dr & 0b001 ? "p" : "",
+          target(pc, instr, 9));
+      }
+      break;
+    }
+    case OP_JMP:
+      if (sr1 == 7) {
+        snprintf(out, size, "RET");
+      } else {
+        snprintf(out, size, "JMP R%u", sr1);
+      }
+      break;
+    case OP_JSR:
+      if ((instr >> 11) & 1) {
+        snprintf(out, size, "JSR x%04x", target(pc, instr, 11));
+      } else {
+        snprintf(out, size, "JSRR R%u", sr1);
+      }
+      break;
+    case OP_LD:
+      snprintf(out, size, "LD R%u, x%04x", dr, target(pc, instr, 9));
+      break;
+    case OP_LDI:
+      snprintf(out, size, "LDI R%u, x%04x", dr, target(pc, instr, 9));
+      break;
+    case OP_LEA:
+      snprintf(out, size, "LEA R%u, x%04x", dr, target(pc, instr, 9));
+      break;
+    case OP_ST:
+      snprintf(out, size, "ST R%u, x%04x", dr, target(pc, instr, 9));
+      break;
+    case OP_STI:
+      snprintf(out, size, "STI R%u, x%04x", dr, target(pc, instr, 9));
+      break;
+    case OP_LDR:
+      snprintf(out, size, "LDR R%u, R%u, #%d", dr, sr1, signed_field(instr, 6));
+      break;
+    case OP_STR:
+      snprintf(out, size, "STR R%u, R%u, #%d", dr, sr1, signed_field(instr, 6));
+      break;
+    case OP_TRAP: {
+      switch (instr & 0xFF) {
+        case 0x20: snprintf(out, size, "GETC"); break;
+        case 0x21: snprintf(out, size, "OUT"); break;
+        case 0x22: snprintf(out, size, "PUTS"); break;
+        case 0x23: snprintf(out, size, "IN"); break;
+        case 0x24: snprintf(out, size, "PUTSP"); break;
+        case 0x25: snprintf(out, size, "HALT"); break;
+        default: snprintf(out, size, "TRAP x%02x", instr & 0xFF); break;
+      }
+      break;
+    }
+    case OP_RTI:
+      snprintf(out, size, "RTI");
+      break;
+    default:
+      snprintf(out, size, ".FILL x%04x", instr);
+      break;
+  }
+}
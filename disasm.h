@@ -0,0 +1,17 @@
+#ifndef DISASM_H
+#define DISASM_H
+#include <cstddef>
+#include <cstdint>
+
+// ============================
+// ======= Disassembler =======
+// ============================
+// Turns one instruction back into LC-3 assembly text
+// - `pc` is the address the instruction lives at,
+//   so PC-relative operands can be shown as absolute addresses
+// - Writes at most `size` chars (including the null terminator) into `out`
+// ex. 0x1265 @ x3003 -> "ADD R1, R1, #5"
+//     0x03FA @ x300a -> "BRp x3005"
+void disassemble(uint16_t pc, uint16_t instr, char* out, size_t size);
+
+#endif // !DISASM_H
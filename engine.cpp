@@ -0,0 +1,64 @@
+#include "engine.h"
+#include "input.h"
+#include "jit.h"
+#include <cstring>
+
+int engine_from_name(const char* name, Engine& engine) {
+  if (strcmp(name, "switch") == 0) {
+    engine = ENGINE_SWITCH;
+    return 1;
+  }
+  if (strcmp(name, "threaded") == 0) {
+    engine = ENGINE_THREADED;
+    return 1;
+  }
+  if (strcmp(name, "jit") == 0) {
+    engine = ENGINE_JIT;
+    return 1;
+  }
+  if (strcmp(name, "specialized") == 0) {
+    engine = ENGINE_SPECIALIZED;
+    return 1;
+  }
+  return 0;
+}
+
+uint64_t run_engine(Engine engine, Vm& vm, uint64_t max_instructions) {
+  switch (engine) {
+    case ENGINE_THREADED:
+      return run_threaded(vm, max_instructions);
+    case ENGINE_JIT:
+      return run_jit(vm, max_instructions);
+    case ENGINE_SPECIALIZED:
+      return run_specialized(vm, max_instructions);
+    case ENGINE_SWITCH:
+    default:
+      return run_switch(vm, max_instructions);
+  }
+}
+
+ExecResult execute(Vm& vm, uint64_t max_instructions, Engine engine) {
+  if (vm.blocked) {
+    if (!input_ready(vm.input) && !input_eof(vm.input)) {
+      return ExecResult{EXEC_BLOCKED, 0};
+    }
+    vm.blocked = 0;
+    vm.running = 1;
+  }
+  if (!vm.running) {
+    return ExecResult{vm.error ? EXEC_ERROR : EXEC_HALTED, 0};
+  }
+
+  vm.yield_on_input = 1;
+  uint64_t retired = run_engine(engine, vm, max_instructions);
+  vm.yield_on_input = 0;
+
+  if (vm.blocked) { return ExecResult{EXEC_BLOCKED, retired}; }
+  if (vm.running) { return ExecResult{EXEC_BUDGET, retired}; }
+  return ExecResult{vm.error ? EXEC_ERROR : EXEC_HALTED, retired};
+}
+
+void bad_opcode(Vm& vm, const char* what) {
+  vm.error = what;
+  vm.running = 0;
+}
@@ -0,0 +1,89 @@
+#ifndef ENGINE_H
+#define ENGINE_H
+#include <cstdint>
+#include "vm.h"
+
+// ============================
+// ===== Interpreter Cores ====
+// ============================
+// Both cores run the exact same handlers from ops.cpp,
+// they only differ in how they get from one instruction to the next
+//
+// - ENGINE_SWITCH
+//   -- one `switch (op)` in a loop
+//   -- every opcode shares that single indirect branch, which the
+//      CPU's branch predictor has a hard time with
+// - ENGINE_THREADED
+//   -- direct threaded, each handler ends with its own indirect jump
+//      to the next handler, so each gets its own predictor history
+//   -- GCC/Clang labels-as-values (computed goto)
+//   -- other compilers fall back to a table of handler functions
+// - ENGINE_JIT
+//   -- translates basic blocks to native x86-64, see jit.h
+// - ENGINE_SPECIALIZED
+//   -- a compile time table of 1024 handlers indexed by the word's top
+//      10 bits (opcode, DR/SR/nzp, SR1/BaseR), those fields baked in as
+//      constants (FixedInstr, see decode.h)
+//   -- each step is one indirect call on the raw word: no decode & no
+//      cache, so no invalidation either
+//   -- not the full 65536: the remaining bits are at most one shift
+//      pair to sign extend, 64x the code wouldn't save anything
+enum Engine {
+  ENGINE_SWITCH = 0,
+  ENGINE_THREADED,
+  ENGINE_JIT,
+  ENGINE_SPECIALIZED,
+};
+
+// Parses "switch" / "threaded" / "jit" / "specialized"
+// returns 0 if `name` isn't an engine
+int engine_from_name(const char* name, Engine& engine);
+
+// Run from vm.reg[R_PC] until vm.running is cleared (HALT or an error),
+// or about `max_instructions` have retired
+// returns the number of instructions retired
+// - The budget is only checked at the end of a basic block (BR/JMP/JSR/TRAP/RTI,
+//   & the JIT's block length limit), so it costs nothing per instruction
+//   & a run can go over it by up to one block
+// - Pending interrupts are taken there too, only while Vm::interrupts is
+//   set (see interrupt.h)
+uint64_t run_switch(Vm& vm, uint64_t max_instructions = UINT64_MAX);
+uint64_t run_threaded(Vm& vm, uint64_t max_instructions = UINT64_MAX);
+uint64_t run_specialized(Vm& vm, uint64_t max_instructions = UINT64_MAX);
+
+// Exactly one instruction at vm.reg[R_PC], the real one even under a
+// breakpoint (the debugger's single step, see debug.h)
+// returns 1 if it retired, 0 if it didn't or the VM had already stopped
+uint64_t run_step(Vm& vm);
+
+// Same as calling run_switch / run_threaded / run_jit / run_specialized directly
+uint64_t run_engine(Engine engine, Vm& vm, uint64_t max_instructions = UINT64_MAX);
+
+// Why execute() returned
+enum ExecStatus {
+  EXEC_HALTED = 0, // HALT (or end of input with EOF_HALT)
+  EXEC_ERROR,      // vm.error says why
+  EXEC_BUDGET,     // ran through max_instructions, call again to carry on
+  EXEC_BLOCKED,    // waiting for input, call again once input_ready / input_eof
+};
+
+struct ExecResult {
+  ExecStatus status;
+  uint64_t retired;
+};
+
+// Run a time slice of `vm`: up to about `max_instructions`, until it stops,
+// or until it would have to wait for input
+// - never blocks: a GETC/IN with nothing to read, or a keyboard polling loop
+//   (see idle.h), pauses the VM & returns EXEC_BLOCKED
+// - a blocked VM picks up where it paused once there is input (or EOF);
+//   called before that it just returns EXEC_BLOCKED again, running nothing
+// - a VM that already stopped returns EXEC_HALTED / EXEC_ERROR straight away
+ExecResult execute(Vm& vm, uint64_t max_instructions, Engine engine = ENGINE_THREADED);
+
+// RES / anything not executable, shared by every core
+// stops the VM with vm.error = `what`, what happens next is up to the caller
+// (the vm program aborts, batch mode just reports it)
+void bad_opcode(Vm& vm, const char* what);
+
+#endif // !ENGINE_H
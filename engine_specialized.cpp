@@ -0,0 +1,110 @@
+#include "engine.h"
+#include "decode.h"
+#include "interrupt.h"
+#include "memory.h"
+#include "ops.h"
+#include "profile.h"
+#include "trace.h"
+#include <array>
+#include <utility>
+
+// What a handler tells the loop
+enum StepKind {
+  STEP_NEXT = 0,
+  STEP_BLOCK_END,   // BR/JMP/JSR/TRAP/RTI, where the budget & interrupts are checked
+  STEP_NOT_RETIRED, // RES, RTI in user mode or a paused GETC/IN
+};
+
+// Every word whose top 10 bits are `Hi`, the same handlers as the other
+// cores instantiated on FixedInstr (see decode.h)
+template <unsigned Hi>
+static StepKind exec(Vm& vm, uint16_t instr) {
+  using D = FixedInstr<Hi>;
+  const D d(instr);
+  if constexpr (D::op == OP_ADD) {
+    add(vm, d);
+  } else if constexpr (D::op == OP_AND) {
+    bitwise_and(vm, d);
+  } else if constexpr (D::op == OP_NOT) {
+    bitwise_complement(vm, d);
+  } else if constexpr (D::op == OP_LD) {
+    load(vm, d);
+  } else if constexpr (D::op == OP_LDI) {
+    load_indirect(vm, d);
+  } else if constexpr (D::op == OP_LDR) {
+    load_base_offset(vm, d);
+  } else if constexpr (D::op == OP_LEA) {
+    load_effective_addr(vm, d);
+  } else if constexpr (D::op == OP_ST) {
+    store(vm, d);
+    return STEP_NEXT;
+  } else if constexpr (D::op == OP_STI) {
+    store_indirect(vm, d);
+    return STEP_NEXT;
+  } else if constexpr (D::op == OP_STR) {
+    store_base_offset(vm, d);
+    return STEP_NEXT;
+  } else if constexpr (D::op == OP_BR) {
+    branch(vm, d);
+    return STEP_BLOCK_END;
+  } else if constexpr (D::op == OP_JMP) {
+    jump(vm, d);
+    return STEP_BLOCK_END;
+  } else if constexpr (D::op == OP_JSR) {
+    jump_subr(vm, d);
+    return STEP_BLOCK_END;
+  } else if constexpr (D::op == OP_TRAP) {
+    // rare & slow anyway, the plain decoded form is fine
+    trap(vm, decode(instr));
+    return vm.blocked ? STEP_NOT_RETIRED : STEP_BLOCK_END;
+  } else if constexpr (D::op == OP_RTI) {
+    return interrupt_return(vm) ? STEP_BLOCK_END : STEP_NOT_RETIRED;
+  } else {
+    bad_opcode(vm, "Unused opcode");
+    return STEP_NOT_RETIRED;
+  }
+  // ADD/AND/NOT/LD/LDI/LDR/LEA
+  update_cond_flags(vm, D::dr);
+  return STEP_NEXT;
+}
+
+using Handler = StepKind (*)(Vm&, uint16_t);
+
+template <size_t... Hi>
+static constexpr std::array<Handler, sizeof...(Hi)> make_handlers(std::index_sequence<Hi...>) {
+  return {{&exec<Hi>...}};
+}
+
+// Indexed by instr >> 6, built at compile time
+static constexpr std::array<Handler, 1024> HANDLERS = make_handlers(std::make_index_sequence<1024>());
+
+uint64_t run_specialized(Vm& vm, uint64_t max_instructions) {
+  // breakpoints live in the decoded cache, which this never reads
+  if (vm.debug) {
+    return run_threaded(vm, max_instructions);
+  }
+
+  uint64_t retired = 0;
+  load_cond(vm);
+  while (vm.running) {
+    uint16_t pc = vm.reg[R_PC]++;
+    // straight from memory: no decode & no cache to keep in sync
+    uint16_t instr = vm.memory[pc];
+    StepKind kind = HANDLERS[instr >> 6](vm, instr);
+    if (kind == STEP_NOT_RETIRED) { continue; }
+
+    ++retired;
+    if (trace_enabled) {
+      trace_step(vm, pc, instr);
+    }
+    if (vm.profile) {
+      profile_step(vm, pc);
+    }
+    if (kind == STEP_BLOCK_END) {
+      if (vm.interrupts) { interrupt_check(vm); }
+      if (retired >= max_instructions) { break; }
+    }
+  }
+  materialize_cond(vm);
+  return retired;
+}
@@ -0,0 +1,165 @@
+#include "engine.h"
+#include "debug.h"
+#include "decode.h"
+#include "interrupt.h"
+#include "memory.h"
+#include "ops.h"
+#include "profile.h"
+#include "trace.h"
+
+// With 2 callers GCC keeps this out of line, a call per instruction
+// in run_switch, so it has to be told
+#if defined(__GNUC__)
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define ALWAYS_INLINE inline
+#endif
+
+// One instruction, PC already past it
+// returns false if it didn't retire, `block_end` is set if it ends a basic block
+static ALWAYS_INLINE bool step(Vm& vm, const DecodedInstr& d, bool& block_end) {
+  switch (d.op)
+  {
+  case OP_ADD: {
+    add(vm, d);
+    update_cond_flags(vm, d.dr);
+    break;
+  }
+  case OP_AND: {
+    bitwise_and(vm, d);
+    update_cond_flags(vm, d.dr);
+    break;
+  }
+  case OP_NOT: {
+    bitwise_complement(vm, d);
+    update_cond_flags(vm, d.dr);
+    break;
+  }
+  case OP_BR: {
+    branch(vm, d);
+    block_end = true;
+    break;
+  }
+  case OP_JMP: {
+    jump(vm, d);
+    block_end = true;
+    break;
+  }
+  case OP_JSR: {
+    jump_subr(vm, d);
+    block_end = true;
+    break;
+  }
+  case OP_LD: {
+    load(vm, d);
+    update_cond_flags(vm, d.dr);
+    break;
+  }
+  case OP_LDI: {
+    load_indirect(vm, d);
+    update_cond_flags(vm, d.dr);
+    break;
+  }
+  case OP_LDR: {
+    load_base_offset(vm, d);
+    update_cond_flags(vm, d.dr);
+    break;
+  }
+  case OP_LEA: {
+    load_effective_addr(vm, d);
+    update_cond_flags(vm, d.dr);
+    break;
+  }
+  case OP_ST: {
+    store(vm, d);
+    break;
+  }
+  case OP_STI: {
+    store_indirect(vm, d);
+    break;
+  }
+  case OP_STR: {
+    store_base_offset(vm, d);
+    break;
+  }
+  case OP_TRAP: {
+    trap(vm, d);
+    // a paused GETC/IN runs again on resume, it didn't retire
+    if (vm.blocked) { return false; }
+    block_end = true;
+    break;
+  }
+  case OP_RTI: {
+    // in user mode it stops the VM, not retired
+    if (!interrupt_return(vm)) { return false; }
+    block_end = true;
+    break;
+  }
+  case OP_RES: {
+    bad_opcode(vm, "Unused opcode");
+    // not retired, the VM stops here
+    return false;
+  }
+  case OP_BREAK: {
+    // not retired either, stops in front of it (see debug.h)
+    debug_break(vm);
+    return false;
+  }
+  default: {
+    bad_opcode(vm, "Invalid opcode");
+    return false;
+  }
+  }
+  return true;
+}
+
+uint64_t run_switch(Vm& vm, uint64_t max_instructions) {
+  uint64_t retired = 0;
+  load_cond(vm);
+
+  while (vm.running) {
+    // Get the (predecoded) instruction then increment PC register
+    uint16_t pc = vm.reg[R_PC]++;
+    bool block_end = false;
+    if (!step(vm, fetch_decoded(vm, pc), block_end)) { continue; }
+
+    ++retired;
+    // Tracing is off by default, this is a single well predicted branch
+    if (trace_enabled) {
+      trace_step(vm, pc, vm.memory[pc]);
+    }
+    if (vm.profile) {
+      profile_step(vm, pc);
+    }
+    // interrupts & the budget are only looked at where a block ends,
+    // like the other cores
+    if (block_end) {
+      if (vm.interrupts) { interrupt_check(vm); }
+      if (retired >= max_instructions) { break; }
+    }
+  }
+
+  materialize_cond(vm);
+  return retired;
+}
+
+uint64_t run_step(Vm& vm) {
+  if (!vm.running) { return 0; }
+  load_cond(vm);
+  uint16_t pc = vm.reg[R_PC]++;
+  // the word itself rather than the cache, where a breakpoint is OP_BREAK
+  bool block_end = false;
+  bool retired = step(vm, decode(vm.memory[pc]), block_end);
+  if (retired) {
+    if (trace_enabled) {
+      trace_step(vm, pc, vm.memory[pc]);
+    }
+    if (vm.profile) {
+      profile_step(vm, pc);
+    }
+    // an interrupt comes in between this instruction & the next one
+    if (block_end && vm.interrupts) { interrupt_check(vm); }
+  }
+  materialize_cond(vm);
+  return retired ? 1 : 0;
+}
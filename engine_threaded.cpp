@@ -0,0 +1,243 @@
+#include "engine.h"
+#include "debug.h"
+#include "decode.h"
+#include "interrupt.h"
+#include "memory.h"
+#include "ops.h"
+#include "profile.h"
+#include "trace.h"
+
+#if defined(__GNUC__)
+
+// Labels-as-values & computed goto are GNU extensions,
+// only this function uses them so only it opts out of -pedantic
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+
+uint64_t run_threaded(Vm& vm, uint64_t max_instructions) {
+  // One entry per opcode, plus OP_UNDECODED which decodes & re-dispatches
+  // so the "is it decoded yet" check costs nothing extra, & OP_BREAK
+  static void* const handlers[] = {
+    &&op_br, &&op_add, &&op_ld, &&op_st,
+    &&op_jsr, &&op_and, &&op_ldr, &&op_str,
+    &&op_rti, &&op_not, &&op_ldi, &&op_sti,
+    &&op_jmp, &&op_res, &&op_lea, &&op_trap,
+    &&op_undecoded, &&op_break,
+  };
+
+  uint64_t retired = 0;
+  uint16_t pc;
+  DecodedInstr* d;
+
+  // Every handler ends with its own copy of this, which is the whole point:
+  // each tail gets its own indirect jump (and branch predictor entry)
+#define DISPATCH()                      \
+  do {                                  \
+    pc = vm.reg[R_PC]++;                \
+    d = &vm.decoded[pc];                \
+    goto *handlers[d->op];              \
+  } while (0)
+
+#define NEXT()                          \
+  do {                                  \
+    ++retired;                          \
+    if (trace_enabled) {                \
+      trace_step(vm, pc, vm.memory[pc]); \
+    }                                   \
+    if (vm.profile) {                   \
+      profile_step(vm, pc);             \
+    }                                   \
+    DISPATCH();                         \
+  } while (0)
+
+  // Loads & stores can stop the VM too: a KBSR read at end of input
+  // (see Vm::eof_policy), or a watchpoint (see debug.h)
+#define NEXT_MEM()                      \
+  do {                                  \
+    if (!vm.running) { goto stop; }     \
+    NEXT();                             \
+  } while (0)
+
+  // Control transfers end a block, the only place the budget & interrupts
+  // are checked (both out of line, at block_end)
+#define NEXT_BLOCK()                                                        \
+  do {                                                                      \
+    if (vm.interrupts || retired + 1 >= max_instructions) { goto block_end; } \
+    NEXT();                                                                 \
+  } while (0)
+
+  if (!vm.running) { return 0; }
+  load_cond(vm);
+  DISPATCH();
+
+op_undecoded:
+  decode_at(vm, pc);
+  goto *handlers[d->op];
+
+op_add:
+  add(vm, *d);
+  update_cond_flags(vm, d->dr);
+  NEXT();
+op_and:
+  bitwise_and(vm, *d);
+  update_cond_flags(vm, d->dr);
+  NEXT();
+op_not:
+  bitwise_complement(vm, *d);
+  update_cond_flags(vm, d->dr);
+  NEXT();
+op_br:
+  branch(vm, *d);
+  NEXT_BLOCK();
+op_jmp:
+  jump(vm, *d);
+  NEXT_BLOCK();
+op_jsr:
+  jump_subr(vm, *d);
+  NEXT_BLOCK();
+op_ld:
+  load(vm, *d);
+  update_cond_flags(vm, d->dr);
+  NEXT_MEM();
+op_ldi:
+  load_indirect(vm, *d);
+  update_cond_flags(vm, d->dr);
+  NEXT_MEM();
+op_ldr:
+  load_base_offset(vm, *d);
+  update_cond_flags(vm, d->dr);
+  NEXT_MEM();
+op_lea:
+  load_effective_addr(vm, *d);
+  update_cond_flags(vm, d->dr);
+  NEXT();
+op_st:
+  store(vm, *d);
+  NEXT_MEM();
+op_sti:
+  store_indirect(vm, *d);
+  NEXT_MEM();
+op_str:
+  store_base_offset(vm, *d);
+  NEXT_MEM();
+op_rti:
+  // in user mode it stops the VM, not retired
+  if (!interrupt_return(vm)) {
+    materialize_cond(vm);
+    return retired;
+  }
+  // (its pops are loads, a watchpoint can stop the VM)
+  goto block_end;
+op_trap:
+  trap(vm, *d);
+  // HALT (or GETC/IN at end of input) is the only other way out
+  if (!vm.running) {
+    // a paused GETC/IN runs again on resume, it didn't retire
+    if (vm.blocked) {
+      materialize_cond(vm);
+      return retired;
+    }
+    goto stop;
+  }
+  NEXT_BLOCK();
+block_end:
+  // the block's last instruction retired, an interrupt comes in after it
+  ++retired;
+  if (trace_enabled) {
+    trace_step(vm, pc, vm.memory[pc]);
+  }
+  if (vm.profile) {
+    profile_step(vm, pc);
+  }
+  if (vm.interrupts) { interrupt_check(vm); }
+  if (!vm.running || retired >= max_instructions) {
+    materialize_cond(vm);
+    return retired;
+  }
+  DISPATCH();
+stop:
+  // the instruction that stopped the VM (or used up the budget) still retired
+  ++retired;
+  if (trace_enabled) {
+    trace_step(vm, pc, vm.memory[pc]);
+  }
+  if (vm.profile) {
+    profile_step(vm, pc);
+  }
+  materialize_cond(vm);
+  return retired;
+op_res:
+  // not retired, the VM stops here
+  bad_opcode(vm, "Unused opcode");
+  materialize_cond(vm);
+  return retired;
+op_break:
+  // not retired either, stops in front of it (see debug.h)
+  debug_break(vm);
+  materialize_cond(vm);
+  return retired;
+
+#undef NEXT_BLOCK
+#undef NEXT_MEM
+#undef NEXT
+#undef DISPATCH
+}
+
+#pragma GCC diagnostic pop
+
+#else
+
+// Portable fallback
+// ISO C++ can't guarantee tail calls (without them a handler calling the
+// next handler grows the stack forever in unoptimised builds), so instead
+// each handler is a function in a table & a tiny loop calls through it.
+// Still one indirect call per instruction, but no opcode switch
+
+static void th_add(Vm& vm, const DecodedInstr& d) { add(vm, d); update_cond_flags(vm, d.dr); }
+static void th_and(Vm& vm, const DecodedInstr& d) { bitwise_and(vm, d); update_cond_flags(vm, d.dr); }
+static void th_not(Vm& vm, const DecodedInstr& d) { bitwise_complement(vm, d); update_cond_flags(vm, d.dr); }
+static void th_ld(Vm& vm, const DecodedInstr& d) { load(vm, d); update_cond_flags(vm, d.dr); }
+static void th_ldi(Vm& vm, const DecodedInstr& d) { load_indirect(vm, d); update_cond_flags(vm, d.dr); }
+static void th_ldr(Vm& vm, const DecodedInstr& d) { load_base_offset(vm, d); update_cond_flags(vm, d.dr); }
+static void th_lea(Vm& vm, const DecodedInstr& d) { load_effective_addr(vm, d); update_cond_flags(vm, d.dr); }
+static void th_rti(Vm& vm, const DecodedInstr&) { interrupt_return(vm); }
+static void th_unused(Vm& vm, const DecodedInstr&) { bad_opcode(vm, "Unused opcode"); }
+static void th_break(Vm& vm, const DecodedInstr&) { debug_break(vm); }
+
+uint64_t run_threaded(Vm& vm, uint64_t max_instructions) {
+  static void (* const handlers[])(Vm&, const DecodedInstr&) = {
+    branch, th_add, th_ld, store,
+    jump_subr, th_and, th_ldr, store_base_offset,
+    th_rti, th_not, th_ldi, store_indirect,
+    jump, th_unused, th_lea, trap,
+    // fetch_decoded never returns OP_UNDECODED
+    th_unused, th_break,
+  };
+
+  uint64_t retired = 0;
+  load_cond(vm);
+  while (vm.running) {
+    uint16_t pc = vm.reg[R_PC]++;
+    const DecodedInstr& d = fetch_decoded(vm, pc);
+    uint8_t op = d.op;
+    handlers[op](vm, d);
+    // not retired: RES, RTI in user mode, a breakpoint, or a paused GETC/IN (runs again on resume)
+    if (op == OP_RES || op == OP_BREAK || (op == OP_RTI && !vm.running) || (op == OP_TRAP && vm.blocked)) { break; }
+    ++retired;
+    if (trace_enabled) {
+      trace_step(vm, pc, vm.memory[pc]);
+    }
+    if (vm.profile) {
+      profile_step(vm, pc);
+    }
+    bool block_end = op == OP_BR || op == OP_JMP || op == OP_JSR || op == OP_TRAP || op == OP_RTI;
+    if (block_end) {
+      if (vm.interrupts) { interrupt_check(vm); }
+      if (retired >= max_instructions) { break; }
+    }
+  }
+  materialize_cond(vm);
+  return retired;
+}
+
+#endif
@@ -0,0 +1,82 @@
+#include "fuzz.h"
+#include "console.h"
+#include "decode.h"
+#include "device.h"
+#include "input.h"
+#include "interrupt.h"
+#include "memory.h"
+#include "ops.h"
+#include <cstring>
+#include <new>
+
+struct FuzzTarget {
+  Vm* vm;
+  // memory right after loading, what dirty pages are put back from
+  uint16_t pristine[MEMORY_MAX];
+  uint16_t pc;
+  size_t reset_pages;
+};
+
+FuzzTarget* fuzz_create(const char* const* image_paths, size_t count, size_t* failed) {
+  FuzzTarget* t = new (std::nothrow) FuzzTarget{};
+  if (!t) { return nullptr; }
+  t->vm = vm_create_headless(nullptr, 0);
+  if (!t->vm || !read_images(*t->vm, image_paths, count, t->pc, failed)) {
+    fuzz_destroy(t);
+    return nullptr;
+  }
+  memcpy(t->pristine, t->vm->memory, sizeof(t->pristine));
+  mem_clear_dirty(*t->vm);
+  return t;
+}
+
+// Copies back the pages written since the last reset, all clean again
+static void reset_memory(FuzzTarget* t) {
+  Vm& vm = *t->vm;
+  uint8_t pages[MEM_PAGES];
+  t->reset_pages = mem_dirty_pages(vm, pages);
+  for (size_t i = 0; i < t->reset_pages; ++i) {
+    uint16_t start = static_cast<uint16_t>(pages[i] << MEM_PAGE_SHIFT);
+    memcpy(vm.memory + start, t->pristine + start, (1u << MEM_PAGE_SHIFT) * sizeof(uint16_t));
+    invalidate_decoded_range(vm, start, 1u << MEM_PAGE_SHIFT);
+  }
+  mem_clear_dirty(vm);
+}
+
+ExecResult fuzz_run(FuzzTarget* t, const uint8_t* data, size_t size, uint8_t* coverage,
+  uint64_t max_instructions, Engine engine) {
+  Vm& vm = *t->vm;
+  reset_memory(t);
+  memset(vm.reg, 0, sizeof(vm.reg));
+  vm.reg[R_PC] = t->pc;
+  vm.reg[R_COND] = FL_ZR0;
+  interrupt_reset(vm);
+  // device registers were put back too
+  bus_sync(vm);
+  vm.running = 1;
+  vm.error = nullptr;
+  vm.idle_polls = 0;
+  input_rewind(vm.input, reinterpret_cast<const char*>(data), size);
+  console_discard(vm.console);
+
+  vm.coverage = coverage;
+  uint64_t retired = run_engine(engine == ENGINE_JIT ? ENGINE_THREADED : engine, vm, max_instructions);
+  vm.coverage = nullptr;
+
+  if (vm.error) { return ExecResult{EXEC_ERROR, retired}; }
+  return ExecResult{vm.running ? EXEC_BUDGET : EXEC_HALTED, retired};
+}
+
+Vm* fuzz_vm(FuzzTarget* t) {
+  return t->vm;
+}
+
+size_t fuzz_reset_pages(const FuzzTarget* t) {
+  return t->reset_pages;
+}
+
+void fuzz_destroy(FuzzTarget* t) {
+  if (!t) { return; }
+  vm_destroy(t->vm);
+  delete t;
+}
@@ -0,0 +1,53 @@
+#ifndef FUZZ_H
+#define FUZZ_H
+#include <cstddef>
+#include <cstdint>
+#include "engine.h"
+#include "vm.h"
+
+// ============================
+// ========= Fuzzing ==========
+// ============================
+// Runs one program over & over on made up keyboard input, looking for
+// input that makes it hit an unused opcode, RTI in user mode, a bad TRAP, ...
+// (anything that sets vm.error) before a user does
+//
+// - The images are loaded once, into a headless VM, & memory is kept aside
+// - Every run
+//   -- puts back only the pages the last run wrote (see Dirty Pages in memory.h),
+//      a run touching its stack & a few variables copies a few hundred
+//      bytes instead of reloading the images & zeroing all 128KB
+//   -- starts at the image's origin with zeroed registers, in user mode
+//   -- keyboard input is the run's bytes, then end of input (EOF_HALT)
+//   -- stops after a budget of instructions, a loop isn't a crash
+// - BR/JMP/JSR count the edges they take into a coverage map
+//   (cover_edge in ops.h), so the fuzzer can tell which inputs went
+//   somewhere new
+//
+// tools/lc3fuzz.cpp is the libFuzzer entry point
+
+struct FuzzTarget;
+
+// Loads `count` images like read_images (later ones win where they overlap)
+// returns nullptr if an image is bad (`*failed`, when given, is its index)
+// or out of memory
+FuzzTarget* fuzz_create(const char* const* image_paths, size_t count, size_t* failed = nullptr);
+
+// One run on input data[0..size), from a fresh start
+// - `coverage` : COVERAGE_MAP_SIZE counters the edges are added to
+//   (nullptr: none recorded)
+// - ENGINE_JIT runs as ENGINE_THREADED (it doesn't record coverage)
+// returns EXEC_HALTED, EXEC_ERROR (fuzz_vm(t)->error says why) or EXEC_BUDGET
+ExecResult fuzz_run(FuzzTarget* t, const uint8_t* data, size_t size, uint8_t* coverage,
+  uint64_t max_instructions, Engine engine = ENGINE_THREADED);
+
+// The machine the runs happen on, as the last run left it
+// (its output: console_captured(fuzz_vm(t)->console, ...))
+Vm* fuzz_vm(FuzzTarget* t);
+
+// Pages the last fuzz_run had to put back
+size_t fuzz_reset_pages(const FuzzTarget* t);
+
+void fuzz_destroy(FuzzTarget* t);
+
+#endif // !FUZZ_H
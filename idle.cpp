@@ -0,0 +1,87 @@
+#include "idle.h"
+#include "decode.h"
+#include "ops.h"
+#include <cstring>
+
+// N/Z/P of a result, like cond_flags
+static uint16_t flags_of(uint16_t v) {
+  return static_cast<uint16_t>(v == 0 ? FL_ZR0 : 1 << ((v >> 15) << 1));
+}
+
+// A read the loop makes, KBSR reads as "no key"
+// returns false for memory mapped registers that might have side effects
+static bool side_read(const Vm& vm, uint16_t addr, uint16_t& value) {
+  if (addr == MMR_KBSR) {
+    value = 0;
+    return true;
+  }
+  if (addr >= 0xFE00 && addr != MMR_KBDR) { return false; }
+  value = vm.memory[addr];
+  return true;
+}
+
+bool is_polling_loop(const Vm& vm, uint16_t next_pc) {
+  const uint16_t start = static_cast<uint16_t>(next_pc - 1);
+  uint16_t reg[8];
+  memcpy(reg, vm.reg, sizeof(reg));
+  uint16_t flags = cond_flags(vm);
+  uint16_t pc = start;
+
+  for (int step = 0; step < IDLE_MAX_LOOP; ++step) {
+    DecodedInstr d = decode(vm.memory[pc]);
+    pc = static_cast<uint16_t>(pc + 1);
+    uint16_t rel = static_cast<uint16_t>(pc + d.imm);
+    uint16_t value = 0;
+
+    switch (d.op) {
+      case OP_ADD:
+        value = static_cast<uint16_t>(reg[d.sr1] + (d.imm_mode ? d.imm : reg[d.sr2]));
+        break;
+      case OP_AND:
+        value = static_cast<uint16_t>(reg[d.sr1] & (d.imm_mode ? d.imm : reg[d.sr2]));
+        break;
+      case OP_NOT:
+        value = static_cast<uint16_t>(~reg[d.sr1]);
+        break;
+      case OP_LEA:
+        value = rel;
+        break;
+      case OP_LD:
+        if (!side_read(vm, rel, value)) { return false; }
+        break;
+      case OP_LDI: {
+        uint16_t addr;
+        if (!side_read(vm, rel, addr) || !side_read(vm, addr, value)) { return false; }
+        break;
+      }
+      case OP_LDR:
+        if (!side_read(vm, static_cast<uint16_t>(reg[d.sr1] + d.imm), value)) { return false; }
+        break;
+      case OP_BR:
+        if (d.dr & flags) { pc = rel; }
+        break;
+      case OP_JMP:
+        pc = reg[d.sr1];
+        break;
+      case OP_JSR: {
+        uint16_t target = d.imm_mode ? rel : reg[d.sr1];
+        reg[R_R7] = pc;
+        pc = target;
+        break;
+      }
+      default:
+        // stores, traps, RTI/RES: not a pure loop
+        return false;
+    }
+
+    if (d.op != OP_BR && d.op != OP_JMP && d.op != OP_JSR) {
+      reg[d.dr] = value;
+      flags = flags_of(value);
+    }
+
+    if (pc == start) {
+      return memcmp(reg, vm.reg, sizeof(reg)) == 0 && flags == cond_flags(vm);
+    }
+  }
+  return false;
+}
@@ -0,0 +1,39 @@
+#ifndef IDLE_H
+#define IDLE_H
+#include <cstdint>
+#include "vm.h"
+
+// ============================
+// === Idle Keyboard Polling ==
+// ============================
+// The usual way to wait for a key is a tiny loop
+//   POLL  LDI R0, KBSR_PTR
+//         BRzp POLL
+// which keeps a host core at 100% running millions of useless instructions
+//
+// When KBSR has read "no key" IDLE_POLL_THRESHOLD times in a row,
+// mem_read checks whether the read comes from such a loop:
+// - starting at the reading instruction, with the current registers & KBSR = 0,
+//   the loop is run (on the side, nothing is written) for one iteration
+// - it has to come back to the same instruction within IDLE_MAX_LOOP
+//   instructions, with exactly the registers & flags it started with
+// - only ADD/AND/NOT/LD/LDI/LDR/LEA/BR/JMP/JSR are allowed, no stores or
+//   traps, & the only memory mapped registers read may be KBSR/KBDR
+// If so, every further iteration is identical until a key arrives, so the
+// host thread can sleep on the input (up to Vm::idle_wait_ms) instead
+// The guest sees the key on this read rather than a later iteration's,
+// which is the same state, so results don't change
+// (only the retired instruction count does, the skipped spins aren't counted)
+
+#define IDLE_POLL_THRESHOLD 32
+#define IDLE_MAX_LOOP 16
+
+// Default for Vm::idle_wait_ms, 0 turns the detection off
+#define IDLE_WAIT_MS_DEFAULT 100
+
+// Is the KBSR read by the instruction before `next_pc` part of a pure polling loop?
+// (also how a program waiting for an interrupt is spotted, `next_pc` one
+// past the loop's first instruction, see interrupt.h)
+bool is_polling_loop(const Vm& vm, uint16_t next_pc);
+
+#endif // !IDLE_H
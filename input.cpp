@@ -0,0 +1,297 @@
+#include "input.h"
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <poll.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+enum InputKind {
+  INPUT_NONE,
+  INPUT_FILE,
+  INPUT_BUFFER,
+  INPUT_STREAM,
+  INPUT_QUEUE,
+};
+
+struct Input {
+  InputKind kind{};
+  int fd{-1};
+
+  // Ring of unread bytes
+  // - the producer (reader thread, or a refill for files) writes at `head`
+  // - the VM reads at `tail`
+  // - both only ever count up, the slot is counter % INPUT_RING_SIZE
+  std::atomic<uint32_t> head{};
+  std::atomic<uint32_t> tail{};
+  uint8_t ring[INPUT_RING_SIZE];
+
+  // Set once the source is exhausted (EOF or a read error)
+  std::atomic<bool> eof{};
+
+  // INPUT_BUFFER only: the bytes & how many were already moved into the ring
+  std::vector<char> buffer{};
+  size_t buffer_pos{};
+
+  // A VM waiting for a byte (GETC/IN, or an idle keyboard poll) sleeps
+  // on `wake`, the producer only takes the lock when someone is waiting
+  std::atomic<int> sleepers{};
+  std::mutex wait_lock{};
+  std::condition_variable wake{};
+
+  // Called by the producer after new bytes (or EOF) show up, for whoever
+  // isn't sleeping on `wake` (the scheduler, see scheduler.h)
+  // notify_lock is held around the call, so once input_set_notify returns
+  // the old callback isn't running anymore
+  std::atomic<void (*)(void*)> notify{};
+  void* notify_arg{};
+  std::mutex notify_lock{};
+
+  // INPUT_STREAM only
+  std::thread reader{};
+  std::atomic<bool> stop{};
+  int wake_pipe[2]{-1, -1}; // written to by input_destroy to end the poll
+};
+
+// New bytes (or EOF) are visible, wake the VM if it's waiting
+static void announce(Input* in) {
+  if (in->sleepers.load() > 0) {
+    std::lock_guard<std::mutex> guard(in->wait_lock);
+    in->wake.notify_one();
+  }
+  if (in->notify.load(std::memory_order_acquire)) {
+    std::lock_guard<std::mutex> guard(in->notify_lock);
+    void (*fn)(void*) = in->notify.load(std::memory_order_relaxed);
+    if (fn) { fn(in->notify_arg); }
+  }
+}
+
+// Reader thread: block in poll until there's input (or input_destroy),
+// then read as much as fits in the ring
+static void reader_loop(Input* in) {
+  while (!in->stop.load(std::memory_order_acquire)) {
+    uint32_t head = in->head.load(std::memory_order_relaxed);
+    uint32_t space = INPUT_RING_SIZE - (head - in->tail.load(std::memory_order_acquire));
+    if (space == 0) {
+      // the guest isn't reading, nothing to do until it catches up
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      continue;
+    }
+
+    struct pollfd fds[2] = {{in->fd, POLLIN, 0}, {in->wake_pipe[0], POLLIN, 0}};
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR) { continue; }
+      break;
+    }
+    if (fds[1].revents) {
+      // input_destroy, or input_interrupt: the input ends here
+      if (in->stop.load(std::memory_order_acquire)) { return; }
+      break;
+    }
+
+    // up to the end of the ring, the wrapped part goes in on the next pass
+    uint32_t slot = head % INPUT_RING_SIZE;
+    uint32_t contiguous = INPUT_RING_SIZE - slot;
+    ssize_t n = read(in->fd, in->ring + slot, space < contiguous ? space : contiguous);
+    if (n > 0) {
+      in->head.store(head + static_cast<uint32_t>(n));
+      announce(in);
+    } else if (n == 0 || (errno != EINTR && errno != EAGAIN)) {
+      break;
+    }
+  }
+  in->eof.store(true);
+  announce(in);
+}
+
+// INPUT_FILE / INPUT_BUFFER: the ring is empty, read the next chunk
+// returns false at end of input
+static bool refill(Input* in) {
+  if (in->eof.load(std::memory_order_relaxed)) { return false; }
+  ssize_t n;
+  if (in->kind == INPUT_BUFFER) {
+    size_t left = in->buffer.size() - in->buffer_pos;
+    n = static_cast<ssize_t>(left < INPUT_RING_SIZE ? left : INPUT_RING_SIZE);
+    memcpy(in->ring, in->buffer.data() + in->buffer_pos, static_cast<size_t>(n));
+    in->buffer_pos += static_cast<size_t>(n);
+  } else {
+    do {
+      n = read(in->fd, in->ring, INPUT_RING_SIZE);
+    } while (n < 0 && errno == EINTR);
+  }
+  if (n <= 0) {
+    in->eof.store(true, std::memory_order_relaxed);
+    return false;
+  }
+  in->tail.store(0, std::memory_order_relaxed);
+  in->head.store(static_cast<uint32_t>(n), std::memory_order_relaxed);
+  return true;
+}
+
+Input* input_create(int fd) {
+  Input* in = new (std::nothrow) Input();
+  if (!in) { return nullptr; }
+  in->fd = fd;
+
+  struct stat st;
+  if (fd < 0) {
+    in->kind = INPUT_NONE;
+    in->eof = true;
+  } else if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+    in->kind = INPUT_FILE;
+  } else {
+    in->kind = INPUT_STREAM;
+    if (pipe(in->wake_pipe) != 0) {
+      delete in;
+      return nullptr;
+    }
+    in->reader = std::thread(reader_loop, in);
+  }
+  return in;
+}
+
+Input* input_create_buffer(const char* data, size_t size) {
+  Input* in = new (std::nothrow) Input();
+  if (!in) { return nullptr; }
+  in->kind = INPUT_BUFFER;
+  in->buffer.assign(data, data + size);
+  return in;
+}
+
+int input_rewind(Input* in, const char* data, size_t size) {
+  if (in->kind != INPUT_BUFFER) { return 0; }
+  in->buffer.assign(data, data + size);
+  in->buffer_pos = 0;
+  in->head.store(0, std::memory_order_relaxed);
+  in->tail.store(0, std::memory_order_relaxed);
+  in->eof.store(false, std::memory_order_relaxed);
+  return 1;
+}
+
+Input* input_create_queue() {
+  Input* in = new (std::nothrow) Input();
+  if (!in) { return nullptr; }
+  in->kind = INPUT_QUEUE;
+  return in;
+}
+
+size_t input_push(Input* in, const char* data, size_t size) {
+  if (in->kind != INPUT_QUEUE || in->eof.load(std::memory_order_relaxed)) { return 0; }
+  uint32_t head = in->head.load(std::memory_order_relaxed);
+  size_t space = INPUT_RING_SIZE - (head - in->tail.load(std::memory_order_acquire));
+  size_t n = size < space ? size : space;
+  for (size_t i = 0; i < n; ++i) {
+    in->ring[(head + i) % INPUT_RING_SIZE] = static_cast<uint8_t>(data[i]);
+  }
+  if (n > 0) {
+    in->head.store(head + static_cast<uint32_t>(n), std::memory_order_release);
+    announce(in);
+  }
+  return n;
+}
+
+void input_close(Input* in) {
+  if (in->kind != INPUT_QUEUE) { return; }
+  in->eof.store(true, std::memory_order_release);
+  announce(in);
+}
+
+void input_interrupt(Input* in) {
+  // only a write(2), safe in a signal handler
+  if (in->kind != INPUT_STREAM) { return; }
+  char wake = 0;
+  ssize_t ignored = write(in->wake_pipe[1], &wake, 1);
+  (void)ignored;
+}
+
+void input_set_notify(Input* in, void (*fn)(void*), void* arg) {
+  std::lock_guard<std::mutex> guard(in->notify_lock);
+  in->notify_arg = arg;
+  in->notify.store(fn, std::memory_order_release);
+}
+
+void input_destroy(Input* in) {
+  if (!in) { return; }
+  if (in->reader.joinable()) {
+    in->stop.store(true, std::memory_order_release);
+    char wake = 0;
+    ssize_t ignored = write(in->wake_pipe[1], &wake, 1);
+    (void)ignored;
+    in->reader.join();
+  }
+  if (in->wake_pipe[0] >= 0) {
+    close(in->wake_pipe[0]);
+    close(in->wake_pipe[1]);
+  }
+  delete in;
+}
+
+bool input_ready(Input* in) {
+  uint32_t tail = in->tail.load(std::memory_order_relaxed);
+  if (in->head.load(std::memory_order_acquire) != tail) { return true; }
+  return (in->kind == INPUT_FILE || in->kind == INPUT_BUFFER) && refill(in);
+}
+
+bool input_eof(Input* in) {
+  if (input_ready(in)) { return false; }
+  // the reader sets eof after publishing its last bytes, so look again
+  return in->eof.load(std::memory_order_acquire)
+    && in->head.load(std::memory_order_acquire) == in->tail.load(std::memory_order_relaxed);
+}
+
+bool input_wait(Input* in, int timeout_ms) {
+  if (input_ready(in)) { return true; }
+  bool async = in->kind == INPUT_STREAM || in->kind == INPUT_QUEUE;
+  if (!async || in->eof.load(std::memory_order_acquire)) {
+    // nothing more will ever arrive, all that's left is to not busy-wait
+    if (timeout_ms >= 0) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(timeout_ms));
+    }
+    return false;
+  }
+
+  // sleepers is bumped before checking the ring, & the reader publishes
+  // before checking sleepers, so one of the two always sees the other
+  in->sleepers.fetch_add(1);
+  std::unique_lock<std::mutex> guard(in->wait_lock);
+  auto arrived = [in]() {
+    return in->head.load() != in->tail.load(std::memory_order_relaxed) || in->eof.load();
+  };
+  if (timeout_ms < 0) {
+    in->wake.wait(guard, arrived);
+  } else {
+    in->wake.wait_for(guard, std::chrono::milliseconds(timeout_ms), arrived);
+  }
+  guard.unlock();
+  in->sleepers.fetch_sub(1);
+  return input_ready(in);
+}
+
+int input_getc(Input* in) {
+  for (;;) {
+    uint32_t tail = in->tail.load(std::memory_order_relaxed);
+    if (in->head.load(std::memory_order_acquire) != tail) {
+      uint8_t c = in->ring[tail % INPUT_RING_SIZE];
+      in->tail.store(tail + 1, std::memory_order_release);
+      return c;
+    }
+    if (in->kind == INPUT_FILE || in->kind == INPUT_BUFFER) {
+      if (!refill(in)) { return -1; }
+      continue;
+    }
+    if (in->eof.load(std::memory_order_acquire)) {
+      // the last bytes may have landed right before EOF was set
+      if (in->head.load(std::memory_order_acquire) != tail) { continue; }
+      return -1;
+    }
+    // nothing yet: sleep until the reader (or input_push) adds something
+    input_wait(in, -1);
+  }
+}
@@ -0,0 +1,78 @@
+#ifndef INPUT_H
+#define INPUT_H
+#include <cstddef>
+
+// ============================
+// ====== Console Input =======
+// ============================
+// Every KBSR read used to be a zero-timeout select() plus a getchar(),
+// so a guest polling the keyboard spent all its time making syscalls
+//
+// Now the VM only ever looks at an in-memory queue of bytes
+// The source feeding it depends on what the input fd is:
+// - terminal or pipe : a background thread does blocking reads (poll + read)
+//   & pushes the bytes into a lock-free single-producer/single-consumer ring
+//   KBSR/KBDR & GETC/IN just pop from the ring, no syscalls
+// - regular file     : read 4KB at a time on demand, always "ready" until EOF
+// - memory buffer    : same as a file, the bytes are copied in from a buffer
+//                      (headless runs, see vm_create_headless)
+// - queue            : the host pushes bytes in whenever it has some
+//                      (ex. a network session), & closes it for EOF
+// - none             : no input at all, always at end of input
+
+#define INPUT_RING_SIZE 4096
+
+struct Input;
+
+// Input reading from `fd` (kind picked with fstat), or no input if fd < 0
+// returns nullptr if out of memory or the reader thread can't start
+Input* input_create(int fd);
+
+// Input serving a copy of data[0..size), then end of input
+// returns nullptr if out of memory
+Input* input_create_buffer(const char* data, size_t size);
+
+// A buffer input starts over, serving a copy of data[0..size) instead
+// (ex. the next fuzzing run, see fuzz.h), no allocation once it's big enough
+// returns 0 if `in` wasn't made by input_create_buffer
+int input_rewind(Input* in, const char* data, size_t size);
+
+// Empty input fed with input_push, until input_close
+// returns nullptr if out of memory
+Input* input_create_queue();
+
+// Queue up to `size` bytes (only one thread may push at a time)
+// returns how many fit, 0 if `in` isn't a queue or was closed
+size_t input_push(Input* in, const char* data, size_t size);
+
+// No more bytes will be pushed, the VM sees EOF once the queue is drained
+void input_close(Input* in);
+
+// A terminal or pipe input ends now (the reader thread stops), so a VM
+// waiting in GETC/IN sees end of input, nothing happens for the other kinds
+// Safe to call from a signal handler (Ctrl-C, see vm.cpp)
+void input_interrupt(Input* in);
+
+// Call fn(arg) from the producer's thread whenever bytes or EOF arrive
+// (nullptr to stop), for waiting without a thread blocked on the input
+void input_set_notify(Input* in, void (*fn)(void*), void* arg);
+
+// Stops the reader thread & frees the input (the fd is left open)
+void input_destroy(Input* in);
+
+// Is there a byte to read right now? never blocks (KBSR)
+bool input_ready(Input* in);
+
+// Wait up to `timeout_ms` (-1: forever) for a byte to be ready
+// returns input_ready afterwards
+// At end of input nothing can arrive, it just sleeps for the timeout
+bool input_wait(Input* in, int timeout_ms);
+
+// Nothing left to read & nothing more will arrive? never blocks
+bool input_eof(Input* in);
+
+// Next byte, waiting for one if there isn't one yet
+// returns -1 at end of input
+int input_getc(Input* in);
+
+#endif // !INPUT_H
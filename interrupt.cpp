@@ -0,0 +1,130 @@
+#include "interrupt.h"
+#include "console.h"
+#include "device.h"
+#include "engine.h"
+#include "idle.h"
+#include "input.h"
+#include "ops.h"
+#include "replay.h"
+
+void interrupt_reset(Vm& vm) {
+  vm.reg[R_PSR] = PSR_USER;
+  vm.reg[R_SAVED_SSP] = SUPERVISOR_STACK_START;
+  vm.reg[R_SAVED_USP] = 0;
+}
+
+// Supervisor stack, through mem_write/mem_read like any other access
+static void push(Vm& vm, uint16_t val) {
+  --vm.reg[R_R6];
+  mem_write(vm, vm.reg[R_R6], val);
+}
+
+static uint16_t pop(Vm& vm) {
+  uint16_t val = mem_read(vm, vm.reg[R_R6]);
+  ++vm.reg[R_R6];
+  return val;
+}
+
+// Into the handler of `vector` at `priority`
+static void enter(Vm& vm, uint16_t vector, uint16_t priority) {
+  uint16_t psr = static_cast<uint16_t>((vm.reg[R_PSR] & ~7u) | cond_flags(vm));
+  if (psr & PSR_USER) {
+    vm.reg[R_SAVED_USP] = vm.reg[R_R6];
+    vm.reg[R_R6] = vm.reg[R_SAVED_SSP];
+  }
+  push(vm, psr);
+  push(vm, vm.reg[R_PC]);
+  vm.reg[R_PSR] = static_cast<uint16_t>(priority << PSR_PRIORITY_SHIFT);
+  vm.reg[R_PC] = vm.memory[INTERRUPT_VECTOR_TABLE + vector];
+}
+
+// The key an interrupt would deliver, from vm.input or the recording being
+// replayed: a key, KEY_EOF (only when eof_policy does something with it)
+// or KEY_NONE
+// Every check is an input point like a KBSR read (see replay.h), the
+// interpreters all check at the same block ends so a replay lines up
+static int pending_key(Vm& vm) {
+  if (vm.replay && vm.replay->playing) {
+    return replay_next(vm, false);
+  }
+  int key = KEY_NONE;
+  if (input_ready(vm.input)) {
+    key = input_getc(vm.input);
+  } else if (vm.eof_policy != EOF_CONTINUE && input_eof(vm.input)) {
+    key = KEY_EOF;
+  }
+  if (vm.replay) { replay_note(vm, key); }
+  return key;
+}
+
+bool interrupt_check(Vm& vm) {
+  // the timer may expire this tick
+  if (vm.bus.events.count) { event_tick(vm); }
+  uint16_t level = static_cast<uint16_t>((vm.reg[R_PSR] & PSR_PRIORITY_MASK) >> PSR_PRIORITY_SHIFT);
+
+  // highest priority first, each masked while its handler (or anything at
+  // its priority or above) runs
+  if (level < TIMER_PRIORITY && (vm.memory[MMR_TMR] & (TMR_READY | TMR_IE)) == (TMR_READY | TMR_IE)) {
+    vm.idle_polls = 0;
+    vm.memory[MMR_TMR] = static_cast<uint16_t>(vm.memory[MMR_TMR] & ~TMR_READY);
+    mem_mark_dirty(vm, MMR_TMR, 1);
+    enter(vm, TIMER_VECTOR, TIMER_PRIORITY);
+    return vm.running;
+  }
+  bool keyboard = level < KEYBOARD_PRIORITY && (vm.memory[MMR_KBSR] & KBSR_IE);
+  int key = keyboard ? pending_key(vm) : KEY_NONE;
+  if (key >= 0) {
+    vm.idle_polls = 0;
+    vm.memory[MMR_KBSR] = KBSR_READY | KBSR_IE;
+    vm.memory[MMR_KBDR] = static_cast<uint16_t>(key);
+    mem_mark_dirty(vm, MMR_KBSR, MMR_KBDR - MMR_KBSR + 1);
+    enter(vm, KEYBOARD_VECTOR, KEYBOARD_PRIORITY);
+    return vm.running;
+  }
+
+  // nothing pending: is the program only waiting for something? looked at
+  // now & then, a program busy with something else pays for one look per
+  // IDLE_POLL_THRESHOLD blocks
+  if (!vm.running || ++vm.idle_polls < IDLE_POLL_THRESHOLD) { return vm.running; }
+  vm.idle_polls = 0;
+  if (!is_polling_loop(vm, static_cast<uint16_t>(vm.reg[R_PC] + 1))) { return true; }
+  // a device event is coming, nothing changes until then
+  if (event_skip(vm)) { return true; }
+  // only a key can end the wait now
+  if (!keyboard) { return true; }
+  if (key == KEY_EOF) {
+    end_of_input(vm);
+    return vm.running;
+  }
+  // (a replay never waits, its keys are all there already)
+  if (vm.replay && vm.replay->playing) { return true; }
+  // waiting for input, show the output so far
+  console_flush(vm.console);
+  if (vm.yield_on_input) {
+    // execute() picks up at the loop once there is input
+    vm.blocked = 1;
+    vm.running = 0;
+  } else if (vm.idle_wait_ms > 0) {
+    // a key that arrives is taken at the next check
+    input_wait(vm.input, vm.idle_wait_ms);
+  }
+  return vm.running;
+}
+
+bool interrupt_return(Vm& vm) {
+  if (vm.reg[R_PSR] & PSR_USER) {
+    bad_opcode(vm, "Privilege mode violation");
+    return false;
+  }
+  vm.reg[R_PC] = pop(vm);
+  uint16_t psr = pop(vm);
+  vm.reg[R_PSR] = static_cast<uint16_t>(psr & (PSR_USER | PSR_PRIORITY_MASK));
+  // N/Z/P as they were when the interrupt came in
+  vm.reg[R_COND] = static_cast<uint16_t>(psr & 7);
+  load_cond(vm);
+  if (psr & PSR_USER) {
+    vm.reg[R_SAVED_SSP] = vm.reg[R_R6];
+    vm.reg[R_R6] = vm.reg[R_SAVED_USP];
+  }
+  return true;
+}
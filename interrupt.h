@@ -0,0 +1,83 @@
+#ifndef INTERRUPT_H
+#define INTERRUPT_H
+#include <cstdint>
+#include "memory.h"
+#include "vm.h"
+
+// ============================
+// ======== Interrupts ========
+// ============================
+// The LC-3 interrupt model, so a program can wait for a key without
+// polling KBSR
+//
+// - PSR (reg[R_PSR])
+//   -- bit 15     : 1 = user mode, 0 = supervisor mode
+//   -- bits 10..8 : priority (PL0..PL7), only a higher priority interrupts
+//   -- bits 2..0  : N/Z/P, only filled in when the PSR is pushed, while
+//      running the flags stay lazy in cond_result (see ops.h)
+// - Saved_SSP / Saved_USP (reg[R_SAVED_SSP], reg[R_SAVED_USP]) : the other
+//   mode's R6, swapped in & out when the mode changes
+// - Interrupt vector table at x0100: the handler of vector v is memory[x0100 + v]
+// - Keyboard: vector x80, priority PL4, raised when KBSR's IE bit (14) is
+//   set & a key is queued in vm.input
+// - Timer: vector x81, priority PL5, raised when TMR's IE bit (14) is set &
+//   the timer expired (see device.h), taking it clears TMR's bit 15
+// (the higher priority one goes first when both are pending)
+//
+// Taking an interrupt (between two instructions)
+// - user mode: Saved_USP = R6, R6 = Saved_SSP
+// - push the PSR (with N/Z/P) then the PC on the supervisor stack (R6)
+// - supervisor mode, the device's priority, PC = its vector table entry
+// - the keyboard's key is latched into KBDR & KBSR's ready bit set, the
+//   handler reads KBDR like a polling program would after KBSR
+// RTI undoes it: pops PC & PSR, back to R6 = Saved_USP if that was user mode
+// (RTI in user mode is a privilege mode violation, which stops the VM)
+//
+// A machine starts in user mode at PL0 with Saved_SSP = x3000 (the
+// supervisor stack grows down from just below the user program)
+//
+// Cost: nothing per instruction
+// - Vm::interrupts is only set while KBSR's IE bit is set or a device event
+//   is scheduled (the device bus keeps it up to date, see device.h)
+// - the interpreters look at it where a basic block ends (BR/JMP/JSR/TRAP/RTI,
+//   where they check the budget anyway), & only then at the input queue
+// - the JIT, lockstep lanes & lc3aot's native code hand a program with
+//   interrupts on to the threaded core
+//
+// Idling: a program looping until its handler sets something (BRnzp to
+// itself, a flag test, ...) is spotted like a polling loop (see idle.h),
+// it sleeps on the input, is paused under execute(), or at end of input
+// (EOF_HALT/EOF_ERROR) stops, the same as a KBSR polling loop would
+// With a device event scheduled it skips ahead to that instead (time is
+// counted in ticks, nothing happens in between, see device.h)
+
+// PSR bits
+#define PSR_USER (1 << 15)
+#define PSR_PRIORITY_SHIFT 8
+#define PSR_PRIORITY_MASK (7 << PSR_PRIORITY_SHIFT)
+
+#define INTERRUPT_VECTOR_TABLE 0x0100
+#define KEYBOARD_VECTOR 0x80
+#define KEYBOARD_PRIORITY 4
+#define TIMER_VECTOR 0x81
+#define TIMER_PRIORITY 5
+
+// Where Saved_SSP starts out
+#define SUPERVISOR_STACK_START 0x3000
+
+// User mode, PL0, Saved_SSP = SUPERVISOR_STACK_START, Saved_USP = 0
+// (vm_alloc does this, so does anything that resets the registers)
+void interrupt_reset(Vm& vm);
+
+// End of a basic block with vm.interrupts set: one tick of the device
+// events, then take a pending interrupt if its priority is above the PSR's,
+// or notice the program idling
+// (PC already at the next instruction, like the TRAP handlers)
+// returns vm.running, idling can pause or stop the VM
+bool interrupt_check(Vm& vm);
+
+// RTI, PC already past it
+// returns false if it didn't retire (user mode, the VM is stopped)
+bool interrupt_return(Vm& vm);
+
+#endif // !INTERRUPT_H
@@ -0,0 +1,1005 @@
+#include "jit.h"
+#include "engine.h"
+
+#if defined(__x86_64__) && defined(__linux__)
+
+#include "decode.h"
+#include "device.h"
+#include "memory.h"
+#include "ops.h"
+#include "trace.h"
+#include "vm.h"
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <vector>
+
+// ============================
+// ========= Emitter ==========
+// ============================
+// Just enough x86-64 encoding for the handful of instruction forms the
+// translator needs. All register operands are 32bit unless noted.
+
+enum HostReg {
+  RAX = 0, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+  R8, R9, R10, R11, R12, R13, R14, R15,
+};
+
+// rbx points at the Vm for the whole time translated code runs
+// - memory is Vm's first member, so guest memory[x] is [rbx + x*2]
+// - reg[] & cond_result are [rbx + their offset]
+static_assert(offsetof(Vm, memory) == 0, "JIT addresses memory at rbx + 0");
+#define VM_REG(idx) static_cast<uint32_t>(offsetof(Vm, reg) + (idx) * 2)
+#define VM_COND static_cast<uint32_t>(offsetof(Vm, cond_result))
+
+// guest R0..R7 live in r8d..r15d
+// edx holds the last flag-setting result (cond_result), not N/Z/P,
+// the flags are only worked out by a BR
+static int guest(uint8_t r) { return R8 + r; }
+#define HOST_COND RDX
+
+// Condition codes (low nibble of Jcc)
+#define CC_NE 0x5
+#define CC_E 0x4
+#define CC_AE 0x3
+#define CC_L 0xC
+#define CC_GE 0xD
+#define CC_LE 0xE
+#define CC_G 0xF
+
+// 16MB of translations before the whole cache gets flushed
+#define CODE_CACHE_SIZE (16 << 20)
+
+// run_jit's budget without a limit, far more than anything ever runs
+#define JIT_MAX_BUDGET (INT64_C(1) << 62)
+
+// longest basic block, longer straight-line code just chains into the next
+#define BLOCK_MAX_INSTRS 64
+// generous upper bound on the code one block (plus its exit stubs) can need
+#define BLOCK_MAX_BYTES (BLOCK_MAX_INSTRS * 320)
+
+// Next byte to emit at
+// Each VM has its own code cache, the translator points this into it
+// (per thread, so VMs on different threads can translate at the same time)
+static thread_local uint8_t* cur = nullptr;
+
+static void emit8(uint8_t b) { *cur++ = b; }
+static void emit16(uint16_t v) { memcpy(cur, &v, 2); cur += 2; }
+static void emit32(uint32_t v) { memcpy(cur, &v, 4); cur += 4; }
+static void emit64(uint64_t v) { memcpy(cur, &v, 8); cur += 8; }
+
+// REX prefix, only emitted when something actually needs it
+// r/x/b are full register numbers, only their 4th bit matters
+static void rex(int w, int r, int x, int b) {
+  uint8_t v = static_cast<uint8_t>(0x40 | (w << 3) | ((r >> 3) << 2) | ((x >> 3) << 1) | (b >> 3));
+  if (v != 0x40) { emit8(v); }
+}
+
+static void modrm(int mod, int reg, int rm) {
+  emit8(static_cast<uint8_t>((mod << 6) | ((reg & 7) << 3) | (rm & 7)));
+}
+
+static void sib(int scale, int index, int base) {
+  emit8(static_cast<uint8_t>((scale << 6) | ((index & 7) << 3) | (base & 7)));
+}
+
+// <op> r/m32, r32 (mov 0x89, add 0x01, and 0x21, xor 0x31, test 0x85)
+static void op_rr(uint8_t op, int rm, int r) {
+  rex(0, r, 0, rm);
+  emit8(op);
+  modrm(3, r, rm);
+}
+static void mov_rr(int dst, int src) { op_rr(0x89, dst, src); }
+
+// mov dst64, src64
+static void mov_rr64(int dst, int src) {
+  rex(1, src, 0, dst);
+  emit8(0x89);
+  modrm(3, src, dst);
+}
+
+// <op> r/m32, imm32 (group 1: add /0, and /4, xor /6, cmp /7)
+static void op_ri(int ext, int rm, uint32_t imm) {
+  rex(0, 0, 0, rm);
+  emit8(0x81);
+  modrm(3, ext, rm);
+  emit32(imm);
+}
+#define EXT_ADD 0
+#define EXT_AND 4
+#define EXT_XOR 6
+#define EXT_CMP 7
+
+static void mov_ri(int r, uint32_t imm) {
+  rex(0, 0, 0, r);
+  emit8(static_cast<uint8_t>(0xB8 + (r & 7)));
+  emit32(imm);
+}
+
+static void mov_ri64(int r, uint64_t imm) {
+  rex(1, 0, 0, r);
+  emit8(static_cast<uint8_t>(0xB8 + (r & 7)));
+  emit64(imm);
+}
+
+static void mov_ri64(int r, const void* p) {
+  mov_ri64(r, reinterpret_cast<uint64_t>(p));
+}
+
+// movzx dst, src16 (0xB7) / movsx dst, src16 (0xBF)
+static void ext_rr16(uint8_t op, int dst, int src) {
+  rex(0, dst, 0, src);
+  emit8(0x0F);
+  emit8(op);
+  modrm(3, dst, src);
+}
+
+// movzx dst, word [rbx + rax*2]      (guest memory[eax])
+static void load_mem_rax(int dst) {
+  rex(0, dst, 0, RBX);
+  emit8(0x0F); emit8(0xB7);
+  modrm(0, dst, 4);
+  sib(1, RAX, RBX);
+}
+
+// mov word [rbx + rax*2], src16      (guest memory[eax] = src)
+static void store_mem_rax(int src) {
+  emit8(0x66);
+  rex(0, src, 0, RBX);
+  emit8(0x89);
+  modrm(0, src, 4);
+  sib(1, RAX, RBX);
+}
+
+// movzx dst, word [rbx + addr*2]     (guest memory[addr], constant addr)
+static void load_mem_abs(int dst, uint16_t addr) {
+  rex(0, dst, 0, RBX);
+  emit8(0x0F); emit8(0xB7);
+  modrm(2, dst, RBX);
+  emit32(static_cast<uint32_t>(addr) * 2);
+}
+
+// mov word [rbx + disp], src16      (a Vm field = src)
+static void store_vm16(int src, uint32_t disp) {
+  emit8(0x66);
+  rex(0, src, 0, RBX);
+  emit8(0x89);
+  modrm(2, src, RBX);
+  emit32(disp);
+}
+
+// movzx dst, word [rbx + disp]       (dst = a Vm field)
+static void load_vm16(int dst, uint32_t disp) {
+  rex(0, dst, 0, RBX);
+  emit8(0x0F); emit8(0xB7);
+  modrm(2, dst, RBX);
+  emit32(disp);
+}
+
+// mov word [rbx + reg[R_PC]], pc
+static void store_pc(uint16_t pc) {
+  emit8(0x66);
+  emit8(0xC7);
+  modrm(2, 0, RBX);
+  emit32(VM_REG(R_PC));
+  emit16(pc);
+}
+
+// Guest state <-> vm.reg[] & vm.cond_result, around helper calls & on block exit
+// (only movs, so the host flags survive a reload)
+static void spill_all() {
+  for (uint8_t r = 0; r < 8; ++r) { store_vm16(guest(r), VM_REG(r)); }
+  store_vm16(HOST_COND, VM_COND);
+}
+
+static void reload_all() {
+  for (uint8_t r = 0; r < 8; ++r) { load_vm16(guest(r), VM_REG(r)); }
+  load_vm16(HOST_COND, VM_COND);
+}
+
+// Jumps with a rel32 patched later, return where the rel32 is
+static uint8_t* jmp_rel32() {
+  emit8(0xE9);
+  uint8_t* site = cur;
+  emit32(0);
+  return site;
+}
+
+static uint8_t* jcc_rel32(int cc) {
+  emit8(0x0F);
+  emit8(static_cast<uint8_t>(0x80 | cc));
+  uint8_t* site = cur;
+  emit32(0);
+  return site;
+}
+
+static void patch_rel32(uint8_t* site, const uint8_t* target) {
+  int32_t rel = static_cast<int32_t>(target - (site + 4));
+  memcpy(site, &rel, 4);
+}
+
+static void call_abs(const void* fn) {
+  mov_ri64(RAX, fn);
+  emit8(0xFF); emit8(0xD0); // call rax
+}
+
+// ============================
+// ====== Block bookkeeping ===
+// ============================
+
+struct JitBlock;
+
+// One direct (BR/JSR/fall-through) exit of a block
+// - Starts out jumping to its stub, which returns to the dispatcher
+// - Once the target block exists the jmp is patched to go straight there
+struct ExitSite {
+  uint8_t* site;  // rel32 of the exit's jmp
+  uint8_t* stub;  // the jmp's original target
+  JitBlock* from;
+  JitBlock* to;   // block it's chained into, nullptr while unchained
+};
+
+struct JitBlock {
+  uint16_t start;
+  uint32_t end;   // one past the last guest address (may be 0x10000)
+  uint8_t* code;
+  std::vector<ExitSite*> exits;     // owned
+  std::vector<ExitSite*> incoming;  // other blocks' exits chained into this one
+};
+
+// Which pages hold translated code (stores there look at JitState::code),
+// which are memory mapped I/O & which may still be clean (PAGE_ATTR_CLEAN,
+// the slow path's mem_write marks them dirty, see jit_note_clean)
+#define PAGE_CODE 1
+#define PAGE_IO 2
+#define PAGE_CLEAN 4
+
+// Trampolines, generated once at the start of each code cache
+// enter(code) : save host callee-saved regs, load guest state, jump to code
+// common_exit : store guest state, restore host regs, return rax (ExitSite* or 0)
+typedef ExitSite* (*EnterFn)(uint8_t* code);
+
+// Everything the JIT keeps for one VM (Vm::jit)
+// Translations bake in the addresses of this VM's tables, so each VM
+// gets its own code cache
+struct JitState {
+  uint8_t* cache{};
+  uint8_t* cache_end{};
+  uint8_t* blocks_start{}; // first byte after the trampolines
+  uint8_t* cur{};          // where the next block goes
+
+  uint8_t page_flags[MEMORY_MAX >> 8];
+  std::vector<JitBlock*> page_blocks[MEMORY_MAX >> 8];
+  // Translated words, a bit each (the blocks in page_blocks, exactly)
+  // only a store to one of them leaves translated code, the data sharing
+  // a page with it (`ST R7, SAVE`, .FILL variables) is stored inline
+  uint64_t code[MEMORY_MAX / 64];
+
+  // Block starting at each guest address, & its host code for indirect jumps
+  JitBlock* block_at[MEMORY_MAX];
+  uint8_t* entry[MEMORY_MAX];
+
+  // Bumped on every full flush, so a pending exit from before it is ignored
+  uint64_t generation{};
+
+  // Translations thrown away so far, jit_mem_write compares it around a store
+  uint64_t invalidated{};
+
+  // The machine it translates for (PAGE_ATTR_CODE lives in its page_attr)
+  Vm* vm{};
+
+  // Instructions retired by translated code minus run_jit's budget,
+  // bumped once per block exit
+  // Negative while there's budget left, so the add that counts a block
+  // also tells a loop's back edge whether to stop (its flags)
+  int64_t retired{};
+
+  EnterFn enter{};
+  uint8_t* common_exit{};
+};
+
+// One perf map per process, shared by every VM's translations
+static FILE* perf_map = nullptr;
+static std::mutex perf_map_lock;
+
+static void unlink_exit(ExitSite* e) {
+  if (!e->to) { return; }
+  std::vector<ExitSite*>& in = e->to->incoming;
+  for (size_t i = 0; i < in.size(); ++i) {
+    if (in[i] == e) {
+      in[i] = in.back();
+      in.pop_back();
+      break;
+    }
+  }
+  patch_rel32(e->site, e->stub);
+  e->to = nullptr;
+}
+
+// Page `page` holds translated code or not, in page_flags & in the Vm's
+// page_attr (PAGE_ATTR_CODE), so a store from anywhere (the interpreters,
+// lockstep lanes, a debugger) goes through mem_write & reaches jit_invalidate
+static void set_code_page(JitState& j, uint32_t page, bool on) {
+  if (on) {
+    j.page_flags[page] |= PAGE_CODE;
+    j.vm->page_attr[page] |= PAGE_ATTR_CODE;
+  } else {
+    j.page_flags[page] &= static_cast<uint8_t>(~PAGE_CODE);
+    j.vm->page_attr[page] = static_cast<uint8_t>(j.vm->page_attr[page] & ~PAGE_ATTR_CODE);
+  }
+}
+
+// Sets the bits of memory[from .. to) in j.code
+static void set_code_bits(JitState& j, uint32_t from, uint32_t to) {
+  for (uint32_t addr = from; addr < to; ++addr) {
+    j.code[addr >> 6] |= UINT64_C(1) << (addr & 63);
+  }
+}
+
+// Page `page`'s bits in j.code, again from the blocks still on it
+// (blocks may overlap, one going away doesn't free all of its words)
+static void rebuild_code_bits(JitState& j, uint32_t page) {
+  uint32_t first = page << 8;
+  uint32_t last = first + 256;
+  memset(j.code + (first >> 6), 0, 256 / 8);
+  for (JitBlock* b : j.page_blocks[page]) {
+    set_code_bits(j, b->start > first ? b->start : first, b->end < last ? b->end : last);
+  }
+}
+
+// Is any word of memory[addr .. end) translated?
+static bool code_in_range(const JitState& j, uint32_t addr, uint32_t end) {
+  for (; addr < end; ++addr) {
+    uint64_t word = j.code[addr >> 6] >> (addr & 63);
+    // the rest of this 64 bit word at once
+    if (word && addr + static_cast<uint32_t>(__builtin_ctzll(word)) < end) { return true; }
+    addr |= 63;
+  }
+  return false;
+}
+
+static void free_block(JitBlock* b) {
+  for (ExitSite* e : b->exits) { delete e; }
+  delete b;
+}
+
+// Forget one translation
+// - anything chained into it goes back through its stub
+// - its own chained exits are unlinked from their targets
+static void invalidate_block(JitState& j, JitBlock* b) {
+  while (!b->incoming.empty()) { unlink_exit(b->incoming.back()); }
+  for (ExitSite* e : b->exits) { unlink_exit(e); }
+
+  j.block_at[b->start] = nullptr;
+  j.entry[b->start] = nullptr;
+
+  for (uint32_t page = b->start >> 8; page <= (b->end - 1) >> 8; ++page) {
+    std::vector<JitBlock*>& list = j.page_blocks[page];
+    for (size_t i = 0; i < list.size(); ++i) {
+      if (list[i] == b) {
+        list[i] = list.back();
+        list.pop_back();
+        break;
+      }
+    }
+    rebuild_code_bits(j, page);
+    if (list.empty()) { set_code_page(j, page, false); }
+  }
+
+  // the host code itself is only reclaimed by the next full flush
+  free_block(b);
+  ++j.invalidated;
+}
+
+// Invalidate every translation covering memory[addr .. addr + count)
+static void invalidate_range(JitState& j, uint32_t addr, uint32_t end) {
+  // most stores to a code page are to its data
+  if (!code_in_range(j, addr, end)) { return; }
+  for (uint32_t page = addr >> 8; page <= (end - 1) >> 8; ++page) {
+    if (!(j.page_flags[page] & PAGE_CODE)) { continue; }
+    std::vector<JitBlock*>& list = j.page_blocks[page];
+    for (size_t i = 0; i < list.size();) {
+      JitBlock* b = list[i];
+      if (b->start < end && addr < b->end) {
+        invalidate_block(j, b); // removes it from `list`
+      } else {
+        ++i;
+      }
+    }
+  }
+}
+
+// Code cache is full: drop every translation & start over
+static void flush_cache(JitState& j) {
+  for (uint32_t page = 0; page < (MEMORY_MAX >> 8); ++page) {
+    for (JitBlock* b : j.page_blocks[page]) {
+      // blocks spanning 2 pages are listed twice, free at their first page
+      if ((b->start >> 8) == page) { free_block(b); }
+    }
+    j.page_blocks[page].clear();
+    set_code_page(j, page, false);
+  }
+  memset(j.code, 0, sizeof(j.code));
+  memset(j.block_at, 0, sizeof(j.block_at));
+  memset(j.entry, 0, sizeof(j.entry));
+  j.cur = j.blocks_start;
+  ++j.generation;
+}
+
+// ============================
+// ====== Runtime helpers =====
+// ============================
+// Called from translated code (SysV ABI, rdi = the Vm)
+// with guest state spilled to vm.reg[]
+
+static uint16_t jit_mem_read(Vm* vm, uint16_t addr) {
+  return mem_read(*vm, addr);
+}
+
+// returns non-zero if the store invalidated translated code (mem_write
+// does that on a PAGE_ATTR_CODE page, see jit_invalidate),
+// in which case the block has to exit before running stale code,
+// or turned interrupts on, which run_jit leaves to the threaded core,
+// or stopped the VM (MCR's clock bit cleared, see device.h)
+static int jit_mem_write(Vm* vm, uint16_t addr, uint16_t val) {
+  uint64_t invalidated = vm->jit->invalidated;
+  mem_write(*vm, addr, val);
+  // dirty now, the next store to the page stays inline
+  vm->jit->page_flags[addr >> 8] &= static_cast<uint8_t>(~PAGE_CLEAN);
+  return vm->jit->invalidated != invalidated || vm->interrupts || !vm->running;
+}
+
+// returns vm.running, 0 after HALT
+static int jit_trap(Vm* vm, uint16_t vect) {
+  DecodedInstr d = decode(static_cast<uint16_t>((OP_TRAP << 12) | vect));
+  trap(*vm, d);
+  // paused for input (see execute), the TRAP runs again on the next slice
+  if (vm->blocked) { --vm->jit->retired; }
+  return vm->running;
+}
+
+// ============================
+// ======== Translator ========
+// ============================
+
+// Direct exit waiting for its stub to be emitted after the block body
+struct PendingExit {
+  uint8_t* site;
+  uint16_t target;
+};
+
+// Jump taken when the budget ran out at a back edge, stub emitted after the body
+// the block is left at `pc` with the last `undo` instructions not retired
+struct BudgetExit {
+  uint8_t* site;
+  uint16_t pc;
+  uint32_t undo;
+};
+
+static void emit_count(JitState& j, uint32_t n) {
+  mov_ri64(RAX, &j.retired);
+  // add qword [rax], n
+  emit8(0x48); emit8(0x81); modrm(0, EXT_ADD, RAX); emit32(n);
+}
+
+static void emit_chain_exit(std::vector<PendingExit>& pending, uint16_t target) {
+  pending.push_back(PendingExit{jmp_rel32(), target});
+}
+
+// Right after an emit_count: leave instead if that went past the budget
+// (past, not onto: a block that just uses it up runs, so every run_jit gets
+//  at least its first block done even when it redoes the last instruction)
+// Only loops need this, code that only ever jumps forwards runs off the
+// end of memory, so back edges & indirect jumps are checked & nothing else
+// - `pc`/`undo` : where the next run starts, a BR/JMP/JSR that hasn't
+//   picked its target yet runs again (undo 1)
+static void emit_budget_check(std::vector<BudgetExit>& over, uint16_t pc, uint32_t undo) {
+  over.push_back(BudgetExit{jcc_rel32(CC_G), pc, undo});
+}
+
+// leave the block with reg[R_PC] = pc, not chainable
+static void emit_exit_pc(JitState& j, uint16_t pc) {
+  store_pc(pc);
+  op_rr(0x31, RAX, RAX); // xor eax, eax
+  patch_rel32(jmp_rel32(), j.common_exit);
+}
+
+// JMP / RET / JSRR, target in eax
+// jump straight into the target's translation when there is one
+static void emit_indirect_exit(JitState& j) {
+  store_vm16(RAX, VM_REG(R_PC));
+  mov_ri64(RSI, j.entry);
+  // mov rax, [rsi + rax*8]
+  emit8(0x48); emit8(0x8B); modrm(0, RAX, 4); sib(3, RAX, RSI);
+  emit8(0x48); emit8(0x85); modrm(3, RAX, RAX); // test rax, rax
+  uint8_t* miss = jcc_rel32(CC_E);
+  emit8(0xFF); emit8(0xE0); // jmp rax
+  patch_rel32(miss, cur);
+  patch_rel32(jmp_rel32(), j.common_exit); // rax is 0 here
+}
+
+// Flag setter: just remember the result, a BR works out N/Z/P
+static void emit_cond(int r) {
+  mov_rr(HOST_COND, r);
+}
+
+// Jcc that is taken when the nzp mask does NOT match the last result
+// (after `movsx eax, dx; test eax, eax`)
+static int not_taken_cc(uint8_t nzp) {
+  switch (nzp) {
+    case 0b100: return CC_GE; // n
+    case 0b010: return CC_NE; // z
+    case 0b001: return CC_LE; // p
+    case 0b110: return CC_G;  // nz
+    case 0b011: return CC_L;  // zp
+    case 0b101: default: return CC_E; // np
+  }
+}
+
+// dst = memory[eax], memory mapped registers go through mem_read
+// `next_pc` is stored first, mem_read looks at the PC to spot
+// keyboard polling loops (see idle.h)
+// A KBSR read at end of input can stop the VM (see Vm::eof_policy), then
+// the block is left with `retired` instructions done & COND = dst
+// (retired 0: the address half of an LDI, which just carries on)
+static void emit_load(JitState& j, int dst, uint32_t retired, uint16_t next_pc) {
+  op_ri(EXT_CMP, RAX, 0xFE00);
+  uint8_t* slow = jcc_rel32(CC_AE);
+  load_mem_rax(dst);
+  uint8_t* done = jmp_rel32();
+
+  patch_rel32(slow, cur);
+  spill_all();
+  store_pc(next_pc);
+  mov_rr(RSI, RAX);
+  mov_rr64(RDI, RBX);
+  call_abs(reinterpret_cast<const void*>(jit_mem_read));
+  reload_all();
+  ext_rr16(0xB7, dst, RAX);      // movzx dst, ax
+  if (retired) {
+    emit8(0x83); modrm(2, EXT_CMP, RBX); emit32(offsetof(Vm, running)); emit8(0); // cmp dword [rbx+running], 0
+    uint8_t* still_running = jcc_rel32(CC_NE);
+    emit_cond(dst);
+    emit_count(j, retired);
+    emit_exit_pc(j, next_pc);
+    patch_rel32(still_running, cur);
+  }
+
+  patch_rel32(done, cur);
+}
+
+// memory[eax] = src
+// - plain RAM: store inline (& mark the decoded cache entry stale)
+// - a code page: the same, unless the word itself is translated (JitState::code)
+// - translated words, I/O pages, or a page not written since mem_clear_dirty:
+//   mem_write, & leave the block if code was invalidated (or interrupts
+//   were turned on, or the VM stopped)
+// `retired` : instructions done by the time an early exit happens
+static void emit_store(JitState& j, int src, uint32_t retired, uint16_t next_pc) {
+  mov_rr(RCX, RAX);
+  emit8(0xC1); modrm(3, 5, RCX); emit8(8);                    // shr ecx, 8
+  mov_ri64(RSI, j.page_flags);
+  emit8(0x80); modrm(0, EXT_CMP, 4); sib(0, RCX, RSI); emit8(0); // cmp byte [rsi+rcx], 0
+  uint8_t* flagged = jcc_rel32(CC_NE);
+  uint8_t* inline_store = cur;
+  store_mem_rax(src);
+  // mov rsi, [rbx + offsetof(Vm, decoded)]
+  rex(1, RSI, 0, RBX); emit8(0x8B); modrm(2, RSI, RBX); emit32(offsetof(Vm, decoded));
+  emit8(0xC6); modrm(0, 0, 4); sib(3, RAX, RSI); emit8(OP_UNDECODED); // mov byte [rsi+rax*8], OP_UNDECODED
+  uint8_t* done = jmp_rel32();
+
+  // a page with only code on it: inline too, unless the word is translated
+  patch_rel32(flagged, cur);
+  emit8(0x80); modrm(0, EXT_CMP, 4); sib(0, RCX, RSI); emit8(PAGE_CODE); // cmp byte [rsi+rcx], PAGE_CODE
+  uint8_t* slow = jcc_rel32(CC_NE);
+  mov_rr(RCX, RAX);
+  emit8(0xC1); modrm(3, 5, RCX); emit8(6);                    // shr ecx, 6
+  mov_ri64(RSI, j.code);
+  rex(1, RSI, RCX, RSI); emit8(0x8B); modrm(0, RSI, 4); sib(3, RCX, RSI); // mov rsi, [rsi+rcx*8]
+  rex(1, RAX, 0, RSI); emit8(0x0F); emit8(0xA3); modrm(3, RAX, RSI);     // bt rsi, rax
+  patch_rel32(jcc_rel32(CC_AE), inline_store);                // jnc: not translated
+
+  patch_rel32(slow, cur);
+  spill_all();
+  mov_rr(RDX, src);              // COND was spilled, edx is free
+  mov_rr(RSI, RAX);
+  mov_rr64(RDI, RBX);
+  call_abs(reinterpret_cast<const void*>(jit_mem_write));
+  op_rr(0x85, RAX, RAX);         // test eax, eax
+  reload_all();
+  uint8_t* still_valid = jcc_rel32(CC_E);
+  emit_count(j, retired);
+  emit_exit_pc(j, next_pc);
+  patch_rel32(still_valid, cur);
+
+  patch_rel32(done, cur);
+}
+
+static bool ends_block(const DecodedInstr& d) {
+  switch (d.op) {
+    case OP_BR: return d.dr != 0; // BR with no nzp bits is a NOP
+    case OP_JMP:
+    case OP_JSR:
+    case OP_TRAP:
+      return true;
+    default:
+      return false;
+  }
+}
+
+static bool sets_cond(const DecodedInstr& d) {
+  switch (d.op) {
+    case OP_ADD: case OP_AND: case OP_NOT:
+    case OP_LD: case OP_LDI: case OP_LDR: case OP_LEA:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Translate the block starting at `start`
+// returns nullptr if the very first instruction can't run (RTI/RES)
+static JitBlock* translate(JitState& j, const Vm& vm, uint16_t start) {
+  DecodedInstr ins[BLOCK_MAX_INSTRS];
+  uint32_t n = 0;
+  for (uint32_t pc = start; n < BLOCK_MAX_INSTRS && pc < MEMORY_MAX; ++pc) {
+    DecodedInstr d = decode(vm.memory[pc]);
+    if (d.op == OP_RTI || d.op == OP_RES) { break; }
+    ins[n++] = d;
+    if (ends_block(d)) { break; }
+  }
+  if (n == 0) { return nullptr; }
+
+  // COND only has to be recorded by the last flag setter before
+  // something that can observe it: BR, TRAP, the block's exits,
+  // or a store (which may leave the block early)
+  bool need_cond[BLOCK_MAX_INSTRS];
+  bool live = true;
+  for (uint32_t i = n; i-- > 0;) {
+    const DecodedInstr& d = ins[i];
+    if (sets_cond(d)) {
+      need_cond[i] = live;
+      live = false;
+    } else {
+      need_cond[i] = false;
+      if (d.op == OP_BR || d.op == OP_TRAP || d.op == OP_ST || d.op == OP_STI || d.op == OP_STR) {
+        live = true;
+      }
+    }
+  }
+
+  if (j.cache_end - j.cur < BLOCK_MAX_BYTES) { flush_cache(j); }
+  cur = j.cur;
+
+  JitBlock* b = new JitBlock{start, start + n, cur, {}, {}};
+  std::vector<PendingExit> pending;
+  std::vector<BudgetExit> over;
+  bool terminated = false;
+
+  for (uint32_t i = 0; i < n; ++i) {
+    const DecodedInstr& d = ins[i];
+    uint16_t here = static_cast<uint16_t>(start + i);
+    uint16_t next = static_cast<uint16_t>(here + 1);
+    uint16_t rel = static_cast<uint16_t>(next + d.imm); // PC-relative target/address
+
+    switch (d.op) {
+      case OP_ADD:
+        mov_rr(RAX, guest(d.sr1));
+        if (d.imm_mode) { op_ri(EXT_ADD, RAX, d.imm); } else { op_rr(0x01, RAX, guest(d.sr2)); }
+        ext_rr16(0xB7, guest(d.dr), RAX);
+        break;
+      case OP_AND:
+        mov_rr(RAX, guest(d.sr1));
+        if (d.imm_mode) { op_ri(EXT_AND, RAX, d.imm); } else { op_rr(0x21, RAX, guest(d.sr2)); }
+        mov_rr(guest(d.dr), RAX);
+        break;
+      case OP_NOT:
+        mov_rr(RAX, guest(d.sr1));
+        op_ri(EXT_XOR, RAX, 0xFFFF);
+        mov_rr(guest(d.dr), RAX);
+        break;
+      case OP_LEA:
+        mov_ri(guest(d.dr), rel);
+        break;
+      case OP_LD:
+        if (rel >= 0xFE00) {
+          mov_ri(RAX, rel);
+          emit_load(j, guest(d.dr), i + 1, next);
+        } else {
+          load_mem_abs(guest(d.dr), rel);
+        }
+        break;
+      case OP_LDI:
+        if (rel >= 0xFE00) {
+          mov_ri(RAX, rel);
+          emit_load(j, RAX, 0, next);
+        } else {
+          load_mem_abs(RAX, rel);
+        }
+        emit_load(j, guest(d.dr), i + 1, next);
+        break;
+      case OP_LDR:
+        mov_rr(RAX, guest(d.sr1));
+        op_ri(EXT_ADD, RAX, d.imm);
+        ext_rr16(0xB7, RAX, RAX);
+        emit_load(j, guest(d.dr), i + 1, next);
+        break;
+      case OP_ST:
+        mov_ri(RAX, rel);
+        emit_store(j, guest(d.dr), i + 1, next);
+        break;
+      case OP_STI:
+        if (rel >= 0xFE00) {
+          mov_ri(RAX, rel);
+          emit_load(j, RAX, 0, next);
+        } else {
+          load_mem_abs(RAX, rel);
+        }
+        emit_store(j, guest(d.dr), i + 1, next);
+        break;
+      case OP_STR:
+        mov_rr(RAX, guest(d.sr1));
+        op_ri(EXT_ADD, RAX, d.imm);
+        ext_rr16(0xB7, RAX, RAX);
+        emit_store(j, guest(d.dr), i + 1, next);
+        break;
+      case OP_BR: {
+        if (d.dr == 0) { break; } // NOP
+        emit_count(j, i + 1);
+        if (rel <= start || (d.dr != 0b111 && next <= start)) {
+          emit_budget_check(over, here, 1);
+        }
+        if (d.dr == 0b111) {
+          emit_chain_exit(pending, rel);
+        } else {
+          ext_rr16(0xBF, RAX, HOST_COND); // movsx eax, dx
+          op_rr(0x85, RAX, RAX);          // test eax, eax
+          uint8_t* not_taken = jcc_rel32(not_taken_cc(d.dr));
+          emit_chain_exit(pending, rel);
+          patch_rel32(not_taken, cur);
+          emit_chain_exit(pending, next);
+        }
+        terminated = true;
+        break;
+      }
+      case OP_JMP:
+        emit_count(j, i + 1);
+        emit_budget_check(over, here, 1);
+        mov_rr(RAX, guest(d.sr1));
+        emit_indirect_exit(j);
+        terminated = true;
+        break;
+      case OP_JSR:
+        emit_count(j, i + 1);
+        if (!d.imm_mode || rel <= start) {
+          emit_budget_check(over, here, 1);
+        }
+        if (d.imm_mode) {
+          mov_ri(guest(R_R7), next);
+          emit_chain_exit(pending, rel);
+        } else {
+          // read the base before R7 is overwritten (JSRR R7)
+          mov_rr(RAX, guest(d.sr1));
+          mov_ri(guest(R_R7), next);
+          emit_indirect_exit(j);
+        }
+        terminated = true;
+        break;
+      case OP_TRAP: {
+        emit_count(j, i + 1);
+        store_pc(next);
+        spill_all();
+        mov_ri(RSI, d.imm);
+        mov_rr64(RDI, RBX);
+        call_abs(reinterpret_cast<const void*>(jit_trap));
+        op_rr(0x85, RAX, RAX);
+        reload_all();
+        uint8_t* still_running = jcc_rel32(CC_NE);
+        // HALT: PC was already stored
+        op_rr(0x31, RAX, RAX);
+        patch_rel32(jmp_rel32(), j.common_exit);
+        patch_rel32(still_running, cur);
+        emit_chain_exit(pending, next);
+        terminated = true;
+        break;
+      }
+    }
+
+    if (need_cond[i]) { emit_cond(guest(d.dr)); }
+  }
+
+  // ran into the length limit (or RTI/RES), carry on at the next address
+  if (!terminated) {
+    emit_count(j, n);
+    // wrapped around the end of memory
+    if (static_cast<uint16_t>(start + n) <= start) {
+      emit_budget_check(over, static_cast<uint16_t>(start + n), 0);
+    }
+    emit_chain_exit(pending, static_cast<uint16_t>(start + n));
+  }
+
+  // Stubs: store the target PC & hand this exit back to the dispatcher
+  for (const PendingExit& p : pending) {
+    ExitSite* e = new ExitSite{p.site, cur, b, nullptr};
+    b->exits.push_back(e);
+    patch_rel32(p.site, cur);
+    store_pc(p.target);
+    mov_ri64(RAX, e);
+    patch_rel32(jmp_rel32(), j.common_exit);
+  }
+  // out of budget: back to the dispatcher, which stops
+  for (const BudgetExit& o : over) {
+    patch_rel32(o.site, cur);
+    // (emit_count's imm32 is sign extended, so this subtracts)
+    if (o.undo) { emit_count(j, static_cast<uint32_t>(-static_cast<int32_t>(o.undo))); }
+    emit_exit_pc(j, o.pc);
+  }
+
+  j.cur = cur;
+  j.block_at[start] = b;
+  j.entry[start] = b->code;
+  for (uint32_t page = b->start >> 8; page <= (b->end - 1) >> 8; ++page) {
+    j.page_blocks[page].push_back(b);
+    set_code_page(j, page, true);
+  }
+  set_code_bits(j, b->start, b->end);
+
+  std::lock_guard<std::mutex> lock(perf_map_lock);
+  if (perf_map) {
+    fprintf(perf_map, "%lx %lx lc3_x%04x\n",
+      reinterpret_cast<unsigned long>(b->code),
+      static_cast<unsigned long>(cur - b->code), start);
+    fflush(perf_map);
+  }
+  return b;
+}
+
+// PAGE_CLEAN wherever vm's page is clean
+static void note_clean_pages(JitState& j, const Vm& vm) {
+  for (size_t page = 0; page < MEM_PAGES; ++page) {
+    if (vm.page_attr[page] & PAGE_ATTR_CLEAN) { j.page_flags[page] |= PAGE_CLEAN; }
+  }
+}
+
+// Sets up a code cache for `vm`, with the enter/exit trampolines at its start
+static JitState* jit_init(Vm& vm) {
+  if (vm.jit) { return vm.jit; }
+  void* mem = mmap(nullptr, CODE_CACHE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED) { return nullptr; }
+
+  JitState* j = new JitState();
+  j->cache = static_cast<uint8_t*>(mem);
+  j->cache_end = j->cache + CODE_CACHE_SIZE;
+  cur = j->cache;
+
+  for (size_t page = 0; page < MEM_PAGES; ++page) {
+    if (device_page(page)) { j->page_flags[page] |= PAGE_IO; }
+  }
+  note_clean_pages(*j, vm);
+  j->vm = &vm;
+
+  // enter(rdi = code)
+  // 5 pushes + the return address keep calls 16 byte aligned
+  j->enter = reinterpret_cast<EnterFn>(cur);
+  emit8(0x53);              // push rbx
+  emit8(0x41); emit8(0x54); // push r12
+  emit8(0x41); emit8(0x55); // push r13
+  emit8(0x41); emit8(0x56); // push r14
+  emit8(0x41); emit8(0x57); // push r15
+  mov_ri64(RBX, &vm);
+  reload_all();
+  emit8(0xFF); emit8(0xE7); // jmp rdi
+
+  j->common_exit = cur;
+  spill_all();
+  emit8(0x41); emit8(0x5F); // pop r15
+  emit8(0x41); emit8(0x5E); // pop r14
+  emit8(0x41); emit8(0x5D); // pop r13
+  emit8(0x41); emit8(0x5C); // pop r12
+  emit8(0x5B);              // pop rbx
+  emit8(0xC3);              // ret
+
+  j->blocks_start = cur;
+  j->cur = cur;
+  vm.jit = j;
+
+  std::lock_guard<std::mutex> lock(perf_map_lock);
+  if (!perf_map) {
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/perf-%d.map", static_cast<int>(getpid()));
+    perf_map = fopen(path, "w");
+  }
+  return j;
+}
+
+uint64_t run_jit(Vm& vm, uint64_t max_instructions) {
+  JitState* j = trace_enabled || vm.profile || vm.debug || vm.coverage || vm.interrupts
+    ? nullptr : jit_init(vm);
+  if (!j) {
+    return run_threaded(vm, max_instructions);
+  }
+
+  // no limit is a budget nothing ever runs through
+  int64_t budget = max_instructions < JIT_MAX_BUDGET
+    ? static_cast<int64_t>(max_instructions) : JIT_MAX_BUDGET;
+  j->retired = -budget;
+  load_cond(vm);
+
+  // exit the last block left through, & the cache generation it belongs to
+  ExitSite* pending = nullptr;
+  uint64_t pending_gen = 0;
+
+  while (vm.running && j->retired < 0 && !vm.interrupts) {
+    uint16_t pc = vm.reg[R_PC];
+    JitBlock* b = j->block_at[pc];
+    if (!b) {
+      b = translate(*j, vm, pc);
+      if (!b && vm.memory[pc] >> 12 == OP_RTI) {
+        // one instruction on the interpreter, nothing to chain across it
+        materialize_cond(vm);
+        j->retired += static_cast<int64_t>(run_step(vm));
+        load_cond(vm);
+        pending = nullptr;
+        continue;
+      }
+      if (!b) {
+        bad_opcode(vm, "Unused opcode");
+        break;
+      }
+    }
+
+    // chain the previous block's exit straight into this one
+    if (pending && pending_gen == j->generation) {
+      patch_rel32(pending->site, b->code);
+      pending->to = b;
+      b->incoming.push_back(pending);
+    }
+
+    pending = j->enter(b->code);
+    pending_gen = j->generation;
+  }
+
+  materialize_cond(vm);
+  uint64_t retired = static_cast<uint64_t>(j->retired + budget);
+  // a store turned interrupts on, the rest of the budget is threaded
+  if (vm.interrupts && vm.running && retired < max_instructions) {
+    retired += run_threaded(vm, max_instructions - retired);
+  }
+  return retired;
+}
+
+void jit_note_clean(Vm& vm) {
+  if (vm.jit) { note_clean_pages(*vm.jit, vm); }
+}
+
+void jit_invalidate(Vm& vm, uint16_t addr, size_t count) {
+  if (!vm.jit || count == 0) { return; }
+  invalidate_range(*vm.jit, addr, static_cast<uint32_t>(addr + count < MEMORY_MAX ? addr + count : MEMORY_MAX));
+}
+
+void jit_destroy(Vm& vm) {
+  JitState* j = vm.jit;
+  if (!j) { return; }
+  flush_cache(*j);
+  munmap(j->cache, CODE_CACHE_SIZE);
+  delete j;
+  vm.jit = nullptr;
+}
+
+#else
+
+uint64_t run_jit(Vm& vm, uint64_t max_instructions) {
+  return run_threaded(vm, max_instructions);
+}
+
+void jit_destroy(Vm&) {}
+
+void jit_note_clean(Vm&) {}
+
+void jit_invalidate(Vm&, uint16_t, size_t) {}
+
+#endif
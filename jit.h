@@ -0,0 +1,59 @@
+#ifndef JIT_H
+#define JIT_H
+#include "vm.h"
+#include <cstdint>
+
+// ============================
+// ======= x86-64 JIT =========
+// ============================
+// Translates basic blocks of LC-3 code into native x86-64
+// - A block starts at vm.reg[R_PC] & runs until (including) BR/JMP/JSR/TRAP
+// - Inside translated code the guest registers live in host registers
+//   -- R0..R7 -> r8d..r15d
+//   -- COND   -> edx (as the last flag-setting result, see ops.h)
+//   -- PC is a constant known at translation time, only stored on exit
+// - Blocks ending in a direct BR/JSR are patched to jump straight into
+//   the next block, indirect JMP/RET/JSRR look up the target in a table
+// - Loads/stores to the memory-mapped registers (& stores to translated
+//   words, tracked a bit per word) leave through mem_read/mem_write, data
+//   next to the code is stored inline like anywhere else
+// - Stores over translated words invalidate the translations covering them,
+//   wherever they come from: pages holding translations are PAGE_ATTR_CODE
+//   (see memory.h), so the interpreters', lockstep lanes' & lc3aot's stores
+//   there go through mem_write, & bulk writes (loaders, snapshot diffs,
+//   fuzzing resets) through invalidate_decoded_range, which both call
+//   jit_invalidate
+// - Every translation is listed in /tmp/perf-<pid>.map so `perf` can
+//   attribute samples to guest blocks
+//
+// Only built on x86-64 Linux, elsewhere run_jit is the threaded core
+// Tracing & profiling need every instruction, & blocks don't stop at
+// breakpoints or watchpoints, so with any of those on (see debug.h),
+// or edge coverage being recorded (see fuzz.h), run_jit also falls back
+// to the threaded core
+// So does a program with interrupts on (see interrupt.h): chained blocks
+// never come back to a place where one could be taken, a store turning
+// them on leaves the block & the rest of the run is threaded
+// RTI (privileged & rare) is run by the interpreter, run_step
+
+// Each VM gets its own code cache (vm.jit), made on its first run_jit
+// & kept across calls, so translations survive between runs
+
+// Run from vm.reg[R_PC] until vm.running is cleared (HALT),
+// or about `max_instructions` have retired (see engine.h)
+// returns the number of instructions retired
+// - translated code only checks the budget on backward & indirect jumps,
+//   so a run can go over it by a stretch of straight line code
+uint64_t run_jit(Vm& vm, uint64_t max_instructions = UINT64_MAX);
+
+// mem_clear_dirty made pages clean again, so their next store has to go
+// through mem_write to mark them (translated stores skip it otherwise)
+void jit_note_clean(Vm& vm);
+
+// memory[addr .. addr + count) changed, throw away the translations of it
+void jit_invalidate(Vm& vm, uint16_t addr, size_t count);
+
+// Free vm's code cache (vm_destroy does this)
+void jit_destroy(Vm& vm);
+
+#endif // !JIT_H
@@ -0,0 +1,187 @@
+#include "lockstep.h"
+#include "engine.h"
+#include "lockstep_core.h"
+#include "ops.h"
+#include "trace.h"
+#include <cstring>
+#include <new>
+
+// One lane at a time, for CPUs without AVX2 (& non x86 hosts)
+struct LockstepScalar {
+  static void alu(LockstepAlu op, uint16_t* dst, uint16_t* cond, const uint16_t* a, const uint16_t* b, uint32_t m) {
+    for (; m; m &= m - 1) {
+      unsigned i = lockstep_first(m);
+      dst[i] = cond[i] = static_cast<uint16_t>(op == LOCKSTEP_ADD ? a[i] + b[i] : a[i] & b[i]);
+    }
+  }
+  static void alu_imm(LockstepAlu op, uint16_t* dst, uint16_t* cond, const uint16_t* a, uint16_t imm, uint32_t m) {
+    for (; m; m &= m - 1) {
+      unsigned i = lockstep_first(m);
+      dst[i] = cond[i] = static_cast<uint16_t>(op == LOCKSTEP_ADD ? a[i] + imm : a[i] & imm);
+    }
+  }
+  static void not_(uint16_t* dst, uint16_t* cond, const uint16_t* a, uint32_t m) {
+    for (; m; m &= m - 1) {
+      unsigned i = lockstep_first(m);
+      dst[i] = cond[i] = static_cast<uint16_t>(~a[i]);
+    }
+  }
+  static void set(uint16_t* dst, uint16_t val, uint32_t m) {
+    for (; m; m &= m - 1) { dst[lockstep_first(m)] = val; }
+  }
+  static void copy(uint16_t* dst, const uint16_t* src, uint32_t m) {
+    for (; m; m &= m - 1) {
+      unsigned i = lockstep_first(m);
+      dst[i] = src[i];
+    }
+  }
+  static uint32_t sign_bits(const uint16_t* a) {
+    uint32_t bits = 0;
+    for (unsigned i = 0; i < LOCKSTEP_LANES; ++i) { bits |= static_cast<uint32_t>(a[i] >> 15) << i; }
+    return bits;
+  }
+  static uint32_t zero_bits(const uint16_t* a) {
+    uint32_t bits = 0;
+    for (unsigned i = 0; i < LOCKSTEP_LANES; ++i) { bits |= static_cast<uint32_t>(a[i] == 0) << i; }
+    return bits;
+  }
+  static uint16_t lowest(const uint16_t* pc, uint32_t active, uint32_t& at) {
+    uint16_t low = 0xFFFF;
+    at = 0;
+    for (uint32_t m = active; m; m &= m - 1) {
+      unsigned i = lockstep_first(m);
+      if (pc[i] < low) {
+        low = pc[i];
+        at = 0;
+      }
+      if (pc[i] == low) { at |= 1u << i; }
+    }
+    return low;
+  }
+  static void count(uint16_t* counter, uint32_t m) {
+    for (; m; m &= m - 1) { ++counter[lockstep_first(m)]; }
+  }
+};
+
+int lockstep_isa_from_name(const char* name, LockstepIsa& isa) {
+  if (strcmp(name, "scalar") == 0) {
+    isa = LOCKSTEP_SCALAR;
+    return 1;
+  }
+  if (strcmp(name, "avx2") == 0) {
+    isa = LOCKSTEP_AVX2;
+    return 1;
+  }
+  if (strcmp(name, "avx512") == 0) {
+    isa = LOCKSTEP_AVX512;
+    return 1;
+  }
+  return 0;
+}
+
+const char* lockstep_isa_name(LockstepIsa isa) {
+  switch (isa) {
+    case LOCKSTEP_AVX2: return "avx2";
+    case LOCKSTEP_AVX512: return "avx512";
+    case LOCKSTEP_SCALAR:
+    default: return "scalar";
+  }
+}
+
+LockstepIsa lockstep_best_isa() {
+#if defined(__x86_64__)
+  static const LockstepIsa best =
+    __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vl") ? LOCKSTEP_AVX512
+    : __builtin_cpu_supports("avx2") ? LOCKSTEP_AVX2
+    : LOCKSTEP_SCALAR;
+  return best;
+#else
+  return LOCKSTEP_SCALAR;
+#endif
+}
+
+// Marks the chunks that hold the same words on every lane
+static void find_same_chunks(LockstepLanes& l, size_t count) {
+  const size_t chunk_words = 1u << LOCKSTEP_CHUNK_SHIFT;
+  for (size_t c = 0; c < LOCKSTEP_CHUNKS; ++c) {
+    size_t page = c >> (MEM_PAGE_SHIFT - LOCKSTEP_CHUNK_SHIFT);
+    // the I/O page changes under the program (KBSR/KBDR), never the same
+    bool same = !(l.vm[0]->page_attr[page] & PAGE_ATTR_IO);
+    const uint16_t* first = l.vm[0]->memory + c * chunk_words;
+    for (size_t i = 1; i < count && same; ++i) {
+      same = !(l.vm[i]->page_attr[page] & PAGE_ATTR_IO)
+        && memcmp(l.vm[i]->memory + c * chunk_words, first, chunk_words * sizeof(uint16_t)) == 0;
+    }
+    l.same_chunk[c] = same;
+  }
+}
+
+int run_lockstep(Vm* const* vms, size_t count, uint64_t* retired, uint64_t max_instructions,
+  LockstepIsa isa, LockstepStats* stats) {
+  if (count == 0 || count > LOCKSTEP_LANES) { return 0; }
+
+  uint64_t steps = 0;
+  uint64_t total = 0;
+  bool observed = trace_enabled;
+  for (size_t i = 0; i < count; ++i) {
+    observed = observed || vms[i]->profile || vms[i]->debug || vms[i]->coverage
+      || vms[i]->interrupts;
+  }
+  LockstepLanes* l = observed ? nullptr : new (std::nothrow) LockstepLanes{};
+  if (!l) {
+    // tracing, profiling & breakpoints work per instruction of one VM,
+    // interrupts come in wherever a block ends (so does running out of
+    // memory for the lanes), same results a VM at a time
+    for (size_t i = 0; i < count; ++i) {
+      retired[i] = run_threaded(*vms[i], max_instructions);
+      steps += retired[i];
+      total += retired[i];
+    }
+    if (stats) { *stats = LockstepStats{steps, total}; }
+    return 1;
+  }
+  for (size_t i = 0; i < count; ++i) {
+    Vm& vm = *vms[i];
+    load_cond(vm);
+    l->vm[i] = &vm;
+    for (unsigned r = 0; r < 8; ++r) { l->reg[r][i] = vm.reg[r]; }
+    l->pc[i] = vm.reg[R_PC];
+    l->cond[i] = vm.cond_result;
+    if (vm.running) { l->active |= 1u << i; }
+  }
+  find_same_chunks(*l, count);
+
+  if (isa > lockstep_best_isa()) { isa = lockstep_best_isa(); }
+  switch (isa) {
+#if defined(__x86_64__)
+    case LOCKSTEP_AVX512: steps = lockstep_run_avx512(*l, max_instructions); break;
+    case LOCKSTEP_AVX2: steps = lockstep_run_avx2(*l, max_instructions); break;
+#endif
+    default: steps = lockstep_run<LockstepScalar>(*l, max_instructions); break;
+  }
+
+  for (size_t i = 0; i < count; ++i) {
+    Vm& vm = *vms[i];
+    for (unsigned r = 0; r < 8; ++r) { vm.reg[r] = l->reg[r][i]; }
+    vm.reg[R_PC] = l->pc[i];
+    vm.cond_result = l->cond[i];
+    materialize_cond(vm);
+    for (size_t c = 0; c < LOCKSTEP_CHUNKS; ++c) {
+      if ((l->written[i][c >> 6] >> (c & 63)) & 1) {
+        invalidate_decoded_range(vm, static_cast<uint16_t>(c << LOCKSTEP_CHUNK_SHIFT), 1u << LOCKSTEP_CHUNK_SHIFT);
+      }
+    }
+    retired[i] = l->retired[i];
+    // the budget is a step count, a lane that sat out some steps (a BR split
+    // it off, or it turned interrupts on) runs the rest of its own alone
+    if (vm.running && retired[i] < max_instructions) {
+      uint64_t alone = run_threaded(vm, max_instructions - retired[i]);
+      retired[i] += alone;
+      steps += alone;
+    }
+    total += retired[i];
+  }
+  delete l;
+  if (stats) { *stats = LockstepStats{steps, total}; }
+  return 1;
+}
@@ -0,0 +1,82 @@
+#ifndef LOCKSTEP_H
+#define LOCKSTEP_H
+#include <cstddef>
+#include <cstdint>
+#include "vm.h"
+
+// ============================
+// ===== Lockstep Lanes =======
+// ============================
+// Runs up to LOCKSTEP_LANES VMs loaded with the same program (ex. one
+// grader image, many students' inputs) as a single instruction stream
+// - Each step fetches & decodes one instruction, & runs it on every lane
+//   whose PC is there
+// - The registers are kept across lanes, reg[r][lane], so ADD/AND/NOT/LEA,
+//   the BR flag test & the PC updates are one vector op for all lanes
+//
+// - LOCKSTEP_AVX512 : 16 x 16 bit lanes in one 256 bit register, the
+//   AVX-512 VL/BW mask registers pick the lanes an op applies to
+// - LOCKSTEP_AVX2   : same width, lanes picked by blending
+// - LOCKSTEP_SCALAR : a loop over the lanes, for CPUs with neither (& non x86)
+//
+// Divergence
+// - Each step runs the lanes at the lowest PC among the running lanes,
+//   the others are masked off & wait
+// - Lanes that took the other side of an if/else, or left a loop early,
+//   are ahead, so they wait where the paths join until the rest catch up
+//   & from there run together again
+// - Lanes at the same PC with different words there (code they wrote)
+//   run in separate steps
+//
+// Memory stays in each lane's own Vm (a shared base keeps it copy-on-write,
+// see base_image.h)
+// - Loads & stores are gathered / scattered a lane at a time through
+//   mem_read/mem_write, TRAPs run the regular trap() per lane, so console,
+//   input & EOF behave exactly like on the other engines
+// - An instruction is only compared across lanes where some lane stored
+//   since the start (kept in 64 word chunks), elsewhere it's the same word
+//   on every lane
+
+// 16 bit registers, 16 of them fill an AVX2 register
+#define LOCKSTEP_LANES 16
+
+enum LockstepIsa {
+  LOCKSTEP_SCALAR = 0,
+  LOCKSTEP_AVX2,
+  LOCKSTEP_AVX512,
+};
+
+// Parses "scalar" / "avx2" / "avx512"
+// returns 0 if `name` isn't one
+int lockstep_isa_from_name(const char* name, LockstepIsa& isa);
+
+const char* lockstep_isa_name(LockstepIsa isa);
+
+// The widest this CPU can run (checked once)
+LockstepIsa lockstep_best_isa();
+
+struct LockstepStats {
+  // instructions issued, one per step however many lanes ran it
+  uint64_t steps;
+  // instructions retired over all lanes
+  // (retired / steps = how many lanes ran together on average)
+  uint64_t retired;
+};
+
+// Run vms[0..count) together until every one of them stops, or each has
+// retired about `max_instructions` (checked at the end of basic blocks,
+// like the engines' budget, so no lane retires much more than that)
+// - the lanes stop together after `max_instructions` steps, one that sat
+//   some of them out finishes its budget on the threaded core alone
+// - retired[i] : instructions vms[i] retired, what run_engine would return
+// - `isa` is lowered to lockstep_best_isa() if the CPU can't run it
+// - a lane being traced, profiled, debugged or fuzzed, or with interrupts
+//   on (see interrupt.h), makes them all run one at a time on the threaded
+//   core instead, a lane turning them on mid run finishes on it alone
+// - `stats` (optional) gets the steps & total retired
+// returns 0 if count is 0 or more than LOCKSTEP_LANES
+int run_lockstep(Vm* const* vms, size_t count, uint64_t* retired,
+  uint64_t max_instructions = UINT64_MAX, LockstepIsa isa = lockstep_best_isa(),
+  LockstepStats* stats = nullptr);
+
+#endif // !LOCKSTEP_H
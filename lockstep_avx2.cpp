@@ -0,0 +1,89 @@
+// The lockstep loop (lockstep_core.h) with all 16 lanes in one AVX2 register
+// Only called once lockstep_best_isa() found AVX2
+#include "decode.h"
+#include "engine.h"
+#include "lockstep.h"
+#include "memory.h"
+#include "ops.h"
+#include "vm.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+
+// Everything from here on may use AVX2, the headers above stay plain x86-64
+// lockstep_core.h comes after, so its loop is built for AVX2 too
+#pragma GCC target("avx2")
+#include "lockstep_core.h"
+
+struct LockstepAvx2 {
+  static __m256i load(const uint16_t* a) {
+    return _mm256_load_si256(reinterpret_cast<const __m256i*>(a));
+  }
+  static void store(uint16_t* a, __m256i v) {
+    _mm256_store_si256(reinterpret_cast<__m256i*>(a), v);
+  }
+  // lane bits -> 0xFFFF in the lanes that are set
+  static __m256i lanes(uint32_t m) {
+    const __m256i bits = _mm256_setr_epi16(1, 2, 4, 8, 16, 32, 64, 128, 256, 512, 1024, 2048, 4096, 8192,
+      16384, static_cast<int16_t>(0x8000));
+    __m256i v = _mm256_and_si256(_mm256_set1_epi16(static_cast<int16_t>(m)), bits);
+    return _mm256_cmpeq_epi16(v, bits);
+  }
+  // the top bit of each lane -> lane bits
+  static uint32_t bits(__m256i v) {
+    // packing keeps the sign of each lane, one byte per lane
+    __m128i packed = _mm_packs_epi16(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+    return static_cast<uint32_t>(_mm_movemask_epi8(packed));
+  }
+  // dst & cond take `v` in the lanes of m
+  static void write(uint16_t* dst, uint16_t* cond, __m256i v, uint32_t m) {
+    __m256i mask = lanes(m);
+    store(dst, _mm256_blendv_epi8(load(dst), v, mask));
+    store(cond, _mm256_blendv_epi8(load(cond), v, mask));
+  }
+  static __m256i apply(LockstepAlu op, __m256i a, __m256i b) {
+    return op == LOCKSTEP_ADD ? _mm256_add_epi16(a, b) : _mm256_and_si256(a, b);
+  }
+
+  static void alu(LockstepAlu op, uint16_t* dst, uint16_t* cond, const uint16_t* a, const uint16_t* b, uint32_t m) {
+    write(dst, cond, apply(op, load(a), load(b)), m);
+  }
+  static void alu_imm(LockstepAlu op, uint16_t* dst, uint16_t* cond, const uint16_t* a, uint16_t imm, uint32_t m) {
+    write(dst, cond, apply(op, load(a), _mm256_set1_epi16(static_cast<int16_t>(imm))), m);
+  }
+  static void not_(uint16_t* dst, uint16_t* cond, const uint16_t* a, uint32_t m) {
+    write(dst, cond, _mm256_xor_si256(load(a), _mm256_set1_epi16(-1)), m);
+  }
+  static void set(uint16_t* dst, uint16_t val, uint32_t m) {
+    store(dst, _mm256_blendv_epi8(load(dst), _mm256_set1_epi16(static_cast<int16_t>(val)), lanes(m)));
+  }
+  static void copy(uint16_t* dst, const uint16_t* src, uint32_t m) {
+    store(dst, _mm256_blendv_epi8(load(dst), load(src), lanes(m)));
+  }
+  static uint32_t sign_bits(const uint16_t* a) {
+    return bits(load(a));
+  }
+  static uint32_t zero_bits(const uint16_t* a) {
+    return bits(_mm256_cmpeq_epi16(load(a), _mm256_setzero_si256()));
+  }
+  static uint16_t lowest(const uint16_t* pc, uint32_t active, uint32_t& at) {
+    __m256i v = load(pc);
+    // lanes that aren't running count as xFFFF
+    __m256i key = _mm256_blendv_epi8(_mm256_set1_epi16(-1), v, lanes(active));
+    // PHMINPOSUW: the lowest unsigned word of 8, on each half
+    __m128i low = _mm_min_epu16(_mm_minpos_epu16(_mm256_castsi256_si128(key)),
+      _mm_minpos_epu16(_mm256_extracti128_si256(key, 1)));
+    uint16_t pc_low = static_cast<uint16_t>(_mm_cvtsi128_si32(low));
+    at = bits(_mm256_cmpeq_epi16(v, _mm256_set1_epi16(static_cast<int16_t>(pc_low)))) & active;
+    return pc_low;
+  }
+  static void count(uint16_t* counter, uint32_t m) {
+    // 0xFFFF = -1 in the lanes of m
+    store(counter, _mm256_sub_epi16(load(counter), lanes(m)));
+  }
+};
+
+uint64_t lockstep_run_avx2(LockstepLanes& l, uint64_t max_steps) {
+  return lockstep_run<LockstepAvx2>(l, max_steps);
+}
+#endif
@@ -0,0 +1,78 @@
+// The lockstep loop (lockstep_core.h) on AVX-512 VL/BW: the same 16 lanes
+// in a 256 bit register, but lane bits go straight into a mask register,
+// so a masked op is one instruction instead of an op & a blend
+// Only called once lockstep_best_isa() found AVX-512 BW & VL
+#include "decode.h"
+#include "engine.h"
+#include "lockstep.h"
+#include "memory.h"
+#include "ops.h"
+#include "vm.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+
+// Everything from here on may use AVX-512, the headers above stay plain x86-64
+// lockstep_core.h comes after, so its loop is built for AVX-512 too
+#pragma GCC target("avx2,avx512f,avx512bw,avx512vl")
+#include "lockstep_core.h"
+
+struct LockstepAvx512 {
+  static __m256i load(const uint16_t* a) {
+    return _mm256_load_si256(reinterpret_cast<const __m256i*>(a));
+  }
+  static void store(uint16_t* a, __m256i v) {
+    _mm256_store_si256(reinterpret_cast<__m256i*>(a), v);
+  }
+  static __mmask16 lanes(uint32_t m) {
+    return static_cast<__mmask16>(m);
+  }
+
+  static void alu(LockstepAlu op, uint16_t* dst, uint16_t* cond, const uint16_t* a, const uint16_t* b, uint32_t m) {
+    __m256i v = op == LOCKSTEP_ADD ? _mm256_add_epi16(load(a), load(b)) : _mm256_and_si256(load(a), load(b));
+    _mm256_mask_storeu_epi16(dst, lanes(m), v);
+    _mm256_mask_storeu_epi16(cond, lanes(m), v);
+  }
+  static void alu_imm(LockstepAlu op, uint16_t* dst, uint16_t* cond, const uint16_t* a, uint16_t imm, uint32_t m) {
+    __m256i b = _mm256_set1_epi16(static_cast<int16_t>(imm));
+    __m256i v = op == LOCKSTEP_ADD ? _mm256_add_epi16(load(a), b) : _mm256_and_si256(load(a), b);
+    _mm256_mask_storeu_epi16(dst, lanes(m), v);
+    _mm256_mask_storeu_epi16(cond, lanes(m), v);
+  }
+  static void not_(uint16_t* dst, uint16_t* cond, const uint16_t* a, uint32_t m) {
+    __m256i v = _mm256_xor_si256(load(a), _mm256_set1_epi16(-1));
+    _mm256_mask_storeu_epi16(dst, lanes(m), v);
+    _mm256_mask_storeu_epi16(cond, lanes(m), v);
+  }
+  static void set(uint16_t* dst, uint16_t val, uint32_t m) {
+    _mm256_mask_storeu_epi16(dst, lanes(m), _mm256_set1_epi16(static_cast<int16_t>(val)));
+  }
+  static void copy(uint16_t* dst, const uint16_t* src, uint32_t m) {
+    _mm256_mask_storeu_epi16(dst, lanes(m), load(src));
+  }
+  static uint32_t sign_bits(const uint16_t* a) {
+    return _mm256_movepi16_mask(load(a));
+  }
+  static uint32_t zero_bits(const uint16_t* a) {
+    return _mm256_cmpeq_epi16_mask(load(a), _mm256_setzero_si256());
+  }
+  static uint16_t lowest(const uint16_t* pc, uint32_t active, uint32_t& at) {
+    __m256i v = load(pc);
+    // lanes that aren't running count as xFFFF
+    __m256i key = _mm256_mask_mov_epi16(_mm256_set1_epi16(-1), lanes(active), v);
+    // PHMINPOSUW: the lowest unsigned word of 8, on each half
+    __m128i low = _mm_min_epu16(_mm_minpos_epu16(_mm256_castsi256_si128(key)),
+      _mm_minpos_epu16(_mm256_extracti128_si256(key, 1)));
+    uint16_t pc_low = static_cast<uint16_t>(_mm_cvtsi128_si32(low));
+    at = _mm256_mask_cmpeq_epi16_mask(lanes(active), v, _mm256_set1_epi16(static_cast<int16_t>(pc_low)));
+    return pc_low;
+  }
+  static void count(uint16_t* counter, uint32_t m) {
+    store(counter, _mm256_mask_add_epi16(load(counter), lanes(m), load(counter), _mm256_set1_epi16(1)));
+  }
+};
+
+uint64_t lockstep_run_avx512(LockstepLanes& l, uint64_t max_steps) {
+  return lockstep_run<LockstepAvx512>(l, max_steps);
+}
+#endif
@@ -0,0 +1,334 @@
+#ifndef LOCKSTEP_CORE_H
+#define LOCKSTEP_CORE_H
+#include <cstdint>
+#include "decode.h"
+#include "engine.h"
+#include "interrupt.h"
+#include "lockstep.h"
+#include "memory.h"
+#include "ops.h"
+#include "vm.h"
+
+// ============================
+// === Lockstep Interpreter ===
+// ============================
+// The loop behind run_lockstep (see lockstep.h), written once on a
+// backend `V` & compiled once per backend:
+// - lockstep.cpp         : LockstepScalar
+// - lockstep_avx2.cpp    : LockstepAvx2, the whole file built for AVX2
+// - lockstep_avx512.cpp  : LockstepAvx512, built for AVX-512 VL/BW
+// Those two include the vm headers, switch their target on, then include
+// this file: the inline functions of the vm headers (fetch_decoded, ...)
+// stay plain x86-64, the linker may keep any TU's copy of those
+// Everything in here is static or a template on V for the same reason
+//
+// A backend works on arrays of LOCKSTEP_LANES words, `m` has a bit per lane,
+// lanes outside `m` are left as they are
+//   alu(op, dst, cond, a, b, m)   dst = cond = a op b  (LOCKSTEP_ADD/AND, b an array)
+//   alu_imm(op, dst, cond, a, imm, m)                  (the same with b = imm)
+//   not_(dst, cond, a, m)         dst = cond = ~a
+//   set(dst, val, m)              dst = val
+//   copy(dst, src, m)             dst = src
+//   sign_bits(a) / zero_bits(a)   a lane bit for each a < 0 / a == 0
+//   lowest(pc, active, at)        lowest pc among `active` lanes,
+//                                 `at` = the active lanes at it
+//   count(counter, m)             counter += 1
+
+enum LockstepAlu {
+  LOCKSTEP_ADD = 0,
+  LOCKSTEP_AND,
+};
+
+// Memory is compared & tracked in chunks of 64 words, small enough that
+// code rarely shares one with the data it writes
+#define LOCKSTEP_CHUNK_SHIFT 6
+#define LOCKSTEP_CHUNKS (MEMORY_MAX >> LOCKSTEP_CHUNK_SHIFT)
+
+// Everything the lanes are while they run, pulled out of their Vms
+struct LockstepLanes {
+  alignas(32) uint16_t reg[8][LOCKSTEP_LANES];
+  alignas(32) uint16_t pc[LOCKSTEP_LANES];
+  // cond_result per lane (flags are lazy, see ops.h)
+  alignas(32) uint16_t cond[LOCKSTEP_LANES];
+  // retired since the last flush into `retired`, 16 bits so it's one vector
+  alignas(32) uint16_t pending[LOCKSTEP_LANES];
+  uint64_t retired[LOCKSTEP_LANES];
+  Vm* vm[LOCKSTEP_LANES];
+  // lane bits of the lanes still running
+  uint32_t active;
+  // 1: the chunk holds the same words on every lane
+  uint8_t same_chunk[LOCKSTEP_CHUNKS];
+  // Chunks each lane stored to, a bit per chunk
+  // - a store doesn't touch the lane's predecoded cache (8 bytes in a 512KB
+  //   table per lane, 16 of those don't stay in cache), run_lockstep
+  //   invalidates the chunks it wrote once it's done
+  // - in the meantime the lane's words there are decoded straight from memory
+  uint64_t written[LOCKSTEP_LANES][LOCKSTEP_CHUNKS / 64];
+};
+
+// Steps between flushes of LockstepLanes::pending, before it can wrap
+#define LOCKSTEP_FLUSH 0xFFFF
+
+// The other backends' loops, only called when the CPU has them
+uint64_t lockstep_run_avx2(LockstepLanes& l, uint64_t max_steps);
+uint64_t lockstep_run_avx512(LockstepLanes& l, uint64_t max_steps);
+
+static inline unsigned lockstep_first(uint32_t m) {
+  return static_cast<unsigned>(__builtin_ctz(m));
+}
+
+static inline void lockstep_flush(LockstepLanes& l) {
+  for (unsigned i = 0; i < LOCKSTEP_LANES; ++i) {
+    l.retired[i] += l.pending[i];
+    l.pending[i] = 0;
+  }
+}
+
+// Lanes of `m` whose word at `pc` is `instr`
+static inline uint32_t lockstep_same_word(const LockstepLanes& l, uint32_t m, uint16_t pc, uint16_t instr) {
+  uint32_t same = 0;
+  for (uint32_t left = m; left; left &= left - 1) {
+    unsigned i = lockstep_first(left);
+    if (l.vm[i]->memory[pc] == instr) { same |= 1u << i; }
+  }
+  return same;
+}
+
+// A lane's registers, cond & PC (already the next one) into its Vm, for code
+// that looks at them there (a device read: KBSR's polling loop check, ...)
+static inline void lockstep_put(LockstepLanes& l, unsigned lane) {
+  Vm& vm = *l.vm[lane];
+  for (unsigned r = 0; r < 8; ++r) { vm.reg[r] = l.reg[r][lane]; }
+  vm.reg[R_PC] = l.pc[lane];
+  vm.cond_result = l.cond[lane];
+}
+
+// & back again
+static inline void lockstep_get(LockstepLanes& l, unsigned lane) {
+  Vm& vm = *l.vm[lane];
+  for (unsigned r = 0; r < 8; ++r) { l.reg[r][lane] = vm.reg[r]; }
+  l.pc[lane] = vm.reg[R_PC];
+  l.cond[lane] = vm.cond_result;
+}
+
+// mem_read/mem_write, with plain RAM (a page without attributes) inline
+// & the lane's registers in its Vm around the slow path
+static inline uint16_t lockstep_load(LockstepLanes& l, unsigned lane, uint16_t addr) {
+  Vm& vm = *l.vm[lane];
+  if (!(vm.page_attr[addr >> MEM_PAGE_SHIFT] & PAGE_ATTR_READ)) { return vm.memory[addr]; }
+  lockstep_put(l, lane);
+  uint16_t val = mem_read(vm, addr);
+  lockstep_get(l, lane);
+  return val;
+}
+
+// (the lane's predecoded cache is only brought up to date at the end,
+// see LockstepLanes::written)
+static inline void lockstep_store(LockstepLanes& l, unsigned lane, uint16_t addr, uint16_t val) {
+  Vm& vm = *l.vm[lane];
+  if (vm.page_attr[addr >> MEM_PAGE_SHIFT]) {
+    lockstep_put(l, lane);
+    mem_write(vm, addr, val);
+    lockstep_get(l, lane);
+  } else {
+    vm.memory[addr] = val;
+  }
+  unsigned chunk = addr >> LOCKSTEP_CHUNK_SHIFT;
+  l.written[lane][chunk >> 6] |= 1ull << (chunk & 63);
+  // this lane's chunk may not match the others any more
+  l.same_chunk[chunk] = 0;
+}
+
+static inline bool lockstep_written(const LockstepLanes& l, unsigned lane, uint16_t addr) {
+  unsigned chunk = addr >> LOCKSTEP_CHUNK_SHIFT;
+  return (l.written[lane][chunk >> 6] >> (chunk & 63)) & 1;
+}
+
+// LD/LDI/LDR/ST/STI/STR, one lane at a time through the lane's own memory
+// (the same mem_read/mem_write as the handlers, KBSR & watchpoints included)
+static inline void lockstep_memory(LockstepLanes& l, const DecodedInstr& d, uint16_t next, uint32_t m) {
+  uint16_t* dst = l.reg[d.dr];
+  const uint16_t* base = l.reg[d.sr1];
+  uint16_t addr = static_cast<uint16_t>(next + d.imm);
+  for (uint32_t left = m; left; left &= left - 1) {
+    unsigned i = lockstep_first(left);
+    Vm& vm = *l.vm[i];
+    uint16_t val;
+    switch (d.op) {
+      case OP_LD: val = lockstep_load(l, i, addr); dst[i] = l.cond[i] = val; break;
+      case OP_LDI: val = lockstep_load(l, i, lockstep_load(l, i, addr)); dst[i] = l.cond[i] = val; break;
+      case OP_LDR: val = lockstep_load(l, i, static_cast<uint16_t>(base[i] + d.imm)); dst[i] = l.cond[i] = val; break;
+      case OP_ST: lockstep_store(l, i, addr, dst[i]); break;
+      case OP_STI: lockstep_store(l, i, lockstep_load(l, i, addr), dst[i]); break;
+      default: lockstep_store(l, i, static_cast<uint16_t>(base[i] + d.imm), dst[i]); break;
+    }
+    // KBSR at the end of the input can stop it (EOF_HALT), after retiring,
+    // & a lane that turned interrupts on carries on alone (see run_lockstep)
+    if (!vm.running || vm.interrupts) { l.active &= ~(1u << i); }
+  }
+}
+
+// TRAP, RTI (& RES) on each lane's Vm, with its registers put back first
+// returns the lanes it retired on
+static inline uint32_t lockstep_trap(LockstepLanes& l, const DecodedInstr& d, uint32_t m) {
+  uint32_t retired = 0;
+  for (uint32_t left = m; left; left &= left - 1) {
+    unsigned i = lockstep_first(left);
+    Vm& vm = *l.vm[i];
+    lockstep_put(l, i);
+    if (d.op == OP_TRAP) {
+      trap(vm, d);
+      // a paused GETC/IN didn't retire, like on the engines
+      if (!vm.blocked) { retired |= 1u << i; }
+    } else if (d.op == OP_RTI) {
+      if (interrupt_return(vm)) { retired |= 1u << i; }
+    } else {
+      bad_opcode(vm, "Unused opcode");
+    }
+    lockstep_get(l, i);
+    if (!vm.running) { l.active &= ~(1u << i); }
+  }
+  return retired;
+}
+
+// Run until no lane is active, or a block ends at least `max_steps` steps in
+// returns the number of steps
+template <typename V>
+static uint64_t lockstep_run(LockstepLanes& l, uint64_t max_steps) {
+  uint64_t steps = 0;
+  uint32_t since_flush = 0;
+  // lanes of the next step & their PC, known without a search while
+  // every running lane stays together
+  uint32_t m = 0;
+  uint16_t pc = 0;
+  bool together = false;
+  while (l.active) {
+    if (!together) { pc = V::lowest(l.pc, l.active, m); }
+    // every lane in m gets the same word, decoded once for all of them
+    unsigned first = lockstep_first(m);
+    Vm& lead = *l.vm[first];
+    DecodedInstr d;
+    if (l.same_chunk[pc >> LOCKSTEP_CHUNK_SHIFT]) {
+      d = fetch_decoded(lead, pc);
+    } else {
+      // lanes with another word there run it in a later step
+      m = lockstep_same_word(l, m, pc, lead.memory[pc]);
+      // the leader's cache is out of date where it stored
+      d = lockstep_written(l, first, pc) ? decode(lead.memory[pc]) : fetch_decoded(lead, pc);
+    }
+    uint16_t next = static_cast<uint16_t>(pc + 1);
+    V::set(l.pc, next, m);
+
+    // this step's lanes are all the running ones: they stay together
+    // unless a BR splits them or they JMP/JSRR by register
+    together = m == l.active;
+    uint16_t to = next;
+    uint32_t retired = m;
+    bool block_end = false;
+    switch (d.op) {
+      case OP_ADD:
+      case OP_AND: {
+        LockstepAlu op = d.op == OP_ADD ? LOCKSTEP_ADD : LOCKSTEP_AND;
+        if (d.imm_mode) {
+          V::alu_imm(op, l.reg[d.dr], l.cond, l.reg[d.sr1], d.imm, m);
+        } else {
+          V::alu(op, l.reg[d.dr], l.cond, l.reg[d.sr1], l.reg[d.sr2], m);
+        }
+        break;
+      }
+      case OP_NOT: {
+        V::not_(l.reg[d.dr], l.cond, l.reg[d.sr1], m);
+        break;
+      }
+      case OP_LEA: {
+        uint16_t addr = static_cast<uint16_t>(next + d.imm);
+        V::set(l.reg[d.dr], addr, m);
+        V::set(l.cond, addr, m);
+        break;
+      }
+      case OP_BR: {
+        // N/Z/P of every lane at once, then the lanes whose flags match nzp
+        uint32_t neg = V::sign_bits(l.cond);
+        uint32_t zero = V::zero_bits(l.cond);
+        uint32_t taken = 0;
+        if (d.dr & FL_NEG) { taken |= neg; }
+        if (d.dr & FL_ZR0) { taken |= zero; }
+        if (d.dr & FL_POS) { taken |= ~(neg | zero); }
+        taken &= m;
+        uint16_t target = static_cast<uint16_t>(next + d.imm);
+        V::set(l.pc, target, taken);
+        if (taken == m) {
+          to = target;
+        } else if (taken) {
+          together = false;
+        }
+        block_end = true;
+        break;
+      }
+      case OP_JMP: {
+        V::copy(l.pc, l.reg[d.sr1], m);
+        together = false;
+        block_end = true;
+        break;
+      }
+      case OP_JSR: {
+        // the base register first, JSRR R7 jumps to the old R7
+        if (d.imm_mode) {
+          to = static_cast<uint16_t>(next + d.imm);
+          V::set(l.pc, to, m);
+        } else {
+          V::copy(l.pc, l.reg[d.sr1], m);
+          together = false;
+        }
+        V::set(l.reg[R_R7], next, m);
+        block_end = true;
+        break;
+      }
+      case OP_LD:
+      case OP_LDI:
+      case OP_LDR:
+      case OP_ST:
+      case OP_STI:
+      case OP_STR: {
+        lockstep_memory(l, d, next, m);
+        break;
+      }
+      case OP_TRAP: {
+        // (a lane's PC only changes if it paused, which stops it)
+        retired = lockstep_trap(l, d, m);
+        block_end = true;
+        break;
+      }
+      case OP_RTI: {
+        // back to where each lane's interrupt came in
+        retired = lockstep_trap(l, d, m);
+        together = false;
+        block_end = true;
+        break;
+      }
+      default: {
+        // RES stops the lanes, nothing retires
+        lockstep_trap(l, d, m);
+        retired = 0;
+        break;
+      }
+    }
+    if (together) {
+      // less any lane that stopped
+      m &= l.active;
+      pc = to;
+    }
+
+    V::count(l.pending, retired);
+    if (++since_flush == LOCKSTEP_FLUSH) {
+      lockstep_flush(l);
+      since_flush = 0;
+    }
+    ++steps;
+    if (block_end && steps >= max_steps) { break; }
+  }
+  lockstep_flush(l);
+  return steps;
+}
+
+#endif // !LOCKSTEP_CORE_H
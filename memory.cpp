@@ -1,7 +1,18 @@
 #include "memory.h"
+#include "console.h"
+#include "debug.h"
+#include "device.h"
+#include "idle.h"
+#include "input.h"
+#include "interrupt.h"
+#include "decode.h"
+#include "jit.h"
+#include "profile.h"
+#include "replay.h"
+#include "vm.h"
 #include <cstddef>
 #include <cstdio>
-#include <sys/select.h>
+#include <cstring>
 #include <stdio.h>
 #include <stdint.h>
 // #include <signal.h>
@@ -12,45 +23,218 @@
 #include <sys/types.h>
 #include <sys/termios.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <vector>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 
-uint16_t memory[MEMORY_MAX];
+// Zeroed machine around `input` & `console`, which it takes ownership of
+// (freed here if anything fails, or either of them is nullptr)
+static Vm* vm_alloc(Input* input, Console* console) {
+  // Anonymous mapping: zeroed & page aligned, so a snapshot's memory
+  // can later be mapped straight over vm.memory (see snapshot.h)
+  void* p = mmap(nullptr, sizeof(Vm), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  Vm* vm = p == MAP_FAILED ? nullptr : static_cast<Vm*>(p);
+  // zeroed predecoded cache (see decode.h), its own mapping too so a
+  // shared base can map its decoded table over it (see base_image.h)
+  if (vm) {
+    void* d = mmap(nullptr, MEMORY_MAX * sizeof(DecodedInstr), PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    vm->decoded = d == MAP_FAILED ? nullptr : static_cast<DecodedInstr*>(d);
+  }
+  if (!vm || !vm->decoded || !input || !console) {
+    input_destroy(input);
+    console_destroy(console);
+    if (vm) {
+      if (vm->decoded) { munmap(vm->decoded, MEMORY_MAX * sizeof(DecodedInstr)); }
+      munmap(vm, sizeof(Vm));
+    }
+    return nullptr;
+  }
+  vm->running = 1;
+  bus_attach(*vm);
+  mem_clear_dirty(*vm);
+  interrupt_reset(*vm);
+  vm->idle_wait_ms = IDLE_WAIT_MS_DEFAULT;
+  vm->input = input;
+  vm->console = console;
+  return vm;
+}
 
-uint16_t reg[Register::R_COUNT];
+Vm* vm_create(FILE* in, FILE* out) {
+  Vm* vm = vm_alloc(input_create(in ? fileno(in) : -1), console_create(fileno(out)));
+  if (vm) {
+    vm->in = in;
+    vm->out = out;
+  }
+  return vm;
+}
+
+Vm* vm_create_session() {
+  Vm* vm = vm_alloc(input_create_queue(), console_create_capture());
+  if (vm) {
+    vm->eof_policy = EOF_HALT;
+  }
+  return vm;
+}
+
+Vm* vm_create_headless(const char* input, size_t size) {
+  Vm* vm = vm_alloc(input_create_buffer(input, size), console_create_capture());
+  if (vm) {
+    vm->eof_policy = EOF_HALT;
+  }
+  return vm;
+}
 
-uint16_t swap16(uint16_t);
-int read_image(const char* image_path);
+void vm_destroy(Vm* vm) {
+  if (!vm) { return; }
+  jit_destroy(*vm);
+  profile_destroy(*vm);
+  replay_destroy(*vm);
+  debug_detach(*vm);
+  console_destroy(vm->console);
+  input_destroy(vm->input);
+  munmap(vm->decoded, MEMORY_MAX * sizeof(DecodedInstr));
+  munmap(vm, sizeof(Vm));
+}
 
 // Memory getter/setter
 
-void mem_write(uint16_t address, uint16_t val) {
-  memory[address] = val;
+// First write to a clean page since mem_clear_dirty
+static void mark_dirty(Vm& vm, size_t page) {
+  vm.dirty[page >> 6] |= 1ull << (page & 63);
+  vm.page_attr[page] = static_cast<uint8_t>(vm.page_attr[page] & ~PAGE_ATTR_CLEAN);
+}
+
+void mem_clear_dirty(Vm& vm) {
+  for (uint8_t& attr : vm.page_attr) {
+    attr |= PAGE_ATTR_CLEAN;
+  }
+  memset(vm.dirty, 0, sizeof(vm.dirty));
+  jit_note_clean(vm);
 }
 
-uint16_t check_key();
+void mem_mark_dirty(Vm& vm, uint16_t address, size_t count) {
+  if (count == 0) { return; }
+  size_t last = (address + count - 1) >> MEM_PAGE_SHIFT;
+  for (size_t page = address >> MEM_PAGE_SHIFT; page <= last && page < MEM_PAGES; ++page) {
+    mark_dirty(vm, page);
+  }
+}
+
+bool mem_page_dirty(const Vm& vm, size_t page) {
+  return (vm.dirty[page >> 6] >> (page & 63)) & 1;
+}
+
+size_t mem_dirty_pages(const Vm& vm, uint8_t* pages) {
+  size_t n = 0;
+  for (size_t w = 0; w < MEM_PAGES / 64; ++w) {
+    for (uint64_t bits = vm.dirty[w]; bits; bits &= bits - 1) {
+      pages[n++] = static_cast<uint8_t>(w * 64 + static_cast<size_t>(__builtin_ctzll(bits)));
+    }
+  }
+  return n;
+}
 
-uint16_t mem_read(uint16_t address) {
-  if (address == MemMapRegister::MMR_KBSR) {
-    if (check_key()) {
-      memory[MMR_KBSR] = (1 << 15);
-      memory[MMR_KBDR] = getchar();
-    } else {
-      memory[MMR_KBSR] = 0;
+void mem_write(Vm& vm, uint16_t address, uint16_t val) {
+  vm.memory[address] = val;
+  // the old predecoded instruction is stale now (self-modifying code)
+  invalidate_decoded(vm, address);
+  // nothing else to do unless the page is clean, I/O, translated by the JIT
+  // or a debugger watches it
+  size_t page = address >> MEM_PAGE_SHIFT;
+  if (vm.page_attr[page]) {
+    if (vm.page_attr[page] & PAGE_ATTR_CLEAN) {
+      mark_dirty(vm, page);
+    }
+    if (vm.page_attr[page] & PAGE_ATTR_CODE) {
+      // the translated code is stale now too
+      jit_invalidate(vm, address, 1);
     }
+    if (vm.page_attr[page] & PAGE_ATTR_IO) {
+      // a device register, the device reacts (see device.h)
+      bus_write(vm, address);
+    }
+    if (vm.page_attr[page] & PAGE_ATTR_WATCH) {
+      debug_watch_hit(vm, address, DEBUG_WATCH_WRITE);
+    }
+  }
+}
+
+// I/O or watched page
+static uint16_t mem_read_slow(Vm& vm, uint16_t address) {
+  uint16_t val = vm.memory[address];
+  if (vm.page_attr[address >> MEM_PAGE_SHIFT] & PAGE_ATTR_IO) {
+    // a device register, what the guest sees is up to the device (see device.h)
+    val = bus_read(vm, address);
+  }
+  if (vm.page_attr[address >> MEM_PAGE_SHIFT] & PAGE_ATTR_WATCH) {
+    debug_watch_hit(vm, address, DEBUG_WATCH_READ);
+  }
+  return val;
+}
+
+uint16_t mem_read(Vm& vm, uint16_t address) {
+  // plain memory unless the page has attributes (device pages do)
+  if (vm.page_attr[address >> MEM_PAGE_SHIFT] & PAGE_ATTR_READ) {
+    return mem_read_slow(vm, address);
+  }
+  return vm.memory[address];
+}
+
+int read_key(Vm& vm) {
+  if (vm.replay && vm.replay->playing) {
+    return replay_next(vm, true);
   }
-  return memory[address];
+  int key = input_getc(vm.input);
+  if (vm.replay) { replay_note(vm, key); }
+  return key;
 }
 
-// Accesses keyboard?
-uint16_t check_key() {
-  fd_set readfds;
-  FD_ZERO(&readfds);
-  FD_SET(STDIN_FILENO, &readfds);
+int eof_policy_from_name(const char* name, EofPolicy& policy) {
+  if (strcmp(name, "continue") == 0) {
+    policy = EOF_CONTINUE;
+    return 1;
+  }
+  if (strcmp(name, "halt") == 0) {
+    policy = EOF_HALT;
+    return 1;
+  }
+  if (strcmp(name, "error") == 0) {
+    policy = EOF_ERROR;
+    return 1;
+  }
+  return 0;
+}
+
+bool pause_for_input(Vm& vm) {
+  // (a replay never waits, its keys are all there already)
+  if (!vm.yield_on_input || (vm.replay && vm.replay->playing)
+      || input_ready(vm.input) || input_eof(vm.input)) {
+    return false;
+  }
+  // back onto the TRAP, it runs again once execute() resumes
+  --vm.reg[R_PC];
+  vm.blocked = 1;
+  vm.running = 0;
+  return true;
+}
 
-  struct timeval timeout;
-  timeout.tv_sec = 0;
-  timeout.tv_usec = 0;
-  return select(1, &readfds, NULL, NULL, &timeout) != 0;
+bool end_of_input(Vm& vm) {
+  switch (vm.eof_policy) {
+    case EOF_HALT:
+      vm.running = 0;
+      return true;
+    case EOF_ERROR:
+      vm.error = "End of input";
+      vm.running = 0;
+      return true;
+    case EOF_CONTINUE:
+    default:
+      return false;
+  }
 }
 
 struct termios original_tio;
@@ -69,41 +253,6 @@ void restore_input_buffering() {
 
 
 
-// The first 16 bits of the program bin file specify the address
-// in memory where the program should start (The "Origin")
-//
-// This is read first, after which the rest of the data
-// can be read from the file into memory starting at the origin addr
-void read_image_file(FILE* file, uint16_t& pc) {
-  // 16bit origin tells us where in memory to place the image
-  uint16_t origin;
-  // read the first 16bits of file into origin
-  fread(&origin, sizeof(origin), 1, file);
-  // swap from little-endian to big-endian
-  origin = swap16(origin);
-  pc = origin;
-
-  // We know max file size so we only need 1 fread
-  // the size between origin & end of memory
-  uint16_t max_read = MEMORY_MAX - origin;
-
-  // Pointer to origin offset in memory,
-  // which is where we place the image file
-  uint16_t* p = memory + origin;
-  
-  // writes `max_read` objects, each being 16bits,
-  // and the first is written at `p` which is the origin
-  // location in memory
-  // returns the # of objects read successfully
-  size_t read = fread(p, sizeof(uint16_t), max_read, file);
-
-  // endian swap each value that was read
-  while (read-- > 0) {
-    *p = swap16(*p);
-    ++p;
-  }
-}
-
 // LC3 programs are big-endian, but most modern computers are little-endian
 // so we need to swap each uint16 that's loaded
 // little endian  : 1st byte is least significant 
@@ -115,18 +264,131 @@ uint16_t swap16(uint16_t x) {
   // (x >> 8) :   0000-0000   1100-1100
   // x<<8|x>>8:   0011-0011   1100-1100
   // It just swaps 1st byte & 2nd byte
-  return (x << 8) | (x >> 8);
+  return static_cast<uint16_t>((x << 8) | (x >> 8));
+}
+
+// One word at a time, for the tail & for non-x86 hosts
+static void swap16_copy_scalar(uint16_t* dst, const uint8_t* src, size_t count) {
+  for (size_t i = 0; i < count; ++i) {
+    dst[i] = static_cast<uint16_t>((src[2 * i] << 8) | src[2 * i + 1]);
+  }
+}
+
+#if defined(__x86_64__)
+// The same shift/or as swap16, on 8 (SSE2) or 16 (AVX2) words at once
+// SSE2 is always there on x86-64, AVX2 is checked for at runtime
+static void swap16_copy_sse2(uint16_t* dst, const uint8_t* src, size_t count) {
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 2 * i));
+    v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), v);
+  }
+  swap16_copy_scalar(dst + i, src + 2 * i, count - i);
+}
+
+__attribute__((target("avx2")))
+static void swap16_copy_avx2(uint16_t* dst, const uint8_t* src, size_t count) {
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + 2 * i));
+    v = _mm256_or_si256(_mm256_slli_epi16(v, 8), _mm256_srli_epi16(v, 8));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), v);
+  }
+  swap16_copy_sse2(dst + i, src + 2 * i, count - i);
+}
+#endif
+
+void swap16_copy(uint16_t* dst, const uint8_t* src, size_t count) {
+#if defined(__x86_64__)
+  static const bool has_avx2 = __builtin_cpu_supports("avx2");
+  if (has_avx2) {
+    swap16_copy_avx2(dst, src, count);
+  } else {
+    swap16_copy_sse2(dst, src, count);
+  }
+#else
+  swap16_copy_scalar(dst, src, count);
+#endif
+}
+
+// An image file mapped read-only, checked but not yet copied into memory
+struct MappedImage {
+  const uint8_t* data;
+  size_t size;
+  uint16_t origin;
+  size_t words;
+};
+
+// The first 16 bits of the program bin file specify the address
+// in memory where the program should start (The "Origin")
+// the rest of the file is the data placed in memory starting at the origin
+//
+// returns 0 if the file can't be opened/mapped, is too short to hold
+// an origin, or doesn't fit between its origin & the end of memory
+static int map_image(const char* image_path, MappedImage& image) {
+  int fd = open(image_path, O_RDONLY);
+  if (fd < 0) { return 0; }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < 2) {
+    close(fd);
+    return 0;
+  }
+  image.size = static_cast<size_t>(st.st_size);
+  void* p = mmap(nullptr, image.size, PROT_READ, MAP_PRIVATE, fd, 0);
+  // the mapping keeps its own reference to the file
+  close(fd);
+  if (p == MAP_FAILED) { return 0; }
+  image.data = static_cast<const uint8_t*>(p);
+
+  // 16bit big-endian origin tells us where in memory to place the image
+  image.origin = static_cast<uint16_t>((image.data[0] << 8) | image.data[1]);
+  // a trailing odd byte isn't a whole word & is ignored
+  image.words = (image.size - 2) / 2;
+  if (image.words > static_cast<size_t>(MEMORY_MAX - image.origin)) {
+    munmap(p, image.size);
+    return 0;
+  }
+  return 1;
 }
 
-// helper to call read_image_file
-int read_image(const char* image_path, uint16_t& pc) {
-  FILE* file = fopen(image_path, "rb");
-  if (!file) { return 0; };
-  read_image_file(file, pc);
-  fclose(file);
+int load_images(uint16_t* memory, Vm* vm, const char* const* image_paths, size_t count,
+  uint16_t& pc, size_t* failed) {
+  std::vector<MappedImage> images(count);
+
+  // check every image before touching memory, so a bad one loads nothing
+  for (size_t i = 0; i < count; ++i) {
+    if (!map_image(image_paths[i], images[i])) {
+      if (failed) { *failed = i; }
+      for (size_t j = 0; j < i; ++j) {
+        munmap(const_cast<uint8_t*>(images[j].data), images[j].size);
+      }
+      return 0;
+    }
+  }
+
+  for (const MappedImage& image : images) {
+    // byte-swap straight from the mapping into memory at the origin
+    swap16_copy(memory + image.origin, image.data + 2, image.words);
+    // anything already decoded in that range is stale, & it was written
+    if (vm) {
+      invalidate_decoded_range(*vm, image.origin, image.words);
+      mem_mark_dirty(*vm, image.origin, image.words);
+    }
+    pc = image.origin;
+    munmap(const_cast<uint8_t*>(image.data), image.size);
+  }
   return 1;
 }
 
+int read_images(Vm& vm, const char* const* image_paths, size_t count, uint16_t& pc, size_t* failed) {
+  return load_images(vm.memory, &vm, image_paths, count, pc, failed);
+}
+
+int read_image(Vm& vm, const char* image_path, uint16_t& pc) {
+  return read_images(vm, &image_path, 1, pc);
+}
+
 
 
 
@@ -1,5 +1,6 @@
 #ifndef MEMORY_H
 #define MEMORY_H
+#include <cstddef>
 #include <cstdint>
 
 // ============================
@@ -9,12 +10,12 @@
 #define MEMORY_MAX (1 << 16)
 
 // 65_536 memory locations, each location can store a 16bit value (128KB total)
-extern uint16_t memory[MEMORY_MAX];
+// (the memory array itself lives in each Vm, see vm.h)
 
 // ============================
 // ========= Registers ========
 // ============================
-// 10 registers, 16bits each
+// 13 registers, 16bits each
 enum Register {
   // 8 general purpose registers
   // used to perform calculations
@@ -26,14 +27,20 @@ enum Register {
   // Condition flags register
   // gives information about the previous calculation
   R_COND,
-  // used as number of Registers since Register::R_COUNT = 10
+  // Processor status register, privilege & priority (see interrupt.h)
+  R_PSR,
+  // R6 of the mode that isn't running, swapped in by interrupts & RTI
+  R_SAVED_SSP,
+  R_SAVED_USP,
+  // used as number of Registers since Register::R_COUNT = 13
   R_COUNT
 };
 
-// Register storage, length 10
+// Register storage, length 13, is Vm::reg
 // each idx can be accessed via reg[Register::R_R2] etc since enum gives int
 // this is a cool way to name each index in reg
-extern uint16_t reg[Register::R_COUNT];
+
+struct Vm;
 
 
 // Memory Mapped Registers: Registers not accessible from normal register table
@@ -48,6 +55,36 @@ enum MemMapRegister {
   MMR_KBDR = 0xFE02,
 };
 
+// KBSR bits
+// - ready : a key is in KBDR
+// - IE    : the keyboard may interrupt (see interrupt.h), kept by KBSR reads
+#define KBSR_READY (1 << 15)
+#define KBSR_IE (1 << 14)
+
+// Pages of 256 words (x3000-x30FF, ...), 256 of them
+// Each has attribute bits in Vm::page_attr, most pages have none
+// - mem_read/mem_write only take a slow path on a page with a bit set
+//   (that they care about), plain memory costs one table lookup
+#define MEM_PAGE_SHIFT 8
+#define MEM_PAGES (MEMORY_MAX >> MEM_PAGE_SHIFT)
+
+enum PageAttr {
+  // memory mapped device registers live here (xFE00-xFEFF, xFF00-xFFFF,
+  // see device.h)
+  PAGE_ATTR_IO = 1 << 0,
+  // some address on the page has a debugger watchpoint (see debug.h)
+  PAGE_ATTR_WATCH = 1 << 1,
+  // not written since mem_clear_dirty, the first write marks the page
+  // in Vm::dirty & clears this (see Dirty pages below)
+  PAGE_ATTR_CLEAN = 1 << 2,
+  // the JIT has translations of code on the page, a write throws the ones
+  // covering it away (see jit.h)
+  PAGE_ATTR_CODE = 1 << 3,
+
+  // the bits a read has to look at, CLEAN only matters to writes
+  PAGE_ATTR_READ = PAGE_ATTR_IO | PAGE_ATTR_WATCH,
+};
+
 // Now that there are memorymapped registers, the way I access memory has to change
 // I can't read/write directly to memory, because I could
 // inadvertently modify the MemMapRegisters
@@ -55,19 +92,67 @@ enum MemMapRegister {
 //
 // When memory is read from Keyboard Status Reg MMR_KBSR,
 // the getter will check the keyboard & update both keyboard registers
+// (the keyboard is one of the devices on the bus now, see device.h)
 
 // Updates memory[address] with val
-void mem_write(uint16_t address, uint16_t val);
+// (a write watchpoint there stops the VM after this instruction, see debug.h)
+// A device register's device sees the write (ex. writing KBSR turns
+// keyboard interrupts on/off, DDR prints, see device.h)
+void mem_write(Vm& vm, uint16_t address, uint16_t val);
 
 // -If address is keyboard status register MMR_KBSR:
-// -- If a key has been pressed:
-//   --- Set MMR_KBSR to 1 << 15 (toggle to "true")
+// -- If a key has been pressed (a byte is queued in vm.input):
+//   --- Set MMR_KBSR to 1 << 15 (toggle to "true"), KBSR_IE stays as it was
 //   --- Set MMR_KBDR to the key pressed (Keyboard Data Register)
 // -- No key was pressed:
 //   --- Set MMR_KBSR to 0 (toggle to "false")
+//   --- At end of input, vm.eof_policy may stop the VM (see vm.h)
+// -If it's another device register: whatever that device says (see device.h)
 // -If any other address:
 // -- Just return `memory[address]`
-uint16_t mem_read(uint16_t address);
+// A read watchpoint stops the VM after this instruction (see debug.h)
+uint16_t mem_read(Vm& vm, uint16_t address);
+
+// ============================
+// ======= Dirty Pages ========
+// ============================
+// Every page written since the last mem_clear_dirty has its bit in Vm::dirty,
+// so a checkpoint, a migration or a fuzzing reset only has to look at those
+// (see snapshot_diff in snapshot.h, fuzz.h)
+// - mem_clear_dirty gives every page PAGE_ATTR_CLEAN, the first mem_write
+//   to one takes the slow path once, marks it & clears the bit, after that
+//   the page is plain memory again
+// - device register updates, the JIT's inline stores & lc3aot's go the same way
+// - whatever writes memory directly (loaders, snapshots, base images)
+//   marks what it wrote with mem_mark_dirty
+// A new Vm starts out all clean (all zero is the baseline)
+
+// Every page clean, Vm::dirty emptied (ex. right after a checkpoint)
+void mem_clear_dirty(Vm& vm);
+
+// Marks the pages holding memory[address .. address + count) dirty
+void mem_mark_dirty(Vm& vm, uint16_t address, size_t count);
+
+// Is page `page` (address >> MEM_PAGE_SHIFT) dirty?
+bool mem_page_dirty(const Vm& vm, size_t page);
+
+// The dirty pages in order, into pages[0..MEM_PAGES)
+// returns how many there are
+size_t mem_dirty_pages(const Vm& vm, uint8_t* pages);
+
+// GETC/IN's key, waiting for one if needed: from vm.input, or the
+// recording being replayed (see replay.h)
+// returns -1 at end of input
+int read_key(Vm& vm);
+
+// GETC/IN found nothing to read under execute() (vm.yield_on_input)
+// returns true if the VM was paused instead, the TRAP isn't done & runs again
+// (called after the TRAP set R7, PC still points past it)
+bool pause_for_input(Vm& vm);
+
+// A read found nothing left, apply vm.eof_policy
+// returns true if that stopped the VM
+bool end_of_input(Vm& vm);
 
 
 void disable_input_buffering();
@@ -75,6 +160,31 @@ void disable_input_buffering();
 void restore_input_buffering();
 
 
-int read_image(const char* image_path, uint16_t& pc);
+// Image files are mmap'd & byte-swapped straight into vm.memory
+// (16 words at a time with AVX2, 8 with SSE2, scalar elsewhere)
+
+// Loads an image file into vm.memory at its origin, `pc` is set to the origin
+// returns 0 if the file couldn't be opened, has no origin, or
+// runs past the end of memory
+int read_image(Vm& vm, const char* image_path, uint16_t& pc);
+
+// Loads `count` images in order (later ones overwrite earlier ones where they
+// overlap), `pc` is set to the last one's origin
+// Every image is checked first, if any is bad nothing is loaded, it returns 0
+// & `*failed` (when given) is the index of the bad one
+int read_images(Vm& vm, const char* const* image_paths, size_t count, uint16_t& pc,
+  size_t* failed = nullptr);
+
+// read_images into any MEMORY_MAX words, `vm` (if given) is the machine
+// owning them, whose predecoded instructions get invalidated & whose
+// pages get marked dirty
+int load_images(uint16_t* memory, Vm* vm, const char* const* image_paths, size_t count,
+  uint16_t& pc, size_t* failed = nullptr);
+
+// Swaps the 2 bytes of a word (big-endian <-> little-endian)
+uint16_t swap16(uint16_t x);
+
+// dst[i] = big-endian word i of src, for `count` words
+void swap16_copy(uint16_t* dst, const uint8_t* src, size_t count);
 
 #endif // !MEMORY_H
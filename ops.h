@@ -1,6 +1,9 @@
 #ifndef OPS_H
 #define OPS_H
 #include <cstdint>
+#include "decode.h"
+#include "memory.h"
+#include "vm.h"
 
 // ============================
 // ==== Instruction Set =======
@@ -25,7 +28,7 @@ enum Instruction {
   OP_AND,    /* bitwise and */
   OP_LDR,    /* load register */
   OP_STR,    /* store register */
-  OP_RTI,    /* unused */
+  OP_RTI,    /* return from interrupt (see interrupt.h) */
   OP_NOT,    /* bitwise not */
   OP_LDI,    /* load indirect */
   OP_STI,    /* store indirect */
@@ -35,6 +38,75 @@ enum Instruction {
   OP_TRAP    /* execute trap */
 };
 
+// ============================
+// ==== Condition Flags =======
+// ============================
+// provide info about most recently executed calculation
+// can be used to check things like `if (x > 0)`
+//
+// LC-3 will only have 3 condition flags,
+// indicating if prev. calc. was Positive, Negative, or Zero
+enum ConditionFlag {
+  FL_POS = 1 << 0, // Positive 001
+  FL_ZR0 = 1 << 1, // Zero     010
+  FL_NEG = 1 << 2, // Negative 100
+};
+
+// Condition flags are evaluated lazily
+// - Most flag results are overwritten by the next ALU/load instruction
+//   before any BR looks at them, so computing N/Z/P every time is wasted work
+// - Instead `Vm::cond_result` just remembers the last value written to a register
+//   by ADD/AND/NOT/LD/LDI/LDR/LEA (or GETC/IN)
+// - N/Z/P is only worked out when something reads it: BR, a TRAP,
+//   or the state being inspected (tracing, engine exit)
+//
+// While an engine runs, `cond_result` is the truth & reg[R_COND] may be stale
+// - Engines call load_cond() on entry & materialize_cond() on exit,
+//   so outside of them reg[R_COND] is always valid
+
+// - Call with the register that was updated
+// Any time a value is written to a register, the R_COND condition flags
+// have to indicate it's sign
+// This is to be called AFTER the Instruction is executed whenever a reg is changed
+inline void update_cond_flags(Vm& vm, uint16_t write_reg) {
+  vm.cond_result = vm.reg[write_reg];
+}
+
+// N/Z/P for the last result
+// zero -> FL_ZR0, bit 15 set -> 1 << 2 (FL_NEG), otherwise 1 << 0 (FL_POS)
+inline uint16_t cond_flags(const Vm& vm) {
+  return static_cast<uint16_t>(vm.cond_result == 0 ? FL_ZR0 : 1 << ((vm.cond_result >> 15) << 1));
+}
+
+// reg[R_COND] = the current flags, so it can be inspected
+inline void materialize_cond(Vm& vm) {
+  vm.reg[R_COND] = cond_flags(vm);
+}
+
+// cond_result = a value with the same flags as reg[R_COND]
+// (after R_COND was set directly, ex. at startup)
+void load_cond(Vm& vm);
+
+// Edge coverage, only while fuzzing (Vm::coverage, see fuzz.h)
+// BR/JMP/JSR count the edge from their own address to where PC ends up,
+// a taken & a not taken branch are different edges
+// - the pair is hashed into the COVERAGE_MAP_SIZE counters
+//   (multiplicative hash, top 16 bits)
+// - counters stop at 255 instead of wrapping back to "never hit"
+inline void cover_edge(Vm& vm, uint16_t from, uint16_t to) {
+  uint32_t edge = (static_cast<uint32_t>(from) << 16 | to) * 0x9E3779B1u;
+  uint8_t& hits = vm.coverage[edge >> 16];
+  hits = static_cast<uint8_t>(hits + (hits != 0xFF));
+}
+
+// Handlers take the VM they run on & the predecoded instruction (see decode.h),
+// the bit layouts below are what `decode` pulls the fields out of
+//
+// They're templates on where the fields come from (inline, in the header)
+// - DecodedInstr : the predecoded cache, fields read at run time
+// - FixedInstr<Hi> : one handler per top 10 bits of the word, DR/SR1/nzp are
+//   compile time constants (ENGINE_SPECIALIZED, see engine.h)
+
 // - Pads `x` with 16 - `bit_count` bits with with 0's (positive) or 1's (negative)
 // - So if x is 5 bits, use `bit_count = 5`
 uint16_t sign_extend(uint16_t x, int bit_count);
@@ -59,7 +131,18 @@ uint16_t sign_extend(uint16_t x, int bit_count);
 // If Immediate mode, 
 // - Must sign-extend the 5bit value to 16bits (to match SR1) before adding
 // --- Fills in 0's for positive nums, 1's for negative nums
-void add(uint16_t instr);
+template <typename Instr>
+inline void add(Vm& vm, const Instr& d) {
+  if (d.imm_mode) {
+    // immediate mode, imm5 was already sign-extended by decode
+    // store reg[sr1] + imm5 in DR
+    vm.reg[d.dr] = vm.reg[d.sr1] + d.imm;
+  } else {
+    // register mode
+    // store reg[sr1] + reg[sr2] in DR
+    vm.reg[d.dr] = vm.reg[d.sr1] + vm.reg[d.sr2];
+  }
+}
 
 // Load a value from a location in memory into a register
 // 1010       : 4bits, indicates LDI instruction
@@ -70,7 +153,18 @@ void add(uint16_t instr);
 // sign extend these 9 bits to 16,
 // add that value to the incremented Program Counter (R_PC) register
 // What is stored in memory at this address is the addr of the data to load into DR
-void load_indirect(uint16_t instr);
+template <typename Instr>
+inline void load_indirect(Vm& vm, const Instr& d) {
+  // (main loop increments the program counter before executing instruction)
+  // add PCoffset9 to program counter & go to that address in memory
+  // uint16_t addr = memory[pc_offset9 + reg[R_PC]];
+  uint16_t addr = mem_read(vm, d.imm + vm.reg[R_PC]);
+  // uint16_t value = memory[addr];
+  uint16_t value = mem_read(vm, addr);
+
+  // store that value into DR
+  vm.reg[d.dr] = value;
+}
 
 // bitwise logical AND
 // 0101     : 4bit instruction
@@ -82,7 +176,17 @@ void load_indirect(uint16_t instr);
 // 000      : 3bit register of 2nd operand
 // -- Immediate mode
 // 00000    : 5bit value of 2nd operand
-void bitwise_and(uint16_t instr);
+template <typename Instr>
+inline void bitwise_and(Vm& vm, const Instr& d) {
+  uint16_t val1 = vm.reg[d.sr1];
+  if (d.imm_mode) {
+    // 5 bits immediate value, already sign extended
+    vm.reg[d.dr] = val1 & d.imm;
+  } else {
+    uint16_t val2 = vm.reg[d.sr2];
+    vm.reg[d.dr] = val1 & val2;
+  }
+}
 
 // Conditional branch
 // 0000     : 4bit instruction
@@ -90,7 +194,17 @@ void bitwise_and(uint16_t instr);
 // 0        : 1bit Z condition
 // 0        : 1bit P condition
 // 000000000: 9bit PCoffset9
-void branch(uint16_t instr);
+template <typename Instr>
+inline void branch(Vm& vm, const Instr& d) {
+  // nzp is stored where DR usually is
+  // if any of the cond codes (nzp) are set in current R_COND
+  // (the only place the lazy flags are ever evaluated on the hot path)
+  uint16_t next = vm.reg[R_PC];
+  if (d.dr & cond_flags(vm)) {
+    vm.reg[R_PC] += d.imm;
+  }
+  if (vm.coverage) { cover_edge(vm, static_cast<uint16_t>(next - 1), vm.reg[R_PC]); }
+}
 
 // 1100     : 4bit instruction
 // 000      : 3bit unused
@@ -104,7 +218,14 @@ void branch(uint16_t instr);
 // RET, special case of JMP instruction
 // Load PC with contents of REG7, which is link
 // back to the instr. following the subroutine call instr.
-void jump(uint16_t instr);
+template <typename Instr>
+inline void jump(Vm& vm, const Instr& d) {
+  // base register or 111 RET
+  // since RET = 111 which is REG7 register anyway, no difference
+  uint16_t next = vm.reg[R_PC];
+  vm.reg[R_PC] = vm.reg[d.sr1];
+  if (vm.coverage) { cover_edge(vm, static_cast<uint16_t>(next - 1), vm.reg[R_PC]); }
+}
 
 // 0100      : 4bit instr
 // 0         : 1bit mode
@@ -119,71 +240,133 @@ void jump(uint16_t instr);
 // 1. Incremented PC saved in reg7
 // 2. PC loaded with addr: base_reg or PCoffset11
 // If PCoffset11, addr is sign extended PCoffset11 + PC
-void jump_subr(uint16_t instr);
+template <typename Instr>
+inline void jump_subr(Vm& vm, const Instr& d) {
+  // read the base register first, JSRR R7 jumps to the old R7
+  uint16_t base = vm.reg[d.sr1];
+  // save (pre-incremented) PC in R7
+  vm.reg[R_R7] = vm.reg[R_PC];
+
+  if (d.imm_mode) {
+    // load PC with pcoffset11 + incremented PC
+    vm.reg[R_PC] += d.imm;
+  } else {
+    // load PC with value in base_reg
+    vm.reg[R_PC] = base;
+  }
+  if (vm.coverage) { cover_edge(vm, static_cast<uint16_t>(vm.reg[R_R7] - 1), vm.reg[R_PC]); }
+}
 
 // 4bit instr
 // 3bit DR
 // 9bit PCoffset9
-void load(uint16_t instr);
+template <typename Instr>
+inline void load(Vm& vm, const Instr& d) {
+  // store val in mem at offset + pc in dr
+  // reg[dr] = memory[pcoffset9 + reg[R_PC]];
+  vm.reg[d.dr] = mem_read(vm, d.imm + vm.reg[R_PC]);
+}
 
 // 0110   4bit instr
 // 000    3bit DR
 // 000    3bit BaseR
 // ...    6bit offset6
-void load_base_offset(uint16_t instr);
+template <typename Instr>
+inline void load_base_offset(Vm& vm, const Instr& d) {
+  uint16_t addr = vm.reg[d.sr1] + d.imm;
+
+  // store val in mem @ addr in dr
+  // reg[dr] = memory[addr];
+  vm.reg[d.dr] = mem_read(vm, addr);
+}
 
 // 1110   4bit instr
 // 000    3bit DR
 // ...    9bit PCoffset
-void load_effective_addr(uint16_t instr);
+template <typename Instr>
+inline void load_effective_addr(Vm& vm, const Instr& d) {
+  // stores addr in dr
+  vm.reg[d.dr] = vm.reg[R_PC] + d.imm;
+}
 
 // 1001   4bit instr
 // 000    3bit DR
 // 000    3bit SR
 // ...    6bit ignored?
-void bitwise_complement(uint16_t instr);
+template <typename Instr>
+inline void bitwise_complement(Vm& vm, const Instr& d) {
+  // store bitwise complement of content in SR into DR
+  vm.reg[d.dr] = ~vm.reg[d.sr1];
+}
 
 // 0011   4bit instr
 // 000    3bit SR
 // ...    9bit PCoffset
-void store(uint16_t instr);
+template <typename Instr>
+inline void store(Vm& vm, const Instr& d) {
+  // contensdt of SR reg are stored in memory location
+  // @ PCoffset9 sign extended + PC
+  uint16_t addr = vm.reg[R_PC] + d.imm;
+  // memory[addr] = reg[sr];
+  mem_write(vm, addr, vm.reg[d.dr]);
+}
 
 // 1011   4bit instr
 // 000    3bit SR
 // ...    9bit PCoffset
-void store_indirect(uint16_t instr);
+template <typename Instr>
+inline void store_indirect(Vm& vm, const Instr& d) {
+  uint16_t addr = vm.reg[R_PC] + d.imm;
+  // content of sr are stored in addr stored at  memory[addr]
+  // memory[memory[addr]] = reg[sr];
+  mem_write(vm, mem_read(vm, addr), vm.reg[d.dr]);
+}
 
 // 0111   4bit instr
 // 000    3bit SR
 // 000    3bit BR
 // ...    6bit offset
-void store_base_offset(uint16_t instr);
+template <typename Instr>
+inline void store_base_offset(Vm& vm, const Instr& d) {
+  // contents of reg[sr] are stored in mem with addr of
+  // sign_extend[6bit offset] + contents of br
+  uint16_t addr = vm.reg[d.sr1] + d.imm;
+  // memory[addr] = reg[sr];
+  mem_write(vm, addr, vm.reg[d.dr]);
+}
+
+// TRAP vectors of the built-in routines
+enum TrapCodes {
+    TRAP_GETC = 0x20,  /* get character from keyboard, not echoed onto the terminal */
+    TRAP_OUT = 0x21,   /* output a character */
+    TRAP_PUTS = 0x22,  /* output a word string */
+    TRAP_IN = 0x23,    /* get character from keyboard, echoed onto the terminal */
+    TRAP_PUTSP = 0x24, /* output a byte string */
+    TRAP_HALT = 0x25   /* halt the program */
+};
 
 // 1111   4bit instr
 // 0000   4bit ignord
 // ...    8bit trapvect
-void trap(
-  uint16_t instr,
-  void (*upd_cond_flags)(uint16_t),
-  int* running
-);
+// HALT clears vm.running
+void trap(Vm& vm, const DecodedInstr& d);
 
 // Read single char from keyboard, not echoed to console
 // It's ASCII code is copied into R0, the high 8 bits of R0 are cleared
-void trap_getc(void (*upd_cond_flags)(uint16_t));
+void trap_getc(Vm& vm);
 
 // Write a character in R0 (lower 8 bits) to console
-void trap_out();
+void trap_out(Vm& vm);
 
 // starting at address in r0, write each value in memory
-// to stdout until terminator is reached
-void trap_puts();
+// to the console until terminator is reached
+void trap_puts(Vm& vm);
 
 // Print prompt on screen & read a single char from keyboard
 // character is echoed onto console, then
 // it's ASCII code is copied into R0
 // high 8 bits of R0 are cleared
-void trap_in(void (*upd_cond_flags)(uint16_t));
+void trap_in(Vm& vm);
 
 
 // write string of ASCII characters to console
@@ -192,11 +375,11 @@ void trap_in(void (*upd_cond_flags)(uint16_t));
 // print lower 8 bits first, then higher 8 bits
 // if odd num chars, last one will have x00 in higher 8 bits
 // finishes at occurence of x0000 in a memory location
-void trap_puts_p();
+void trap_puts_p(Vm& vm);
 
 
 // halt execution & print message on console
-void trap_halt(int* running);
+void trap_halt(Vm& vm);
 
 
 
@@ -0,0 +1,216 @@
+#include "profile.h"
+#include "disasm.h"
+#include <algorithm>
+#include <cstdio>
+#include <new>
+#include <string>
+
+static const char* const OPCODE_NAMES[16] = {
+  "BR", "ADD", "LD", "ST", "JSR", "AND", "LDR", "STR",
+  "RTI", "NOT", "LDI", "STI", "JMP", "RES", "LEA", "TRAP",
+};
+
+static const char* trap_name(unsigned vect) {
+  switch (vect) {
+    case TRAP_GETC: return "GETC";
+    case TRAP_OUT: return "OUT";
+    case TRAP_PUTS: return "PUTS";
+    case TRAP_IN: return "IN";
+    case TRAP_PUTSP: return "PUTSP";
+    case TRAP_HALT: return "HALT";
+    default: return "?";
+  }
+}
+
+int profile_enable(Vm& vm) {
+  if (vm.profile) { return 1; }
+  Profile* p = new (std::nothrow) Profile;
+  if (!p) { return 0; }
+  p->frames.push_back(ProfileFrame{0, vm.reg[R_PC], 0});
+  vm.profile = p;
+  return 1;
+}
+
+// The instructions since the current frame was entered belong to it
+static void charge_frame(Profile& p) {
+  p.frames[p.frame].self += p.total - p.frame_start;
+  p.frame_start = p.total;
+}
+
+static void push_frame(Profile& p, uint16_t addr) {
+  if (p.depth >= PROFILE_MAX_DEPTH) {
+    ++p.overflow;
+    return;
+  }
+  charge_frame(p);
+  uint64_t key = static_cast<uint64_t>(p.frame) << 16 | addr;
+  auto it = p.children.find(key);
+  if (it == p.children.end()) {
+    uint32_t id = static_cast<uint32_t>(p.frames.size());
+    p.frames.push_back(ProfileFrame{p.frame, addr, 0});
+    it = p.children.emplace(key, id).first;
+  }
+  p.frame = it->second;
+  ++p.depth;
+}
+
+static void pop_frame(Profile& p) {
+  if (p.overflow) {
+    --p.overflow;
+    return;
+  }
+  // a RET without a matching JSR (ex. a hand made jump table) stays at the root
+  if (p.depth == 0) { return; }
+  charge_frame(p);
+  p.frame = p.frames[p.frame].parent;
+  --p.depth;
+}
+
+void profile_control(Vm& vm, uint16_t pc, uint16_t instr) {
+  Profile& p = *vm.profile;
+  switch (instr >> 12) {
+    case OP_BR:
+      // taken if any of the nzp bits match the flags
+      if ((instr >> 9) & cond_flags(vm)) {
+        ++p.taken[pc];
+      }
+      break;
+    case OP_JSR:
+      push_frame(p, vm.reg[R_PC]);
+      break;
+    case OP_JMP:
+      if (((instr >> 6) & 0x7) == 7) {
+        pop_frame(p);
+      }
+      break;
+    case OP_TRAP:
+      ++p.traps[instr & 0xFF];
+      break;
+    default:
+      break;
+  }
+}
+
+static bool ends_block(uint16_t instr) {
+  uint16_t op = static_cast<uint16_t>(instr >> 12);
+  return (op & 3) == 0 || op == OP_TRAP;
+}
+
+struct HotBlock {
+  uint16_t start;
+  uint32_t length;
+  uint64_t instructions;
+};
+
+// Basic blocks, worked out from the counts afterwards
+// - a block ends after BR/JSR/JMP/TRAP
+// - a new one starts wherever the count changes (something jumped in
+//   or out in the middle), so no branch targets have to be known
+static std::vector<HotBlock> hot_blocks(const Vm& vm, const Profile& p) {
+  std::vector<HotBlock> blocks;
+  HotBlock cur{0, 0, 0};
+  for (uint32_t addr = 0; addr < MEMORY_MAX; ++addr) {
+    uint64_t n = p.counts[addr];
+    if (cur.length && (n != p.counts[addr - 1] || ends_block(vm.memory[addr - 1]))) {
+      blocks.push_back(cur);
+      cur.length = 0;
+    }
+    if (n == 0) { continue; }
+    if (cur.length == 0) {
+      cur = HotBlock{static_cast<uint16_t>(addr), 0, 0};
+    }
+    ++cur.length;
+    cur.instructions += n;
+  }
+  if (cur.length) { blocks.push_back(cur); }
+  return blocks;
+}
+
+static int write_report(const Vm& vm, const Profile& p, const char* path) {
+  FILE* f = fopen(path, "w");
+  if (!f) { return 0; }
+  double total = p.total ? static_cast<double>(p.total) : 1.0;
+
+  fprintf(f, "instructions: %llu\n\n", static_cast<unsigned long long>(p.total));
+
+  // opcodes of what's in memory now, self-modifying code is counted
+  // as whatever the address ended up holding
+  uint64_t ops[16] = {};
+  for (uint32_t addr = 0; addr < MEMORY_MAX; ++addr) {
+    ops[vm.memory[addr] >> 12] += p.counts[addr];
+  }
+  fprintf(f, "%-6s %14s %7s\n", "opcode", "count", "%");
+  for (int op = 0; op < 16; ++op) {
+    if (!ops[op]) { continue; }
+    fprintf(f, "%-6s %14llu %6.2f%%\n", OPCODE_NAMES[op],
+      static_cast<unsigned long long>(ops[op]), 100.0 * static_cast<double>(ops[op]) / total);
+  }
+
+  fprintf(f, "\n%-10s %14s\n", "trap", "count");
+  for (unsigned vect = 0; vect < 256; ++vect) {
+    if (!p.traps[vect]) { continue; }
+    fprintf(f, "x%02X %-6s %14llu\n", vect, trap_name(vect), static_cast<unsigned long long>(p.traps[vect]));
+  }
+
+  std::vector<HotBlock> blocks = hot_blocks(vm, p);
+  std::sort(blocks.begin(), blocks.end(), [](const HotBlock& a, const HotBlock& b) {
+    return a.instructions > b.instructions;
+  });
+  if (blocks.size() > PROFILE_HOT_BLOCKS) { blocks.resize(PROFILE_HOT_BLOCKS); }
+
+  fprintf(f, "\nhottest blocks\n");
+  for (size_t i = 0; i < blocks.size(); ++i) {
+    const HotBlock& b = blocks[i];
+    fprintf(f, "\n#%zu x%04X-x%04X  %u instructions, %llu executed (%.2f%%)\n", i + 1, b.start,
+      static_cast<unsigned>(b.start + b.length - 1), b.length,
+      static_cast<unsigned long long>(b.instructions), 100.0 * static_cast<double>(b.instructions) / total);
+    for (uint32_t k = 0; k < b.length; ++k) {
+      uint16_t addr = static_cast<uint16_t>(b.start + k);
+      uint16_t instr = vm.memory[addr];
+      char text[64];
+      disassemble(addr, instr, text, sizeof(text));
+      fprintf(f, "  x%04X  %04X  %-26s %14llu", addr, instr, text,
+        static_cast<unsigned long long>(p.counts[addr]));
+      if ((instr >> 12) == OP_BR && p.counts[addr]) {
+        fprintf(f, "  taken %.1f%%", 100.0 * static_cast<double>(p.taken[addr]) / static_cast<double>(p.counts[addr]));
+      }
+      fprintf(f, "\n");
+    }
+  }
+
+  return fclose(f) == 0;
+}
+
+// `x3000;x3100;x3180 12345` per call stack that executed anything
+static int write_folded(const Profile& p, const std::string& path) {
+  FILE* f = fopen(path.c_str(), "w");
+  if (!f) { return 0; }
+  std::vector<uint16_t> stack;
+  for (const ProfileFrame& frame : p.frames) {
+    if (!frame.self) { continue; }
+    stack.clear();
+    // walk up to the root, frames[0] is its own parent
+    for (const ProfileFrame* at = &frame;; at = &p.frames[at->parent]) {
+      stack.push_back(at->addr);
+      if (at == &p.frames[0]) { break; }
+    }
+    for (size_t i = stack.size(); i-- > 0;) {
+      fprintf(f, "x%04X%s", stack[i], i ? ";" : " ");
+    }
+    fprintf(f, "%llu\n", static_cast<unsigned long long>(frame.self));
+  }
+  return fclose(f) == 0;
+}
+
+int profile_write(Vm& vm, const char* path) {
+  Profile* p = vm.profile;
+  if (!p) { return 0; }
+  charge_frame(*p);
+  int ok = write_report(vm, *p, path);
+  return write_folded(*p, std::string(path) + ".folded") && ok;
+}
+
+void profile_destroy(Vm& vm) {
+  delete vm.profile;
+  vm.profile = nullptr;
+}
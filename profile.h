@@ -0,0 +1,95 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+#include "memory.h"
+#include "ops.h"
+#include "vm.h"
+
+// ============================
+// ====== Guest Profiler ======
+// ============================
+// Optional, off by default (`vm --profile report.txt`)
+// - Counts how many times each guest address was executed,
+//   a counter array parallel to `memory`
+// - Counts taken branches per BR & TRAPs per vector
+// - Keeps a shadow call stack, JSR/JSRR push the target & RET (JMP R7) pops,
+//   & charges every instruction to the stack it ran under
+//
+// Per instruction it's two increments & a check of the opcode, so it's
+// fine to leave on for long runs
+// (the JIT needs every instruction too, so with profiling on run_jit
+//  falls back to the threaded core, like with tracing)
+//
+// On exit profile_write writes
+// - `path`: opcode & TRAP histograms, & the hottest basic blocks disassembled
+//   with per instruction counts
+// - `path`.folded: one `frame;frame;frame count` line per call stack,
+//   what flamegraph.pl / speedscope / inferno read
+
+// Deeper calls (ex. runaway recursion) are charged to the deepest frame kept
+#define PROFILE_MAX_DEPTH 64
+
+// How many basic blocks the report lists
+#define PROFILE_HOT_BLOCKS 20
+
+// One call stack: the frame it was called from + the routine's address
+struct ProfileFrame {
+  uint32_t parent;
+  uint16_t addr;
+  // instructions executed with this as the innermost frame
+  uint64_t self;
+};
+
+struct Profile {
+  // executions per address
+  uint64_t counts[MEMORY_MAX]{};
+  // times the BR at each address was taken
+  uint64_t taken[MEMORY_MAX]{};
+  // TRAPs by trapvect8
+  uint64_t traps[256]{};
+
+  // every call stack seen so far, frames[0] is the root (where the program started)
+  std::vector<ProfileFrame> frames{};
+  // (parent frame << 16 | routine address) -> frame
+  std::unordered_map<uint64_t, uint32_t> children{};
+  // innermost frame right now
+  uint32_t frame{0};
+  // calls past PROFILE_MAX_DEPTH, their RETs don't pop a frame
+  uint32_t overflow{0};
+  uint32_t depth{0};
+
+  // instructions so far, & when the current frame was entered
+  uint64_t total{0};
+  uint64_t frame_start{0};
+};
+
+// Start profiling `vm`, the root frame is the current PC
+// returns 0 if out of memory
+int profile_enable(Vm& vm);
+
+// BR/JSR/JMP/TRAP, called by profile_step
+void profile_control(Vm& vm, uint16_t pc, uint16_t instr);
+
+// Record the instruction `vm` just executed from `pc`
+// Engines only call this when vm.profile is set
+inline void profile_step(Vm& vm, uint16_t pc) {
+  Profile& p = *vm.profile;
+  ++p.counts[pc];
+  ++p.total;
+  uint16_t instr = vm.memory[pc];
+  // BR 0000, JSR 0100, RTI 1000 & JMP 1100 are the only opcodes ending in 00
+  if ((instr & 0x3000) == 0 || (instr >> 12) == OP_TRAP) {
+    profile_control(vm, pc, instr);
+  }
+}
+
+// Write the report to `path` & the folded stacks to `path`.folded
+// returns 0 if either file couldn't be written
+int profile_write(Vm& vm, const char* path);
+
+// Free vm's profile (vm_destroy does this)
+void profile_destroy(Vm& vm);
+
+#endif // !PROFILE_H
@@ -0,0 +1,123 @@
+#include "replay.h"
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <new>
+
+int replay_record(Vm& vm, const char* path) {
+  FILE* file = fopen(path, "wb");
+  if (!file) { return 0; }
+  Replay* r = new (std::nothrow) Replay;
+  if (!r) {
+    fclose(file);
+    return 0;
+  }
+  fwrite("LC3R", 4, 1, file);
+  fputc(REPLAY_VERSION, file);
+  r->file = file;
+  replay_destroy(vm);
+  vm.replay = r;
+  return 1;
+}
+
+int replay_open(Vm& vm, const char* path) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file) { return 0; }
+  Replay* r = new (std::nothrow) Replay;
+  if (!r) { return 0; }
+  r->log.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+  if (file.bad() || r->log.size() < 5 || memcmp(r->log.data(), "LC3R", 4) != 0
+      || r->log[4] != REPLAY_VERSION) {
+    delete r;
+    return 0;
+  }
+  r->playing = 1;
+  r->pos = 5;
+  replay_destroy(vm);
+  vm.replay = r;
+  return 1;
+}
+
+static void write_varint(FILE* file, uint64_t v) {
+  while (v >= 0x80) {
+    fputc(static_cast<int>((v & 0x7F) | 0x80), file);
+    v >>= 7;
+  }
+  fputc(static_cast<int>(v), file);
+}
+
+void replay_log(Vm& vm, int key) {
+  Replay& r = *vm.replay;
+  // end of input stays that way, once is enough
+  if (r.eof) { return; }
+  bool eof = key == KEY_EOF;
+  write_varint(r.file, (r.points - r.last) << 1 | (eof ? 1 : 0));
+  if (eof) {
+    r.eof = true;
+  } else {
+    fputc(key, r.file);
+  }
+  r.last = r.points;
+}
+
+// returns false at the end of the log (or if it's cut off mid event)
+static bool read_varint(Replay& r, uint64_t& v) {
+  v = 0;
+  for (int shift = 0; r.pos < r.log.size() && shift < 64; shift += 7) {
+    uint8_t b = r.log[r.pos++];
+    v |= static_cast<uint64_t>(b & 0x7F) << shift;
+    if (!(b & 0x80)) { return true; }
+  }
+  return false;
+}
+
+int replay_next(Vm& vm, bool blocking) {
+  Replay& r = *vm.replay;
+  ++r.points;
+  if (r.eof) { return KEY_EOF; }
+
+  // peek at the next event, only consumed once its point comes up
+  size_t at = r.pos;
+  uint64_t v;
+  if (!read_varint(r, v) || (!(v & 1) && r.pos >= r.log.size())) {
+    // recorded up to here & no further
+    r.pos = at;
+    vm.running = 0;
+    return KEY_EOF;
+  }
+  uint64_t point = r.last + (v >> 1);
+  if (point != r.points) {
+    r.pos = at;
+    // a GETC/IN always read something when it was recorded, & a point
+    // already gone by means the program took another path
+    if (blocking || point < r.points) {
+      vm.error = "Replay diverged from the recording";
+      vm.running = 0;
+      return KEY_EOF;
+    }
+    return KEY_NONE;
+  }
+
+  r.last = point;
+  if (v & 1) {
+    r.eof = true;
+    return KEY_EOF;
+  }
+  return r.log[r.pos++];
+}
+
+void replay_destroy(Vm& vm) {
+  Replay* r = vm.replay;
+  if (!r) { return; }
+  if (r->file) {
+    // the run got this far: the points it went through after its last key
+    // found nothing, the one after them is end of input
+    if (!r->eof) {
+      ++r->points;
+      replay_log(vm, KEY_EOF);
+    }
+    fclose(r->file);
+  }
+  delete r;
+  vm.replay = nullptr;
+}
@@ -0,0 +1,84 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+#include "vm.h"
+
+// ============================
+// ====== Record / Replay =====
+// ============================
+// Keyboard input is the only thing that makes two runs of the same image
+// differ, so a log of it is enough to run a session again exactly
+//
+//   vm --record session.rec image.obj                (use it as normal)
+//   vm --headless --replay session.rec image.obj     (same run, no keyboard)
+//
+// - Every KBSR read & every GETC/IN is an input point, numbered in order
+//   (so is every check for a keyboard interrupt, see interrupt.h)
+// - Recording logs each key with the input point that read it (& the point
+//   where end of input was first seen), nothing for the reads that found
+//   no key, so a polling loop costs one increment per read
+// - Replaying serves those keys at exactly those points, as fast as the
+//   engine runs (any engine, the points don't depend on it)
+// - A recording that's closed (vm_destroy) ends with end of input one point
+//   past the last one it went through, so the points after the last key
+//   (ex. interrupt checks until HALT, see interrupt.h) replay as "no key"
+// - Past the end of the log (the recording was cut off) the VM stops
+//
+// The position is the input point rather than the instruction count:
+// the engines only count instructions per run, not where an I/O happens,
+// & between two input points the program runs the same either way
+//
+// File: "LC3R", a version byte, then per event
+//   varint(points since the last event << 1 | is_eof), the key byte (if not eof)
+// varint = 7 bits per byte, low bits first, high bit set on all but the last
+
+#define REPLAY_VERSION 1
+
+// What an input point read: a key (0..255), or
+#define KEY_EOF -1  // end of input
+#define KEY_NONE -2 // nothing yet (KBSR only)
+
+struct Replay {
+  // 1: serving the log instead of vm.input, 0: writing it
+  int playing{0};
+  FILE* file{nullptr};
+  // playing: the whole log & how far into it
+  std::vector<uint8_t> log{};
+  size_t pos{0};
+
+  // input points so far & the point of the last event
+  uint64_t points{0};
+  uint64_t last{0};
+  // end of input was logged / has been reached
+  bool eof{false};
+};
+
+// Log vm's input to `path` from now on
+// returns 0 if the file can't be created
+int replay_record(Vm& vm, const char* path);
+
+// Serve vm's input from the log in `path` instead of vm.input
+// returns 0 if it can't be read or isn't a recording
+int replay_open(Vm& vm, const char* path);
+
+// Recording: input point `key` was just read (KEY_NONE/KEY_EOF included)
+void replay_log(Vm& vm, int key);
+inline void replay_note(Vm& vm, int key) {
+  Replay& r = *vm.replay;
+  ++r.points;
+  if (key != KEY_NONE) { replay_log(vm, key); }
+}
+
+// Playing: what the next input point reads
+// `blocking` is GETC/IN, which always read something when recorded
+// A point the log doesn't match (ex. another image) stops the VM with an
+// error, the end of the log stops it like a HALT
+int replay_next(Vm& vm, bool blocking);
+
+// Flush & close the log, marking where the input ended (vm_destroy does this)
+void replay_destroy(Vm& vm);
+
+#endif // !REPLAY_H
@@ -29,6 +29,9 @@ set WARNINGS "-Wall" "-Weffc++" "-Wextra" "-Wconversion" "-Wsign-conversion"
 # What language standard to use
 set STANDARD "-std=c++2a"
 
+# Tracing writes from a background thread
+set THREADS "-pthread"
+
 # Get all .cpp files in current dir
 set CPP_FILES (ls *.cpp)
 
@@ -39,7 +42,7 @@ end
 
 # Compile all .cpp files and link them into a single executable
 # g++ $CPP_FILES -o "$BASE_NAME" $DEBUG $NOEXT $WARNINGS $ERRONWARN $STANDARD
-g++ $CPP_FILES -o "bin/$BASE_NAME" $DEBUG $NOEXT $WARNINGS $STANDARD
+g++ $CPP_FILES -o "bin/$BASE_NAME" $DEBUG $NOEXT $WARNINGS $STANDARD $THREADS
 
 # Check if the compilation was successful
 if test $status -eq 0
@@ -49,4 +52,22 @@ if test $status -eq 0
     # ./bin/"$BASE_NAME"
 else
     echo "Compilation failed."
+    exit 1
+end
+
+# Each file in tools/ is its own program (own main)
+# linked against every vm source except vm.cpp
+set LIB_FILES (ls *.cpp | string match -v vm.cpp)
+for TOOL in tools/*.cpp
+    set TOOL_NAME (basename $TOOL .cpp)
+    g++ $TOOL $LIB_FILES -o "bin/$TOOL_NAME" $DEBUG $NOEXT $WARNINGS $STANDARD $THREADS
+    or echo "Compilation of $TOOL_NAME failed."
+end
+
+# Benchmarks in bench/ are built like tools/, but optimized
+# since what they measure is the speed of the vm itself
+for BENCH in bench/*.cpp
+    set BENCH_NAME (basename $BENCH .cpp)
+    g++ $BENCH $LIB_FILES -o "bin/$BENCH_NAME" -O2 -DNDEBUG $NOEXT $WARNINGS $STANDARD $THREADS
+    or echo "Compilation of $BENCH_NAME failed."
 end
@@ -0,0 +1,157 @@
+#include "scheduler.h"
+#include "input.h"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+// One scheduled VM
+struct SchedTask {
+  Scheduler* sched;
+  Vm* vm;
+  SchedDoneFn done;
+  void* arg;
+  // 1 while parked waiting for input, whoever swaps it back to 0
+  // (the input's notify or the worker re-checking) queues the VM again
+  std::atomic<int> parked{0};
+};
+
+struct Scheduler {
+  Engine engine{ENGINE_THREADED};
+  uint64_t slice{};
+
+  // `ready` & `tasks` are guarded by `lock`
+  std::mutex lock{};
+  std::condition_variable work{};
+  std::condition_variable all_done{};
+  std::deque<SchedTask*> ready{};
+  // every VM added & not stopped yet, queued, running or parked
+  std::unordered_set<SchedTask*> tasks{};
+  bool stopping{false};
+
+  std::atomic<uint64_t> retired{0};
+  std::vector<std::thread> workers{};
+};
+
+static void make_ready(SchedTask* t) {
+  Scheduler* s = t->sched;
+  {
+    std::lock_guard<std::mutex> guard(s->lock);
+    s->ready.push_back(t);
+  }
+  s->work.notify_one();
+}
+
+// input_set_notify callback, runs on whatever thread fed the input
+static void input_arrived(void* arg) {
+  SchedTask* t = static_cast<SchedTask*>(arg);
+  if (t->parked.exchange(0) == 1) {
+    make_ready(t);
+  }
+}
+
+static void park(SchedTask* t) {
+  t->parked.store(1);
+  // input that showed up between execute() giving up & the store above
+  // already announced itself to nobody, so look once more
+  if ((input_ready(t->vm->input) || input_eof(t->vm->input)) && t->parked.exchange(0) == 1) {
+    make_ready(t);
+  }
+}
+
+static void finish(SchedTask* t, ExecStatus status) {
+  Scheduler* s = t->sched;
+  // once this returns input_arrived can't be running for `t` anymore
+  input_set_notify(t->vm->input, nullptr, nullptr);
+  t->done(t->vm, status, t->arg);
+  {
+    std::lock_guard<std::mutex> guard(s->lock);
+    s->tasks.erase(t);
+    if (s->tasks.empty()) { s->all_done.notify_all(); }
+  }
+  delete t;
+}
+
+static void worker(Scheduler* s) {
+  for (;;) {
+    SchedTask* t;
+    {
+      std::unique_lock<std::mutex> guard(s->lock);
+      s->work.wait(guard, [s]() { return s->stopping || !s->ready.empty(); });
+      if (s->stopping) { return; }
+      t = s->ready.front();
+      s->ready.pop_front();
+    }
+
+    ExecResult result = execute(*t->vm, s->slice, s->engine);
+    s->retired.fetch_add(result.retired, std::memory_order_relaxed);
+    switch (result.status) {
+      case EXEC_BUDGET:
+        make_ready(t);
+        break;
+      case EXEC_BLOCKED:
+        park(t);
+        break;
+      case EXEC_HALTED:
+      case EXEC_ERROR:
+      default:
+        finish(t, result.status);
+        break;
+    }
+  }
+}
+
+Scheduler* sched_create(size_t workers, Engine engine, uint64_t slice) {
+  Scheduler* s = new (std::nothrow) Scheduler();
+  if (!s) { return nullptr; }
+  s->engine = engine;
+  s->slice = slice;
+  if (workers == 0) { workers = std::thread::hardware_concurrency(); }
+  if (workers == 0) { workers = 1; }
+  for (size_t w = 0; w < workers; ++w) {
+    s->workers.emplace_back(worker, s);
+  }
+  return s;
+}
+
+int sched_add(Scheduler* s, Vm* vm, SchedDoneFn done, void* arg) {
+  SchedTask* t = new (std::nothrow) SchedTask{s, vm, done, arg};
+  if (!t) { return 0; }
+  input_set_notify(vm->input, input_arrived, t);
+  {
+    std::lock_guard<std::mutex> guard(s->lock);
+    s->tasks.insert(t);
+    s->ready.push_back(t);
+  }
+  s->work.notify_one();
+  return 1;
+}
+
+void sched_wait(Scheduler* s) {
+  std::unique_lock<std::mutex> guard(s->lock);
+  s->all_done.wait(guard, [s]() { return s->tasks.empty(); });
+}
+
+uint64_t sched_retired(Scheduler* s) {
+  return s->retired.load(std::memory_order_relaxed);
+}
+
+void sched_destroy(Scheduler* s) {
+  if (!s) { return; }
+  {
+    std::lock_guard<std::mutex> guard(s->lock);
+    s->stopping = true;
+  }
+  s->work.notify_all();
+  for (std::thread& t : s->workers) { t.join(); }
+  // whatever is left is parked or queued, hand the VMs back untouched
+  for (SchedTask* t : s->tasks) {
+    input_set_notify(t->vm->input, nullptr, nullptr);
+    delete t;
+  }
+  delete s;
+}
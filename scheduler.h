@@ -0,0 +1,56 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+#include <cstddef>
+#include <cstdint>
+#include "engine.h"
+#include "vm.h"
+
+// ============================
+// ======== Scheduler =========
+// ============================
+// Runs many VMs on a few threads (M:N), ex. thousands of interactive
+// sessions that mostly sit waiting for their next keystroke
+//
+// - A fixed pool of worker threads shares one run queue of VMs
+// - A worker takes the VM at the front & runs it for a time slice
+//   with execute() (see engine.h), then
+//   -- EXEC_BUDGET  : back of the queue, round robin
+//   -- EXEC_BLOCKED : parked, off the queue, no thread waits on it
+//   -- halted/error : done, the VM's callback is called
+// - A parked VM goes back on the queue when its input gets bytes or EOF,
+//   input_push / input_close call back into the scheduler (input_set_notify)
+//
+// Any input can be scheduled, but only a queue (vm_create_session) or a
+// stream ever wakes a parked VM up, files & buffers are never empty
+// until EOF anyway
+//
+// A VM belongs to the scheduler from sched_add until its callback,
+// nothing else may run it or read its input in between
+
+struct Scheduler;
+
+// Called on a worker thread once `vm` stops (EXEC_HALTED / EXEC_ERROR)
+// the VM is the caller's again, it may be destroyed right here
+typedef void (*SchedDoneFn)(Vm* vm, ExecStatus status, void* arg);
+
+// `workers` threads (0: one per core), running VMs on `engine`
+// `slice` instructions at a time
+// returns nullptr if out of memory
+Scheduler* sched_create(size_t workers, Engine engine, uint64_t slice);
+
+// Start scheduling `vm`, done(vm, status, arg) is called when it stops
+// returns 0 if out of memory
+int sched_add(Scheduler* s, Vm* vm, SchedDoneFn done, void* arg);
+
+// Wait until every VM added so far has stopped
+// (one still waiting for input that never comes waits forever)
+void sched_wait(Scheduler* s);
+
+// Instructions retired by every VM so far
+uint64_t sched_retired(Scheduler* s);
+
+// Stops the workers & frees the scheduler
+// VMs that haven't stopped are dropped without a callback, still the caller's
+void sched_destroy(Scheduler* s);
+
+#endif // !SCHEDULER_H
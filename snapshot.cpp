@@ -0,0 +1,209 @@
+#include "snapshot.h"
+#include "decode.h"
+#include "device.h"
+#include "jit.h"
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+// vm_create gives every Vm its own page aligned mapping with memory first,
+// so memory can be replaced by mapping the file over it
+static_assert(offsetof(Vm, memory) == 0, "snapshots map over vm.memory");
+static_assert(sizeof(Vm::memory) % 65536 == 0, "memory is a whole number of pages");
+
+// Saves never write over `path` in place: they go to a temporary file next
+// to it (same directory, so the rename stays on one file system) that
+// replaces it once it's complete
+// - a failed save leaves the old file as it was
+// - whatever has the old file mapped (snapshot_restore's copy-on-write
+//   memory, maybe another process) keeps its pages instead of SIGBUS on
+//   a truncated file, even when saving over the snapshot it came from
+// returns the open file, nullptr if it couldn't be made, `tmp` is its name
+static FILE* open_replacement(const char* path, std::string& tmp) {
+  tmp = std::string(path) + ".tmpXXXXXX";
+  int fd = mkstemp(&tmp[0]);
+  if (fd < 0) { return nullptr; }
+  // mkstemp makes it 0600, keep the old file's mode (or a new file's usual one)
+  struct stat st;
+  fchmod(fd, stat(path, &st) == 0 ? st.st_mode & 07777 : 0644);
+  FILE* file = fdopen(fd, "wb");
+  if (!file) {
+    close(fd);
+    unlink(tmp.c_str());
+  }
+  return file;
+}
+
+// Flushes `file` to disk & renames it over `path` if everything was written
+// (`ok`), otherwise the temporary file is removed
+// returns 1 if `path` was replaced
+static int commit_replacement(FILE* file, const std::string& tmp, const char* path, bool ok) {
+  ok = fflush(file) == 0 && ok;
+  ok = fsync(fileno(file)) == 0 && ok;
+  ok = fclose(file) == 0 && ok;
+  if (ok && rename(tmp.c_str(), path) == 0) { return 1; }
+  unlink(tmp.c_str());
+  return 0;
+}
+
+int snapshot_save(const Vm& vm, const char* path) {
+  std::string tmp;
+  FILE* file = open_replacement(path, tmp);
+  if (!file) { return 0; }
+
+  SnapshotHeader header{{'L', 'C', '3', 'S'}, SNAPSHOT_VERSION, R_COUNT,
+    static_cast<uint32_t>(sysconf(_SC_PAGESIZE)), {}};
+  memcpy(header.reg, vm.reg, sizeof(header.reg));
+
+  // header, padded out to a page
+  fwrite(&header, sizeof(header), 1, file);
+  for (size_t i = sizeof(header); i < header.memory_offset; ++i) { fputc(0, file); }
+  size_t written = fwrite(vm.memory, sizeof(vm.memory), 1, file);
+
+  return commit_replacement(file, tmp, path, written == 1);
+}
+
+int snapshot_restore(Vm& vm, const char* path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) { return 0; }
+
+  SnapshotHeader header;
+  struct stat st;
+  bool valid = read(fd, &header, sizeof(header)) == static_cast<ssize_t>(sizeof(header))
+    && memcmp(header.magic, "LC3S", 4) == 0
+    && header.version == SNAPSHOT_VERSION
+    && header.reg_count == R_COUNT
+    && header.memory_offset >= sizeof(header)
+    && fstat(fd, &st) == 0
+    && static_cast<size_t>(st.st_size) >= header.memory_offset + sizeof(vm.memory);
+  if (!valid) {
+    close(fd);
+    return 0;
+  }
+
+  // Copy-on-write mapping over the old memory, or a plain read if
+  // the offset doesn't sit on a page boundary here
+  bool mapped = false;
+  if (header.memory_offset % static_cast<uint32_t>(sysconf(_SC_PAGESIZE)) == 0) {
+    void* p = mmap(vm.memory, sizeof(vm.memory), PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_FIXED, fd, header.memory_offset);
+    mapped = p != MAP_FAILED;
+  }
+  if (!mapped) {
+    ssize_t got = pread(fd, vm.memory, sizeof(vm.memory), header.memory_offset);
+    if (got != static_cast<ssize_t>(sizeof(vm.memory))) {
+      close(fd);
+      return 0;
+    }
+  }
+  // the mapping keeps its own reference to the file
+  close(fd);
+
+  memcpy(vm.reg, header.reg, sizeof(vm.reg));
+  vm.cond_result = 0;
+  vm.running = 1;
+  vm.error = nullptr;
+  // device registers came with memory (KBSR's IE bit, the timer)
+  bus_sync(vm);
+
+  // everything derived from the old memory is stale, all of it was written
+  invalidate_decoded_range(vm, 0, MEMORY_MAX);
+  mem_mark_dirty(vm, 0, MEMORY_MAX);
+  jit_destroy(vm);
+  return 1;
+}
+
+#define PAGE_WORDS (1u << MEM_PAGE_SHIFT)
+// page number + the page
+#define DIFF_PAGE_BYTES (sizeof(uint16_t) + PAGE_WORDS * sizeof(uint16_t))
+
+size_t snapshot_diff_size(const Vm& vm) {
+  uint8_t pages[MEM_PAGES];
+  return sizeof(SnapshotDiffHeader) + mem_dirty_pages(vm, pages) * DIFF_PAGE_BYTES;
+}
+
+size_t snapshot_diff(const Vm& vm, uint8_t* buf, size_t size) {
+  uint8_t pages[MEM_PAGES];
+  size_t count = mem_dirty_pages(vm, pages);
+  size_t total = sizeof(SnapshotDiffHeader) + count * DIFF_PAGE_BYTES;
+  if (size < total) { return 0; }
+
+  SnapshotDiffHeader header{{'L', 'C', '3', 'D'}, SNAPSHOT_VERSION, R_COUNT,
+    static_cast<uint16_t>(count), {}};
+  memcpy(header.reg, vm.reg, sizeof(header.reg));
+  memcpy(buf, &header, sizeof(header));
+  uint8_t* p = buf + sizeof(header);
+  for (size_t i = 0; i < count; ++i) {
+    uint16_t page = pages[i];
+    memcpy(p, &page, sizeof(page));
+    memcpy(p + sizeof(page), vm.memory + (page << MEM_PAGE_SHIFT), PAGE_WORDS * sizeof(uint16_t));
+    p += DIFF_PAGE_BYTES;
+  }
+  return total;
+}
+
+int snapshot_apply_diff(Vm& vm, const uint8_t* buf, size_t size) {
+  SnapshotDiffHeader header;
+  if (size < sizeof(header)) { return 0; }
+  memcpy(&header, buf, sizeof(header));
+  bool valid = memcmp(header.magic, "LC3D", 4) == 0
+    && header.version == SNAPSHOT_VERSION
+    && header.reg_count == R_COUNT
+    && header.page_count <= MEM_PAGES
+    && size >= sizeof(header) + header.page_count * DIFF_PAGE_BYTES;
+  // check every page number before writing any
+  const uint8_t* pages = buf + sizeof(header);
+  for (size_t i = 0; valid && i < header.page_count; ++i) {
+    uint16_t page;
+    memcpy(&page, pages + i * DIFF_PAGE_BYTES, sizeof(page));
+    valid = page < MEM_PAGES;
+  }
+  if (!valid) { return 0; }
+
+  for (size_t i = 0; i < header.page_count; ++i) {
+    uint16_t page;
+    memcpy(&page, pages + i * DIFF_PAGE_BYTES, sizeof(page));
+    uint16_t start = static_cast<uint16_t>(page << MEM_PAGE_SHIFT);
+    memcpy(vm.memory + start, pages + i * DIFF_PAGE_BYTES + sizeof(page), PAGE_WORDS * sizeof(uint16_t));
+    invalidate_decoded_range(vm, start, PAGE_WORDS);
+    mem_mark_dirty(vm, start, PAGE_WORDS);
+  }
+  memcpy(vm.reg, header.reg, sizeof(vm.reg));
+  vm.cond_result = 0;
+  vm.running = 1;
+  vm.error = nullptr;
+  // device registers came with memory (KBSR's IE bit, the timer)
+  bus_sync(vm);
+  jit_destroy(vm);
+  return 1;
+}
+
+int snapshot_save_diff(Vm& vm, const char* path) {
+  std::vector<uint8_t> buf(snapshot_diff_size(vm));
+  size_t size = snapshot_diff(vm, buf.data(), buf.size());
+  std::string tmp;
+  FILE* file = open_replacement(path, tmp);
+  if (!file) { return 0; }
+  size_t written = fwrite(buf.data(), size, 1, file);
+  if (!commit_replacement(file, tmp, path, written == 1)) { return 0; }
+  mem_clear_dirty(vm);
+  return 1;
+}
+
+int snapshot_restore_diff(Vm& vm, const char* path) {
+  FILE* file = fopen(path, "rb");
+  if (!file) { return 0; }
+  std::vector<uint8_t> buf;
+  uint8_t chunk[4096];
+  size_t n;
+  while ((n = fread(chunk, 1, sizeof(chunk), file)) > 0) { buf.insert(buf.end(), chunk, chunk + n); }
+  fclose(file);
+  return snapshot_apply_diff(vm, buf.data(), buf.size());
+}
@@ -0,0 +1,104 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+#include <cstddef>
+#include <cstdint>
+#include "memory.h"
+#include "vm.h"
+
+// ============================
+// ======== Snapshots =========
+// ============================
+// The whole machine saved to a file, so a long init routine only runs once
+//
+//   vm --save-snapshot init.snap init.obj      (runs until HALT, then saves)
+//   vm --restore-snapshot init.snap            (carries on after that HALT)
+//
+// - A snapshot is taken when the VM halts, the saved PC is the instruction
+//   after the HALT, so ending the init code with HALT marks the checkpoint
+// - Restoring maps the memory part of the file straight over vm.memory
+//   (MAP_PRIVATE, copy-on-write), so nothing is read until it's touched &
+//   pages the program never writes stay shared with the page cache
+// - Device state (KBSR/KBDR) lives in memory & comes along with it,
+//   PSR & the saved stack pointers are registers (see interrupt.h)
+//
+// File layout (host byte order):
+// SnapshotHeader, zero padding up to `memory_offset`, then the 65_536
+// memory words. memory_offset is the saving machine's page size so the
+// memory can be mmap'd, if it isn't a multiple of the restoring machine's
+// page size the memory is copied in instead
+struct SnapshotHeader {
+  char magic[4];           // "LC3S"
+  uint16_t version;        // SNAPSHOT_VERSION
+  uint16_t reg_count;      // R_COUNT
+  uint32_t memory_offset;  // where memory starts in the file
+  uint16_t reg[R_COUNT];   // registers, R_COND included
+};
+
+// 2: PSR, Saved_SSP & Saved_USP were added to the registers
+#define SNAPSHOT_VERSION 2
+
+// Write vm's registers & memory to `path`
+// (into a temporary file renamed over `path` once complete, so saving over
+// the snapshot vm was restored from, or one another process maps, is safe)
+// returns 0 if the file couldn't be written, `path` is left as it was
+int snapshot_save(const Vm& vm, const char* path);
+
+// Replace vm's registers & memory with the snapshot in `path`
+// - The predecoded cache & any JIT translations are thrown away
+// - vm.running is set again
+// - The file must not change while the VM runs, pages not yet
+//   written by the guest may still be read from it
+// returns 0 if the file couldn't be opened or isn't a valid snapshot
+int snapshot_restore(Vm& vm, const char* path);
+
+// ============================
+// ====== Snapshot Diffs ======
+// ============================
+// A checkpoint of a long running session doesn't need all 128KB again,
+// only the registers & the pages written since the last checkpoint
+// (Vm::dirty, see Dirty Pages in memory.h)
+//
+//   vm --restore-snapshot init.snap --save-diff d1.diff ...
+//   vm --restore-snapshot init.snap --restore-diff d1.diff --save-diff d2.diff
+//
+// - A diff takes a machine from the state it was made against (the last
+//   mem_clear_dirty) to the state it was made in, so a full snapshot
+//   followed by its diffs in order gives back the latest state
+// - snapshot_diff fills a buffer instead of a file (ex. to send a running
+//   session to another process), a few pages instead of all of memory
+//
+// Layout (host byte order, like snapshots):
+// SnapshotDiffHeader, then `page_count` times a uint16_t page number
+// (address >> MEM_PAGE_SHIFT) followed by that page's 256 words
+struct SnapshotDiffHeader {
+  char magic[4];           // "LC3D"
+  uint16_t version;        // SNAPSHOT_VERSION
+  uint16_t reg_count;      // R_COUNT
+  uint16_t page_count;     // pages after the header
+  uint16_t reg[R_COUNT];   // registers, R_COND included
+};
+
+// Bytes snapshot_diff needs for vm's dirty pages right now
+size_t snapshot_diff_size(const Vm& vm);
+
+// Write vm's registers & dirty pages into buf[0..size)
+// returns the bytes written, 0 if `size` is less than snapshot_diff_size
+size_t snapshot_diff(const Vm& vm, uint8_t* buf, size_t size);
+
+// Apply a diff from snapshot_diff / snapshot_save_diff to vm
+// - its pages are written (& marked dirty), the registers replaced,
+//   vm.running set again
+// - predecoded instructions on those pages & JIT translations are thrown away
+// returns 0 if buf[0..size) isn't a valid diff (vm is left as it was)
+int snapshot_apply_diff(Vm& vm, const uint8_t* buf, size_t size);
+
+// snapshot_diff to `path` (replaced the same way as snapshot_save), then
+// mem_clear_dirty so the next diff starts here
+// returns 0 if the file couldn't be written (the dirty pages are kept)
+int snapshot_save_diff(Vm& vm, const char* path);
+
+// snapshot_apply_diff from the file at `path`
+// returns 0 if it couldn't be read or isn't a valid diff
+int snapshot_restore_diff(Vm& vm, const char* path);
+
+#endif // !SNAPSHOT_H
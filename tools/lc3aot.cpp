@@ -0,0 +1,332 @@
+// Ahead-of-time translator
+// Loads images like the vm does, follows the control flow from the start
+// address & writes a C++ program with one label per basic block (see aot.h)
+//
+// Usage: lc3aot [-o out.cpp] <image-file1> ...
+// then:  g++ -O2 -I. out.cpp <every .cpp but vm.cpp> -o prog
+#include "../decode.h"
+#include "../device.h"
+#include "../disasm.h"
+#include "../memory.h"
+#include "../ops.h"
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+struct Block {
+  uint16_t start;
+  uint16_t length;
+};
+
+static uint16_t next_of(uint16_t addr) {
+  return static_cast<uint16_t>(addr + 1);
+}
+
+// BR with any nzp bits / JSR / JSRR / JMP / TRAP / RTI / RES
+static bool ends_block(uint16_t instr) {
+  uint16_t op = static_cast<uint16_t>(instr >> 12);
+  if (op == OP_BR) { return ((instr >> 9) & 7) != 0; }
+  return op == OP_JSR || op == OP_JMP || op == OP_TRAP || op == OP_RTI || op == OP_RES;
+}
+
+// Every address reachable from `start` through direct control flow
+// - `leader` marks where a block has to start: branch & call targets,
+//   & whatever follows a block end (a branch not taken, a return address)
+static void find_code(const uint16_t* memory, uint16_t start,
+    std::vector<bool>& reach, std::vector<bool>& leader) {
+  std::vector<uint16_t> work{start};
+  leader[start] = true;
+  auto visit = [&](uint16_t addr, bool starts_block) {
+    if (starts_block) { leader[addr] = true; }
+    if (!reach[addr]) { work.push_back(addr); }
+  };
+
+  while (!work.empty()) {
+    uint16_t addr = work.back();
+    work.pop_back();
+    if (reach[addr]) { continue; }
+    reach[addr] = true;
+
+    uint16_t instr = memory[addr];
+    DecodedInstr d = decode(instr);
+    uint16_t next = next_of(addr);
+    // the last word has nowhere to fall through to (the native code leaves there)
+    bool has_next = addr != 0xFFFF;
+    switch (d.op) {
+      case OP_BR:
+        if (d.dr) { visit(static_cast<uint16_t>(next + d.imm), true); }
+        if (d.dr != 7 && has_next) { visit(next, d.dr != 0); }
+        break;
+      case OP_JSR:
+        if (d.imm_mode) { visit(static_cast<uint16_t>(next + d.imm), true); }
+        if (has_next) { visit(next, true); }
+        break;
+      case OP_TRAP:
+        if (d.imm != TRAP_HALT && has_next) { visit(next, true); }
+        break;
+      case OP_JMP:
+      case OP_RTI:
+      case OP_RES:
+        break;
+      default:
+        if (has_next) { visit(next, false); }
+        break;
+    }
+  }
+}
+
+static std::vector<Block> find_blocks(const uint16_t* memory, const std::vector<bool>& reach,
+    const std::vector<bool>& leader) {
+  std::vector<Block> blocks;
+  for (uint32_t addr = 0; addr < MEMORY_MAX; ++addr) {
+    if (!reach[addr]) { continue; }
+    bool open = !blocks.empty() && blocks.back().start + blocks.back().length == addr
+      && !ends_block(memory[addr - 1]) && !leader[addr];
+    if (open) {
+      ++blocks.back().length;
+    } else {
+      blocks.push_back(Block{static_cast<uint16_t>(addr), 1});
+    }
+  }
+  return blocks;
+}
+
+static const char* const BR_CONDS[8] = {
+  "false", "static_cast<int16_t>(cc) > 0", "cc == 0", "static_cast<int16_t>(cc) >= 0",
+  "static_cast<int16_t>(cc) < 0", "cc != 0", "static_cast<int16_t>(cc) <= 0", "true",
+};
+
+// Where control goes at `addr`: its block if translated, otherwise out to the interpreter
+static std::string jump_to(const std::vector<bool>& leader, uint16_t addr) {
+  char text[64];
+  if (leader[addr]) {
+    snprintf(text, sizeof(text), "goto b_%04X;", addr);
+  } else {
+    snprintf(text, sizeof(text), "pc = 0x%04X; goto no_code;", addr);
+  }
+  return text;
+}
+
+// A load that went through mem_read (KBSR) can stop the VM, the
+// instruction still retired
+static void stop_check(FILE* out, uint32_t count, uint16_t next) {
+  fprintf(out, "  if (!vm.running) { n += %u; pc = 0x%04X; goto stopped; }\n", count, next);
+}
+
+// `addr` as a load expression, straight from memory unless it's on an I/O page
+static std::string load_expr(uint16_t addr, bool& io) {
+  char text[64];
+  io = device_page(addr >> MEM_PAGE_SHIFT);
+  snprintf(text, sizeof(text), io ? "aot_load(vm, 0x%04X)" : "mem[0x%04X]", addr);
+  return text;
+}
+
+static void emit_block(FILE* out, const uint16_t* memory, const Block& b, const std::vector<bool>& leader) {
+  fprintf(out, "b_%04X:\n", b.start);
+  for (uint32_t k = 0; k < b.length; ++k) {
+    uint16_t addr = static_cast<uint16_t>(b.start + k);
+    uint16_t instr = memory[addr];
+    uint16_t next = next_of(addr);
+    uint32_t count = k + 1;
+    DecodedInstr d = decode(instr);
+    char text[64];
+    disassemble(addr, instr, text, sizeof(text));
+    fprintf(out, "  // x%04X  %s\n", addr, text);
+
+    bool io = false;
+    std::string src;
+    uint16_t target = static_cast<uint16_t>(next + d.imm);
+    switch (d.op) {
+      case OP_ADD:
+      case OP_AND: {
+        char sym = d.op == OP_ADD ? '+' : '&';
+        if (d.imm_mode) {
+          fprintf(out, "  r%u = static_cast<uint16_t>(r%u %c 0x%04Xu); cc = r%u;\n", d.dr, d.sr1, sym, d.imm, d.dr);
+        } else {
+          fprintf(out, "  r%u = static_cast<uint16_t>(r%u %c r%u); cc = r%u;\n", d.dr, d.sr1, sym, d.sr2, d.dr);
+        }
+        break;
+      }
+      case OP_NOT:
+        fprintf(out, "  r%u = static_cast<uint16_t>(~r%u); cc = r%u;\n", d.dr, d.sr1, d.dr);
+        break;
+      case OP_LEA:
+        fprintf(out, "  r%u = 0x%04X; cc = r%u;\n", d.dr, target, d.dr);
+        break;
+      case OP_LD:
+        src = load_expr(target, io);
+        fprintf(out, "  r%u = %s; cc = r%u;\n", d.dr, src.c_str(), d.dr);
+        if (io) { stop_check(out, count, next); }
+        break;
+      case OP_LDI:
+        src = load_expr(target, io);
+        fprintf(out, "  r%u = aot_load(vm, %s); cc = r%u;\n", d.dr, src.c_str(), d.dr);
+        stop_check(out, count, next);
+        break;
+      case OP_LDR:
+        fprintf(out, "  r%u = aot_load(vm, static_cast<uint16_t>(r%u + 0x%04Xu)); cc = r%u;\n",
+          d.dr, d.sr1, d.imm, d.dr);
+        stop_check(out, count, next);
+        break;
+      case OP_ST:
+      case OP_STI:
+      case OP_STR: {
+        char addr_expr[64];
+        if (d.op == OP_ST) {
+          snprintf(addr_expr, sizeof(addr_expr), "0x%04X", target);
+        } else if (d.op == OP_STI) {
+          snprintf(addr_expr, sizeof(addr_expr), "%s", load_expr(target, io).c_str());
+        } else {
+          snprintf(addr_expr, sizeof(addr_expr), "static_cast<uint16_t>(r%u + 0x%04Xu)", d.sr1, d.imm);
+        }
+        fprintf(out, "  if (aot_store(vm, st, %s, r%u)) { n += %u; pc = 0x%04X; goto modified; }\n",
+          addr_expr, d.dr, count, next);
+        if (io) { stop_check(out, count, next); }
+        break;
+      }
+      case OP_BR:
+        if (d.dr == 0) { break; }
+        fprintf(out, "  n += %u;\n", count);
+        if (d.dr == 7) {
+          fprintf(out, "  %s\n", jump_to(leader, target).c_str());
+        } else {
+          fprintf(out, "  if (%s) { %s }\n  %s\n", BR_CONDS[d.dr], jump_to(leader, target).c_str(),
+            jump_to(leader, next).c_str());
+        }
+        return;
+      case OP_JSR:
+        if (d.imm_mode) {
+          fprintf(out, "  r7 = 0x%04X; n += %u;\n  %s\n", next, count, jump_to(leader, target).c_str());
+        } else {
+          // base first, JSRR R7 jumps to the old R7
+          fprintf(out, "  pc = r%u; r7 = 0x%04X; n += %u;\n  goto dispatch;\n", d.sr1, next, count);
+        }
+        return;
+      case OP_JMP:
+        fprintf(out, "  pc = r%u; n += %u;\n  goto dispatch;\n", d.sr1, count);
+        return;
+      case OP_TRAP:
+        fprintf(out, "  n += %u;\n  SPILL();\n  vm.reg[R_PC] = 0x%04X;\n  aot_trap(vm, 0x%02X);\n"
+          "  if (!vm.running) { goto trap_stopped; }\n  RELOAD();\n  %s\n",
+          count, next, d.imm, jump_to(leader, next).c_str());
+        return;
+      case OP_RTI:
+      case OP_RES:
+      default:
+        // the interpreter reports it
+        fprintf(out, "  n += %u; pc = 0x%04X; goto no_code;\n", k, addr);
+        return;
+    }
+  }
+  // fell through into the next block
+  uint16_t end = static_cast<uint16_t>(b.start + b.length);
+  fprintf(out, "  n += %u;\n  %s\n", b.length, jump_to(leader, end).c_str());
+}
+
+static void emit(FILE* out, const uint16_t* memory, uint16_t start, const std::vector<Block>& blocks,
+    const std::vector<bool>& leader, const std::vector<const char*>& images) {
+  fprintf(out, "// Generated by lc3aot from");
+  for (const char* path : images) { fprintf(out, " %s", path); }
+  fprintf(out, ", don't edit\n// %zu blocks, start x%04X\n", blocks.size(), start);
+  fprintf(out, "#include \"aot.h\"\n\n");
+  fprintf(out, "#pragma GCC diagnostic ignored \"-Wunused-label\"\n\n");
+
+  // memory: every run of non-zero words
+  std::vector<std::pair<uint16_t, uint32_t>> runs;
+  for (uint32_t addr = 0; addr < MEMORY_MAX;) {
+    if (!memory[addr]) {
+      ++addr;
+      continue;
+    }
+    uint32_t end = addr;
+    while (end < MEMORY_MAX && memory[end]) { ++end; }
+    fprintf(out, "static const uint16_t IMAGE_%04X[] = {", addr);
+    for (uint32_t i = addr; i < end; ++i) {
+      fprintf(out, "%s0x%04X,", (i - addr) % 12 ? " " : "\n  ", memory[i]);
+    }
+    fprintf(out, "\n};\n");
+    runs.push_back({static_cast<uint16_t>(addr), end - addr});
+    addr = end;
+  }
+  fprintf(out, "static const AotImage IMAGES[] = {\n");
+  for (auto& run : runs) {
+    fprintf(out, "  {0x%04X, %u, IMAGE_%04X},\n", run.first, run.second, run.first);
+  }
+  fprintf(out, "};\n\nstatic const AotBlock BLOCKS[] = {\n");
+  for (const Block& b : blocks) {
+    fprintf(out, "  {0x%04X, %u},\n", b.start, b.length);
+  }
+  fprintf(out, "};\n\n");
+
+  fprintf(out,
+    "#define SPILL() do { vm.reg[0] = r0; vm.reg[1] = r1; vm.reg[2] = r2; vm.reg[3] = r3; \\\n"
+    "  vm.reg[4] = r4; vm.reg[5] = r5; vm.reg[6] = r6; vm.reg[7] = r7; vm.cond_result = cc; } while (0)\n"
+    "#define RELOAD() do { r0 = vm.reg[0]; r1 = vm.reg[1]; r2 = vm.reg[2]; r3 = vm.reg[3]; \\\n"
+    "  r4 = vm.reg[4]; r5 = vm.reg[5]; r6 = vm.reg[6]; r7 = vm.reg[7]; cc = vm.cond_result; } while (0)\n\n");
+
+  fprintf(out, "static AotExit run(Vm& vm, const AotState& st, uint64_t& retired) {\n");
+  fprintf(out, "  uint16_t* const mem = vm.memory;\n");
+  fprintf(out, "  uint16_t r0, r1, r2, r3, r4, r5, r6, r7, cc;\n");
+  fprintf(out, "  RELOAD();\n  uint16_t pc = vm.reg[R_PC];\n  uint64_t n = 0;\n  (void)mem;\n  (void)st;\n\n");
+  fprintf(out, "dispatch:\n  switch (pc) {\n");
+  for (const Block& b : blocks) {
+    fprintf(out, "    case 0x%04X: goto b_%04X;\n", b.start, b.start);
+  }
+  fprintf(out, "    default: goto no_code;\n  }\n\n");
+
+  for (const Block& b : blocks) {
+    emit_block(out, memory, b, leader);
+    fprintf(out, "\n");
+  }
+
+  fprintf(out,
+    "no_code:\n  SPILL();\n  vm.reg[R_PC] = pc;\n  retired += n;\n  return AOT_NO_CODE;\n"
+    "stopped:\n  SPILL();\n  vm.reg[R_PC] = pc;\n  retired += n;\n  return AOT_STOPPED;\n"
+    "trap_stopped:\n  retired += n;\n  return AOT_STOPPED;\n"
+    "modified:\n  SPILL();\n  vm.reg[R_PC] = pc;\n  retired += n;\n  return AOT_MODIFIED;\n}\n\n");
+
+  fprintf(out, "static const AotProgram PROGRAM = {\n  IMAGES, %zu, 0x%04X, BLOCKS, %zu, run,\n};\n\n",
+    runs.size(), start, blocks.size());
+  fprintf(out, "int main(int argc, const char* argv[]) {\n  return aot_main(argc, argv, PROGRAM);\n}\n");
+}
+
+int main(int argc, const char* argv[]) {
+  const char* out_path = nullptr;
+  std::vector<const char*> images;
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+      out_path = argv[++i];
+    } else {
+      images.push_back(argv[i]);
+    }
+  }
+  if (images.empty()) {
+    fprintf(stderr, "Usage: lc3aot [-o out.cpp] <image-file1> ...\n");
+    return 2;
+  }
+
+  std::vector<uint16_t> memory(MEMORY_MAX);
+  uint16_t start = 0x3000;
+  size_t failed = 0;
+  if (!load_images(memory.data(), nullptr, images.data(), images.size(), start, &failed)) {
+    fprintf(stderr, "Failed to load image: %s\n", images[failed]);
+    return 1;
+  }
+
+  std::vector<bool> reach(MEMORY_MAX), leader(MEMORY_MAX);
+  find_code(memory.data(), start, reach, leader);
+  std::vector<Block> blocks = find_blocks(memory.data(), reach, leader);
+
+  FILE* out = out_path ? fopen(out_path, "w") : stdout;
+  if (!out) {
+    fprintf(stderr, "Failed to open output: %s\n", out_path);
+    return 1;
+  }
+  emit(out, memory.data(), start, blocks, leader, images);
+  if (out != stdout && fclose(out) != 0) {
+    fprintf(stderr, "Failed to write output: %s\n", out_path);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,118 @@
+#ifndef LC3ASM_H
+#define LC3ASM_H
+#include "../decode.h"
+#include "../memory.h"
+#include "../ops.h"
+#include "../vm.h"
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+// ============================
+// ===== Tiny assembler =======
+// ============================
+// Just enough to write test & benchmark programs as code (lc3bench,
+// lc3smc), labels resolved by link()
+
+struct Asm {
+  uint16_t origin{0x3000};
+  std::vector<uint16_t> words{};
+  std::map<std::string, uint16_t> labels{};
+
+  // PC-relative operand to fill in once every label is known
+  struct Fixup {
+    size_t index;
+    std::string label;
+    int bits;
+  };
+  std::vector<Fixup> fixups{};
+
+  uint16_t here() const { return static_cast<uint16_t>(origin + words.size()); }
+  void label(const std::string& name) { labels[name] = here(); }
+  void emit(uint32_t w) { words.push_back(static_cast<uint16_t>(w)); }
+
+  void emit_rel(uint32_t w, const std::string& target, int bits) {
+    fixups.push_back(Fixup{words.size(), target, bits});
+    emit(w);
+  }
+
+  static uint32_t imm(int v, int bits) { return static_cast<uint32_t>(v) & ((1u << bits) - 1); }
+
+  void add(uint32_t dr, uint32_t sr1, uint32_t sr2) { emit(0x1000u | dr << 9 | sr1 << 6 | sr2); }
+  void addi(uint32_t dr, uint32_t sr1, int v) { emit(0x1000u | dr << 9 | sr1 << 6 | 0x20 | imm(v, 5)); }
+  void and_(uint32_t dr, uint32_t sr1, uint32_t sr2) { emit(0x5000u | dr << 9 | sr1 << 6 | sr2); }
+  void andi(uint32_t dr, uint32_t sr1, int v) { emit(0x5000u | dr << 9 | sr1 << 6 | 0x20 | imm(v, 5)); }
+  void not_(uint32_t dr, uint32_t sr) { emit(0x903Fu | dr << 9 | sr << 6); }
+  void ld(uint32_t dr, const std::string& l) { emit_rel(0x2000u | dr << 9, l, 9); }
+  void ldi(uint32_t dr, const std::string& l) { emit_rel(0xA000u | dr << 9, l, 9); }
+  void ldr(uint32_t dr, uint32_t base, int v) { emit(0x6000u | dr << 9 | base << 6 | imm(v, 6)); }
+  void lea(uint32_t dr, const std::string& l) { emit_rel(0xE000u | dr << 9, l, 9); }
+  void st(uint32_t sr, const std::string& l) { emit_rel(0x3000u | sr << 9, l, 9); }
+  void sti(uint32_t sr, const std::string& l) { emit_rel(0xB000u | sr << 9, l, 9); }
+  void str(uint32_t sr, uint32_t base, int v) { emit(0x7000u | sr << 9 | base << 6 | imm(v, 6)); }
+  void br(int nzp, const std::string& l) { emit_rel(static_cast<uint32_t>(nzp) << 9, l, 9); }
+  void jsr(const std::string& l) { emit_rel(0x4800u, l, 11); }
+  void ret() { emit(0xC1C0u); }
+  void rti() { emit(0x8000u); }
+  void trap(int vect) { emit(0xF000u | static_cast<uint32_t>(vect)); }
+  void fill(int v) { emit(static_cast<uint32_t>(v)); }
+  void fill_addr(const std::string& l) { emit_rel(0, l, 16); }
+  void blkw(size_t n) { words.insert(words.end(), n, 0); }
+  void stringz(const char* s) {
+    for (; *s; ++s) { emit(static_cast<uint8_t>(*s)); }
+    emit(0);
+  }
+
+  void link() {
+    for (const Fixup& f : fixups) {
+      uint16_t target = labels.at(f.label);
+      if (f.bits == 16) {
+        words[f.index] = target;
+        continue;
+      }
+      int offset = target - (origin + static_cast<int>(f.index) + 1);
+      if (offset < -(1 << (f.bits - 1)) || offset >= (1 << (f.bits - 1))) {
+        fprintf(stderr, "lc3asm: branch to %s out of range\n", f.label.c_str());
+        exit(1);
+      }
+      words[f.index] = static_cast<uint16_t>(words[f.index] | imm(offset, f.bits));
+    }
+  }
+};
+
+enum : uint32_t { R0, R1, R2, R3, R4, R5, R6, R7 };
+#define BR_N 4
+#define BR_Z 2
+#define BR_P 1
+
+// `a` into vm's memory, vm.reg[R_PC] at its first word
+inline void asm_place(Vm& vm, const Asm& a) {
+  memcpy(vm.memory + a.origin, a.words.data(), a.words.size() * sizeof(uint16_t));
+  // same as an image load: the predecoded cache forgets these words,
+  // & they were written (see mem_mark_dirty)
+  invalidate_decoded_range(vm, a.origin, a.words.size());
+  mem_mark_dirty(vm, a.origin, a.words.size());
+  vm.reg[R_PC] = a.origin;
+  vm.reg[R_COND] = FL_ZR0;
+}
+
+// A fresh headless VM with `a` loaded & input[0..size) as its keyboard
+// (the output is kept in memory, so no write syscalls get timed)
+// exits if out of memory
+inline Vm* asm_load(const Asm& a, const char* input, size_t size) {
+  Vm* vm = vm_create_headless(input, size);
+  if (!vm) {
+    fprintf(stderr, "lc3asm: out of memory\n");
+    exit(1);
+  }
+  asm_place(*vm, a);
+  // measure the engines, not the idle detection
+  vm->idle_wait_ms = 0;
+  return vm;
+}
+
+#endif // !LC3ASM_H
@@ -0,0 +1,291 @@
+// Coverage guided fuzzer for LC-3 programs (see fuzz.h)
+// Finds keyboard input that makes a program hit an unused opcode, RTI in user mode,
+// a bad TRAP, ... (anything that stops the VM with an error)
+//
+// With libFuzzer (clang -fsanitize=fuzzer, libFuzzer's main replaces ours)
+//   LC3_FUZZ_IMAGE=a.obj[:b.obj...] lc3fuzz [libFuzzer flags] [corpus dir]
+//   - LC3_FUZZ_BUDGET : instructions per run (default 1000000)
+//   - LC3_FUZZ_ENGINE : switch / threaded / specialized (default threaded)
+//   - the edge counters are libFuzzer "extra counters", an input that
+//     errors aborts, so libFuzzer saves it as a crash
+//
+// Built plain (run.fish), a small fuzzer of its own
+//   lc3fuzz [--engine name] [--max-instructions n] [--runs n] [--seed n]
+//           image.obj [...] [-- input ...]
+//   - no --runs : runs each input file once & prints how it ended
+//   - --runs n  : n runs of mutated inputs, starting from the input files
+//     (or empty input), keeping the ones that cover new edges
+//   -- stops at the first input that errors, saved as crash-<hash>
+#include "../engine.h"
+#include "../fuzz.h"
+#include "../vm.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+#define FUZZ_BUDGET_DEFAULT 1000000
+
+// Edge counters (Vm::coverage), in the section libFuzzer reads extra
+// counters from, it clears them before every run
+__attribute__((used, section("__libfuzzer_extra_counters")))
+static uint8_t coverage[COVERAGE_MAP_SIZE];
+
+static FuzzTarget* target = nullptr;
+static uint64_t budget = FUZZ_BUDGET_DEFAULT;
+static Engine engine = ENGINE_THREADED;
+
+// Loads `images`, ':' separated
+static int load_target(const char* images) {
+  std::vector<std::string> paths;
+  std::string path;
+  for (const char* c = images;; ++c) {
+    if (*c == ':' || *c == '\0') {
+      if (!path.empty()) { paths.push_back(path); }
+      path.clear();
+      if (*c == '\0') { break; }
+    } else {
+      path += *c;
+    }
+  }
+  std::vector<const char*> argv;
+  for (const std::string& p : paths) { argv.push_back(p.c_str()); }
+  size_t failed = 0;
+  target = argv.empty() ? nullptr : fuzz_create(argv.data(), argv.size(), &failed);
+  if (!target) {
+    fprintf(stderr, "Failed to load image: %s\n", argv.empty() ? "(none)" : argv[failed]);
+    return 0;
+  }
+  return 1;
+}
+
+extern "C" int LLVMFuzzerInitialize(int*, char***) {
+  const char* images = getenv("LC3_FUZZ_IMAGE");
+  if (!images) {
+    fprintf(stderr, "LC3_FUZZ_IMAGE isn't set (image.obj[:more.obj...])\n");
+    exit(2);
+  }
+  if (const char* b = getenv("LC3_FUZZ_BUDGET")) { budget = strtoull(b, nullptr, 10); }
+  if (const char* e = getenv("LC3_FUZZ_ENGINE")) {
+    if (!engine_from_name(e, engine)) {
+      fprintf(stderr, "Unknown engine: %s\n", e);
+      exit(2);
+    }
+  }
+  if (!load_target(images)) { exit(1); }
+  return 0;
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+  ExecResult r = fuzz_run(target, data, size, coverage, budget, engine);
+  if (r.status == EXEC_ERROR) {
+    Vm& vm = *fuzz_vm(target);
+    fprintf(stderr, "lc3fuzz: %s at x%04X after %llu instructions\n", vm.error,
+      static_cast<unsigned>(static_cast<uint16_t>(vm.reg[R_PC] - 1)),
+      static_cast<unsigned long long>(r.retired));
+    abort();
+  }
+  return 0;
+}
+
+// ============================
+// ==== Standalone fuzzer =====
+// ============================
+
+static bool read_file(const char* path, std::vector<uint8_t>& bytes) {
+  FILE* file = fopen(path, "rb");
+  if (!file) { return false; }
+  bytes.clear();
+  uint8_t buf[4096];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), file)) > 0) { bytes.insert(bytes.end(), buf, buf + n); }
+  fclose(file);
+  return true;
+}
+
+// Counts into power of 2 buckets (1, 2, 3, 4-7, 8-15, 16-31, 32-127, 128+),
+// one bit each, so looping more often only counts as new now & then
+static uint8_t bucket(uint8_t hits) {
+  if (hits == 0) { return 0; }
+  if (hits <= 3) { return static_cast<uint8_t>(1 << (hits - 1)); }
+  if (hits <= 7) { return 1 << 3; }
+  if (hits <= 15) { return 1 << 4; }
+  if (hits <= 31) { return 1 << 5; }
+  if (hits <= 127) { return 1 << 6; }
+  return 1 << 7;
+}
+
+// Adds this run's buckets to `seen` & clears the counters for the next run
+// returns how many edges hit a bucket they never hit before
+static size_t merge_coverage(uint8_t* seen) {
+  size_t fresh = 0;
+  // a run hits a few hundred of the 65536 at most, skip 64 empty at a time
+  for (size_t w = 0; w < COVERAGE_MAP_SIZE; w += 64) {
+    uint64_t words[8];
+    memcpy(words, coverage + w, sizeof(words));
+    uint64_t any = 0;
+    for (uint64_t word : words) { any |= word; }
+    if (!any) { continue; }
+    for (size_t i = w; i < w + 64; ++i) {
+      uint8_t b = bucket(coverage[i]);
+      if (b && !(seen[i] & b)) {
+        seen[i] |= b;
+        ++fresh;
+      }
+    }
+    memset(coverage + w, 0, 64);
+  }
+  return fresh;
+}
+
+static size_t count_edges(const uint8_t* seen) {
+  size_t n = 0;
+  for (size_t i = 0; i < COVERAGE_MAP_SIZE; ++i) { n += seen[i] != 0; }
+  return n;
+}
+
+// One random change: flip a bit, set a byte, insert, delete or splice
+// in a piece of another corpus entry
+static void mutate(std::vector<uint8_t>& in, const std::vector<std::vector<uint8_t>>& corpus,
+  std::mt19937_64& rng) {
+  auto pick = [&rng](size_t n) { return static_cast<size_t>(rng() % n); };
+  // mostly keys people type, now & then any byte
+  auto key = [&]() {
+    return static_cast<uint8_t>(pick(8) == 0 ? pick(256) : 32 + pick(95));
+  };
+  switch (in.empty() ? 2 : pick(5)) {
+    case 0: in[pick(in.size())] ^= static_cast<uint8_t>(1 << pick(8)); break;
+    case 1: in[pick(in.size())] = key(); break;
+    case 2: in.insert(in.begin() + static_cast<std::ptrdiff_t>(pick(in.size() + 1)), key()); break;
+    case 3: in.erase(in.begin() + static_cast<std::ptrdiff_t>(pick(in.size()))); break;
+    default: {
+      const std::vector<uint8_t>& other = corpus[pick(corpus.size())];
+      if (other.empty()) { break; }
+      size_t from = pick(other.size());
+      size_t len = 1 + pick(other.size() - from);
+      in.insert(in.begin() + static_cast<std::ptrdiff_t>(pick(in.size() + 1)),
+        other.begin() + static_cast<std::ptrdiff_t>(from),
+        other.begin() + static_cast<std::ptrdiff_t>(from + len));
+      break;
+    }
+  }
+}
+
+static void save_crash(const std::vector<uint8_t>& in) {
+  // FNV-1a, names the same input the same way
+  uint32_t h = 2166136261u;
+  for (uint8_t b : in) { h = (h ^ b) * 16777619u; }
+  char path[32];
+  snprintf(path, sizeof(path), "crash-%08x", h);
+  FILE* file = fopen(path, "wb");
+  if (file) {
+    fwrite(in.data(), 1, in.size(), file);
+    fclose(file);
+  }
+  Vm& vm = *fuzz_vm(target);
+  fprintf(stderr, "%s at x%04X, input saved as %s\n", vm.error,
+    static_cast<unsigned>(static_cast<uint16_t>(vm.reg[R_PC] - 1)), path);
+}
+
+static ExecResult run_one(const std::vector<uint8_t>& in) {
+  return fuzz_run(target, in.data(), in.size(), coverage, budget, engine);
+}
+
+static const char* status_name(ExecStatus status) {
+  switch (status) {
+    case EXEC_ERROR: return "error";
+    case EXEC_BUDGET: return "budget";
+    default: return "halted";
+  }
+}
+
+// libFuzzer's main takes over when it's linked in
+__attribute__((weak)) int main(int argc, const char* argv[]) {
+  uint64_t runs = 0;
+  uint64_t seed = 1;
+  std::string images;
+  std::vector<const char*> inputs;
+  bool in_inputs = false;
+  for (int i = 1; i < argc; ++i) {
+    if (in_inputs) {
+      inputs.push_back(argv[i]);
+    } else if (strcmp(argv[i], "--") == 0) {
+      in_inputs = true;
+    } else if (strcmp(argv[i], "--engine") == 0 && i + 1 < argc) {
+      if (!engine_from_name(argv[++i], engine)) {
+        fprintf(stderr, "Unknown engine: %s\n", argv[i]);
+        return 2;
+      }
+    } else if (strcmp(argv[i], "--max-instructions") == 0 && i + 1 < argc) {
+      budget = strtoull(argv[++i], nullptr, 10);
+    } else if (strcmp(argv[i], "--runs") == 0 && i + 1 < argc) {
+      runs = strtoull(argv[++i], nullptr, 10);
+    } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+      seed = strtoull(argv[++i], nullptr, 10);
+    } else {
+      images += images.empty() ? "" : ":";
+      images += argv[i];
+    }
+  }
+  if (images.empty()) {
+    fprintf(stderr, "Usage: lc3fuzz [--engine name] [--max-instructions n] [--runs n] [--seed n]\n"
+      "               image.obj [...] [-- input ...]\n");
+    return 2;
+  }
+  if (!load_target(images.c_str())) { return 1; }
+
+  std::vector<std::vector<uint8_t>> corpus;
+  for (const char* path : inputs) {
+    corpus.emplace_back();
+    if (!read_file(path, corpus.back())) {
+      fprintf(stderr, "Failed to read input: %s\n", path);
+      fuzz_destroy(target);
+      return 1;
+    }
+  }
+
+  std::vector<uint8_t> seen(COVERAGE_MAP_SIZE);
+  int status = 0;
+  if (runs == 0) {
+    // replay
+    for (size_t i = 0; i < corpus.size(); ++i) {
+      ExecResult r = run_one(corpus[i]);
+      merge_coverage(seen.data());
+      Vm& vm = *fuzz_vm(target);
+      printf("%s\t%s\t%llu\t%s\n", inputs[i], status_name(r.status),
+        static_cast<unsigned long long>(r.retired), vm.error ? vm.error : "");
+      if (r.status == EXEC_ERROR) { status = 1; }
+    }
+    printf("edges %zu\n", count_edges(seen.data()));
+    fuzz_destroy(target);
+    return status;
+  }
+
+  if (corpus.empty()) { corpus.emplace_back(); }
+  for (const std::vector<uint8_t>& in : corpus) {
+    run_one(in);
+    merge_coverage(seen.data());
+  }
+  std::mt19937_64 rng(seed);
+  std::vector<uint8_t> in;
+  uint64_t run = 0;
+  for (; run < runs; ++run) {
+    in = corpus[rng() % corpus.size()];
+    // a few changes stacked, small inputs stay small
+    for (uint64_t n = 1 + rng() % 4; n > 0; --n) { mutate(in, corpus, rng); }
+    if (in.size() > 4096) { in.resize(4096); }
+    ExecResult r = run_one(in);
+    if (r.status == EXEC_ERROR) {
+      save_crash(in);
+      status = 1;
+      break;
+    }
+    if (merge_coverage(seen.data()) > 0) { corpus.push_back(in); }
+  }
+  printf("runs %llu  corpus %zu  edges %zu\n", static_cast<unsigned long long>(run),
+    corpus.size(), count_edges(seen.data()));
+  fuzz_destroy(target);
+  return status;
+}
@@ -0,0 +1,114 @@
+// Image loader microbenchmark
+// Writes a full 64K-word image (origin x0000) & times loading it
+// - fread + scalar swap16 loop (how images used to be loaded)
+// - swap16_copy alone (the byte swap, from a buffer already in memory)
+// - read_image (mmap + swap16_copy into vm.memory)
+//
+// Usage: lc3loadbench [iterations]
+// prints the best & median time per load for each, in microseconds
+#include "../memory.h"
+#include "../vm.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+#include <vector>
+
+#define IMAGE_WORDS (MEMORY_MAX - 1)
+
+static double now_us() {
+  return std::chrono::duration<double, std::micro>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void report(const char* name, std::vector<double>& times) {
+  std::sort(times.begin(), times.end());
+  printf("%-24s best %8.1f us   median %8.1f us\n", name, times.front(), times[times.size() / 2]);
+}
+
+// The loader before mmap: one fread into memory, then swap word by word
+static int fread_scalar(Vm& vm, const char* path, uint16_t& pc) {
+  FILE* file = fopen(path, "rb");
+  if (!file) { return 0; }
+  uint16_t origin;
+  if (fread(&origin, sizeof(origin), 1, file) != 1) {
+    fclose(file);
+    return 0;
+  }
+  origin = swap16(origin);
+  pc = origin;
+  uint16_t* p = vm.memory + origin;
+  size_t read = fread(p, sizeof(uint16_t), static_cast<size_t>(MEMORY_MAX - origin), file);
+  while (read-- > 0) {
+    *p = swap16(*p);
+    ++p;
+  }
+  fclose(file);
+  return 1;
+}
+
+int main(int argc, const char* argv[]) {
+  int iterations = argc > 1 ? atoi(argv[1]) : 200;
+  if (iterations < 1) { iterations = 1; }
+
+  // origin + every word after it, big-endian
+  std::vector<uint8_t> bytes(2 + 2 * IMAGE_WORDS);
+  for (size_t i = 0; i < bytes.size(); ++i) {
+    bytes[i] = static_cast<uint8_t>(i * 131 + 7);
+  }
+  bytes[0] = 0;
+  bytes[1] = 0;
+
+  char path[] = "/tmp/lc3loadbench-XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0 || write(fd, bytes.data(), bytes.size()) != static_cast<ssize_t>(bytes.size())) {
+    fprintf(stderr, "Failed to write test image\n");
+    return 1;
+  }
+  close(fd);
+
+  Vm* vm = vm_create(stdin, stdout);
+  if (!vm) {
+    fprintf(stderr, "Out of memory\n");
+    return 1;
+  }
+  uint16_t pc = 0;
+  std::vector<double> times(static_cast<size_t>(iterations));
+
+  printf("%d loads of a %d word image\n", iterations, IMAGE_WORDS);
+
+  for (double& t : times) {
+    double start = now_us();
+    fread_scalar(*vm, path, pc);
+    t = now_us() - start;
+  }
+  report("fread + scalar swap", times);
+
+  for (double& t : times) {
+    double start = now_us();
+    swap16_copy(vm->memory, bytes.data() + 2, IMAGE_WORDS);
+    t = now_us() - start;
+  }
+  report("swap16_copy only", times);
+
+  for (double& t : times) {
+    double start = now_us();
+    read_image(*vm, path, pc);
+    t = now_us() - start;
+  }
+  report("read_image (mmap)", times);
+
+  // check the fast path agrees with the simple one
+  for (size_t i = 0; i < IMAGE_WORDS; ++i) {
+    uint16_t expect = static_cast<uint16_t>((bytes[2 + 2 * i] << 8) | bytes[3 + 2 * i]);
+    if (vm->memory[i] != expect) {
+      fprintf(stderr, "Mismatch at x%04zx\n", i);
+      return 1;
+    }
+  }
+
+  vm_destroy(vm);
+  unlink(path);
+  return 0;
+}
@@ -0,0 +1,248 @@
+// Scheduler check
+// Runs a few hundred interactive sessions (vm_create_session) on a
+// handful of scheduler workers & types into them with input_push
+//
+// Every session echoes the keys it reads until 'q' or EOF, half of them
+// with GETC & half with a KBSR polling loop (what the idle detection
+// parks). Checks, on every engine:
+// - sessions waiting for a key park: the scheduler goes quiet, no
+//   instructions retired, instead of spinning on them
+// - a parked session wakes up on input_push: keys are typed in the
+//   reverse order of sched_add, with far more sessions than workers,
+//   so nothing gets anywhere if waiting sessions held on to a worker
+// - input_close ends a session (EOF_HALT)
+// - every done callback is called once, with EXEC_HALTED & the same
+//   captured output as one run on the switch core with all the input
+//
+// Usage: lc3sched [sessions] [workers]
+// Prints one line per mismatch, exits 1 if there was any
+#include "../console.h"
+#include "../engine.h"
+#include "../input.h"
+#include "../memory.h"
+#include "../ops.h"
+#include "../scheduler.h"
+#include "../vm.h"
+#include "lc3asm.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+
+// ============================
+// ========= Programs =========
+// ============================
+
+// Echoes keys until 'q', R0 = the key
+static void echo_tail(Asm& a) {
+  a.ld(R1, "minus_q");
+  a.add(R1, R0, R1);
+  a.br(BR_Z, "quit");
+  a.trap(TRAP_OUT);
+  a.br(BR_N | BR_Z | BR_P, "loop");
+  a.label("quit");
+  a.trap(TRAP_HALT);
+  a.label("prompt"); a.stringz("> ");
+  a.label("minus_q"); a.fill(-'q');
+}
+
+static void build_getc(Asm& a) {
+  a.lea(R0, "prompt");
+  a.trap(TRAP_PUTS);
+  a.label("loop");
+  a.trap(TRAP_GETC);
+  echo_tail(a);
+}
+
+static void build_poll(Asm& a) {
+  a.lea(R0, "prompt");
+  a.trap(TRAP_PUTS);
+  a.label("loop");
+  a.label("wait");
+  a.ldi(R1, "kbsr");
+  a.br(BR_Z | BR_P, "wait");
+  a.ldi(R0, "kbdr");
+  echo_tail(a);
+  a.label("kbsr"); a.fill(MMR_KBSR);
+  a.label("kbdr"); a.fill(MMR_KBDR);
+}
+
+static const char* const ENGINE_NAMES[] = {"switch", "threaded", "jit", "specialized"};
+
+// Instructions per execute() slice, small so sessions that are busy
+// echoing also go round the queue
+#define SLICE 1000
+
+// How long the scheduler has to stay quiet to count as idle, & how long
+// it gets to get there
+#define QUIET_MS 50
+#define TIMEOUT_MS 10000
+
+// ============================
+// ========= Harness ==========
+// ============================
+
+struct Session {
+  int index{0};
+  const Asm* program{nullptr};
+  std::string typed{};
+  // filled in by the done callback
+  std::atomic<int> calls{0};
+  ExecStatus status{EXEC_ERROR};
+  std::string output{};
+};
+
+static std::atomic<size_t> sessions_done{0};
+
+static void on_done(Vm* vm, ExecStatus status, void* arg) {
+  Session* s = static_cast<Session*>(arg);
+  s->status = status;
+  size_t size = 0;
+  const char* out = console_captured(vm->console, size);
+  s->output.assign(out, size);
+  vm_destroy(vm);
+  s->calls.fetch_add(1);
+  sessions_done.fetch_add(1);
+}
+
+// Waits until no instruction was retired for QUIET_MS (every session
+// parked or done), returns false if that takes longer than TIMEOUT_MS
+static bool settle(Scheduler* s) {
+  uint64_t last = sched_retired(s);
+  for (int waited = 0; waited < TIMEOUT_MS; waited += QUIET_MS) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(QUIET_MS));
+    uint64_t now = sched_retired(s);
+    if (now == last) { return true; }
+    last = now;
+  }
+  return false;
+}
+
+// One run on the switch core with every key already there
+static std::string reference(const Asm& a, const std::string& typed) {
+  Vm* vm = asm_load(a, typed.data(), typed.size());
+  run_engine(ENGINE_SWITCH, *vm);
+  size_t size = 0;
+  const char* out = console_captured(vm->console, size);
+  std::string o(out, size);
+  vm_destroy(vm);
+  return o;
+}
+
+static void push(Vm* vm, const std::string& keys) {
+  if (input_push(vm->input, keys.data(), keys.size()) != keys.size()) {
+    fprintf(stderr, "lc3sched: input queue full\n");
+    exit(1);
+  }
+}
+
+static bool run(const Asm programs[2], Engine engine, size_t count, size_t workers) {
+  const char* name = ENGINE_NAMES[engine];
+  bool ok = true;
+  sessions_done = 0;
+  Scheduler* sched = sched_create(workers, engine, SLICE);
+  std::vector<Session> sessions(count);
+  std::vector<Vm*> vms(count);
+  if (!sched) {
+    fprintf(stderr, "lc3sched: out of memory\n");
+    exit(1);
+  }
+  for (size_t i = 0; i < count; ++i) {
+    Session& s = sessions[i];
+    s.index = static_cast<int>(i);
+    s.program = &programs[i % 2];
+    vms[i] = vm_create_session();
+    if (!vms[i]) {
+      fprintf(stderr, "lc3sched: out of memory\n");
+      exit(1);
+    }
+    asm_place(*vms[i], *s.program);
+    if (!sched_add(sched, vms[i], on_done, &s)) {
+      fprintf(stderr, "lc3sched: out of memory\n");
+      exit(1);
+    }
+  }
+
+  // nothing typed yet, every session prints its prompt & parks
+  if (!settle(sched)) {
+    printf("%s: sessions still running with no input, not parked\n", name);
+    ok = false;
+  }
+
+  // two rounds of keys, last session first
+  for (int round = 0; round < 2 && ok; ++round) {
+    for (size_t i = count; i-- > 0;) {
+      char keys[32];
+      snprintf(keys, sizeof(keys), "%d:%zu ", round, i);
+      sessions[i].typed += keys;
+      push(vms[i], keys);
+    }
+    if (!settle(sched)) {
+      printf("%s: sessions still running after round %d, not parked\n", name, round);
+      ok = false;
+    }
+  }
+  if (ok && sessions_done != 0) {
+    printf("%s: %zu sessions stopped before 'q' or EOF\n", name, sessions_done.load());
+    ok = false;
+  }
+
+  // every other pair of sessions gets 'q', the rest EOF
+  // (either way the VM may be gone right after, it's the callback's)
+  for (size_t i = count; i-- > 0;) {
+    if (i / 2 % 2) {
+      sessions[i].typed += "q";
+      push(vms[i], "q");
+    } else {
+      input_close(vms[i]->input);
+    }
+  }
+  for (int waited = 0; sessions_done < count && waited < TIMEOUT_MS; waited += QUIET_MS) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(QUIET_MS));
+  }
+  if (sessions_done < count) {
+    // the rest never stopped, sched_wait would wait forever
+    printf("%s: %zu of %zu sessions stopped\n", name, sessions_done.load(), count);
+    sched_destroy(sched);
+    return false;
+  }
+  sched_wait(sched);
+  if (sched_retired(sched) == 0) {
+    printf("%s: no instructions retired\n", name);
+    ok = false;
+  }
+  sched_destroy(sched);
+
+  for (Session& s : sessions) {
+    std::string ref = reference(*s.program, s.typed);
+    if (s.calls != 1 || s.status != EXEC_HALTED || s.output != ref) {
+      printf("%s session %d: %d callbacks status %d output \"%s\", switch has \"%s\"\n", name, s.index,
+        s.calls.load(), static_cast<int>(s.status), s.output.c_str(), ref.c_str());
+      ok = false;
+    }
+  }
+  return ok;
+}
+
+int main(int argc, const char* argv[]) {
+  size_t count = argc > 1 ? strtoul(argv[1], nullptr, 10) : 400;
+  size_t workers = argc > 2 ? strtoul(argv[2], nullptr, 10) : 4;
+  if (count == 0 || workers == 0) {
+    fprintf(stderr, "Usage: lc3sched [sessions] [workers]\n");
+    return 2;
+  }
+  Asm programs[2];
+  build_getc(programs[0]);
+  build_poll(programs[1]);
+  for (Asm& a : programs) { a.link(); }
+
+  bool ok = true;
+  for (int e = 0; e < static_cast<int>(sizeof(ENGINE_NAMES) / sizeof(ENGINE_NAMES[0])); ++e) {
+    ok &= run(programs, static_cast<Engine>(e), count, workers);
+  }
+  printf("%s\n", ok ? "ok" : "mismatch");
+  return ok ? 0 : 1;
+}
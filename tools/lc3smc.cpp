@@ -0,0 +1,313 @@
+// Self-modifying code differential check
+// Runs a few built-in programs that rewrite their own code, each from a
+// different store path, on every engine & compares the machine it ends
+// with (memory, registers, flags, output, instructions retired) against
+// one uninterrupted run on the switch core
+//
+// Programs:
+//   fallback  patches a subroutine while interrupts are on (the JIT hands
+//             that stretch to the threaded core), then turns them off
+//             & calls it again from translated code
+//   handler   a keyboard interrupt handler patches a subroutine the main
+//             loop keeps calling
+//   inline    a hot loop rewrites the immediate of an instruction it runs
+//             with STR on every pass
+//   adjacent  stores to the data words right before & after a subroutine
+//             on every pass (the JIT keeps those inline), & now & then
+//             patches one of the subroutine's instructions
+//
+// Every engine runs each program in execute() slices of several sizes (so
+// runs stop & start again around the patches) & on the lockstep lanes
+//
+// Usage: lc3smc
+// Prints one line per mismatch, exits 1 if there was any
+#include "../console.h"
+#include "../engine.h"
+#include "../interrupt.h"
+#include "../lockstep.h"
+#include "../memory.h"
+#include "../ops.h"
+#include "../vm.h"
+#include "lc3asm.h"
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// ============================
+// ========= Programs =========
+// ============================
+
+// ADD R0, R0, #5, what the subroutines get patched to
+#define ADD_R0_5 0x1025
+
+// A loop of `count` passes (R2), long enough to cross a few slices
+static void delay(Asm& a, const char* name, const char* count) {
+  a.label(name);
+  a.ld(R2, count);
+  a.label(std::string(name) + "_loop");
+  a.addi(R2, R2, -1);
+  a.br(BR_P, std::string(name) + "_loop");
+  a.ret();
+}
+
+static void build_fallback(Asm& a) {
+  a.ld(R6, "ustack");
+  a.andi(R0, R0, 0);
+  a.jsr("sub");
+  a.jsr("delay");
+  // interrupts on: the patch below runs on the threaded core under the JIT
+  a.ld(R1, "ie");
+  a.sti(R1, "kbsr");
+  a.ld(R1, "patch");
+  a.st(R1, "sub");
+  a.andi(R1, R1, 0);
+  a.sti(R1, "kbsr");
+  // back to translated code, which must see the patch
+  a.jsr("delay");
+  a.jsr("sub");
+  a.trap(TRAP_HALT);
+  a.label("sub"); a.addi(R0, R0, 1);
+  a.ret();
+  delay(a, "delay", "count");
+  a.label("count"); a.fill(2000);
+  a.label("ustack"); a.fill(0xF000);
+  a.label("ie"); a.fill(KBSR_IE);
+  a.label("kbsr"); a.fill(MMR_KBSR);
+  a.label("patch"); a.fill(ADD_R0_5);
+}
+
+static void build_handler(Asm& a) {
+  a.ld(R6, "ustack");
+  a.lea(R1, "isr");
+  a.sti(R1, "vector");
+  a.andi(R0, R0, 0);
+  a.andi(R3, R3, 0);
+  a.label("loop");
+  a.jsr("sub");
+  a.addi(R3, R3, 1);
+  // the key is taken once IE goes on, 1000 passes in
+  a.ld(R1, "on_at");
+  a.add(R1, R3, R1);
+  a.br(BR_N | BR_P, "skip");
+  a.ld(R1, "ie");
+  a.sti(R1, "kbsr");
+  a.label("skip");
+  a.ld(R1, "passes");
+  a.add(R1, R3, R1);
+  a.br(BR_N, "loop");
+  a.trap(TRAP_HALT);
+  a.label("sub"); a.addi(R0, R0, 1);
+  a.ret();
+  a.label("isr");
+  a.ld(R1, "patch");
+  a.st(R1, "sub");
+  a.andi(R1, R1, 0);
+  a.sti(R1, "kbsr");
+  a.ldi(R1, "kbdr");
+  a.rti();
+  a.label("ustack"); a.fill(0xF000);
+  a.label("vector"); a.fill(INTERRUPT_VECTOR_TABLE + KEYBOARD_VECTOR);
+  a.label("ie"); a.fill(KBSR_IE);
+  a.label("kbsr"); a.fill(MMR_KBSR);
+  a.label("kbdr"); a.fill(MMR_KBDR);
+  a.label("patch"); a.fill(ADD_R0_5);
+  a.label("on_at"); a.fill(-1000);
+  a.label("passes"); a.fill(-3000);
+}
+
+static void build_inline(Asm& a) {
+  a.andi(R0, R0, 0);
+  a.ld(R3, "passes");
+  a.lea(R4, "sub");
+  a.label("loop");
+  // sub's immediate = the low 4 bits of the pass count
+  a.andi(R1, R3, 15);
+  a.ld(R2, "base");
+  a.add(R1, R1, R2);
+  a.str(R1, R4, 0);
+  a.jsr("sub");
+  a.addi(R3, R3, -1);
+  a.br(BR_P, "loop");
+  a.trap(TRAP_HALT);
+  a.label("sub"); a.addi(R0, R0, 0);
+  a.ret();
+  a.label("passes"); a.fill(5000);
+  a.label("base"); a.fill(0x1020);
+}
+
+static void build_adjacent(Asm& a) {
+  a.andi(R0, R0, 0);
+  a.andi(R5, R5, 0);
+  a.ld(R3, "passes");
+  a.lea(R4, "before");
+  a.label("loop");
+  a.str(R3, R4, 0);
+  a.str(R3, R4, 4);
+  a.jsr("sub");
+  // every 256 passes one of sub's ADDs gets a new immediate (R5, the
+  // patches so far), the first one & the second one in turn
+  a.ld(R1, "low8");
+  a.and_(R1, R3, R1);
+  a.br(BR_N | BR_P, "next");
+  a.addi(R5, R5, 1);
+  a.andi(R2, R5, 15);
+  a.ld(R1, "base");
+  a.add(R2, R2, R1);
+  a.andi(R1, R5, 1);
+  a.br(BR_P, "second");
+  a.str(R2, R4, 1);
+  a.br(BR_N | BR_Z | BR_P, "next");
+  a.label("second");
+  a.str(R2, R4, 2);
+  a.label("next");
+  a.addi(R3, R3, -1);
+  a.br(BR_P, "loop");
+  a.trap(TRAP_HALT);
+  a.label("before"); a.fill(0);
+  a.label("sub"); a.addi(R0, R0, 1);
+  a.addi(R0, R0, 2);
+  a.ret();
+  a.label("after"); a.fill(0);
+  a.label("passes"); a.fill(3000);
+  a.label("low8"); a.fill(0xFF);
+  // ADD R0, R0, #0, the immediate added in
+  a.label("base"); a.fill(0x1020);
+}
+
+struct Program {
+  const char* name;
+  void (*build)(Asm& a);
+  const char* input;
+};
+
+static const Program PROGRAMS[] = {
+  {"fallback", build_fallback, ""},
+  {"handler", build_handler, "k"},
+  {"inline", build_inline, ""},
+  {"adjacent", build_adjacent, ""},
+};
+
+static const char* const ENGINE_NAMES[] = {"switch", "threaded", "jit", "specialized"};
+
+// execute() slice sizes, 0: one run_engine call
+static const uint64_t SLICES[] = {0, 1000, 97};
+
+// ============================
+// ========= Harness ==========
+// ============================
+
+static Vm* load(const Asm& a, const Program& p) {
+  return asm_load(a, p.input, strlen(p.input));
+}
+
+// What a run ended with
+struct Outcome {
+  std::vector<uint16_t> memory;
+  uint16_t reg[R_COUNT];
+  uint16_t cond;
+  std::string output;
+  uint64_t retired;
+  int running;
+  std::string error;
+};
+
+static Outcome outcome(Vm& vm, uint64_t retired) {
+  Outcome o{};
+  o.memory.assign(vm.memory, vm.memory + MEMORY_MAX);
+  memcpy(o.reg, vm.reg, sizeof(o.reg));
+  // R_COND is only brought up to date lazily, the flags are what count
+  o.reg[R_COND] = 0;
+  o.cond = cond_flags(vm);
+  size_t size = 0;
+  const char* out = console_captured(vm.console, size);
+  o.output.assign(out, size);
+  o.retired = retired;
+  o.running = vm.running;
+  o.error = vm.error ? vm.error : "";
+  return o;
+}
+
+static Outcome run(const Asm& a, const Program& p, Engine engine, uint64_t slice) {
+  Vm* vm = load(a, p);
+  uint64_t retired = 0;
+  if (slice == 0) {
+    retired = run_engine(engine, *vm);
+  } else {
+    for (;;) {
+      ExecResult r = execute(*vm, slice, engine);
+      retired += r.retired;
+      if (r.status != EXEC_BUDGET) { break; }
+    }
+  }
+  Outcome o = outcome(*vm, retired);
+  vm_destroy(vm);
+  return o;
+}
+
+// Every lane has the same program & input, lane 0 is compared
+static Outcome run_lanes(const Asm& a, const Program& p, LockstepIsa isa) {
+  Vm* vms[LOCKSTEP_LANES];
+  uint64_t retired[LOCKSTEP_LANES];
+  for (Vm*& vm : vms) { vm = load(a, p); }
+  run_lockstep(vms, LOCKSTEP_LANES, retired, UINT64_MAX, isa);
+  Outcome o = outcome(*vms[0], retired[0]);
+  for (Vm* vm : vms) { vm_destroy(vm); }
+  return o;
+}
+
+// Prints what differs, returns false if anything does
+static bool same(const char* program, const char* what, const Outcome& ref, const Outcome& o) {
+  bool ok = true;
+  for (size_t addr = 0; addr < MEMORY_MAX; ++addr) {
+    if (ref.memory[addr] != o.memory[addr]) {
+      printf("%s %s: memory[x%04zX] = x%04X, switch has x%04X\n", program, what, addr,
+        o.memory[addr], ref.memory[addr]);
+      ok = false;
+      break;
+    }
+  }
+  for (int r = 0; r < R_COUNT; ++r) {
+    if (ref.reg[r] != o.reg[r]) {
+      printf("%s %s: reg[%d] = x%04X, switch has x%04X\n", program, what, r, o.reg[r], ref.reg[r]);
+      ok = false;
+    }
+  }
+  if (ref.cond != o.cond || ref.output != o.output || ref.retired != o.retired
+      || ref.running != o.running || ref.error != o.error) {
+    printf("%s %s: flags %u output \"%s\" retired %llu error \"%s\", switch has %u \"%s\" %llu \"%s\"\n",
+      program, what, o.cond, o.output.c_str(), static_cast<unsigned long long>(o.retired), o.error.c_str(),
+      ref.cond, ref.output.c_str(), static_cast<unsigned long long>(ref.retired), ref.error.c_str());
+    ok = false;
+  }
+  return ok;
+}
+
+int main() {
+  bool ok = true;
+  for (const Program& p : PROGRAMS) {
+    Asm a;
+    p.build(a);
+    a.link();
+    Outcome ref = run(a, p, ENGINE_SWITCH, 0);
+
+    for (int e = 0; e < static_cast<int>(sizeof(ENGINE_NAMES) / sizeof(ENGINE_NAMES[0])); ++e) {
+      for (uint64_t slice : SLICES) {
+        char what[64];
+        if (slice == 0) {
+          snprintf(what, sizeof(what), "%s", ENGINE_NAMES[e]);
+        } else {
+          snprintf(what, sizeof(what), "%s in slices of %llu", ENGINE_NAMES[e],
+            static_cast<unsigned long long>(slice));
+        }
+        ok &= same(p.name, what, ref, run(a, p, static_cast<Engine>(e), slice));
+      }
+    }
+    for (int isa = 0; isa <= static_cast<int>(lockstep_best_isa()); ++isa) {
+      std::string what = std::string("lockstep-") + lockstep_isa_name(static_cast<LockstepIsa>(isa));
+      ok &= same(p.name, what.c_str(), ref, run_lanes(a, p, static_cast<LockstepIsa>(isa)));
+    }
+  }
+  printf("%s\n", ok ? "ok" : "mismatch");
+  return ok ? 0 : 1;
+}
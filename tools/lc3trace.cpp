@@ -0,0 +1,68 @@
+// Offline trace decoder
+// Reads a binary trace written by `vm --trace` / `vm --trace-last`
+// and prints one line of disassembly per executed instruction
+//
+// Usage: lc3trace <trace-file>
+// ex. output line:
+//   x3004  1265  ADD R1, R1, #5            R1=x0005  COND=P
+#include "../disasm.h"
+#include "../trace.h"
+#include <cstdio>
+#include <cstring>
+
+static char cond_char(uint8_t cond) {
+  switch (cond) {
+    case 1 << 0: return 'P';
+    case 1 << 1: return 'Z';
+    case 1 << 2: return 'N';
+    default: return '?';
+  }
+}
+
+int main(int argc, const char* argv[]) {
+  if (argc != 2) {
+    fprintf(stderr, "Usage: lc3trace <trace-file>\n");
+    return 2;
+  }
+
+  FILE* file = fopen(argv[1], "rb");
+  if (!file) {
+    fprintf(stderr, "Failed to open trace: %s\n", argv[1]);
+    return 1;
+  }
+
+  TraceHeader header;
+  if (fread(&header, sizeof(header), 1, file) != 1
+      || memcmp(header.magic, "LC3T", 4) != 0) {
+    fprintf(stderr, "Not a trace file: %s\n", argv[1]);
+    fclose(file);
+    return 1;
+  }
+  if (header.version != TRACE_VERSION || header.record_size != sizeof(TraceRecord)) {
+    fprintf(stderr, "Unsupported trace version %u (record size %u)\n",
+      header.version, header.record_size);
+    fclose(file);
+    return 1;
+  }
+
+  // decode in chunks, traces are usually millions of records
+  TraceRecord records[4096];
+  size_t n;
+  char text[64];
+  while ((n = fread(records, sizeof(TraceRecord), 4096, file)) > 0) {
+    for (size_t i = 0; i < n; ++i) {
+      const TraceRecord& rec = records[i];
+      disassemble(rec.pc, rec.instr, text, sizeof(text));
+      if (rec.dr == TRACE_NO_REG) {
+        printf("x%04x  %04x  %-24s  %-8s  COND=%c\n",
+          rec.pc, rec.instr, text, "", cond_char(rec.cond));
+      } else {
+        printf("x%04x  %04x  %-24s  R%u=x%04x  COND=%c\n",
+          rec.pc, rec.instr, text, rec.dr, rec.dr_val, cond_char(rec.cond));
+      }
+    }
+  }
+
+  fclose(file);
+  return 0;
+}
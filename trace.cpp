@@ -0,0 +1,166 @@
+#include "trace.h"
+#include "memory.h"
+#include "ops.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+
+bool trace_enabled = false;
+
+// Ring storage, capacity is always a power of 2 so `index & ring_mask` wraps
+static TraceRecord* ring = nullptr;
+static size_t ring_mask = 0;
+// head : next slot the VM (producer) writes
+// tail : next slot the writer thread (consumer) reads
+// Both only ever increase, `head - tail` is the number of unread records
+static std::atomic<size_t> ring_head{0};
+static std::atomic<size_t> ring_tail{0};
+
+static FILE* trace_file = nullptr;
+static bool flight_mode = false;
+// how many records flight mode keeps (the ring itself may be bigger)
+static size_t flight_count = 0;
+
+static std::thread writer;
+static std::atomic<bool> writer_stop{false};
+
+static size_t round_up_pow2(size_t n) {
+  size_t cap = 1;
+  while (cap < n) { cap <<= 1; }
+  return cap;
+}
+
+static int open_common(const char* path, size_t capacity) {
+  trace_file = fopen(path, "wb");
+  if (!trace_file) { return 0; }
+
+  TraceHeader header;
+  memcpy(header.magic, "LC3T", 4);
+  header.version = TRACE_VERSION;
+  header.record_size = sizeof(TraceRecord);
+  fwrite(&header, sizeof(header), 1, trace_file);
+
+  capacity = round_up_pow2(capacity);
+  ring = static_cast<TraceRecord*>(calloc(capacity, sizeof(TraceRecord)));
+  if (!ring) {
+    fclose(trace_file);
+    trace_file = nullptr;
+    return 0;
+  }
+  ring_mask = capacity - 1;
+  ring_head.store(0, std::memory_order_relaxed);
+  ring_tail.store(0, std::memory_order_relaxed);
+  trace_enabled = true;
+  return 1;
+}
+
+// Writes records [from, to) to the file
+// the range can wrap around the end of the ring, so it's at most 2 fwrites
+static void write_range(size_t from, size_t to) {
+  while (from != to) {
+    size_t idx = from & ring_mask;
+    size_t n = to - from;
+    if (idx + n > ring_mask + 1) { n = ring_mask + 1 - idx; }
+    fwrite(ring + idx, sizeof(TraceRecord), n, trace_file);
+    from += n;
+  }
+}
+
+// Background consumer for streaming mode
+static void writer_loop() {
+  for (;;) {
+    size_t tail = ring_tail.load(std::memory_order_relaxed);
+    size_t head = ring_head.load(std::memory_order_acquire);
+    if (head != tail) {
+      write_range(tail, head);
+      // only now can the producer reuse those slots
+      ring_tail.store(head, std::memory_order_release);
+    } else if (writer_stop.load(std::memory_order_acquire)) {
+      return;
+    } else {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  }
+}
+
+// 64K records (512KB) is plenty of slack for the writer thread
+int trace_open_stream(const char* path) {
+  if (!open_common(path, 1 << 16)) { return 0; }
+  flight_mode = false;
+  writer_stop.store(false);
+  writer = std::thread(writer_loop);
+  return 1;
+}
+
+int trace_open_flight(const char* path, size_t count) {
+  if (count == 0) { count = 1; }
+  if (!open_common(path, count)) { return 0; }
+  flight_mode = true;
+  flight_count = count;
+  return 1;
+}
+
+// Which register an instruction wrote
+// TRAP writes R7 too, but R0 is the interesting one (GETC/IN)
+// and R7 can be recovered from the PC
+static uint8_t written_reg(uint16_t instr) {
+  switch (instr >> 12) {
+    case OP_ADD:
+    case OP_AND:
+    case OP_NOT:
+    case OP_LD:
+    case OP_LDI:
+    case OP_LDR:
+    case OP_LEA:
+      return static_cast<uint8_t>((instr >> 9) & 0x7);
+    case OP_JSR:
+      return R_R7;
+    case OP_TRAP:
+      return R_R0;
+    default:
+      return TRACE_NO_REG;
+  }
+}
+
+void trace_step(const Vm& vm, uint16_t pc, uint16_t instr) {
+  size_t head = ring_head.load(std::memory_order_relaxed);
+
+  if (!flight_mode) {
+    // streaming mode never drops records, wait for the writer to catch up
+    while (head - ring_tail.load(std::memory_order_acquire) > ring_mask) {
+      std::this_thread::yield();
+    }
+  }
+
+  TraceRecord& rec = ring[head & ring_mask];
+  rec.pc = pc;
+  rec.instr = instr;
+  rec.dr = written_reg(instr);
+  rec.cond = static_cast<uint8_t>(cond_flags(vm));
+  rec.dr_val = rec.dr == TRACE_NO_REG ? 0 : vm.reg[rec.dr];
+
+  ring_head.store(head + 1, std::memory_order_release);
+}
+
+void trace_close() {
+  if (!trace_file) { return; }
+  trace_enabled = false;
+
+  if (flight_mode) {
+    // only the newest `flight_count` records, oldest first
+    size_t head = ring_head.load(std::memory_order_relaxed);
+    size_t from = head > flight_count ? head - flight_count : 0;
+    write_range(from, head);
+  } else {
+    writer_stop.store(true, std::memory_order_release);
+    writer.join();
+  }
+
+  fclose(trace_file);
+  trace_file = nullptr;
+  free(ring);
+  ring = nullptr;
+}
@@ -0,0 +1,63 @@
+#ifndef TRACE_H
+#define TRACE_H
+#include <cstddef>
+#include <cstdint>
+#include "vm.h"
+
+// ============================
+// ========= Tracing ==========
+// ============================
+// Optional execution trace, off by default
+// - Each executed instruction becomes one fixed-size binary TraceRecord
+// - Records go into a lock-free single-producer/single-consumer ring buffer
+// - Streaming mode: a background thread drains the ring into a file
+// - Flight recorder mode: the ring just keeps overwriting, and only the
+//   last N records are written to the file when the VM exits
+//
+// Use `tools/lc3trace` to turn a trace file back into readable disassembly
+
+// Written into TraceRecord::dr when the instruction writes no register
+#define TRACE_NO_REG 0xFF
+
+// File layout:
+// TraceHeader, followed by `TraceRecord`s until end of file
+// (all little-endian, host layout)
+struct TraceHeader {
+  char magic[4];        // "LC3T"
+  uint16_t version;     // TRACE_VERSION
+  uint16_t record_size; // sizeof(TraceRecord)
+};
+
+#define TRACE_VERSION 1
+
+// 8 bytes per executed instruction
+struct TraceRecord {
+  uint16_t pc;      // address the instruction was fetched from
+  uint16_t instr;   // the raw instruction
+  uint8_t dr;       // register the instruction wrote, or TRACE_NO_REG
+  uint8_t cond;     // R_COND after the instruction
+  uint16_t dr_val;  // new value of `dr` (the register delta)
+};
+
+// Checked by the main loop before calling trace_step,
+// so tracing costs a single predictable branch when it's off
+extern bool trace_enabled;
+
+// Start streaming every record into `path`
+// returns 0 if the file couldn't be opened
+int trace_open_stream(const char* path);
+
+// Keep only the last `count` records in memory, written to `path` on trace_close
+// returns 0 if the file couldn't be opened
+int trace_open_flight(const char* path, size_t count);
+
+// Record the instruction `vm` just executed
+// - `pc` is the address it was fetched from (not the incremented PC)
+// - There is one trace per process, only one VM should be traced
+void trace_step(const Vm& vm, uint16_t pc, uint16_t instr);
+
+// Drain whatever is left in the ring, stop the writer thread & close the file
+// Safe to call more than once, or when tracing was never opened
+void trace_close();
+
+#endif // !TRACE_H
@@ -1,37 +1,27 @@
+#include <chrono>
 #include <csignal>
 #include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
 #include <iostream>
+#include <iterator>
 #include <ostream>
+#include <string>
+#include <vector>
 #include "ops.h"
 #include "memory.h"
-
-// ============================
-// ==== Condition Flags =======
-// ============================
-// provide info about most recently executed calculation
-// can be used to check things like `if (x > 0)`
-//
-// LC-3 will only have 3 condition flags,
-// indicating if prev. calc. was Positive, Negative, or Zero
-enum ConditionFlag {
-  FL_POS = 1 << 0, // Positive 001
-  FL_ZR0 = 1 << 1, // Zero     010
-  FL_NEG = 1 << 2, // Negative 100
-};
-
-// - Call with the register that was updated
-// Any time a value is written to a register, we have to update the
-// R_COND condition flags to indicate it's sign
-// This is to be called AFTER the Instruction is executed whenever a reg is changed
-void update_cond_flags(uint16_t write_reg) {
-  if (reg[write_reg] == 0) {
-    reg[R_COND] = FL_ZR0;
-  } else if (reg[write_reg] >> 15) { // 1 in leftmost bit indicates negative
-    reg[R_COND] = FL_NEG;
-  } else {
-    reg[R_COND] = FL_POS;
-  }
-}
+#include "engine.h"
+#include "trace.h"
+#include "vm.h"
+#include "batch.h"
+#include "snapshot.h"
+#include "console.h"
+#include "profile.h"
+#include "replay.h"
+#include "debug.h"
+#include "input.h"
+#include <unistd.h>
 
 // ============================
 // ======= Procedure ==========
@@ -41,32 +31,256 @@ void update_cond_flags(uint16_t write_reg) {
 // 3. Look at the opcode of the instruction to decide what instruction it should perform
 // 4. Perform the instruction using the params in the instruction
 // 5. Go back to step 1
+// (engine.h has the interpreter cores which run this loop)
+
+// Ctrl-C only flags the run to stop, main leaves the way it always does
+// (trace written, terminal restored), a signal handler can't safely do
+// any of that in the middle of an instruction
+static volatile sig_atomic_t interrupted = 0;
+// The VM it stops: `running` is cleared (a sig_atomic_t store), so it
+// stops after the instruction it's in, & a GETC/IN waiting for a key is
+// woken through the input (the slices in main catch what never looks at
+// `running`, ex. translated loops)
+static Vm* volatile interrupted_vm = nullptr;
+static_assert(sizeof(sig_atomic_t) == sizeof(Vm::running), "Vm::running is stored as a sig_atomic_t");
+
+// Instructions between looks at `interrupted` (a few ms of running)
+#define INTERRUPT_SLICE (UINT64_C(1) << 20)
 
 void handle_interrupt(int signal) {
-  restore_input_buffering();
-  printf("\n");
-  exit(-2);
+  if (interrupted) {
+    // a second Ctrl-C: whatever didn't stop for the first (the debugger
+    // waiting for a command), leave right away
+    restore_input_buffering();
+    _exit(-2);
+  }
+  interrupted = 1;
+  Vm* vm = interrupted_vm;
+  if (vm) {
+    *reinterpret_cast<volatile sig_atomic_t*>(&vm->running) = 0;
+    input_interrupt(vm->input);
+  }
 }
 
-int main(int argc, const char* argv[]) { 
+// Whole file into `data`, returns false if it can't be read
+static bool read_file(const char* path, std::string& data) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file) { return false; }
+  data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+  return !file.bad();
+}
 
-  signal(SIGINT, handle_interrupt);
-  disable_input_buffering();
+int main(int argc, const char* argv[]) { 
 
   if (argc < 2) {
-    std::cout << "Usage: vm [image-file1] ..." << std::endl;
+    std::cout << "Usage: vm [--engine switch|threaded|jit|specialized] [--stats]"
+                 " [--trace file | --trace-last count file]"
+                 " [--save-snapshot file] [--restore-snapshot file] [--save-diff file] [--restore-diff file]"
+                 " [--idle-wait ms] [--profile file]"
+                 " [--headless [--input file] [--output file]] [--on-eof continue|halt|error]"
+                 " [--max-instructions n] [--record file | --replay file]"
+                 " [--debug | --debug-socket path]"
+                 " [image-file1] ...\n"
+                 "       vm --batch dir|manifest [--jobs n] [--summary file] [--engine name]"
+                 " [--on-eof policy] [--max-instructions n] [--lockstep]" << std::endl;
     exit(2);
   }
 
+  // --batch : run many images without a console, see batch.h
   for (int i = 1; i < argc; ++i) {
-    if (!read_image(argv[i], reg[R_PC])) {
-      std::cerr << "Failed to load image: " << argv[i] << std::endl;
+    if (strcmp(argv[i], "--batch") == 0) {
+      return batch_main(argc, argv);
+    }
+  }
+
+  // --headless : never touch the terminal, keyboard input is --input file
+  // (or nothing), output is kept in memory & written to stdout (or --output
+  // file) once the VM stops, reading past the input HALTs (see --on-eof)
+  // --debug : debugger commands on stdin, replies on stdout (see debug.h),
+  // so the program itself runs headless
+  // --debug-socket <path> : debugger commands from one client of a unix
+  // socket at path, the program keeps the terminal
+  bool headless = false;
+  bool debug = false;
+  const char* debug_socket = nullptr;
+  const char* input_path = nullptr;
+  const char* output_path = nullptr;
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--headless") == 0) {
+      headless = true;
+    } else if (strcmp(argv[i], "--debug") == 0) {
+      headless = true;
+      debug = true;
+    } else if (strcmp(argv[i], "--debug-socket") == 0 && i + 1 < argc) {
+      debug_socket = argv[++i];
+    } else if (strcmp(argv[i], "--input") == 0 && i + 1 < argc) {
+      input_path = argv[++i];
+    } else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+      output_path = argv[++i];
+    }
+  }
+
+  Vm* vm = nullptr;
+  if (headless) {
+    std::string input;
+    if (input_path && !read_file(input_path, input)) {
+      std::cerr << "Failed to read input: " << input_path << std::endl;
       exit(1);
     }
+    vm = vm_create_headless(input.data(), input.size());
+  } else {
+    signal(SIGINT, handle_interrupt);
+    disable_input_buffering();
+    vm = vm_create(stdin, stdout);
+  }
+  if (!vm) {
+    std::cerr << "Out of memory" << std::endl;
+    exit(1);
+  }
+  interrupted_vm = vm;
+  // interactive: a prompt without a newline still shows up within 50ms
+  if (!headless && isatty(STDOUT_FILENO)) {
+    console_start_timer(vm->console, 50);
   }
 
   // set initial condition flag register to zero
-  reg[R_COND] = FL_ZR0;
+  // (a restored snapshot brings its own)
+  vm->reg[R_COND] = FL_ZR0;
+
+  Engine engine = ENGINE_THREADED;
+  bool print_stats = false;
+  const char* save_snapshot = nullptr;
+  const char* save_diff = nullptr;
+  const char* profile_path = nullptr;
+  uint64_t max_instructions = UINT64_MAX;
+  std::vector<const char*> images;
+
+  for (int i = 1; i < argc; ++i) {
+    // already handled above
+    if (strcmp(argv[i], "--headless") == 0 || strcmp(argv[i], "--debug") == 0) {
+      continue;
+    }
+    if ((strcmp(argv[i], "--input") == 0 || strcmp(argv[i], "--output") == 0
+        || strcmp(argv[i], "--debug-socket") == 0) && i + 1 < argc) {
+      ++i;
+      continue;
+    }
+    // --on-eof <policy> : what reading past the end of the input does (see vm.h)
+    if (strcmp(argv[i], "--on-eof") == 0 && i + 1 < argc) {
+      if (!eof_policy_from_name(argv[++i], vm->eof_policy)) {
+        std::cerr << "Unknown --on-eof policy: " << argv[i] << std::endl;
+        exit(2);
+      }
+      continue;
+    }
+    // --engine <name> : which interpreter core to run
+    if (strcmp(argv[i], "--engine") == 0 && i + 1 < argc) {
+      if (!engine_from_name(argv[++i], engine)) {
+        std::cerr << "Unknown engine: " << argv[i] << std::endl;
+        exit(2);
+      }
+      continue;
+    }
+    // --idle-wait <ms> : sleep up to ms at a time while the program only
+    // polls the keyboard (see idle.h), 0 keeps spinning
+    if (strcmp(argv[i], "--idle-wait") == 0 && i + 1 < argc) {
+      vm->idle_wait_ms = atoi(argv[++i]);
+      continue;
+    }
+    // --max-instructions <n> : stop after about n instructions even if the
+    // program hasn't HALTed (checked once per basic block, see engine.h)
+    if (strcmp(argv[i], "--max-instructions") == 0 && i + 1 < argc) {
+      max_instructions = strtoull(argv[++i], nullptr, 10);
+      continue;
+    }
+
+    // --record <file> : log every key the program reads, with when it read it
+    // --replay <file> : read the keys from such a log instead (see replay.h)
+    if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+      if (!replay_record(*vm, argv[++i])) {
+        std::cerr << "Failed to open recording: " << argv[i] << std::endl;
+        exit(1);
+      }
+      continue;
+    }
+    if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+      if (!replay_open(*vm, argv[++i])) {
+        std::cerr << "Failed to read recording: " << argv[i] << std::endl;
+        exit(1);
+      }
+      continue;
+    }
+
+    // --stats : print instructions retired & MIPS to stderr on exit
+    if (strcmp(argv[i], "--stats") == 0) {
+      print_stats = true;
+      continue;
+    }
+    // --trace <file> : stream every executed instruction into file
+    if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+      if (!trace_open_stream(argv[++i])) {
+        std::cerr << "Failed to open trace file: " << argv[i] << std::endl;
+        exit(1);
+      }
+      continue;
+    }
+    // --trace-last <count> <file> : flight recorder, keep the last `count`
+    // instructions in memory & write them to file on exit
+    if (strcmp(argv[i], "--trace-last") == 0 && i + 2 < argc) {
+      size_t count = strtoull(argv[++i], nullptr, 10);
+      if (!trace_open_flight(argv[++i], count)) {
+        std::cerr << "Failed to open trace file: " << argv[i] << std::endl;
+        exit(1);
+      }
+      continue;
+    }
+    // --profile <file> : count executions per address & call stack,
+    // write a report to file & the stacks to file.folded on exit
+    if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+      profile_path = argv[++i];
+      continue;
+    }
+    // --save-snapshot <file> : once the program HALTs, save the machine to file
+    if (strcmp(argv[i], "--save-snapshot") == 0 && i + 1 < argc) {
+      save_snapshot = argv[++i];
+      continue;
+    }
+    // --restore-snapshot <file> : start from a saved machine instead of booting
+    // (images are loaded on top of it)
+    if (strcmp(argv[i], "--restore-snapshot") == 0 && i + 1 < argc) {
+      if (!snapshot_restore(*vm, argv[++i])) {
+        std::cerr << "Failed to restore snapshot: " << argv[i] << std::endl;
+        exit(1);
+      }
+      // --save-diff is against the restored machine
+      mem_clear_dirty(*vm);
+      continue;
+    }
+    // --save-diff <file> : once the program HALTs, save what changed since it
+    // started (since the restored snapshot & diffs, if any) to file
+    if (strcmp(argv[i], "--save-diff") == 0 && i + 1 < argc) {
+      save_diff = argv[++i];
+      continue;
+    }
+    // --restore-diff <file> : apply a diff on top of the restored snapshot
+    // (diffs go in the order they were saved)
+    if (strcmp(argv[i], "--restore-diff") == 0 && i + 1 < argc) {
+      if (!snapshot_restore_diff(*vm, argv[++i])) {
+        std::cerr << "Failed to restore diff: " << argv[i] << std::endl;
+        exit(1);
+      }
+      mem_clear_dirty(*vm);
+      continue;
+    }
+    images.push_back(argv[i]);
+  }
+
+  // every image in one pass, checked before any is copied in
+  size_t failed = 0;
+  if (!images.empty() && !read_images(*vm, images.data(), images.size(), vm->reg[R_PC], &failed)) {
+    std::cerr << "Failed to load image: " << images[failed] << std::endl;
+    exit(1);
+  }
 
   // set program counter register to starting memory position
   // 0x3000 is default
@@ -75,98 +289,89 @@ int main(int argc, const char* argv[]) {
 
   // exit(0);
 
-  int running = 1;
-  while (running) {
-    // Get the instruction then increment PC register
-    uint16_t instr = memory[reg[R_PC]++];
-    // uint16_t instr = mem_read(reg[R_PC]);
-    // mem_write(reg[R_PC], instr + 1);
-    // opcode : first 4 bits of instruction
-    uint16_t opcode = static_cast<uint16_t>(instr >> 12);
-    std::cout << "PC: x" << std::hex << reg[R_PC]
-              << ", Instruction: x" << instr
-              << ", Opcode: x" << opcode << std::endl;
-     
-    switch (opcode)
-    {
-    case OP_ADD: {
-      add(instr);
-      update_cond_flags(static_cast<uint16_t>((instr >> 9) & 0x7));
-      break;
-    }
-    case OP_AND: {
-      bitwise_and(instr);
-      update_cond_flags(static_cast<uint16_t>((instr >> 9) & 0b0111));
-      break;
-    }
-    case OP_NOT: {
-      bitwise_complement(instr);
-      update_cond_flags(static_cast<uint16_t>((instr >> 9) & 0b111));
-      break;
-    }
-    case OP_BR: {
-      branch(instr);
-      break;
-    }
-    case OP_JMP: {
-      jump(instr);
-      break;
-    }
-    case OP_JSR: {
-      jump_subr(instr);
-      break;
-    }
-    case OP_LD: {
-      load(instr);
-      update_cond_flags(static_cast<uint16_t>((instr >> 9) & 0b111));
-      break;
-    }
-    case OP_LDI: {
-      load_indirect(instr);
-      update_cond_flags(static_cast<uint16_t>((instr >> 9) & 0b111));
-      break;
-    }
-    case OP_LDR: {
-      load_base_offset(instr);
-      update_cond_flags(static_cast<uint16_t>((instr >> 9) & 0b111));
-      break;
-    }
-    case OP_LEA: {
-      load_effective_addr(instr);
-      update_cond_flags(static_cast<uint16_t>((instr >> 9) & 0b111));
-      break;
-    }
-    case OP_ST: {
-      store(instr);
-      break;
-    }
-    case OP_STI: {
-      store_indirect(instr);
-      break;
-    }
-    case OP_STR: {
-      store_base_offset(instr);
-      break;
-    }
-    case OP_TRAP: {
-      trap(instr, update_cond_flags, &running);
-      break;
-    }
-    case OP_RES:
-    case OP_RTI: {
-      std::cerr << "Unused opcode" << std::endl;
-      restore_input_buffering();
-      abort();
-    }
-    default: {
-      std::cerr << "Invalid opcode" << std::endl;
-      restore_input_buffering();
-      abort();
-      break;
-    }
-    }
-  }
-
-  restore_input_buffering();
+  // after loading, so the root of the call stacks is where the program starts
+  if (profile_path && !profile_enable(*vm)) {
+    std::cerr << "Out of memory" << std::endl;
+    exit(1);
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  uint64_t retired = 0;
+  if (debug_socket) {
+    if (!debug_serve_socket(*vm, engine, debug_socket, retired)) {
+      std::cerr << "Failed to open debug socket: " << debug_socket << std::endl;
+      exit(1);
+    }
+  } else if (debug) {
+    retired = debug_serve(*vm, engine, stdin, stdout);
+  } else if (headless) {
+    retired = run_engine(engine, *vm, max_instructions);
+  } else {
+    // a slice at a time, to see a Ctrl-C (the engines pick up where they left off)
+    while (vm->running && !interrupted && retired < max_instructions) {
+      uint64_t left = max_instructions - retired;
+      retired += run_engine(engine, *vm, left < INTERRUPT_SLICE ? left : INTERRUPT_SLICE);
+    }
+  }
+  console_flush(vm->console);
+  if (interrupted) {
+    trace_close();
+    restore_input_buffering();
+    printf("\n");
+    exit(-2);
+  }
+  // still running: the budget ran out (a saved snapshot can carry on from here)
+  // or the debugger quit before the end, which is up to the user
+  bool out_of_budget = vm->running && !vm->error && !debug && !debug_socket;
+  if (out_of_budget) {
+    std::cerr << "Instruction limit reached after " << retired << " instructions" << std::endl;
+  }
+  auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  if (print_stats) {
+    // MIPS = millions of instructions retired per second
+    std::cerr << "instructions: " << retired
+              << ", seconds: " << elapsed
+              << ", MIPS: " << (elapsed > 0 ? static_cast<double>(retired) / elapsed / 1e6 : 0.0)
+              << std::endl;
+  }
+
+  // written even if the VM stopped on an error, that's when it's most useful
+  if (profile_path && !profile_write(*vm, profile_path)) {
+    std::cerr << "Failed to write profile: " << profile_path << std::endl;
+  }
+
+  if (headless) {
+    size_t size = 0;
+    const char* output = console_captured(vm->console, size);
+    FILE* out = output_path ? fopen(output_path, "wb") : stdout;
+    if (!out || fwrite(output, 1, size, out) != size) {
+      std::cerr << "Failed to write output: " << (output_path ? output_path : "stdout") << std::endl;
+    }
+    if (out && out != stdout) { fclose(out); }
+    fflush(stdout);
+  }
+
+  if (vm->error) {
+    std::cerr << vm->error << std::endl;
+    trace_close();
+    // keep the recording of the session that went wrong
+    replay_destroy(*vm);
+    if (!headless) { restore_input_buffering(); }
+    abort();
+  }
+
+  if (save_snapshot && !snapshot_save(*vm, save_snapshot)) {
+    std::cerr << "Failed to save snapshot: " << save_snapshot << std::endl;
+  }
+  if (save_diff && !snapshot_save_diff(*vm, save_diff)) {
+    std::cerr << "Failed to save diff: " << save_diff << std::endl;
+  }
+
+  interrupted_vm = nullptr;
+  vm_destroy(vm);
+  trace_close();
+  if (!headless) { restore_input_buffering(); }
+  return out_of_budget ? 3 : 0;
 }
 
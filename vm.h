@@ -0,0 +1,139 @@
+#ifndef VM_H
+#define VM_H
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include "device.h"
+#include "memory.h"
+
+struct DecodedInstr;
+struct JitState;
+struct Console;
+struct Input;
+struct Profile;
+struct Replay;
+struct Debugger;
+
+// What reading past the end of the input does (KBSR, GETC/IN)
+// - EOF_CONTINUE : KBSR just never becomes ready again, GETC/IN read xFFFF
+// - EOF_HALT     : the VM stops after that instruction, as if it HALTed
+// - EOF_ERROR    : same, but with vm.error = "End of input"
+// Headless runs use EOF_HALT, so a program waiting for more input than
+// its script has ends instead of spinning forever
+enum EofPolicy {
+  EOF_CONTINUE = 0,
+  EOF_HALT,
+  EOF_ERROR,
+};
+
+// Parses "continue" / "halt" / "error"
+// returns 0 if `name` isn't a policy
+int eof_policy_from_name(const char* name, EofPolicy& policy);
+
+// Bytes in a coverage map (Vm::coverage), one counter per edge hash
+#define COVERAGE_MAP_SIZE (1 << 16)
+
+// ============================
+// ======== VM Context ========
+// ============================
+// Everything one LC-3 machine owns
+// - Every handler & engine takes the Vm explicitly, nothing is global,
+//   so one process can run any number of machines (even on many threads)
+struct Vm {
+  // 65_536 memory locations, each location can store a 16bit value (128KB total)
+  // First member: the JIT addresses memory & the rest of the Vm off one pointer
+  uint16_t memory[MEMORY_MAX];
+
+  // PageAttr bits per 256 word page, what mem_read/mem_write check first
+  uint8_t page_attr[MEM_PAGES];
+
+  // Pages written since mem_clear_dirty, one bit per page (see memory.h)
+  uint64_t dirty[MEM_PAGES / 64];
+
+  // Register storage, length 13 (PSR & the saved stack pointers included)
+  uint16_t reg[R_COUNT];
+
+  // Last flag-setting result, R_COND is derived from it lazily (see ops.h)
+  uint16_t cond_result;
+
+  // Cleared by HALT, or when the VM can't continue (see `error`)
+  int running;
+
+  // Why the VM stopped if it wasn't HALT (ex. "Unused opcode"), nullptr otherwise
+  const char* error;
+
+  // Some device may interrupt (KBSR's IE bit is set) or has an event coming
+  // (the timer), engines only look for a pending interrupt, where a block
+  // ends, while this is set (see interrupt.h & device.h)
+  int interrupts;
+
+  // Device state that isn't in memory: the event wheel (see device.h)
+  Bus bus;
+
+  // Predecoded cache parallel to memory (see decode.h)
+  DecodedInstr* decoded;
+
+  // Console streams
+  // KBSR/KBDR & GETC/IN read from `in` through `input`, a queue filled
+  // ahead of time (see input.h)
+  // OUT/PUTS/PUTSP/HALT write to `out` through `console`, which buffers
+  // the output (see console.h)
+  // Headless VMs have no streams, input & output are memory buffers
+  FILE* in;
+  FILE* out;
+  Input* input;
+  Console* console;
+  EofPolicy eof_policy;
+
+  // Keyboard polling loop detection (see idle.h)
+  // - KBSR reads in a row that found no key
+  // - how long to sleep on the input once a polling loop is spotted, 0: never
+  uint32_t idle_polls;
+  int idle_wait_ms;
+
+  // Set by execute() (see engine.h): never wait for input, instead a GETC/IN
+  // with nothing to read, or a keyboard polling loop, pauses the VM
+  // - `blocked` : paused that way, `running` is cleared too so the engine
+  //   returns, execute() sets it again once there is input
+  int yield_on_input;
+  int blocked;
+
+  // x86-64 translations, created by the first run_jit (see jit.h)
+  JitState* jit;
+
+  // Per address execution counts & call stacks, nullptr unless profiling (see profile.h)
+  Profile* profile;
+
+  // Input log being written or replayed, nullptr normally (see replay.h)
+  Replay* replay;
+
+  // Breakpoints & watchpoints, nullptr unless debugging (see debug.h)
+  Debugger* debug;
+
+  // Edge hit counters, COVERAGE_MAP_SIZE of them, nullptr unless fuzzing
+  // (see fuzz.h & cover_edge in ops.h)
+  uint8_t* coverage;
+};
+
+// Zeroed machine reading from `in` (nullptr: no input) & writing to `out`
+// returns nullptr if out of memory
+Vm* vm_create(FILE* in, FILE* out);
+
+// Headless machine: no streams & nothing touches the terminal
+// - keyboard input is a copy of input[0..size), then end of input (EOF_HALT)
+// - output is kept in memory, see console_captured(vm->console, ...)
+// returns nullptr if out of memory
+Vm* vm_create_headless(const char* input, size_t size);
+
+// Headless machine for a long running session (see scheduler.h)
+// - keyboard input is pushed in as it arrives, input_push(vm->input, ...),
+//   & input_close(vm->input) ends it (EOF_HALT)
+// - output is kept in memory like vm_create_headless
+// returns nullptr if out of memory
+Vm* vm_create_session();
+
+// Flushes the console & frees the VM
+// (the streams are left open, they belong to the caller)
+void vm_destroy(Vm* vm);
+
+#endif // !VM_H